@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef CORO_TRACE
+#include <dlfcn.h>
+#include <time.h>
+#endif
+
+#include "coro.h"
+
+/* Per thread: scheduler workers resume coroutines on whichever thread picked them up. */
+static __thread coro_t* coro_current;
+
+#ifdef CORO_TRACE
+/*
+ * Each thread writes events to its own ring, nobody else writes there and nothing waits: an event is rdtsc and three
+ * stores, then `written` is bumped for the dumper. A full ring overwrites its oldest events. Rings are never freed,
+ * the dump still has threads which exited, like workers of a deleted coro_sched_t.
+ */
+typedef struct {
+  uint64_t tsc;
+  const coro_t* coro;
+  coro_function_t fn;
+  uint32_t type;
+} coro__trace_event_t;
+
+enum { coro__trace_events = 1 << 16 };
+
+typedef struct coro__trace_ring coro__trace_ring_t;
+struct coro__trace_ring {
+  _Atomic uint64_t written;
+  coro__trace_ring_t* next;
+  uint32_t thread;
+  coro__trace_event_t events[coro__trace_events];
+};
+
+static _Atomic(coro__trace_ring_t*) coro__trace_rings;
+static _Atomic uint32_t coro__trace_threads;
+static uint64_t coro__trace_start_tsc;
+static uint64_t coro__trace_start_ns;
+static __thread coro__trace_ring_t* coro__trace_ring;
+
+static uint64_t coro__trace_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+__attribute__((noinline, cold))
+static coro__trace_ring_t* coro__trace_ring_new(void) {
+  coro__trace_ring_t* ring = calloc(1, sizeof(coro__trace_ring_t));
+  ring->thread = atomic_fetch_add(&coro__trace_threads, 1);
+  if (ring->thread == 0) {
+    /* Timestamps in the dump are relative to this, and tsc is converted to time by comparing it with the clock. */
+    coro__trace_start_ns = coro__trace_ns();
+    coro__trace_start_tsc = __builtin_ia32_rdtsc();
+  }
+  ring->next = atomic_load(&coro__trace_rings);
+  while (!atomic_compare_exchange_weak(&coro__trace_rings, &ring->next, ring)) {}
+  coro__trace_ring = ring;
+  return ring;
+}
+
+static inline __attribute__((always_inline)) void coro__trace(uint32_t type, const coro_t* coro) {
+  coro__trace_ring_t* ring = coro__trace_ring;
+  if (__builtin_expect(!ring, 0)) ring = coro__trace_ring_new();
+  const uint64_t i = atomic_load_explicit(&ring->written, memory_order_relaxed);
+  coro__trace_event_t* event = &ring->events[i & (coro__trace_events - 1)];
+  event->tsc = __builtin_ia32_rdtsc();
+  event->coro = coro;
+  event->fn = coro->fn;
+  event->type = type;
+  atomic_store_explicit(&ring->written, i + 1, memory_order_release);
+}
+
+#define CORO__TRACE(Type, Coro) coro__trace((Type), (Coro))
+#else
+#define CORO__TRACE(Type, Coro) ((void)0)
+#endif
+
+/*
+ * coro_value_t coro__switch(void** save_sp, void* load_sp, coro_value_t value)
+ *
+ * Pushes what SysV ABI says a callee must preserve: rbx, rbp, r12-r15, MXCSR and the x87 control word (rounding
+ * modes, exception masks). Everything else is dead across a call anyway, that's why this is a function and
+ * not inline asm. Stores rsp to `*save_sp`, pops the same frame from `load_sp` and returns `value` on the other side.
+ *
+ * Frame at the saved rsp, lowest address first:
+ *   MXCSR (4 bytes), x87 CW (2 bytes), padding, r15, r14, r13, r12, rbx, rbp, return address
+ */
+__asm__(
+  ".text\n"
+  ".globl coro__switch\n"
+  ".type coro__switch, @function\n"
+  "coro__switch:\n"
+  "  .cfi_startproc\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsp, %r8\n"
+  "  movq %rsi, %rsp\n"
+  /* ldmxcsr and fldcw are microcoded and cost more than the rest of the switch, skip them when nothing changed. */
+  "  movl (%rsp), %ecx\n"
+  "  cmpl (%r8), %ecx\n"
+  "  je 1f\n"
+  "  ldmxcsr (%rsp)\n"
+  "1:\n"
+  "  movw 4(%rsp), %cx\n"
+  "  cmpw 4(%r8), %cx\n"
+  "  je 2f\n"
+  "  fldcw 4(%rsp)\n"
+  "2:\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  movq %rdx, %rax\n"
+  /* Not ret: return stack buffer predicts the caller of this coro__switch, and that's never where we are going. */
+  "  popq %r8\n"
+  "  jmpq *%r8\n"
+  "  .cfi_endproc\n"
+  ".size coro__switch, .-coro__switch\n"
+
+  /* First switch into a coroutine returns here with the coroutine in r12 and the value passed to coro_next in rax. */
+  ".globl coro__trampoline\n"
+  ".type coro__trampoline, @function\n"
+  "coro__trampoline:\n"
+  "  .cfi_startproc\n"
+  "  .cfi_undefined rip\n"
+  "  movq %r12, %rdi\n"
+  "  movq %rax, %rsi\n"
+  "  call coro__main\n"
+  "  ud2\n"
+  "  .cfi_endproc\n"
+  ".size coro__trampoline, .-coro__trampoline\n"
+);
+
+coro_value_t coro__switch(void** save_sp, void* load_sp, coro_value_t value);
+void coro__trampoline(void);
+
+__attribute__((noinline, cold))
+static void coro__altstack_init(void);
+static __thread void* coro__altstack;
+
+void coro__main(coro_t* coro, coro_value_t pass) {
+  /* Value passed to the first coro_next has nowhere to go: the coroutine hasn't yielded yet. */
+  (void)pass;
+  coro_value_t result = coro->fn(coro->arg);
+  coro->done = true;
+  CORO__TRACE(CORO_TRACE_FINISH, coro);
+  coro__switch(&coro->coro_sp, coro->user_sp, result);
+  abort();
+}
+
+void coro_init(coro_t* coro, coro_function_t fn, void* stack, size_t stack_size, coro_value_t arg) {
+  *coro = (coro_t){ .fn = fn, .arg = arg };
+
+  /* Frame coro__switch pops, returning into coro__trampoline with rsp 16-byte aligned like right before a call. */
+  uint64_t* top = (uint64_t*)(((uintptr_t)stack + stack_size) & ~(uintptr_t)15);
+  uint64_t* sp = top - 10;
+  memset(sp, 0, 10 * sizeof(uint64_t));
+  /* New coroutines start with the rounding mode and exception masks of their creator. */
+  __asm__ volatile("stmxcsr %0\n fnstcw %1" : "=m"(*(uint32_t*)sp), "=m"(*((uint16_t*)sp + 2)));
+  sp[4] = (uintptr_t)coro;                      /* r12 */
+  sp[7] = (uintptr_t)coro__trampoline;          /* return address */
+  coro->coro_sp = sp;
+  CORO__TRACE(CORO_TRACE_CREATE, coro);
+}
+
+bool coro_next(coro_t* coro, coro_value_t* value, coro_value_t pass) {
+  if (coro->done) return false;
+
+  /* Growable stacks fault to grow, and the handler can't run on the stack which is out of room. */
+  if (__builtin_expect(coro->stack_open && !coro__altstack, 0)) coro__altstack_init();
+
+  coro_t* const this_coro = coro_current;
+  coro_current = coro;
+  CORO__TRACE(CORO_TRACE_RESUME, coro);
+  *value = coro__switch(&coro->user_sp, coro->coro_sp, pass);
+  coro_current = this_coro;
+  /* Back on our own stack, the finished one can go. */
+  if (coro->done) coro_destroy(coro);
+  return !coro->done;
+}
+
+coro_value_t coro_yield(coro_value_t value) {
+  coro_t* coro = coro_current;
+  CORO__TRACE(CORO_TRACE_YIELD, coro);
+  return coro__switch(&coro->coro_sp, coro->user_sp, value);
+}
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102  /* Linux 6.13 */
+#define MADV_GUARD_REMOVE 103
+#endif
+
+enum { coro__slab_stacks = 64 };
+
+void coro_stack_pool_init(coro_stack_pool_t* pool, size_t stack_size, uint32_t hot) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  *pool = (coro_stack_pool_t){
+    .stack_size = (stack_size + page - 1) & ~(page - 1), .guard_size = page, .hot = hot, .light_guards = true
+  };
+}
+
+static void coro__stack_guard(coro_stack_pool_t* pool, void* start, size_t size) {
+  /* mprotect splits the mapping, two VMAs per stack run into vm.max_map_count (65530) at ~32k stacks. */
+  if (pool->light_guards && madvise(start, size, MADV_GUARD_INSTALL) != 0) pool->light_guards = false;
+  if (!pool->light_guards && mprotect(start, size, PROT_NONE) != 0) {
+    perror("coro_stack_get: mprotect");
+    abort();
+  }
+}
+
+/* From the SIGSEGV handler too, only syscalls here. */
+static bool coro__stack_unguard(coro_stack_pool_t* pool, void* start, size_t size) {
+  if (pool->light_guards) return madvise(start, size, MADV_GUARD_REMOVE) == 0;
+  return mprotect(start, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void coro_stack_pool_destroy(coro_stack_pool_t* pool) {
+  for (uint32_t i = 0; i < pool->slab_count; i++) {
+    munmap(pool->slabs[i], coro__slab_stacks * (pool->guard_size + pool->stack_size));
+  }
+  free(pool->slabs);
+  free(pool->free);
+  *pool = (coro_stack_pool_t){0};
+}
+
+static void coro__stack_pool_grow(coro_stack_pool_t* pool) {
+  const size_t stride = pool->guard_size + pool->stack_size;
+  char* slab = mmap(0, coro__slab_stacks * stride, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (slab == MAP_FAILED) {
+    perror("coro_stack_get: mmap");
+    abort();
+  }
+
+  pool->slabs = realloc(pool->slabs, (pool->slab_count + 1) * sizeof(void*));
+  pool->slabs[pool->slab_count++] = slab;
+  if (pool->free_capacity < pool->free_count + coro__slab_stacks) {
+    pool->free_capacity = (pool->free_count + coro__slab_stacks) * 2;
+    pool->free = realloc(pool->free, pool->free_capacity * sizeof(void*));
+  }
+
+  /* Growable stacks are guarded all the way up to their initial part. */
+  const size_t guarded = pool->guard_size + (pool->initial_size ? pool->stack_size - pool->initial_size : 0);
+  for (uint32_t i = 0; i < coro__slab_stacks; i++) {
+    coro__stack_guard(pool, slab + i * stride, guarded);
+    /* Reversed, so stacks are handed out from the bottom of the slab up. */
+    pool->free[pool->free_count++] = slab + (coro__slab_stacks - i) * stride - pool->stack_size;
+  }
+  /* Fresh stacks have no pages to trim. */
+  pool->trimmed = pool->free_count;
+  pool->stacks += coro__slab_stacks;
+}
+
+void* coro_stack_get(coro_stack_pool_t* pool) {
+  if (!pool->free_count) coro__stack_pool_grow(pool);
+  pool->gets++;
+  void* stack = pool->free[--pool->free_count];
+  if (pool->trimmed > pool->free_count) pool->trimmed = pool->free_count;
+  return stack;
+}
+
+void coro_stack_put(coro_stack_pool_t* pool, void* stack) {
+  if (pool->free_count == pool->free_capacity) {
+    pool->free_capacity = pool->free_capacity ? pool->free_capacity * 2 : 64;
+    pool->free = realloc(pool->free, pool->free_capacity * sizeof(void*));
+  }
+  pool->free[pool->free_count++] = stack;
+
+  /* Pages of stacks which went cold go back to the kernel, the memory stays reserved. */
+  const size_t open = pool->initial_size ? pool->initial_size : pool->stack_size;
+  while (pool->free_count - pool->trimmed > pool->hot) {
+    madvise((char*)pool->free[pool->trimmed++] + pool->stack_size - open, open, MADV_DONTNEED);
+  }
+}
+
+void coro_spawn(coro_t* coro, coro_stack_pool_t* pool, coro_function_t fn, coro_value_t arg) {
+  void* stack = coro_stack_get(pool);
+  coro_init(coro, fn, stack, pool->stack_size, arg);
+  coro->pool = pool;
+  coro->stack = stack;
+  coro->stack_open = pool->initial_size;
+}
+
+static void coro__stack_shut(coro_t* coro);
+
+void coro_destroy(coro_t* coro) {
+  if (coro->stack_open) coro__stack_shut(coro);
+  if (coro->pool) coro_stack_put(coro->pool, coro->stack);
+  coro->pool = 0;
+  coro->stack = 0;
+}
+
+/*******************/
+/* growable stacks */
+/*******************/
+
+enum { coro__altstack_size = 64 * 1024, coro__usage_slots = 1024 };
+
+static struct sigaction coro__fault_previous;
+static pthread_once_t coro__fault_once = PTHREAD_ONCE_INIT;
+static pthread_key_t coro__altstack_key;
+
+/* Open addressing on the function pointer, never removed. Functions past the first 1024 aren't counted. */
+typedef struct {
+  _Atomic(coro_function_t) fn;
+  _Atomic size_t high_water;
+  _Atomic uint64_t coroutines;
+  _Atomic uint64_t grows;
+} coro__usage_t;
+
+static coro__usage_t coro__usage[coro__usage_slots];
+
+static void coro__stack_fault(int sig, siginfo_t* info, void* context) {
+  coro_t* coro = coro_current;
+  char* addr = info->si_addr;
+  if (coro && coro->stack_open) {
+    coro_stack_pool_t* pool = coro->pool;
+    char* top = (char*)coro->stack + pool->stack_size;
+    char* open = top - coro->stack_open;
+    if (addr >= (char*)coro->stack && addr < open) {
+      /* At least twice as much, so a deep recursion takes a few faults and not one per page. */
+      size_t size = coro->stack_open * 2;
+      const size_t needed = top - (char*)((uintptr_t)addr & ~(pool->guard_size - 1));
+      if (size < needed) size = needed;
+      if (size > pool->stack_size) size = pool->stack_size;
+      if (coro__stack_unguard(pool, top - size, open - (top - size))) {
+        coro->stack_open = size;
+        coro->stack_grows++;
+        return;
+      }
+    }
+  }
+
+  /* Not ours: the previous handler gets it, or the default action once the instruction faults again. */
+  if (coro__fault_previous.sa_flags & SA_SIGINFO) {
+    coro__fault_previous.sa_sigaction(sig, info, context);
+  } else if (coro__fault_previous.sa_handler != SIG_DFL && coro__fault_previous.sa_handler != SIG_IGN) {
+    coro__fault_previous.sa_handler(sig);
+  } else {
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+
+static void coro__altstack_free(void* stack) {
+  sigaltstack(&(stack_t){ .ss_flags = SS_DISABLE }, 0);
+  munmap(stack, coro__altstack_size);
+}
+
+static void coro__fault_install(void) {
+  pthread_key_create(&coro__altstack_key, coro__altstack_free);
+  struct sigaction action = { .sa_sigaction = coro__stack_fault, .sa_flags = SA_SIGINFO | SA_ONSTACK };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &coro__fault_previous);
+}
+
+/* Once per thread which resumes coroutines on growable stacks, a signal stack someone else set up is fine too. */
+static void coro__altstack_init(void) {
+  pthread_once(&coro__fault_once, coro__fault_install);
+  stack_t current;
+  if (sigaltstack(0, &current) == 0 && !(current.ss_flags & SS_DISABLE)) {
+    coro__altstack = current.ss_sp;
+    return;
+  }
+
+  void* stack = mmap(0, coro__altstack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED || sigaltstack(&(stack_t){ .ss_sp = stack, .ss_size = coro__altstack_size }, 0) != 0) {
+    perror("coro_next: sigaltstack");
+    abort();
+  }
+  coro__altstack = stack;
+  pthread_setspecific(coro__altstack_key, stack);
+}
+
+void coro_stack_pool_init_growable(coro_stack_pool_t* pool, size_t stack_size, size_t initial_size, uint32_t hot) {
+  coro_stack_pool_init(pool, stack_size, hot);
+  const size_t page = pool->guard_size;
+  initial_size = (initial_size + page - 1) & ~(page - 1);
+  pool->initial_size = initial_size < page ? page : initial_size > pool->stack_size ? pool->stack_size : initial_size;
+  pthread_once(&coro__fault_once, coro__fault_install);
+}
+
+/* Pages nobody touched since the last shut aren't resident, the rest are zero below whatever was used. */
+static size_t coro__stack_high_water(coro_t* coro) {
+  const size_t page = coro->pool->guard_size;
+  char* const top = (char*)coro->stack + coro->pool->stack_size;
+  unsigned char resident[256];
+  for (char* chunk = top - coro->stack_open; chunk < top; chunk += sizeof(resident) * page) {
+    size_t pages = (top - chunk) / page;
+    if (pages > sizeof(resident)) pages = sizeof(resident);
+    if (mincore(chunk, pages * page, resident) != 0) memset(resident, 1, pages);
+    for (size_t i = 0; i < pages; i++) {
+      if (!(resident[i] & 1)) continue;
+      const uint64_t* word = (const uint64_t*)(chunk + i * page);
+      for (const uint64_t* end = word + page / sizeof(uint64_t); word < end; word++) {
+        if (*word) return top - (const char*)word;
+      }
+    }
+  }
+  return 0;
+}
+
+static void coro__usage_record(coro_function_t fn, size_t high_water, uint32_t grows) {
+  size_t i = ((uintptr_t)fn * 0x9e3779b97f4a7c15ull) >> 54;
+  for (size_t probes = 0; probes < coro__usage_slots; probes++, i = (i + 1) % coro__usage_slots) {
+    coro__usage_t* usage = &coro__usage[i];
+    coro_function_t seen = 0;
+    if (!atomic_compare_exchange_strong(&usage->fn, &seen, fn) && seen != fn) continue;
+
+    size_t previous = atomic_load(&usage->high_water);
+    while (previous < high_water && !atomic_compare_exchange_weak(&usage->high_water, &previous, high_water)) {}
+    atomic_fetch_add(&usage->coroutines, 1);
+    atomic_fetch_add(&usage->grows, grows);
+    return;
+  }
+}
+
+/* Measures, then puts the stack back the way the pool hands it out: zeroed and open only `initial_size` deep. */
+static void coro__stack_shut(coro_t* coro) {
+  coro_stack_pool_t* pool = coro->pool;
+  const size_t high_water = coro__stack_high_water(coro);
+  coro__usage_record(coro->fn, high_water, coro->stack_grows);
+
+  char* const top = (char*)coro->stack + pool->stack_size;
+  /* Guarding again drops the pages, only the part which stays open has to be cleaned by hand. */
+  if (coro->stack_open > pool->initial_size) {
+    const size_t grown = coro->stack_open - pool->initial_size;
+    if (!pool->light_guards) madvise(top - coro->stack_open, grown, MADV_DONTNEED);
+    coro__stack_guard(pool, top - coro->stack_open, grown);
+  }
+  const size_t dirty = high_water < pool->initial_size ? high_water : pool->initial_size;
+  memset(top - dirty, 0, dirty);
+  coro->stack_open = 0;
+  coro->stack_grows = 0;
+}
+
+size_t coro_stack_usage(coro_stack_usage_t* usage, size_t capacity) {
+  size_t count = 0;
+  for (size_t i = 0; i < coro__usage_slots; i++) {
+    const coro_function_t fn = atomic_load(&coro__usage[i].fn);
+    if (!fn) continue;
+    if (count < capacity) {
+      usage[count] = (coro_stack_usage_t){
+        .fn = fn, .high_water = atomic_load(&coro__usage[i].high_water),
+        .coroutines = atomic_load(&coro__usage[i].coroutines), .grows = atomic_load(&coro__usage[i].grows)
+      };
+    }
+    count++;
+  }
+  return count;
+}
+
+/***********/
+/* tracing */
+/***********/
+
+#ifdef CORO_TRACE
+static void coro__trace_name(char* name, size_t size, coro_function_t fn) {
+  Dl_info info;
+  if (dladdr((void*)fn, &info) && info.dli_sname) {
+    snprintf(name, size, "%s", info.dli_sname);
+  } else {
+    snprintf(name, size, "%p", (void*)fn);
+  }
+}
+
+/*
+ * Resume and the yield or finish which ends it become one complete ("X") event, they nest like calls when coroutines
+ * resume coroutines. Still running ones are left open ("B"), ends of runs which began before the oldest event in the
+ * ring are dropped.
+ */
+bool coro_trace_dump(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) return false;
+
+  const uint64_t ticks = __builtin_ia32_rdtsc() - coro__trace_start_tsc;
+  const double us_per_tick = ticks ? (coro__trace_ns() - coro__trace_start_ns) / 1e3 / ticks : 0;
+  static const char* ends[] = { [CORO_TRACE_YIELD] = "yield", [CORO_TRACE_FINISH] = "finish" };
+
+  fprintf(f, "{\"traceEvents\":[\n");
+  const char* separator = "";
+  for (coro__trace_ring_t* ring = atomic_load(&coro__trace_rings); ring; ring = ring->next) {
+    const uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+    fprintf(f, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"thread %u\"}}",
+      separator, ring->thread, ring->thread);
+    separator = ",\n";
+
+    enum { max_depth = 64 };
+    const coro__trace_event_t* running[max_depth];
+    uint32_t depth = 0;
+    char name[256];
+    for (uint64_t i = written > coro__trace_events ? written - coro__trace_events : 0; i < written; i++) {
+      const coro__trace_event_t* event = &ring->events[i & (coro__trace_events - 1)];
+      const double ts = (double)(event->tsc - coro__trace_start_tsc) * us_per_tick;
+      if (event->type == CORO_TRACE_CREATE) {
+        coro__trace_name(name, sizeof(name), event->fn);
+        fprintf(f, "%s{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"name\":\"create %s\","
+          "\"args\":{\"coro\":\"%p\"}}", separator, ring->thread, ts, name, (void*)event->coro);
+      } else if (event->type == CORO_TRACE_RESUME) {
+        if (depth < max_depth) running[depth++] = event;
+      } else if (depth) {
+        const coro__trace_event_t* begin = running[--depth];
+        const double begin_ts = (double)(begin->tsc - coro__trace_start_tsc) * us_per_tick;
+        coro__trace_name(name, sizeof(name), begin->fn);
+        fprintf(f, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"%s\","
+          "\"args\":{\"coro\":\"%p\",\"end\":\"%s\"}}", separator, ring->thread, begin_ts, ts - begin_ts, name,
+          (void*)begin->coro, ends[event->type]);
+      }
+    }
+    for (uint32_t j = 0; j < depth; j++) {
+      coro__trace_name(name, sizeof(name), running[j]->fn);
+      fprintf(f, "%s{\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"name\":\"%s\",\"args\":{\"coro\":\"%p\"}}",
+        separator, ring->thread, (double)(running[j]->tsc - coro__trace_start_tsc) * us_per_tick, name,
+        (void*)running[j]->coro);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+uint64_t coro_trace_count(void) {
+  uint64_t count = 0;
+  for (coro__trace_ring_t* ring = atomic_load(&coro__trace_rings); ring; ring = ring->next) count += ring->written;
+  return count;
+}
+#else
+bool coro_trace_dump(const char* path) {
+  return false;
+}
+
+uint64_t coro_trace_count(void) {
+  return 0;
+}
+#endif
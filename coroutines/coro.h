@@ -0,0 +1,244 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef void* coro_value_t;
+typedef coro_value_t (*coro_function_t)(coro_value_t value);
+
+/*
+ * Stacks are carved out of big PROT_READ|PROT_WRITE mappings, each with a guard page below it. Nothing is committed
+ * until touched, so a 256 KiB stack used one page deep costs one page. Free stacks are reused LIFO; the `hot` most
+ * recently freed ones keep their pages, older ones are given back with MADV_DONTNEED and fault in again on reuse.
+ */
+typedef struct {
+  size_t stack_size;      /* usable bytes, without the guard page */
+  size_t initial_size;    /* growable pools: bytes open at the top of a stack handed out, 0 when all are open */
+  size_t guard_size;
+  uint32_t hot;
+  bool light_guards;      /* MADV_GUARD_INSTALL works, guards don't split the mapping into two VMAs per stack */
+  void** free;            /* lowest usable addresses, free[0..trimmed) have no pages */
+  uint32_t free_count;
+  uint32_t free_capacity;
+  uint32_t trimmed;
+  void** slabs;
+  uint32_t slab_count;
+  uint32_t stacks;        /* ever mapped */
+  uint64_t gets;
+} coro_stack_pool_t;
+
+typedef struct {
+  void* coro_sp;          /* rsp of the coroutine while it's suspended */
+  void* user_sp;          /* rsp of whoever resumed it while it runs */
+  coro_function_t fn;
+  coro_value_t arg;
+  bool done;
+  coro_stack_pool_t* pool;  /* where the stack goes back when the coroutine is done or destroyed */
+  void* stack;
+  size_t stack_open;        /* growable stacks: bytes at the top without guards, 0 otherwise */
+  uint32_t stack_grows;
+} coro_t;
+
+void coro_init(coro_t* coro, coro_function_t fn, void* stack, size_t stack_size, coro_value_t arg);
+bool coro_next(coro_t* coro, coro_value_t* value, coro_value_t pass);
+coro_value_t coro_yield(coro_value_t value);
+
+/*
+ * Built with -DCORO_TRACE, coro_init, coro_next, coro_yield and the end of a coroutine write an event with an rdtsc
+ * timestamp to a per-thread ring (the last 64k events of every thread). Without it they have no trace code at all,
+ * and the calls below do nothing.
+ */
+enum { CORO_TRACE_CREATE, CORO_TRACE_RESUME, CORO_TRACE_YIELD, CORO_TRACE_FINISH };
+
+/* Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev) of what the rings hold. Best when things are quiet. */
+bool coro_trace_dump(const char* path);
+/* Events recorded so far, including overwritten ones. */
+uint64_t coro_trace_count(void);
+
+void coro_stack_pool_init(coro_stack_pool_t* pool, size_t stack_size, uint32_t hot);
+/*
+ * Stacks which grow: only the top `initial_size` bytes are open, everything below up to `stack_size` is guarded.
+ * Touching the guarded part raises SIGSEGV, which a handler on a per-thread alternate signal stack catches, opening
+ * at least twice as much and retrying the instruction. Nothing moves, so pointers into the stack stay good; past
+ * `stack_size` it's a real overflow and the signal goes to whatever handled it before. Stacks are shut back to
+ * `initial_size` when they return to the pool, so a deep coroutine doesn't leave its pages to the next tiny one.
+ * The kernel doesn't fault on user memory, it fails: a fresh stack buffer passed straight to read() may get EFAULT.
+ */
+void coro_stack_pool_init_growable(coro_stack_pool_t* pool, size_t stack_size, size_t initial_size, uint32_t hot);
+void coro_stack_pool_destroy(coro_stack_pool_t* pool);
+void* coro_stack_get(coro_stack_pool_t* pool);
+void coro_stack_put(coro_stack_pool_t* pool, void* stack);
+/* coro_init on a stack from `pool`, which is put back once the coroutine returns. */
+void coro_spawn(coro_t* coro, coro_stack_pool_t* pool, coro_function_t fn, coro_value_t arg);
+/* Gives back the stack of a coroutine which won't be resumed anymore. */
+void coro_destroy(coro_t* coro);
+
+/*
+ * Deepest stack use per coroutine function, measured when coroutines on growable stacks are destroyed (stacks of a
+ * growable pool are kept zeroed below the top frame, the first non-zero word from the bottom is the high water).
+ */
+typedef struct {
+  coro_function_t fn;
+  size_t high_water;      /* bytes from the top of the stack */
+  uint64_t coroutines;
+  uint64_t grows;
+} coro_stack_usage_t;
+
+/* Fills up to `capacity` entries, returns how many functions there are. */
+size_t coro_stack_usage(coro_stack_usage_t* usage, size_t capacity);
+
+/*
+ * M:N scheduler: coroutines ("tasks") run on a few worker threads, each with its own Chase-Lev deque. Workers push
+ * and pop at the bottom of their own deque (newest first, hot in cache), idle ones steal the oldest task from the
+ * top of someone else's. Tasks get a stack from the pool of the worker which first runs them and give it back to
+ * the pool of the worker they finish on.
+ *
+ * Inside a task use coro_sched_* only from the task itself, not from a generator it drives with coro_next.
+ */
+typedef struct coro_sched coro_sched_t;
+typedef struct coro_task coro_task_t;
+
+coro_sched_t* coro_sched_new(uint32_t workers, size_t stack_size);
+/* Stops the workers, every task must be joined by now. */
+void coro_sched_delete(coro_sched_t* sched);
+/* Callable from anywhere, from a worker of `sched` it's a push to its own deque. */
+coro_task_t* coro_sched_spawn(coro_sched_t* sched, coro_function_t fn, coro_value_t arg);
+/* Lets other tasks of this worker run, then continues wherever a worker picks it up. */
+void coro_sched_yield(void);
+/* Waits for `task` and frees it: a task parks, any other thread blocks. */
+coro_value_t coro_sched_join(coro_task_t* task);
+
+typedef struct {
+  uint64_t tasks;         /* run to completion */
+  uint64_t steals;
+  uint64_t parks;         /* joins and coro_park calls which had to wait */
+  uint64_t sleeps;        /* times a worker found nothing and went to sleep */
+} coro_sched_stats_t;
+
+coro_sched_stats_t coro_sched_get_stats(coro_sched_t* sched);
+
+/*
+ * Single-threaded event loop: coroutines submit reads, writes, accepts and connects, park, and are resumed once the
+ * operation completes. Operations go to io_uring; where it's missing or disabled, the loop tries them right away
+ * and waits in epoll for the ones which would block. Regular files never "would block" and a blocking pipe or tty
+ * blocks for real in the epoll fallback. Sockets use MSG_DONTWAIT, only the ones passed to coro_accept or
+ * coro_connect are switched to O_NONBLOCK there.
+ */
+typedef struct coro_loop coro_loop_t;
+typedef struct coro_io coro_io_t;
+
+enum { CORO_IO_READ, CORO_IO_WRITE, CORO_IO_ACCEPT, CORO_IO_CONNECT };
+
+struct coro_io {
+  uint8_t op;
+  int fd;
+  void* buf;
+  size_t len;
+  int64_t offset;         /* -1 for the current file position, sockets and pipes */
+  const void* addr;       /* CORO_IO_CONNECT */
+  uint32_t addr_len;
+  int64_t result;         /* bytes or the accepted fd, -errno on failure */
+  void (*complete)(coro_io_t* io);  /* called from coro_loop_run, may submit again */
+  void* data;
+  coro_io_t* next;        /* owned by the loop until completed */
+};
+
+coro_loop_t* coro_loop_new(bool epoll_only);
+void coro_loop_delete(coro_loop_t* loop);
+/* "io_uring" or "epoll". */
+const char* coro_loop_backend(coro_loop_t* loop);
+/* Starts `io` without waiting for it, `io` must stay alive until `io->complete` is called. */
+void coro_loop_submit(coro_loop_t* loop, coro_io_t* io);
+/* Coroutine on a stack from the loop's own pool, first run from coro_loop_run and freed once it returns. */
+void coro_loop_spawn(coro_loop_t* loop, coro_function_t fn, coro_value_t arg);
+/*
+ * Until every coroutine returned and every submitted operation completed. While coroutines are parked it waits for
+ * whoever unparks them, possibly forever.
+ */
+void coro_loop_run(coro_loop_t* loop);
+
+/* From coroutines run by coro_loop_run only. Same as read(2) & co: -1 and errno on failure. */
+int64_t coro_read(int fd, void* buf, size_t len, int64_t offset);
+int64_t coro_write(int fd, const void* buf, size_t len, int64_t offset);
+int coro_accept(int fd);
+int coro_connect(int fd, const void* addr, uint32_t addr_len);
+
+/*
+ * Timers of a loop on a hierarchical timing wheel: 6 levels of 64 slots, 1 ms apart on the first level, 64 ms on the
+ * second and so on up to ~2 years. A timer goes to the level where its deadline first differs from the wheel's time
+ * and moves down a level each time its slot comes, so start and cancel are O(1) list operations and a timer is moved
+ * at most 5 times. The loop sleeps until the nearest slot.
+ */
+typedef struct coro_timer coro_timer_t;
+
+struct coro_timer {
+  uint64_t deadline;                      /* ms of coro_loop_now */
+  void (*expire)(coro_timer_t* timer);    /* called from coro_loop_run, may start the timer again */
+  void* data;
+  coro_timer_t* next;                     /* owned by the loop until expired or cancelled */
+  coro_timer_t* previous;
+  uint32_t slot;                          /* 1 + level * 64 + slot while pending, 0 otherwise */
+};
+
+/* Milliseconds since the loop was created, as of the current round of coro_loop_run. */
+uint64_t coro_loop_now(coro_loop_t* loop);
+/* `timer` must stay alive until it expires or is cancelled, zeroed before the first start. */
+void coro_timer_start(coro_loop_t* loop, coro_timer_t* timer, uint64_t ms);
+/* False when it wasn't pending (already expired, cancelled or never started). */
+bool coro_timer_cancel(coro_loop_t* loop, coro_timer_t* timer);
+
+/*
+ * From coroutines run by coro_loop_run only. coro_deadline(ms) makes I/O, coro_park and channel waits of the calling
+ * coroutine fail with ETIMEDOUT once `ms` from now have passed, until another coro_deadline (0 removes it).
+ */
+void coro_sleep(uint64_t ms);
+void coro_deadline(uint64_t ms);
+/* False outside of coroutines of a loop. */
+bool coro_deadline_passed(void);
+
+/*
+ * Parking whatever runs the calling code: a coro_sched task, a coroutine of coro_loop_run or a plain thread (on a
+ * futex). A coro_unpark which comes before coro_park isn't lost, the park returns right away; only one is kept and
+ * parks may return for no reason, so callers recheck what they wait for. Any of them can be unparked from any thread;
+ * coro_loop coroutines unparked from another thread go through an eventfd of their loop.
+ */
+typedef struct coro_parker coro_parker_t;
+
+enum { CORO_PARKER_EMPTY, CORO_PARKER_PARKED, CORO_PARKER_NOTIFIED };
+
+struct coro_parker {
+  _Atomic uint32_t state;
+  void (*suspend)(coro_parker_t* parker);  /* EMPTY -> PARKED once it's safe and wait, or EMPTY again if notified */
+  void (*resume)(coro_parker_t* parker);   /* after PARKED -> EMPTY: make it run again */
+};
+
+coro_parker_t* coro_parker_current(void);
+void coro_park(void);
+void coro_unpark(coro_parker_t* parker);
+
+/*
+ * Channels of coro_value_t between any mix of coro_sched tasks, coro_loop coroutines and threads. Messages go through
+ * a lock-free MPMC ring (Vyukov's bounded queue); senders park when a bounded channel is full, receivers when it's
+ * empty, and the other side wakes them. Unbounded channels never park senders: once the ring is full, messages
+ * go to an overflow list under a mutex until receivers have moved them into the ring again.
+ */
+typedef struct coro_chan coro_chan_t;
+
+/* `capacity` of the ring is rounded up to a power of two. */
+coro_chan_t* coro_chan_new(size_t capacity, bool unbounded);
+/* Nobody may use the channel anymore. */
+void coro_chan_delete(coro_chan_t* chan);
+/* False when the channel is closed. */
+bool coro_chan_send(coro_chan_t* chan, coro_value_t value);
+/*
+ * False when the channel is closed and everything sent before was received. In a loop coroutine with a deadline, both
+ * also fail with errno ETIMEDOUT.
+ */
+bool coro_chan_recv(coro_chan_t* chan, coro_value_t* value);
+/* Same, but false instead of waiting. */
+bool coro_chan_try_send(coro_chan_t* chan, coro_value_t value);
+bool coro_chan_try_recv(coro_chan_t* chan, coro_value_t* value);
+/* Wakes everybody waiting, sends fail from now on. */
+void coro_chan_close(coro_chan_t* chan);
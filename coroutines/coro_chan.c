@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "coro.h"
+
+coro_parker_t* coro__sched_parker(void);
+coro_parker_t* coro__loop_parker(void);
+
+/***********/
+/* parking */
+/***********/
+
+static void coro__thread_suspend(coro_parker_t* parker) {
+  uint32_t expected = CORO_PARKER_EMPTY;
+  if (!atomic_compare_exchange_strong(&parker->state, &expected, CORO_PARKER_PARKED)) {
+    atomic_store(&parker->state, CORO_PARKER_EMPTY);
+    return;
+  }
+  while (atomic_load(&parker->state) == CORO_PARKER_PARKED) {
+    syscall(SYS_futex, &parker->state, FUTEX_WAIT_PRIVATE, CORO_PARKER_PARKED, 0, 0, 0);
+  }
+}
+
+static void coro__thread_resume(coro_parker_t* parker) {
+  syscall(SYS_futex, &parker->state, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
+
+static __thread coro_parker_t coro__thread_parker = {
+  .suspend = coro__thread_suspend, .resume = coro__thread_resume
+};
+
+/* Not inlined for the same reason as coro__current_worker: a task can park on one thread and wake up on another. */
+__attribute__((noinline, noclone))
+coro_parker_t* coro_parker_current(void) {
+  coro_parker_t* parker = coro__sched_parker();
+  if (!parker) parker = coro__loop_parker();
+  return parker ? parker : &coro__thread_parker;
+}
+
+void coro_park(void) {
+  coro_parker_t* parker = coro_parker_current();
+  uint32_t notified = CORO_PARKER_NOTIFIED;
+  if (atomic_compare_exchange_strong(&parker->state, &notified, CORO_PARKER_EMPTY)) return;
+  parker->suspend(parker);
+}
+
+void coro_unpark(coro_parker_t* parker) {
+  uint32_t state = atomic_load(&parker->state);
+  for (;;) {
+    if (state == CORO_PARKER_NOTIFIED) return;
+    if (state == CORO_PARKER_EMPTY) {
+      if (atomic_compare_exchange_weak(&parker->state, &state, CORO_PARKER_NOTIFIED)) return;
+    } else if (atomic_compare_exchange_weak(&parker->state, &state, CORO_PARKER_EMPTY)) {
+      parker->resume(parker);
+      return;
+    }
+  }
+}
+
+/************/
+/* channels */
+/************/
+
+typedef struct {
+  _Atomic size_t sequence;  /* == position: free for the sender of it, position + 1: full for its receiver */
+  coro_value_t value;
+} coro__cell_t;
+
+/* Somebody parked until the other side makes progress, on its own stack. */
+typedef struct coro__waiter coro__waiter_t;
+struct coro__waiter {
+  coro_parker_t* parker;
+  coro__waiter_t* next;
+  coro__waiter_t* previous;
+  bool woken;               /* taken off the list by a wakeup, under the lock */
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  coro__waiter_t* head;
+  coro__waiter_t* tail;
+  _Atomic uint32_t count;   /* checked without the lock after every send or receive */
+} coro__waiters_t;
+
+struct coro_chan {
+  _Alignas(64) _Atomic size_t head;   /* next position to receive */
+  _Alignas(64) _Atomic size_t tail;   /* next position to send */
+  _Alignas(64) coro__cell_t* cells;
+  size_t mask;
+  bool unbounded;
+  _Atomic bool closed;
+  coro__waiters_t senders;
+  coro__waiters_t receivers;
+
+  /* Unbounded: FIFO of what didn't fit, `overflowed` is its length as of the last time somebody held the lock. */
+  _Atomic size_t overflowed;
+  pthread_mutex_t overflow_lock;
+  coro_value_t* overflow;
+  size_t overflow_start;
+  size_t overflow_count;
+  size_t overflow_capacity;
+};
+
+static void coro__waiters_init(coro__waiters_t* waiters) {
+  pthread_mutex_init(&waiters->lock, 0);
+  waiters->head = waiters->tail = 0;
+  atomic_init(&waiters->count, 0);
+}
+
+static void coro__waiters_unlink(coro__waiters_t* waiters, coro__waiter_t* waiter) {
+  *(waiter->previous ? &waiter->previous->next : &waiters->head) = waiter->next;
+  *(waiter->next ? &waiter->next->previous : &waiters->tail) = waiter->previous;
+  atomic_fetch_sub(&waiters->count, 1);
+}
+
+static void coro__waiters_add(coro__waiters_t* waiters, coro__waiter_t* waiter) {
+  pthread_mutex_lock(&waiters->lock);
+  waiter->next = 0;
+  waiter->previous = waiters->tail;
+  *(waiters->tail ? &waiters->tail->next : &waiters->head) = waiter;
+  waiters->tail = waiter;
+  atomic_fetch_add(&waiters->count, 1);
+  pthread_mutex_unlock(&waiters->lock);
+  /* Pairs with the fence in coro__waiters_wake: either the other side sees us counted or we see its progress. */
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* Off the list if still there. True when it was woken instead, maybe without having parked for it. */
+static bool coro__waiters_remove(coro__waiters_t* waiters, coro__waiter_t* waiter) {
+  pthread_mutex_lock(&waiters->lock);
+  const bool woken = waiter->woken;
+  if (!woken) coro__waiters_unlink(waiters, waiter);
+  pthread_mutex_unlock(&waiters->lock);
+  return woken;
+}
+
+/*
+ * Unparks under the lock: the waiter is on the stack of whoever parked, and once it can see `woken` it may return
+ * and be gone, task and parker included.
+ */
+static void coro__waiters_wake(coro__waiters_t* waiters, bool all) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&waiters->count, memory_order_relaxed)) return;
+
+  pthread_mutex_lock(&waiters->lock);
+  for (coro__waiter_t* waiter; (waiter = waiters->head);) {
+    coro__waiters_unlink(waiters, waiter);
+    waiter->woken = true;
+    coro_unpark(waiter->parker);
+    if (!all) break;
+  }
+  pthread_mutex_unlock(&waiters->lock);
+}
+
+coro_chan_t* coro_chan_new(size_t capacity, bool unbounded) {
+  size_t size = 2;
+  while (size < capacity) size *= 2;
+
+  coro_chan_t* chan = aligned_alloc(64, (sizeof(coro_chan_t) + 63) & ~(size_t)63);
+  memset(chan, 0, sizeof(*chan));
+  chan->cells = malloc(size * sizeof(coro__cell_t));
+  for (size_t i = 0; i < size; i++) atomic_init(&chan->cells[i].sequence, i);
+  chan->mask = size - 1;
+  chan->unbounded = unbounded;
+  coro__waiters_init(&chan->senders);
+  coro__waiters_init(&chan->receivers);
+  pthread_mutex_init(&chan->overflow_lock, 0);
+  return chan;
+}
+
+void coro_chan_delete(coro_chan_t* chan) {
+  pthread_mutex_destroy(&chan->senders.lock);
+  pthread_mutex_destroy(&chan->receivers.lock);
+  pthread_mutex_destroy(&chan->overflow_lock);
+  free(chan->overflow);
+  free(chan->cells);
+  free(chan);
+}
+
+static bool coro__ring_push(coro_chan_t* chan, coro_value_t value) {
+  size_t position = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+  coro__cell_t* cell;
+  for (;;) {
+    cell = &chan->cells[position & chan->mask];
+    const intptr_t lag = atomic_load_explicit(&cell->sequence, memory_order_acquire) - position;
+    if (lag == 0) {
+      if (atomic_compare_exchange_weak_explicit(&chan->tail, &position, position + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) break;
+    } else if (lag < 0) {
+      /* Still holds the value from a lap ago. */
+      return false;
+    } else {
+      position = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+    }
+  }
+  cell->value = value;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+  return true;
+}
+
+static bool coro__ring_pop(coro_chan_t* chan, coro_value_t* value) {
+  size_t position = atomic_load_explicit(&chan->head, memory_order_relaxed);
+  coro__cell_t* cell;
+  for (;;) {
+    cell = &chan->cells[position & chan->mask];
+    const intptr_t lag = atomic_load_explicit(&cell->sequence, memory_order_acquire) - (position + 1);
+    if (lag == 0) {
+      if (atomic_compare_exchange_weak_explicit(&chan->head, &position, position + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) break;
+    } else if (lag < 0) {
+      /* Not sent yet, or the sender has the cell but hasn't written it. */
+      return false;
+    } else {
+      position = atomic_load_explicit(&chan->head, memory_order_relaxed);
+    }
+  }
+  *value = cell->value;
+  atomic_store_explicit(&cell->sequence, position + chan->mask + 1, memory_order_release);
+  return true;
+}
+
+/* Unbounded channel with a full ring: to the end of the overflow, which stays in front of later sends. */
+static void coro__overflow_push(coro_chan_t* chan, coro_value_t value) {
+  pthread_mutex_lock(&chan->overflow_lock);
+  if (chan->overflow_count == chan->overflow_capacity) {
+    const size_t capacity = chan->overflow_capacity ? chan->overflow_capacity * 2 : 1024;
+    coro_value_t* grown = malloc(capacity * sizeof(coro_value_t));
+    for (size_t i = 0; i < chan->overflow_count; i++) {
+      grown[i] = chan->overflow[(chan->overflow_start + i) % chan->overflow_capacity];
+    }
+    free(chan->overflow);
+    chan->overflow = grown;
+    chan->overflow_start = 0;
+    chan->overflow_capacity = capacity;
+  }
+  chan->overflow[(chan->overflow_start + chan->overflow_count++) % chan->overflow_capacity] = value;
+  atomic_store(&chan->overflowed, chan->overflow_count);
+  pthread_mutex_unlock(&chan->overflow_lock);
+}
+
+/* Empty ring: move the oldest of the overflow into it. False when there was nothing. */
+static bool coro__overflow_refill(coro_chan_t* chan) {
+  if (!atomic_load(&chan->overflowed)) return false;
+
+  pthread_mutex_lock(&chan->overflow_lock);
+  size_t moved = 0;
+  while (chan->overflow_count && coro__ring_push(chan, chan->overflow[chan->overflow_start])) {
+    chan->overflow_start = (chan->overflow_start + 1) % chan->overflow_capacity;
+    chan->overflow_count--;
+    moved++;
+  }
+  atomic_store(&chan->overflowed, chan->overflow_count);
+  pthread_mutex_unlock(&chan->overflow_lock);
+  return moved;
+}
+
+bool coro_chan_try_send(coro_chan_t* chan, coro_value_t value) {
+  if (atomic_load_explicit(&chan->closed, memory_order_relaxed)) return false;
+
+  if (!chan->unbounded) {
+    if (!coro__ring_push(chan, value)) return false;
+  } else if (atomic_load(&chan->overflowed) || !coro__ring_push(chan, value)) {
+    coro__overflow_push(chan, value);
+  }
+  coro__waiters_wake(&chan->receivers, false);
+  return true;
+}
+
+bool coro_chan_try_recv(coro_chan_t* chan, coro_value_t* value) {
+  while (!coro__ring_pop(chan, value)) {
+    if (!chan->unbounded || !coro__overflow_refill(chan)) return false;
+  }
+  if (!chan->unbounded) coro__waiters_wake(&chan->senders, false);
+  return true;
+}
+
+/*
+ * Slow path of both: get on the list of waiters, try once more (the other side may have come and gone while we
+ * were getting on), park. Wakeups take waiters off the list, so it's back on the list every round.
+ */
+static bool coro__chan_wait(coro_chan_t* chan, bool send, coro_value_t* value) {
+  coro__waiters_t* waiters = send ? &chan->senders : &chan->receivers;
+  for (;;) {
+    if (send ? coro_chan_try_send(chan, *value) : coro_chan_try_recv(chan, value)) return true;
+    if (atomic_load(&chan->closed)) return send ? false : coro_chan_try_recv(chan, value);
+
+    if (coro_deadline_passed()) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+
+    coro__waiter_t waiter = { .parker = coro_parker_current() };
+    coro__waiters_add(waiters, &waiter);
+    const bool done = send ? coro_chan_try_send(chan, *value) : coro_chan_try_recv(chan, value);
+    if (!done && !atomic_load(&chan->closed)) coro_park();
+
+    /* Woken for progress we didn't wait for in the end: pass it on to whoever is next. */
+    const bool timed_out = !done && coro_deadline_passed();
+    if (coro__waiters_remove(waiters, &waiter) && (done || timed_out)) coro__waiters_wake(waiters, false);
+    if (done) return true;
+    if (timed_out) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+  }
+}
+
+bool coro_chan_send(coro_chan_t* chan, coro_value_t value) {
+  return coro_chan_try_send(chan, value) || coro__chan_wait(chan, true, &value);
+}
+
+bool coro_chan_recv(coro_chan_t* chan, coro_value_t* value) {
+  return coro_chan_try_recv(chan, value) || coro__chan_wait(chan, false, value);
+}
+
+void coro_chan_close(coro_chan_t* chan) {
+  atomic_store(&chan->closed, true);
+  coro__waiters_wake(&chan->senders, true);
+  coro__waiters_wake(&chan->receivers, true);
+}
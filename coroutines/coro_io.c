@@ -0,0 +1,846 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "coro.h"
+
+typedef struct coro__loop_task coro__loop_task_t;
+struct coro__loop_task {
+  coro_t coro;
+  coro_loop_t* loop;
+  coro_parker_t parker;
+  uint64_t deadline;         /* coro_deadline, 0 for none */
+  coro__loop_task_t* next;   /* in the ready list */
+};
+
+/* epoll fallback: operations parked on an fd until it's readable or writable. */
+typedef struct {
+  coro_io_t* readers;       /* reads and accepts */
+  coro_io_t* writers;       /* writes and connects */
+  uint32_t armed;           /* events of the last EPOLL_CTL_ADD/MOD, one-shot */
+  bool added;
+} coro__fd_t;
+
+enum { coro__wheel_levels = 6, coro__wheel_slots = 64 };
+
+typedef struct {
+  uint64_t elapsed;         /* everything before it has expired */
+  uint32_t count;
+  uint64_t occupied[coro__wheel_levels];
+  coro_timer_t* slots[coro__wheel_levels][coro__wheel_slots];
+  coro_timer_t* expiring;   /* due, taken off the wheel by coro__wheel_advance and not expired yet */
+} coro__wheel_t;
+
+struct coro_loop {
+  coro_stack_pool_t pool;
+  coro__loop_task_t* ready;
+  coro__loop_task_t** ready_tail;
+  coro__loop_task_t* running;
+  uint32_t tasks;           /* alive */
+  uint32_t pending;         /* submitted and not completed, the wake read included */
+  uint32_t parked;          /* in coro__loop_suspend, whoever unparks them may be another thread */
+  bool uring;
+  uint64_t start_ns;
+  uint64_t now;             /* ms since start_ns, updated every round */
+  coro__wheel_t wheel;
+
+  /* Coroutines unparked from other threads, handed over under the lock and announced on the eventfd. */
+  pthread_mutex_t remote_lock;
+  coro__loop_task_t* remote;
+  coro__loop_task_t** remote_tail;
+  int wake_fd;
+  coro_io_t wake;           /* read of wake_fd, submitted while coroutines are parked */
+  uint64_t wake_count;
+  bool wake_armed;
+
+  /* io_uring */
+  int ring_fd;
+  uint32_t to_submit;
+  struct __kernel_timespec timeout;  /* of the last IORING_OP_TIMEOUT, read whenever the kernel gets to the SQE */
+  uint32_t *sq_head, *sq_tail, sq_mask, *sq_array;
+  struct io_uring_sqe* sqes;
+  uint32_t *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  /* epoll */
+  int epoll_fd;
+  coro__fd_t* fds;
+  int fd_capacity;
+  coro_io_t* completed;     /* finished right away, completed from the loop and not from inside coro_loop_submit */
+  coro_io_t** completed_tail;
+};
+
+static __thread coro_loop_t* coro__loop;
+
+/************/
+/* io_uring */
+/************/
+
+enum { coro__sq_entries = 1024, coro__cq_entries = 8192 };
+
+static bool coro__uring_init(coro_loop_t* loop) {
+  struct io_uring_params params = {
+    /* Completions are only reaped in io_uring_enter from this thread anyway, don't interrupt it for them. */
+    .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    .cq_entries = coro__cq_entries,
+  };
+  int fd = syscall(__NR_io_uring_setup, coro__sq_entries, &params);
+  if (fd < 0 && errno == EINVAL) {
+    /* Older than 6.1. */
+    params = (struct io_uring_params){ .flags = IORING_SETUP_CQSIZE, .cq_entries = coro__cq_entries };
+    fd = syscall(__NR_io_uring_setup, coro__sq_entries, &params);
+  }
+  if (fd < 0) return false;
+
+  loop->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  loop->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (loop->cq_ring_size > loop->sq_ring_size) loop->sq_ring_size = loop->cq_ring_size;
+    loop->cq_ring_size = loop->sq_ring_size;
+  }
+
+  loop->sq_ring = mmap(0, loop->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+  loop->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+    ? loop->sq_ring
+    : mmap(0, loop->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  loop->sqes = mmap(0, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (loop->sq_ring == MAP_FAILED || loop->cq_ring == MAP_FAILED || loop->sqes == MAP_FAILED) {
+    perror("coro_loop_new: mmap io_uring");
+    abort();
+  }
+
+  char* sq = loop->sq_ring;
+  loop->sq_head = (uint32_t*)(sq + params.sq_off.head);
+  loop->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+  loop->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+  loop->sq_array = (uint32_t*)(sq + params.sq_off.array);
+  char* cq = loop->cq_ring;
+  loop->cq_head = (uint32_t*)(cq + params.cq_off.head);
+  loop->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+  loop->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  /* Slot i of the SQ array always points at SQE i, so an SQE is filled in place. */
+  for (uint32_t i = 0; i < params.sq_entries; i++) loop->sq_array[i] = i;
+
+  loop->ring_fd = fd;
+  loop->uring = true;
+  return true;
+}
+
+static int coro__uring_enter(coro_loop_t* loop, uint32_t min_complete) {
+  const uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int submitted;
+  while ((submitted = syscall(__NR_io_uring_enter, loop->ring_fd, loop->to_submit, min_complete, flags, 0, 0)) < 0) {
+    if (errno == EINTR) continue;
+    /* CQ overflowed into the kernel's backlog: reap first (the caller does), then submit the rest. */
+    if (errno == EBUSY || errno == EAGAIN) return 0;
+    perror("io_uring_enter");
+    abort();
+  }
+  loop->to_submit -= submitted;
+  return submitted;
+}
+
+/* Next SQE, zeroed, pushed to the SQ right away: fill it in before anything else submits. */
+static struct io_uring_sqe* coro__uring_sqe(coro_loop_t* loop) {
+  uint32_t tail = *loop->sq_tail;
+  while (tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) == loop->sq_mask + 1) {
+    /* Full, hand what's there to the kernel. */
+    coro__uring_enter(loop, 0);
+  }
+
+  struct io_uring_sqe* sqe = &loop->sqes[tail & loop->sq_mask];
+  *sqe = (struct io_uring_sqe){0};
+  __atomic_store_n(loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  loop->to_submit++;
+  return sqe;
+}
+
+static void coro__uring_submit(coro_loop_t* loop, coro_io_t* io) {
+  struct io_uring_sqe* sqe = coro__uring_sqe(loop);
+  sqe->fd = io->fd;
+  sqe->user_data = (uintptr_t)io;
+  switch (io->op) {
+  case CORO_IO_READ:
+  case CORO_IO_WRITE:
+    sqe->opcode = io->op == CORO_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->addr = (uintptr_t)io->buf;
+    sqe->len = io->len;
+    sqe->off = io->offset;
+    break;
+  case CORO_IO_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    break;
+  case CORO_IO_CONNECT:
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->addr = (uintptr_t)io->addr;
+    sqe->off = io->addr_len;
+    break;
+  }
+}
+
+/* `io` completes soon after, with -ECANCELED unless it's done already. */
+static void coro__uring_cancel(coro_loop_t* loop, coro_io_t* io) {
+  struct io_uring_sqe* sqe = coro__uring_sqe(loop);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)io;
+}
+
+/* SQEs with no user_data (cancels, timeouts) are the loop's own, their completions are dropped. */
+static void coro__uring_wait(coro_loop_t* loop, int64_t timeout_ms) {
+  /*
+   * Done after one completion of anything or the timeout. The timespec lives in the loop: an SQE left in the ring by
+   * EBUSY or a short submit is only read on a later io_uring_enter, by then a newer timeout is as good as its own.
+   */
+  if (timeout_ms >= 0) {
+    loop->timeout = (struct __kernel_timespec){ .tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000 };
+    struct io_uring_sqe* sqe = coro__uring_sqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->off = 1;
+  }
+  coro__uring_enter(loop, 1);
+
+  uint32_t head = *loop->cq_head;
+  const uint32_t tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = &loop->cqes[head & loop->cq_mask];
+    coro_io_t* io = (coro_io_t*)(uintptr_t)cqe->user_data;
+    const int32_t result = cqe->res;
+    /* Release the slot before calling out, completions resubmit and the CQ must not look full to the kernel. */
+    __atomic_store_n(loop->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (!io) continue;
+    io->result = result;
+    loop->pending--;
+    io->complete(io);
+  }
+}
+
+/*********/
+/* epoll */
+/*********/
+
+/* One attempt without blocking, false when the operation has to wait for the fd. */
+static bool coro__epoll_try(coro_io_t* io) {
+  int64_t result;
+  switch (io->op) {
+  case CORO_IO_READ:
+    result = io->offset >= 0
+      ? pread(io->fd, io->buf, io->len, io->offset)
+      : recv(io->fd, io->buf, io->len, MSG_DONTWAIT);
+    if (result < 0 && errno == ENOTSOCK) result = read(io->fd, io->buf, io->len);
+    break;
+  case CORO_IO_WRITE:
+    result = io->offset >= 0
+      ? pwrite(io->fd, io->buf, io->len, io->offset)
+      : send(io->fd, io->buf, io->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (result < 0 && errno == ENOTSOCK) result = write(io->fd, io->buf, io->len);
+    break;
+  case CORO_IO_ACCEPT:
+    /* There's no MSG_DONTWAIT for accept, the listening socket itself must not block. */
+    if (!(fcntl(io->fd, F_GETFL) & O_NONBLOCK)) fcntl(io->fd, F_SETFL, fcntl(io->fd, F_GETFL) | O_NONBLOCK);
+    result = accept4(io->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    break;
+  case CORO_IO_CONNECT:
+    if (io->result == -EINPROGRESS) {
+      /* Second round: the fd became writable, the handshake is over one way or another. */
+      int error = 0;
+      socklen_t length = sizeof(error);
+      result = getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (result == 0 && error) errno = error, result = -1;
+      break;
+    }
+    fcntl(io->fd, F_SETFL, fcntl(io->fd, F_GETFL) | O_NONBLOCK);
+    result = connect(io->fd, io->addr, io->addr_len);
+    if (result < 0 && errno == EINPROGRESS) {
+      io->result = -EINPROGRESS;
+      return false;
+    }
+    break;
+  default:
+    result = -1;
+    errno = EINVAL;
+  }
+
+  if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+  io->result = result < 0 ? -errno : result;
+  return true;
+}
+
+static void coro__epoll_arm(coro_loop_t* loop, int fd) {
+  coro__fd_t* state = &loop->fds[fd];
+  const uint32_t events = (state->readers ? EPOLLIN : 0) | (state->writers ? EPOLLOUT : 0);
+  if (!events || events == state->armed) return;
+
+  /* The fd may have been closed and reused since it was last armed, epoll forgets closed fds by itself. */
+  struct epoll_event event = { .events = events | EPOLLONESHOT, .data.fd = fd };
+  if (epoll_ctl(loop->epoll_fd, state->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) < 0) {
+    const int retry = errno == ENOENT ? EPOLL_CTL_ADD : errno == EEXIST ? EPOLL_CTL_MOD : -1;
+    if (retry < 0 || epoll_ctl(loop->epoll_fd, retry, fd, &event) < 0) {
+      perror("epoll_ctl");
+      abort();
+    }
+  }
+  state->armed = events;
+  state->added = true;
+}
+
+static void coro__epoll_park(coro_loop_t* loop, coro_io_t* io) {
+  if (io->fd >= loop->fd_capacity) {
+    int capacity = loop->fd_capacity ? loop->fd_capacity : 1024;
+    while (capacity <= io->fd) capacity *= 2;
+    loop->fds = realloc(loop->fds, capacity * sizeof(loop->fds[0]));
+    memset(loop->fds + loop->fd_capacity, 0, (capacity - loop->fd_capacity) * sizeof(loop->fds[0]));
+    loop->fd_capacity = capacity;
+  }
+
+  coro__fd_t* state = &loop->fds[io->fd];
+  coro_io_t** list = io->op == CORO_IO_READ || io->op == CORO_IO_ACCEPT ? &state->readers : &state->writers;
+  io->next = *list;
+  *list = io;
+  coro__epoll_arm(loop, io->fd);
+}
+
+static void coro__epoll_complete(coro_loop_t* loop, coro_io_t* io) {
+  loop->pending--;
+  io->complete(io);
+}
+
+/* Retries everything parked on `*list`, puts back what still has to wait. */
+static void coro__epoll_retry(coro_loop_t* loop, coro_io_t** list) {
+  coro_io_t* io = *list;
+  *list = 0;
+  while (io) {
+    coro_io_t* next = io->next;
+    if (coro__epoll_try(io)) {
+      coro__epoll_complete(loop, io);
+    } else {
+      io->next = *list;
+      *list = io;
+    }
+    io = next;
+  }
+}
+
+/* Takes a parked operation back, false when it isn't parked. */
+static bool coro__epoll_unpark(coro_loop_t* loop, coro_io_t* io) {
+  coro__fd_t* state = &loop->fds[io->fd];
+  coro_io_t** list = io->op == CORO_IO_READ || io->op == CORO_IO_ACCEPT ? &state->readers : &state->writers;
+  for (; *list; list = &(*list)->next) {
+    if (*list == io) {
+      /* The fd stays armed, a wakeup for nobody is only a wasted retry. */
+      *list = io->next;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void coro__epoll_wait(coro_loop_t* loop, int64_t timeout_ms) {
+  struct epoll_event events[256];
+  int count = epoll_wait(loop->epoll_fd, events, 256, timeout_ms);
+  if (count < 0 && errno != EINTR) {
+    perror("epoll_wait");
+    abort();
+  }
+
+  for (int i = 0; i < count; i++) {
+    const int fd = events[i].data.fd;
+    coro__fd_t* state = &loop->fds[fd];
+    state->armed = 0;
+    /* Errors and hangups wake both sides, the retried operation reports what happened. */
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) coro__epoll_retry(loop, &state->readers);
+    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) coro__epoll_retry(loop, &state->writers);
+    coro__epoll_arm(loop, fd);
+  }
+}
+
+/**********/
+/* timers */
+/**********/
+
+/* Timers at most this far away fit on the wheel without lapping its last level, the rest are cut to it. */
+static const uint64_t coro__wheel_max = (1ull << 36) - (1ull << 30);
+/* `slot` of timers taken off the wheel to be expired. */
+static const uint32_t coro__wheel_expiring = 1 + coro__wheel_levels * coro__wheel_slots;
+
+static coro_timer_t** coro__wheel_list(coro__wheel_t* wheel, uint32_t slot) {
+  if (slot == coro__wheel_expiring) return &wheel->expiring;
+  return &wheel->slots[(slot - 1) / coro__wheel_slots][(slot - 1) % coro__wheel_slots];
+}
+
+static void coro__wheel_insert(coro__wheel_t* wheel, coro_timer_t* timer) {
+  const uint64_t when = timer->deadline > wheel->elapsed ? timer->deadline : wheel->elapsed;
+  /* The highest group of 6 bits where `when` differs from now, everything above it is the same. */
+  uint32_t level = (63 - __builtin_clzll((wheel->elapsed ^ when) | (coro__wheel_slots - 1))) / 6;
+  if (level >= coro__wheel_levels) level = coro__wheel_levels - 1;
+  const uint32_t slot = (when >> (6 * level)) % coro__wheel_slots;
+
+  coro_timer_t** list = &wheel->slots[level][slot];
+  timer->slot = 1 + level * coro__wheel_slots + slot;
+  timer->previous = 0;
+  timer->next = *list;
+  if (*list) (*list)->previous = timer;
+  *list = timer;
+  wheel->occupied[level] |= 1ull << slot;
+}
+
+static void coro__wheel_remove(coro__wheel_t* wheel, coro_timer_t* timer) {
+  coro_timer_t** list = coro__wheel_list(wheel, timer->slot);
+  if (timer->next) timer->next->previous = timer->previous;
+  if (timer->previous) {
+    timer->previous->next = timer->next;
+  } else {
+    *list = timer->next;
+  }
+  if (!*list && timer->slot != coro__wheel_expiring) {
+    const uint32_t index = timer->slot - 1;
+    wheel->occupied[index / coro__wheel_slots] &= ~(1ull << (index % coro__wheel_slots));
+  }
+  timer->slot = 0;
+}
+
+/*
+ * Start of the nearest occupied slot. Lower levels always come first: a slot of a higher level is processed when its
+ * time starts, before anything of its range can be on the level below.
+ */
+static bool coro__wheel_next(coro__wheel_t* wheel, uint32_t* level, uint32_t* slot, uint64_t* at) {
+  for (uint32_t l = 0; l < coro__wheel_levels; l++) {
+    const uint64_t occupied = wheel->occupied[l];
+    if (!occupied) continue;
+
+    const uint32_t shift = 6 * l;
+    const uint32_t current = (wheel->elapsed >> shift) % coro__wheel_slots;
+    const uint64_t rotated = occupied >> current | (current ? occupied << (64 - current) : 0);
+    const uint32_t found = (current + __builtin_ctzll(rotated)) % coro__wheel_slots;
+    const uint64_t range = 1ull << (shift + 6);
+
+    *level = l;
+    *slot = found;
+    *at = (wheel->elapsed & ~(range - 1)) + ((uint64_t)found << shift) + (found < current ? range : 0);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Expires everything due by `now`, in no particular order, timers of higher levels move down as their slots come.
+ * Due timers are all collected first: expire callbacks start and cancel timers, and a timer started again for right
+ * now must wait for the next round, not expire over and over. True if anything expired.
+ */
+static bool coro__wheel_advance(coro__wheel_t* wheel, uint64_t now) {
+  uint32_t level, slot;
+  uint64_t at;
+  while (coro__wheel_next(wheel, &level, &slot, &at) && at <= now) {
+    wheel->elapsed = at;
+    coro_timer_t* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = 0;
+    wheel->occupied[level] &= ~(1ull << slot);
+    while (timer) {
+      coro_timer_t* next = timer->next;
+      if (timer->deadline <= at) {
+        timer->slot = coro__wheel_expiring;
+        timer->previous = 0;
+        timer->next = wheel->expiring;
+        if (wheel->expiring) wheel->expiring->previous = timer;
+        wheel->expiring = timer;
+      } else {
+        coro__wheel_insert(wheel, timer);
+      }
+      timer = next;
+    }
+  }
+  if (now > wheel->elapsed) wheel->elapsed = now;
+
+  const bool expired = wheel->expiring;
+  for (coro_timer_t* timer; (timer = wheel->expiring);) {
+    coro__wheel_remove(wheel, timer);
+    wheel->count--;
+    timer->expire(timer);
+  }
+  return expired;
+}
+
+uint64_t coro_loop_now(coro_loop_t* loop) {
+  return loop->now;
+}
+
+void coro_timer_start(coro_loop_t* loop, coro_timer_t* timer, uint64_t ms) {
+  if (timer->slot) coro_timer_cancel(loop, timer);
+  timer->deadline = loop->now + (ms < coro__wheel_max ? ms : coro__wheel_max);
+  coro__wheel_insert(&loop->wheel, timer);
+  loop->wheel.count++;
+}
+
+bool coro_timer_cancel(coro_loop_t* loop, coro_timer_t* timer) {
+  if (!timer->slot) return false;
+  coro__wheel_remove(&loop->wheel, timer);
+  loop->wheel.count--;
+  return true;
+}
+
+static void coro__loop_clock(coro_loop_t* loop) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  loop->now = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - loop->start_ns) / 1000000;
+}
+
+/* Milliseconds until the nearest slot of the wheel, -1 without timers. */
+static int64_t coro__loop_timeout(coro_loop_t* loop) {
+  uint32_t level, slot;
+  uint64_t at;
+  if (!coro__wheel_next(&loop->wheel, &level, &slot, &at)) return -1;
+  if (at <= loop->now) return 0;
+  return at - loop->now < INT32_MAX ? (int64_t)(at - loop->now) : INT32_MAX;
+}
+
+/********/
+/* loop */
+/********/
+
+coro_loop_t* coro_loop_new(bool epoll_only) {
+  coro_loop_t* loop = calloc(1, sizeof(coro_loop_t));
+  coro_stack_pool_init(&loop->pool, 64 * 1024, 64);
+  loop->ready_tail = &loop->ready;
+  loop->completed_tail = &loop->completed;
+  loop->remote_tail = &loop->remote;
+  pthread_mutex_init(&loop->remote_lock, 0);
+  loop->ring_fd = -1;
+  loop->epoll_fd = -1;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  loop->start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+  if (epoll_only || !coro__uring_init(loop)) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+      perror("epoll_create1");
+      abort();
+    }
+  }
+
+  /* io_uring gives up on reads of O_NONBLOCK files with -EAGAIN, epoll must not block in read. */
+  loop->wake_fd = eventfd(0, EFD_CLOEXEC | (loop->uring ? 0 : EFD_NONBLOCK));
+  if (loop->wake_fd < 0) {
+    perror("eventfd");
+    abort();
+  }
+  return loop;
+}
+
+void coro_loop_delete(coro_loop_t* loop) {
+  if (loop->uring) {
+    munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ring != loop->sq_ring) munmap(loop->cq_ring, loop->cq_ring_size);
+    munmap(loop->sq_ring, loop->sq_ring_size);
+    close(loop->ring_fd);
+  } else {
+    close(loop->epoll_fd);
+    free(loop->fds);
+  }
+  close(loop->wake_fd);
+  pthread_mutex_destroy(&loop->remote_lock);
+  coro_stack_pool_destroy(&loop->pool);
+  free(loop);
+}
+
+const char* coro_loop_backend(coro_loop_t* loop) {
+  return loop->uring ? "io_uring" : "epoll";
+}
+
+void coro_loop_submit(coro_loop_t* loop, coro_io_t* io) {
+  loop->pending++;
+  if (loop->uring) {
+    coro__uring_submit(loop, io);
+  } else if (coro__epoll_try(io)) {
+    io->next = 0;
+    *loop->completed_tail = io;
+    loop->completed_tail = &io->next;
+  } else {
+    coro__epoll_park(loop, io);
+  }
+}
+
+static void coro__loop_ready(coro_loop_t* loop, coro__loop_task_t* task) {
+  task->next = 0;
+  *loop->ready_tail = task;
+  loop->ready_tail = &task->next;
+}
+
+static void coro__loop_unpark_expire(coro_timer_t* timer) {
+  coro_unpark(timer->data);
+}
+
+/*
+ * Everything runs on the loop's thread, so unlike tasks of coro_sched the coroutine is never running here. A deadline
+ * only ends the park, whoever parked finds out with coro_deadline_passed.
+ */
+static void coro__loop_suspend(coro_parker_t* parker) {
+  coro__loop_task_t* task = (coro__loop_task_t*)((char*)parker - offsetof(coro__loop_task_t, parker));
+  coro_loop_t* loop = task->loop;
+  if (task->deadline && task->deadline <= loop->now) return;
+
+  uint32_t expected = CORO_PARKER_EMPTY;
+  if (!atomic_compare_exchange_strong(&parker->state, &expected, CORO_PARKER_PARKED)) {
+    atomic_store(&parker->state, CORO_PARKER_EMPTY);
+    return;
+  }
+
+  coro_timer_t timer = { .expire = coro__loop_unpark_expire, .data = parker };
+  if (task->deadline) coro_timer_start(loop, &timer, task->deadline - loop->now);
+  loop->parked++;
+  coro_yield(0);
+  loop->parked--;
+  coro_timer_cancel(loop, &timer);
+}
+
+/* Unparked from another thread (or outside of coro_loop_run): the loop picks it up once it reads the eventfd. */
+static void coro__loop_resume(coro_parker_t* parker) {
+  coro__loop_task_t* task = (coro__loop_task_t*)((char*)parker - offsetof(coro__loop_task_t, parker));
+  coro_loop_t* loop = task->loop;
+  if (loop == coro__loop) {
+    coro__loop_ready(loop, task);
+    return;
+  }
+
+  /* Only the first one since the last handover writes, the loop takes all of them at once. */
+  pthread_mutex_lock(&loop->remote_lock);
+  const bool first = !loop->remote;
+  task->next = 0;
+  *loop->remote_tail = task;
+  loop->remote_tail = &task->next;
+  if (first && write(loop->wake_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+    perror("coro_unpark: eventfd");
+    abort();
+  }
+  pthread_mutex_unlock(&loop->remote_lock);
+}
+
+static void coro__loop_woken(coro_io_t* io) {
+  coro_loop_t* loop = io->data;
+  loop->wake_armed = false;
+
+  pthread_mutex_lock(&loop->remote_lock);
+  coro__loop_task_t* task = loop->remote;
+  loop->remote = 0;
+  loop->remote_tail = &loop->remote;
+  pthread_mutex_unlock(&loop->remote_lock);
+
+  while (task) {
+    coro__loop_task_t* next = task->next;
+    coro__loop_ready(loop, task);
+    task = next;
+  }
+}
+
+void coro_loop_spawn(coro_loop_t* loop, coro_function_t fn, coro_value_t arg) {
+  coro__loop_task_t* task = malloc(sizeof(coro__loop_task_t));
+  coro_spawn(&task->coro, &loop->pool, fn, arg);
+  task->loop = loop;
+  task->deadline = 0;
+  task->parker = (coro_parker_t){ .suspend = coro__loop_suspend, .resume = coro__loop_resume };
+  coro__loop_ready(loop, task);
+  loop->tasks++;
+}
+
+/* Parker of the coroutine coro_loop_run runs on this thread, null outside of them. */
+coro_parker_t* coro__loop_parker(void) {
+  return coro__loop && coro__loop->running ? &coro__loop->running->parker : 0;
+}
+
+void coro_loop_run(coro_loop_t* loop) {
+  coro_loop_t* const outer = coro__loop;
+  coro__loop = loop;
+  coro__loop_clock(loop);
+
+  while (loop->tasks || loop->pending > loop->wake_armed || loop->wheel.count) {
+    coro__loop_task_t* task;
+    while ((task = loop->ready)) {
+      loop->ready = task->next;
+      if (!loop->ready) loop->ready_tail = &loop->ready;
+
+      loop->running = task;
+      coro_value_t ignored;
+      if (!coro_next(&task->coro, &ignored, 0)) {
+        free(task);
+        loop->tasks--;
+      }
+      loop->running = 0;
+    }
+
+    if (loop->completed) {
+      coro_io_t* io = loop->completed;
+      loop->completed = 0;
+      loop->completed_tail = &loop->completed;
+      while (io) {
+        coro_io_t* next = io->next;
+        coro__epoll_complete(loop, io);
+        io = next;
+      }
+      continue;
+    }
+
+    coro__loop_clock(loop);
+    if (coro__wheel_advance(&loop->wheel, loop->now)) continue;
+
+    const int64_t timeout = coro__loop_timeout(loop);
+    if (loop->pending == loop->wake_armed && timeout < 0) {
+      if (!loop->tasks) break;
+      if (!loop->parked) {
+        fprintf(stderr, "coro_loop_run: %u coroutines wait for nothing\n", loop->tasks);
+        abort();
+      }
+    }
+
+    /*
+     * Parked coroutines may be unparked by other threads, so the loop waits for the eventfd as well. A write which
+     * came before completes the read right away. Coroutines of the loop parked on each other block it for good then.
+     */
+    if (loop->parked && !loop->wake_armed) {
+      loop->wake = (coro_io_t){
+        .op = CORO_IO_READ, .fd = loop->wake_fd, .buf = &loop->wake_count, .len = sizeof(loop->wake_count),
+        .offset = -1, .complete = coro__loop_woken, .data = loop,
+      };
+      loop->wake_armed = true;
+      coro_loop_submit(loop, &loop->wake);
+      if (loop->completed) continue;
+    }
+
+    if (!loop->pending) {
+      nanosleep(&(struct timespec){ .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000 }, 0);
+    } else if (loop->uring) {
+      coro__uring_wait(loop, timeout);
+    } else {
+      coro__epoll_wait(loop, timeout);
+    }
+  }
+
+  coro__loop = outer;
+}
+
+/**************************/
+/* blocking-looking calls */
+/**************************/
+
+static void coro__io_resume(coro_io_t* io) {
+  coro__loop_ready(coro__loop, io->data);
+}
+
+/* io_uring finishes the operation with -ECANCELED soon after, the epoll fallback can do it right away. */
+static void coro__io_expire(coro_timer_t* timer) {
+  coro_loop_t* loop = coro__loop;
+  coro_io_t* io = timer->data;
+  if (loop->uring) {
+    coro__uring_cancel(loop, io);
+  } else if (coro__epoll_unpark(loop, io)) {
+    io->result = -ETIMEDOUT;
+    coro__epoll_complete(loop, io);
+  }
+}
+
+static int64_t coro__io(coro_io_t* io) {
+  coro_loop_t* loop = coro__loop;
+  coro__loop_task_t* task = loop->running;
+  if (task->deadline && task->deadline <= loop->now) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  /* Without io_uring most socket operations don't have to wait, no need for a round trip through the loop then. */
+  if (!loop->uring && coro__epoll_try(io)) {
+    if (io->result >= 0) return io->result;
+    errno = -io->result;
+    return -1;
+  }
+
+  io->complete = coro__io_resume;
+  io->data = task;
+  loop->pending++;
+  if (loop->uring) {
+    coro__uring_submit(loop, io);
+  } else {
+    coro__epoll_park(loop, io);
+  }
+  coro_timer_t timer = { .expire = coro__io_expire, .data = io };
+  if (task->deadline) coro_timer_start(loop, &timer, task->deadline - loop->now);
+  coro_yield(0);
+  const bool expired = task->deadline && !coro_timer_cancel(loop, &timer);
+
+  if (io->result >= 0) return io->result;
+  errno = expired && io->result == -ECANCELED ? ETIMEDOUT : -io->result;
+  return -1;
+}
+
+/* The timer is on the stack of the sleeping coroutine, which is only resumed by it. */
+static void coro__sleep_expire(coro_timer_t* timer) {
+  coro__loop_ready(coro__loop, timer->data);
+}
+
+void coro_sleep(uint64_t ms) {
+  coro_loop_t* loop = coro__loop;
+  coro_timer_t timer = { .expire = coro__sleep_expire, .data = loop->running };
+  coro_timer_start(loop, &timer, ms);
+  coro_yield(0);
+}
+
+void coro_deadline(uint64_t ms) {
+  coro_loop_t* loop = coro__loop;
+  loop->running->deadline = ms ? loop->now + ms : 0;
+}
+
+bool coro_deadline_passed(void) {
+  coro_loop_t* loop = coro__loop;
+  if (!loop || !loop->running) return false;
+  const uint64_t deadline = loop->running->deadline;
+  return deadline && deadline <= loop->now;
+}
+
+int64_t coro_read(int fd, void* buf, size_t len, int64_t offset) {
+  coro_io_t io = { .op = CORO_IO_READ, .fd = fd, .buf = buf, .len = len, .offset = offset };
+  return coro__io(&io);
+}
+
+int64_t coro_write(int fd, const void* buf, size_t len, int64_t offset) {
+  coro_io_t io = { .op = CORO_IO_WRITE, .fd = fd, .buf = (void*)buf, .len = len, .offset = offset };
+  return coro__io(&io);
+}
+
+/* The new socket is close-on-exec. */
+int coro_accept(int fd) {
+  coro_io_t io = { .op = CORO_IO_ACCEPT, .fd = fd };
+  return coro__io(&io);
+}
+
+int coro_connect(int fd, const void* addr, uint32_t addr_len) {
+  coro_io_t io = { .op = CORO_IO_CONNECT, .fd = fd, .addr = addr, .addr_len = addr_len };
+  return coro__io(&io);
+}
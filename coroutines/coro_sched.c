@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "coro.h"
+
+static void coro__futex_wait(_Atomic uint32_t* word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, 0, 0, 0);
+}
+
+static void coro__futex_wake(_Atomic uint32_t* word, int count) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
+/*
+ * Chase-Lev deque in C11 atomics as in Lê, Pop, Cohen, Zappa Nardelli "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (PPoPP 2013). The owner pushes and pops at the bottom, thieves take from the top, and only a pop
+ * of the last task races thieves with a CAS on top. Buffers only grow. Old ones stay around until the deque is
+ * destroyed, because a thief may still read from them.
+ */
+typedef struct coro__buffer coro__buffer_t;
+struct coro__buffer {
+  int64_t size;             /* power of two */
+  coro__buffer_t* previous;
+  _Atomic(coro_task_t*) tasks[];
+};
+
+typedef struct {
+  _Alignas(64) _Atomic int64_t top;
+  _Alignas(64) _Atomic int64_t bottom;
+  _Atomic(coro__buffer_t*) buffer;
+} coro__deque_t;
+
+#define CORO__ABORT ((coro_task_t*)1)
+
+static coro__buffer_t* coro__buffer_new(int64_t size, coro__buffer_t* previous) {
+  coro__buffer_t* buffer = calloc(1, sizeof(coro__buffer_t) + size * sizeof(coro_task_t*));
+  buffer->size = size;
+  buffer->previous = previous;
+  return buffer;
+}
+
+static void coro__deque_init(coro__deque_t* q) {
+  atomic_init(&q->top, 0);
+  atomic_init(&q->bottom, 0);
+  atomic_init(&q->buffer, coro__buffer_new(1024, 0));
+}
+
+static void coro__deque_destroy(coro__deque_t* q) {
+  for (coro__buffer_t* buffer = atomic_load(&q->buffer), *previous; buffer; buffer = previous) {
+    previous = buffer->previous;
+    free(buffer);
+  }
+}
+
+static void coro__deque_push(coro__deque_t* q, coro_task_t* task) {
+  const int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+  const int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+  coro__buffer_t* a = atomic_load_explicit(&q->buffer, memory_order_relaxed);
+  if (b - t > a->size - 1) {
+    coro__buffer_t* grown = coro__buffer_new(a->size * 2, a);
+    for (int64_t i = t; i < b; i++) {
+      coro_task_t* moved = atomic_load_explicit(&a->tasks[i & (a->size - 1)], memory_order_relaxed);
+      atomic_store_explicit(&grown->tasks[i & (grown->size - 1)], moved, memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->buffer, grown, memory_order_release);
+    a = grown;
+  }
+  atomic_store_explicit(&a->tasks[b & (a->size - 1)], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+static coro_task_t* coro__deque_pop(coro__deque_t* q) {
+  const int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+  coro__buffer_t* a = atomic_load_explicit(&q->buffer, memory_order_relaxed);
+  atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+  if (t > b) {
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    return 0;
+  }
+
+  coro_task_t* task = atomic_load_explicit(&a->tasks[b & (a->size - 1)], memory_order_relaxed);
+  if (t == b) {
+    /* The last one, thieves may be after it too. */
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      task = 0;
+    }
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+/* Returns CORO__ABORT when another thief or the owner won the race, the deque may still have tasks. */
+static coro_task_t* coro__deque_steal(coro__deque_t* q) {
+  int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  const int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+  if (t >= b) return 0;
+
+  coro__buffer_t* a = atomic_load_explicit(&q->buffer, memory_order_acquire);
+  coro_task_t* task = atomic_load_explicit(&a->tasks[t & (a->size - 1)], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return CORO__ABORT;
+  }
+  return task;
+}
+
+/*************/
+/* scheduler */
+/*************/
+
+enum { CORO__RUN, CORO__YIELD, CORO__PARK, CORO__WAIT };
+
+#define CORO__DONE ((uintptr_t)1)
+#define CORO__EXTERNAL ((uintptr_t)2)
+
+struct coro_task {
+  coro_t coro;
+  coro_sched_t* sched;
+  coro_function_t fn;
+  coro_value_t arg;
+  coro_value_t result;
+  coro_task_t* next;          /* in the inject queue or in the yielded list */
+  coro_task_t* join;          /* what it parks on */
+  uint8_t action;             /* why it switched back to the worker */
+  coro_parker_t parker;       /* coro_park, CORO__WAIT */
+  _Atomic uintptr_t waiter;   /* 0, CORO__DONE, CORO__EXTERNAL or the task parked in coro_sched_join */
+  _Atomic uint32_t done;      /* 1 when finished (futex for joins from outside), 2 once the finisher let go of it */
+};
+
+typedef struct {
+  coro__deque_t deque;
+  coro_sched_t* sched;
+  coro_task_t* running;
+  coro_task_t* yielded;       /* FIFO of tasks which called coro_sched_yield, run after the deque is empty */
+  coro_task_t** yielded_tail;
+  coro_stack_pool_t pool;
+  uint64_t random;
+  coro_sched_stats_t stats;   /* written by the owner only */
+  pthread_t thread;
+} coro__worker_t;
+
+struct coro_sched {
+  coro__worker_t* workers;
+  uint32_t worker_count;
+  pthread_mutex_t inject_lock;
+  coro_task_t* injected;      /* spawned from outside of the workers */
+  coro_task_t** injected_tail;
+  _Atomic uint32_t injected_count;
+  _Atomic uint32_t searching;  /* workers looking for tasks to steal, they'll find new ones without a wakeup */
+  _Atomic uint32_t sleeping;
+  _Atomic uint32_t epoch;     /* futex idle workers sleep on */
+  _Atomic bool stopping;
+};
+
+static __thread coro__worker_t* coro__worker;
+
+/*
+ * Tasks move between threads at every switch. An inlined TLS access could keep the previous thread's address in a
+ * register across one, so tasks only reach worker state through a call.
+ */
+__attribute__((noinline, noclone))
+static coro__worker_t* coro__current_worker(void) {
+  return coro__worker;
+}
+
+/* Wakes one sleeping worker after work was published, unless some worker is already out looking for it. */
+static void coro__wake(coro_sched_t* sched) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&sched->sleeping, memory_order_relaxed)
+      && !atomic_load_explicit(&sched->searching, memory_order_relaxed)) {
+    atomic_fetch_add(&sched->epoch, 1);
+    coro__futex_wake(&sched->epoch, 1);
+  }
+}
+
+static void coro__ready(coro__worker_t* w, coro_task_t* task) {
+  coro__deque_push(&w->deque, task);
+  coro__wake(w->sched);
+}
+
+static void coro__inject(coro_sched_t* sched, coro_task_t* task) {
+  pthread_mutex_lock(&sched->inject_lock);
+  task->next = 0;
+  *sched->injected_tail = task;
+  sched->injected_tail = &task->next;
+  atomic_fetch_add(&sched->injected_count, 1);
+  pthread_mutex_unlock(&sched->inject_lock);
+  coro__wake(sched);
+}
+
+static coro_task_t* coro__take_injected(coro_sched_t* sched) {
+  if (!atomic_load_explicit(&sched->injected_count, memory_order_relaxed)) return 0;
+
+  pthread_mutex_lock(&sched->inject_lock);
+  coro_task_t* task = sched->injected;
+  if (task) {
+    sched->injected = task->next;
+    if (!sched->injected) sched->injected_tail = &sched->injected;
+    atomic_fetch_sub(&sched->injected_count, 1);
+  }
+  pthread_mutex_unlock(&sched->inject_lock);
+  return task;
+}
+
+static coro_task_t* coro__steal(coro__worker_t* w) {
+  coro_sched_t* sched = w->sched;
+  if (sched->worker_count < 2) return 0;
+
+  w->random ^= w->random << 13, w->random ^= w->random >> 7, w->random ^= w->random << 17;
+  const uint32_t start = w->random % sched->worker_count;
+  for (uint32_t i = 0; i < sched->worker_count; i++) {
+    coro__worker_t* victim = &sched->workers[(start + i) % sched->worker_count];
+    if (victim == w) continue;
+    coro_task_t* task;
+    do task = coro__deque_steal(&victim->deque); while (task == CORO__ABORT);
+    if (task) {
+      w->stats.steals++;
+      return task;
+    }
+  }
+  return 0;
+}
+
+/* Own deque, yielded tasks, injected ones, other deques, then sleep. Returns 0 when the scheduler stops. */
+static coro_task_t* coro__find(coro__worker_t* w) {
+  coro_sched_t* sched = w->sched;
+  for (;;) {
+    coro_task_t* task = coro__deque_pop(&w->deque);
+    if (task) return task;
+
+    if (w->yielded) {
+      for (task = w->yielded; task; task = task->next) coro__deque_push(&w->deque, task);
+      w->yielded = 0;
+      w->yielded_tail = &w->yielded;
+      coro__wake(sched);
+      continue;
+    }
+
+    if ((task = coro__take_injected(sched))) return task;
+    atomic_fetch_add(&sched->searching, 1);
+    for (int spin = 0; spin < 64 && !task; spin++) {
+      if (!(task = coro__steal(w))) __builtin_ia32_pause();
+    }
+    atomic_fetch_sub(&sched->searching, 1);
+    if (task) return task;
+
+    /* Announce sleeping first: whoever publishes work after this either is seen below or bumps the epoch. */
+    atomic_fetch_add(&sched->sleeping, 1);
+    const uint32_t epoch = atomic_load(&sched->epoch);
+    if (!(task = coro__take_injected(sched)) && !(task = coro__steal(w)) && !atomic_load(&sched->stopping)) {
+      w->stats.sleeps++;
+      coro__futex_wait(&sched->epoch, epoch);
+    }
+    atomic_fetch_sub(&sched->sleeping, 1);
+    if (task) return task;
+    if (atomic_load(&sched->stopping)) return 0;
+  }
+}
+
+static void coro__finish(coro__worker_t* w, coro_task_t* task) {
+  w->stats.tasks++;
+  const uintptr_t waiter = atomic_exchange(&task->waiter, CORO__DONE);
+  atomic_store(&task->done, 1);
+  if (waiter == CORO__EXTERNAL) coro__futex_wake(&task->done, INT_MAX);
+  /* Last touch of `task`, the joiner frees it once it sees this, so a woken joiner can't free the futex word early. */
+  atomic_store_explicit(&task->done, 2, memory_order_release);
+  if (waiter && waiter != CORO__EXTERNAL) coro__ready(w, (coro_task_t*)waiter);
+}
+
+static void coro__run(coro__worker_t* w, coro_task_t* task) {
+  /* Stacks are taken on the first run, not on spawn: a million queued tasks are a million small structs. */
+  if (!task->coro.coro_sp) {
+    /* The task's own function, not a wrapper: what it returns comes out of coro_next, and traces show its name. */
+    coro_spawn(&task->coro, &w->pool, task->fn, task->arg);
+  }
+  /* A finished task gives its stack to the pool of the worker it finished on. */
+  task->coro.pool = &w->pool;
+  task->action = CORO__RUN;
+
+  w->running = task;
+  coro_value_t value;
+  const bool suspended = coro_next(&task->coro, &value, 0);
+  w->running = 0;
+
+  if (!suspended) {
+    task->result = value;
+    coro__finish(w, task);
+  } else if (task->action == CORO__YIELD) {
+    task->next = 0;
+    *w->yielded_tail = task;
+    w->yielded_tail = &task->next;
+  } else if (task->action == CORO__PARK) {
+    /* Parked only now that it's off its stack, the task it waits for may finish on another worker any moment. */
+    uintptr_t expected = 0;
+    w->stats.parks++;
+    if (!atomic_compare_exchange_strong(&task->join->waiter, &expected, (uintptr_t)task)) coro__ready(w, task);
+  } else if (task->action == CORO__WAIT) {
+    /* Same for coro_park: an unpark which came while the task was still on its stack puts it right back. */
+    uint32_t expected = CORO_PARKER_EMPTY;
+    w->stats.parks++;
+    if (!atomic_compare_exchange_strong(&task->parker.state, &expected, CORO_PARKER_PARKED)) {
+      atomic_store(&task->parker.state, CORO_PARKER_EMPTY);
+      coro__ready(w, task);
+    }
+  }
+}
+
+static void* coro__worker_main(void* arg) {
+  coro__worker_t* w = arg;
+  coro__worker = w;
+  for (coro_task_t* task; (task = coro__find(w)); ) coro__run(w, task);
+  return 0;
+}
+
+coro_sched_t* coro_sched_new(uint32_t workers, size_t stack_size) {
+  coro_sched_t* sched = calloc(1, sizeof(coro_sched_t));
+  sched->worker_count = workers;
+  sched->workers = aligned_alloc(64, (workers * sizeof(coro__worker_t) + 63) & ~(size_t)63);
+  pthread_mutex_init(&sched->inject_lock, 0);
+  sched->injected_tail = &sched->injected;
+
+  for (uint32_t i = 0; i < workers; i++) {
+    coro__worker_t* w = &sched->workers[i];
+    memset(w, 0, sizeof(*w));
+    coro__deque_init(&w->deque);
+    w->sched = sched;
+    w->yielded_tail = &w->yielded;
+    w->random = 0x9e3779b97f4a7c15ull * (i + 1);
+    coro_stack_pool_init(&w->pool, stack_size, 64);
+  }
+  for (uint32_t i = 0; i < workers; i++) {
+    pthread_create(&sched->workers[i].thread, 0, coro__worker_main, &sched->workers[i]);
+  }
+  return sched;
+}
+
+void coro_sched_delete(coro_sched_t* sched) {
+  atomic_store(&sched->stopping, true);
+  atomic_fetch_add(&sched->epoch, 1);
+  coro__futex_wake(&sched->epoch, INT_MAX);
+
+  for (uint32_t i = 0; i < sched->worker_count; i++) pthread_join(sched->workers[i].thread, 0);
+  /* Stacks migrate between pools, so pools go only after all workers are done with them. */
+  for (uint32_t i = 0; i < sched->worker_count; i++) {
+    coro__deque_destroy(&sched->workers[i].deque);
+    coro_stack_pool_destroy(&sched->workers[i].pool);
+  }
+  pthread_mutex_destroy(&sched->inject_lock);
+  free(sched->workers);
+  free(sched);
+}
+
+static void coro__task_suspend(coro_parker_t* parker) {
+  coro__current_worker()->running->action = CORO__WAIT;
+  coro_yield(0);
+}
+
+static void coro__task_resume(coro_parker_t* parker) {
+  coro_task_t* task = (coro_task_t*)((char*)parker - offsetof(coro_task_t, parker));
+  coro__worker_t* w = coro__current_worker();
+  if (w && w->sched == task->sched) {
+    coro__ready(w, task);
+  } else {
+    coro__inject(task->sched, task);
+  }
+}
+
+coro_task_t* coro_sched_spawn(coro_sched_t* sched, coro_function_t fn, coro_value_t arg) {
+  coro_task_t* task = calloc(1, sizeof(coro_task_t));
+  task->sched = sched;
+  task->fn = fn;
+  task->arg = arg;
+  task->parker.suspend = coro__task_suspend;
+  task->parker.resume = coro__task_resume;
+
+  coro__worker_t* w = coro__current_worker();
+  if (w && w->sched == sched) {
+    coro__ready(w, task);
+  } else {
+    coro__inject(sched, task);
+  }
+  return task;
+}
+
+void coro_sched_yield(void) {
+  coro__current_worker()->running->action = CORO__YIELD;
+  coro_yield(0);
+}
+
+/* Parker of the task running on this thread, null outside of tasks. */
+coro_parker_t* coro__sched_parker(void) {
+  coro__worker_t* w = coro__current_worker();
+  return w && w->running ? &w->running->parker : 0;
+}
+
+coro_value_t coro_sched_join(coro_task_t* task) {
+  coro__worker_t* w = coro__current_worker();
+  if (w && w->running) {
+    /* Still the newest in our own deque: nobody else started it, so run it right here on this stack. */
+    coro_task_t* newest = coro__deque_pop(&w->deque);
+    if (newest == task) {
+      task->result = task->fn(task->arg);
+      coro__finish(coro__current_worker(), task);
+    } else if (newest) {
+      coro__deque_push(&w->deque, newest);
+    }
+
+    if (atomic_load_explicit(&task->waiter, memory_order_acquire) != CORO__DONE) {
+      w->running->join = task;
+      w->running->action = CORO__PARK;
+      /* Back here once `task` is done, maybe on another thread. */
+      coro_yield(0);
+    }
+  } else {
+    uintptr_t expected = 0;
+    if (atomic_compare_exchange_strong(&task->waiter, &expected, CORO__EXTERNAL)) {
+      while (!atomic_load(&task->done)) coro__futex_wait(&task->done, 0);
+    }
+  }
+
+  /* The finisher is done with `task` right after handing over `waiter` (and waking external joiners). */
+  while (atomic_load_explicit(&task->done, memory_order_acquire) != 2) __builtin_ia32_pause();
+  const coro_value_t result = task->result;
+  free(task);
+  return result;
+}
+
+coro_sched_stats_t coro_sched_get_stats(coro_sched_t* sched) {
+  coro_sched_stats_t stats = {0};
+  for (uint32_t i = 0; i < sched->worker_count; i++) {
+    const coro_sched_stats_t* w = &sched->workers[i].stats;
+    stats.tasks += w->tasks;
+    stats.steals += w->steals;
+    stats.parks += w->parks;
+    stats.sleeps += w->sleeps;
+  }
+  return stats;
+}
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -7,11 +7,83 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-typedef void* coro_value_t;
-typedef coro_value_t (*coro_function_t)(coro_value_t value);
+#include "coro.h"
 
+coro_value_t gen_range(coro_value_t max) {
+  printf("gen_range: start\n");
+
+  for (uint64_t i = 0; i < (uint64_t)max; i++) {
+    printf("gen_range: %ld\n", i);
+    coro_yield((coro_value_t)i);
+  }
+
+  printf("gen_range: finish\n");
+
+  return 0;
+}
+
+coro_value_t gen_squared(coro_value_t arg) {
+  printf("gen_squared: start\n");
+
+  coro_t* range = arg;
+
+  uint64_t x;
+  while (coro_next(range, (coro_value_t*)&x, 0)) {
+    printf("gen_squared: %lu -> %lu\n", x, x*x);
+    coro_yield((coro_value_t)(x*x));
+  }
+
+  printf("gen_squared: finish\n");
+
+  return 0;
+}
+
+
+/* Reads a line without blocking the thread: the loop runs something else until it's there. */
+coro_value_t gen_interaction(coro_value_t arg) {
+  char line[256];
+  const int fd = open("/etc/timezone", O_RDONLY | O_CLOEXEC);
+  int64_t length = fd < 0 ? -1 : coro_read(fd, line, sizeof(line), 0);
+  if (fd >= 0) close(fd);
+  if (length < 0) {
+    perror("gen_interaction: /etc/timezone");
+    return 0;
+  }
+
+  const char* newline = memchr(line, '\n', length);
+  if (newline) length = newline - line + 1;
+  coro_write(STDOUT_FILENO, line, length, -1);
+
+  return 0;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+coro_value_t bench_pingpong(coro_value_t arg) {
+  for (;;) coro_yield(arg);
+}
+
+/*
+ * The setjmp/longjmp coroutines this file started with, copied as they were so bench measures the code coro__switch
+ * replaced, built with the same flags. Only kept for the comparison.
+ */
 typedef struct {
   jmp_buf user_ctx;
   jmp_buf coro_ctx;
@@ -19,38 +91,46 @@ typedef struct {
   coro_value_t yielded_value;
   coro_function_t fn;
   bool done;
-} coro_t;
+} coro_old_t;
 
 typedef struct {
-  coro_t* coro;
+  coro_old_t* coro;
   coro_function_t fn;
   void* stack;
   size_t stack_size;
   coro_value_t arg;
   void* user_stack;
   void* user_frame;
-} coro__startup_t;
+} coro_old__startup_t;
 
-void coro_init(coro_t* coro, coro_function_t fn, void* stack, size_t stack_size, coro_value_t arg);
-bool coro_next(coro_t* coro, coro_value_t* value, coro_value_t pass);
-coro_value_t coro_yield(coro_value_t value);
+static coro_old_t* coro_old_current;
 
-static coro_t* coro_current;
+coro_value_t coro_old_yield(coro_value_t value) {
+  coro_old_t* coro = coro_old_current;
+  coro_old_current->yielded_value = value;
+  if (setjmp(coro->coro_ctx) == 0) {
+    /* Back to user code */
+    longjmp(coro->user_ctx, 1);
+  } else {
+    /* Returned to the coroutine */
+    return coro->argument;
+  }
+}
 
-void coro__wrap(coro__startup_t* ctx) {
-  coro_yield((coro_value_t)0);
+void coro_old__wrap(coro_old__startup_t* ctx) {
+  coro_old_yield((coro_value_t)0);
   coro_value_t result = ctx->fn(ctx->arg);
-  coro_current->yielded_value = result;
-  coro_current->done = true;
-  longjmp(coro_current->user_ctx, 1);
+  coro_old_current->yielded_value = result;
+  coro_old_current->done = true;
+  longjmp(coro_old_current->user_ctx, 1);
 }
 
-void coro__init(coro__startup_t* ctx) {
-  coro__startup_t* ctx_copy = (void*)((char*)ctx->stack + ctx->stack_size - sizeof(coro__startup_t));
+void coro_old__init(coro_old__startup_t* ctx) {
+  coro_old__startup_t* ctx_copy = (void*)((char*)ctx->stack + ctx->stack_size - sizeof(coro_old__startup_t));
   *ctx_copy = *ctx;
   ctx = ctx_copy;
 
-  coro_current = ctx->coro;
+  coro_old_current = ctx->coro;
 
   if (setjmp(ctx->coro->user_ctx) == 0) {
     __asm__ volatile(
@@ -69,7 +149,7 @@ void coro__init(coro__startup_t* ctx) {
       : "=r"(ctx)
     );
 
-    coro__wrap(ctx);
+    coro_old__wrap(ctx);
     longjmp(ctx->coro->user_ctx, 1);
   }
 
@@ -82,107 +162,671 @@ void coro__init(coro__startup_t* ctx) {
   );
 }
 
-void coro_init(coro_t* coro, coro_function_t fn, void* stack, size_t stack_size, coro_value_t arg) {
+void coro_old_init(coro_old_t* coro, coro_function_t fn, void* stack, size_t stack_size, coro_value_t arg) {
   coro->done = false;
   coro->fn = fn;
-  coro__startup_t ctx_instance = { coro, fn, stack, stack_size, arg };
-  coro__init(&ctx_instance);
+  coro_old__startup_t ctx_instance = { coro, fn, stack, stack_size, arg };
+  coro_old__init(&ctx_instance);
 }
 
-bool coro_next(coro_t* coro, coro_value_t* value, coro_value_t pass) {
-  coro_t* const this_coro = coro_current;
-  coro_current = coro;
+bool coro_old_next(coro_old_t* coro, coro_value_t* value, coro_value_t pass) {
+  coro_old_t* const this_coro = coro_old_current;
+  coro_old_current = coro;
   if (setjmp(coro->user_ctx) == 0) {
     /* Transfer control to aready running coroutine */
     coro->argument = pass;
     longjmp(coro->coro_ctx, 1);
   } else {
     /* Back from coroutine. */
-    coro_current = this_coro;
+    coro_old_current = this_coro;
     *value = coro->yielded_value;
     return !coro->done;
   }
 }
 
-coro_value_t coro_yield(coro_value_t value) {
-  coro_t* coro = coro_current;
-  coro_current->yielded_value = value;
-  if (setjmp(coro->coro_ctx) == 0) {
-    /* Back to user code */
-    longjmp(coro->user_ctx, 1);
-  } else {
-    /* Returned to the coroutine */
-    return coro->argument;
+coro_value_t bench_old_pingpong(coro_value_t arg) {
+  for (;;) coro_old_yield(arg);
+}
+
+static ucontext_t bench_user_uctx, bench_coro_uctx;
+
+/* swapcontext also saves and restores the signal mask, which is a syscall each way. */
+void bench_ucontext_pingpong(void) {
+  for (;;) swapcontext(&bench_coro_uctx, &bench_user_uctx);
+}
+
+static void bench_report(const char* name, uint64_t elapsed, uint64_t switches) {
+  printf("%-16s %6.1f ns/switch %8.1f M switches/s\n", name, (double)elapsed / switches, switches * 1e3 / elapsed);
+}
+
+void bench(void) {
+  enum { rounds = 10000000 };
+  static char stack[16384];
+  coro_t coro;
+  coro_value_t value;
+
+  /* coro_next and coro_yield are one switch each. */
+  coro_init(&coro, bench_pingpong, stack, sizeof(stack), 0);
+  uint64_t start = now_ns();
+  for (int i = 0; i < rounds; i++) coro_next(&coro, &value, 0);
+  bench_report("asm switch:", now_ns() - start, 2ull * rounds);
+
+  coro_old_t old;
+  coro_old_init(&old, bench_old_pingpong, stack, sizeof(stack), 0);
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) coro_old_next(&old, &value, 0);
+  bench_report("setjmp/longjmp:", now_ns() - start, 2ull * rounds);
+
+  getcontext(&bench_coro_uctx);
+  bench_coro_uctx.uc_stack.ss_sp = stack;
+  bench_coro_uctx.uc_stack.ss_size = sizeof(stack);
+  makecontext(&bench_coro_uctx, bench_ucontext_pingpong, 0);
+  start = now_ns();
+  for (int i = 0; i < rounds / 10; i++) swapcontext(&bench_user_uctx, &bench_coro_uctx);
+  bench_report("swapcontext:", now_ns() - start, 2ull * rounds / 10);
+}
+
+coro_value_t pool_worker(coro_value_t arg) {
+  /* Something on the stack across yields, like a coroutine a few frames deep. */
+  volatile char buffer[1024];
+  buffer[0] = (char)(uintptr_t)arg;
+  for (int i = 0; i < 3; i++) coro_yield((coro_value_t)(uintptr_t)(i + buffer[0]));
+  return 0;
+}
+
+static size_t rss_mib(void) {
+  size_t size = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f || fscanf(f, "%zu %zu", &size, &resident) != 2) resident = 0;
+  if (f) fclose(f);
+  return resident * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+/* All coroutines alive at once, twice: the second round runs on the stacks of the first one. */
+void pool_demo(uint32_t count) {
+  coro_stack_pool_t pool;
+  coro_stack_pool_init(&pool, 256 << 10, 64);
+  coro_t* coros = calloc(count, sizeof(coro_t));
+  printf("%u coroutines on %zu KiB stacks, RSS %zu MiB before\n", count, pool.stack_size >> 10, rss_mib());
+
+  for (int round = 1; round <= 2; round++) {
+    const uint32_t stacks = pool.stacks;
+    const uint64_t start = now_ns();
+    for (uint32_t i = 0; i < count; i++) coro_spawn(&coros[i], &pool, pool_worker, (coro_value_t)(uintptr_t)i);
+    const uint64_t spawned = now_ns();
+
+    size_t running_rss = 0;
+    for (uint32_t alive = count; alive; ) {
+      alive = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        coro_value_t value;
+        alive += coro_next(&coros[i], &value, 0);
+      }
+      if (!running_rss) running_rss = rss_mib();
+    }
+
+    printf("round %d: %.0f ns/spawn, %u new stacks, %zu GiB reserved, RSS %zu MiB running, %zu MiB after, "
+      "%s guards\n", round, (double)(spawned - start) / count, pool.stacks - stacks,
+      pool.stacks * (pool.stack_size + pool.guard_size) >> 30, running_rss, rss_mib(),
+      pool.light_guards ? "MADV_GUARD_INSTALL" : "mprotect");
   }
+
+  free(coros);
+  coro_stack_pool_destroy(&pool);
 }
 
-coro_value_t gen_range(coro_value_t max) {
-  printf("gen_range: start\n");
+/* Recursion with a KiB of locals per frame, yields at the bottom: coroutines `depth` KiB deep, all alive at once. */
+__attribute__((noinline))
+static uint64_t grow_recurse(uint32_t depth) {
+  volatile char frame[1024];
+  frame[0] = depth;
+  if (!depth) return (uintptr_t)coro_yield(0);
+  return grow_recurse(depth - 1) + frame[0];
+}
 
-  for (uint64_t i = 0; i < (uint64_t)max; i++) {
-    printf("gen_range: %ld\n", i);
-    coro_yield((coro_value_t)i);
+coro_value_t grow_tiny(coro_value_t arg) {
+  return (coro_value_t)grow_recurse(1);
+}
+
+coro_value_t grow_medium(coro_value_t arg) {
+  return (coro_value_t)grow_recurse(24);
+}
+
+coro_value_t grow_deep(coro_value_t arg) {
+  return (coro_value_t)grow_recurse(600);
+}
+
+/*
+ * Mostly tiny coroutines, 1% medium, and 0.1% deep ones which finish last, so the stacks a pool keeps hot are deep.
+ * On a fixed pool they keep their pages, a growable pool shuts them back to the initial size.
+ */
+void grow_demo(uint32_t count) {
+  static const struct { const char* name; coro_function_t fn; } functions[] = {
+    { "grow_tiny", grow_tiny }, { "grow_medium", grow_medium }, { "grow_deep", grow_deep },
+  };
+  coro_t* coros = calloc(count, sizeof(coro_t));
+  const uint32_t deep = count / 1000;
+
+  for (int growable = 0; growable <= 1; growable++) {
+    coro_stack_pool_t pool;
+    if (growable) {
+      coro_stack_pool_init_growable(&pool, 1 << 20, 8 << 10, 64);
+    } else {
+      coro_stack_pool_init(&pool, 1 << 20, 64);
+    }
+    const size_t before = rss_mib();
+
+    const uint64_t start = now_ns();
+    for (uint32_t i = 0; i < count; i++) {
+      coro_function_t fn = i >= count - deep ? grow_deep : i % 100 == 0 ? grow_medium : grow_tiny;
+      coro_spawn(&coros[i], &pool, fn, 0);
+    }
+    coro_value_t value;
+    for (uint32_t i = 0; i < count; i++) coro_next(&coros[i], &value, 0);
+    const size_t running = rss_mib();
+    for (uint32_t i = 0; i < count; i++) while (coro_next(&coros[i], &value, 0)) {}
+    const uint64_t elapsed = now_ns() - start;
+
+    printf("%-8s %u coroutines in %.1f ms, RSS %zu MiB running, %zu MiB after\n", growable ? "growable" : "fixed",
+      count, elapsed / 1e6, running - before, rss_mib() - before);
+
+    /* One deep coroutine after another on the same hot stack: every run grows it from 8 KiB again. */
+    enum { runs = 1000 };
+    const uint64_t deep_start = now_ns();
+    for (int run = 0; run < runs; run++) {
+      coro_spawn(&coros[0], &pool, grow_deep, 0);
+      while (coro_next(&coros[0], &value, 0)) {}
+    }
+    printf("%-8s one deep coroutine at a time: %.1f us per run\n", growable ? "growable" : "fixed",
+      (now_ns() - deep_start) / 1e3 / runs);
+    coro_stack_pool_destroy(&pool);
   }
 
-  printf("gen_range: finish\n");
+  coro_stack_usage_t usage[16];
+  const size_t found = coro_stack_usage(usage, 16);
+  printf("stack high water of coroutines on growable stacks:\n");
+  for (size_t i = 0; i < found && i < 16; i++) {
+    const char* name = "?";
+    for (size_t j = 0; j < sizeof(functions) / sizeof(functions[0]); j++) {
+      if (functions[j].fn == usage[i].fn) name = functions[j].name;
+    }
+    printf("  %-12s %8lu coroutines, %7.1f KiB, %6.2f grows each\n", name, usage[i].coroutines,
+      usage[i].high_water / 1024.0, (double)usage[i].grows / usage[i].coroutines);
+  }
+  free(coros);
+}
 
+static coro_sched_t* sched_bench;
+
+/* Splits the range in two until single leaves: the left half goes to another task, the right one continues here. */
+coro_value_t sched_tree(coro_value_t arg) {
+  const uintptr_t n = (uintptr_t)arg;
+  if (n == 1) return (coro_value_t)1;
+  coro_task_t* left = coro_sched_spawn(sched_bench, sched_tree, (coro_value_t)(n / 2));
+  const uintptr_t right = (uintptr_t)sched_tree((coro_value_t)(n - n / 2));
+  return (coro_value_t)((uintptr_t)coro_sched_join(left) + right);
+}
+
+coro_value_t sched_leaf(coro_value_t arg) {
+  return (coro_value_t)((uintptr_t)arg * 2);
+}
+
+/* One task spawns everything, the others steal from its deque, then it joins them in order. */
+coro_value_t sched_fan(coro_value_t arg) {
+  const uintptr_t n = (uintptr_t)arg;
+  coro_task_t** tasks = malloc(n * sizeof(coro_task_t*));
+  for (uintptr_t i = 0; i < n; i++) tasks[i] = coro_sched_spawn(sched_bench, sched_leaf, (coro_value_t)i);
+  uintptr_t sum = 0;
+  for (uintptr_t i = 0; i < n; i++) sum += (uintptr_t)coro_sched_join(tasks[i]);
+  free(tasks);
+  return (coro_value_t)sum;
+}
+
+void sched_demo(uint32_t workers, uint32_t count) {
+  const struct {
+    const char* name;
+    coro_function_t fn;
+    uintptr_t expected;
+  } runs[] = {
+    { "tree", sched_tree, count },
+    { "fan-out", sched_fan, (uintptr_t)count * (count - 1) },
+  };
+
+  for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    sched_bench = coro_sched_new(workers, 64 << 10);
+    const uint64_t start = now_ns();
+    const uintptr_t result = (uintptr_t)coro_sched_join(coro_sched_spawn(sched_bench, runs[i].fn, (coro_value_t)(uintptr_t)count));
+    const uint64_t elapsed = now_ns() - start;
+    const coro_sched_stats_t stats = coro_sched_get_stats(sched_bench);
+    coro_sched_delete(sched_bench);
+
+    printf("%-8s %u workers: %lu tasks in %.1f ms, %.0f ns/task, %lu steals, %lu parks, %lu sleeps, %s\n",
+      runs[i].name, workers, stats.tasks, elapsed / 1e6, (double)elapsed / stats.tasks, stats.steals, stats.parks,
+      stats.sleeps, result == runs[i].expected ? "ok" : "WRONG RESULT");
+  }
+}
+
+/*
+ * Echo server and its clients on one thread: `connections` clients each do `rounds` round trips of a 64-byte message
+ * to their own server coroutine, over loopback TCP or a UNIX socket.
+ */
+typedef struct {
+  coro_loop_t* loop;
+  int listener;
+  int domain;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint32_t connections;
+  uint32_t rounds;
+  uint32_t failures;
+} echo_bench_t;
+
+enum { echo_message = 64 };
+
+coro_value_t echo_session(coro_value_t arg) {
+  const int fd = (intptr_t)arg;
+  char buf[4096];
+  int64_t length;
+  while ((length = coro_read(fd, buf, sizeof(buf), -1)) > 0) {
+    for (int64_t sent = 0, n; sent < length; sent += n) {
+      if ((n = coro_write(fd, buf + sent, length - sent, -1)) <= 0) goto out;
+    }
+  }
+
+out:
+  close(fd);
   return 0;
 }
 
-coro_value_t gen_squared(coro_value_t arg) {
-  printf("gen_squared: start\n");
+coro_value_t echo_server(coro_value_t arg) {
+  echo_bench_t* bench = arg;
+  for (uint32_t i = 0; i < bench->connections; i++) {
+    const int fd = coro_accept(bench->listener);
+    if (fd < 0) {
+      perror("echo_server: accept");
+      exit(1);
+    }
+    coro_loop_spawn(bench->loop, echo_session, (coro_value_t)(intptr_t)fd);
+  }
+  return 0;
+}
 
-  coro_t* range = arg;
+coro_value_t echo_client(coro_value_t arg) {
+  echo_bench_t* bench = arg;
+  const int fd = socket(bench->domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (bench->domain == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+  if (coro_connect(fd, &bench->addr, bench->addr_len) < 0) {
+    perror("echo_client: connect");
+    exit(1);
+  }
 
-  uint64_t x;
-  while (coro_next(range, (coro_value_t*)&x, 0)) {
-    printf("gen_squared: %lu -> %lu\n", x, x*x);
-    coro_yield((coro_value_t)(x*x));
+  char message[echo_message], reply[echo_message];
+  memset(message, 'a' + fd % 26, sizeof(message));
+  for (uint32_t i = 0; i < bench->rounds; i++) {
+    message[0] = i;
+    if (coro_write(fd, message, sizeof(message), -1) != sizeof(message)) {
+      bench->failures++;
+      break;
+    }
+
+    int64_t received = 0, n = 0;
+    while (received < (int64_t)sizeof(reply) && (n = coro_read(fd, reply + received, sizeof(reply) - received, -1)) > 0) {
+      received += n;
+    }
+    if (received != sizeof(reply) || memcmp(message, reply, sizeof(reply))) bench->failures++;
   }
 
-  printf("gen_squared: finish\n");
+  close(fd);
+  return 0;
+}
+
+void echo_demo(uint32_t connections, uint32_t rounds, int domain) {
+  for (int epoll_only = 0; epoll_only <= 1; epoll_only++) {
+    echo_bench_t bench = {
+      .loop = coro_loop_new(epoll_only), .domain = domain, .connections = connections, .rounds = rounds
+    };
+    if (!epoll_only && strcmp(coro_loop_backend(bench.loop), "io_uring") != 0) {
+      printf("io_uring is not available\n");
+      coro_loop_delete(bench.loop);
+      continue;
+    }
+
+    bench.listener = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (domain == AF_UNIX) {
+      struct sockaddr_un* addr = (struct sockaddr_un*)&bench.addr;
+      addr->sun_family = AF_UNIX;
+      snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/coro-echo-%d.sock", getpid());
+      unlink(addr->sun_path);
+      bench.addr_len = sizeof(*addr);
+    } else {
+      struct sockaddr_in* addr = (struct sockaddr_in*)&bench.addr;
+      addr->sin_family = AF_INET;
+      addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      bench.addr_len = sizeof(*addr);
+    }
+    if (bind(bench.listener, (struct sockaddr*)&bench.addr, bench.addr_len) < 0
+        || listen(bench.listener, connections) < 0
+        || getsockname(bench.listener, (struct sockaddr*)&bench.addr, &bench.addr_len) < 0) {
+      perror("echo_demo: listen");
+      exit(1);
+    }
+
+    coro_loop_spawn(bench.loop, echo_server, &bench);
+    for (uint32_t i = 0; i < connections; i++) coro_loop_spawn(bench.loop, echo_client, &bench);
 
+    const uint64_t start = now_ns();
+    coro_loop_run(bench.loop);
+    const uint64_t elapsed = now_ns() - start;
+
+    const uint64_t round_trips = (uint64_t)connections * rounds;
+    printf("%-8s %s: %u connections x %u round trips in %.1f ms, %.0f ns/round trip, %.2f M messages/s, %s\n",
+      coro_loop_backend(bench.loop), domain == AF_UNIX ? "unix" : "tcp", connections, rounds, elapsed / 1e6,
+      (double)elapsed / round_trips, 2 * round_trips * 1e3 / elapsed, bench.failures ? "WRONG ECHO" : "ok");
+
+    close(bench.listener);
+    if (domain == AF_UNIX) unlink(((struct sockaddr_un*)&bench.addr)->sun_path);
+    coro_loop_delete(bench.loop);
+  }
+}
+
+/*
+ * Senders send 1..messages each, receivers add up whatever they get until the channel is closed. All of them are
+ * coroutines of one coro_loop (one thread), or tasks on coro_sched workers, or senders are threads and receivers are
+ * coroutines of a loop, which those threads unpark through its eventfd.
+ */
+typedef struct {
+  coro_chan_t* chan;
+  uint64_t messages;
+  _Atomic uint32_t senders;   /* still sending, the last one closes the channel */
+  _Atomic uint64_t sum;
+} chan_bench_t;
+
+coro_value_t chan_sender(coro_value_t arg) {
+  chan_bench_t* bench = arg;
+  for (uint64_t i = 1; i <= bench->messages; i++) coro_chan_send(bench->chan, (coro_value_t)i);
+  if (atomic_fetch_sub(&bench->senders, 1) == 1) coro_chan_close(bench->chan);
   return 0;
 }
 
+void* chan_sender_thread(void* arg) {
+  chan_sender(arg);
+  return 0;
+}
+
+coro_value_t chan_receiver(coro_value_t arg) {
+  chan_bench_t* bench = arg;
+  uint64_t sum = 0;
+  for (coro_value_t value; coro_chan_recv(bench->chan, &value);) sum += (uint64_t)value;
+  atomic_fetch_add(&bench->sum, sum);
+  return 0;
+}
 
+void chan_demo(uint32_t workers, uint64_t messages) {
+  static const struct { const char* name; uint32_t senders; uint32_t receivers; } patterns[] = {
+    { "1:1", 1, 1 },
+    { "N:1", 4, 1 },
+    { "N:M", 4, 4 },
+  };
+  enum { capacity = 1024 };
+  enum { on_loop, on_sched, on_threads };
+
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    for (int on = on_loop; on <= on_threads; on++) {
+      for (int unbounded = 0; unbounded <= 1; unbounded++) {
+        const uint32_t senders = patterns[i].senders, receivers = patterns[i].receivers;
+        chan_bench_t bench = { .chan = coro_chan_new(capacity, unbounded), .messages = messages / senders };
+        atomic_init(&bench.senders, senders);
+        atomic_init(&bench.sum, 0);
+        coro_sched_stats_t stats = {0};
+
+        const uint64_t start = now_ns();
+        if (on == on_sched) {
+          coro_sched_t* sched = coro_sched_new(workers, 64 << 10);
+          coro_task_t* tasks[8];
+          for (uint32_t j = 0; j < receivers; j++) tasks[j] = coro_sched_spawn(sched, chan_receiver, &bench);
+          for (uint32_t j = 0; j < senders; j++) tasks[receivers + j] = coro_sched_spawn(sched, chan_sender, &bench);
+          for (uint32_t j = 0; j < senders + receivers; j++) coro_sched_join(tasks[j]);
+          stats = coro_sched_get_stats(sched);
+          coro_sched_delete(sched);
+        } else {
+          coro_loop_t* loop = coro_loop_new(on == on_loop);
+          pthread_t threads[4];
+          for (uint32_t j = 0; j < receivers; j++) coro_loop_spawn(loop, chan_receiver, &bench);
+          for (uint32_t j = 0; j < senders; j++) {
+            if (on == on_threads) {
+              pthread_create(&threads[j], 0, chan_sender_thread, &bench);
+            } else {
+              coro_loop_spawn(loop, chan_sender, &bench);
+            }
+          }
+          coro_loop_run(loop);
+          if (on == on_threads) for (uint32_t j = 0; j < senders; j++) pthread_join(threads[j], 0);
+          coro_loop_delete(loop);
+        }
+        const uint64_t elapsed = now_ns() - start;
+        coro_chan_delete(bench.chan);
+
+        const uint64_t sent = bench.messages * senders;
+        char where[32], parks[32] = "";
+        if (on == on_loop) snprintf(where, sizeof(where), "one thread");
+        if (on == on_sched) snprintf(where, sizeof(where), "%u workers", workers);
+        if (on == on_threads) snprintf(where, sizeof(where), "%u threads", senders);
+        if (on == on_sched) snprintf(parks, sizeof(parks), ", %lu task parks", stats.parks);
+        printf("%s %-9s %-11s: %lu messages in %.1f ms, %6.1f ns/message, %6.2f M messages/s, %s%s\n",
+          patterns[i].name, unbounded ? "unbounded" : "bounded", where, sent, elapsed / 1e6, (double)elapsed / sent,
+          sent * 1e3 / elapsed, bench.sum == senders * (bench.messages * (bench.messages + 1) / 2) ? "ok" : "WRONG SUM",
+          parks);
+      }
+    }
+  }
+}
+
+/*
+ * A million timers 1..1000 ms away on one wheel, half of them cancelled, then coroutines sleeping the same way, then
+ * deadlines on a channel and a pipe.
+ */
 typedef struct {
-  char* str;
-  size_t len;
-} readline_result_t;
+  coro_loop_t* loop;
+  uint64_t start;     /* now_ns when coro_loop_now was 0, give or take */
+  uint64_t run;       /* now_ns when coro_loop_run started, nothing can expire before */
+  uint64_t fired;
+  uint64_t early;
+  uint64_t late_ns;
+  uint64_t max_late_ns;
+} timer_bench_t;
+
+static timer_bench_t timer_bench;
+
+static uint64_t timer_random(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
 
-coro_value_t gen_interaction(coro_value_t arg) {
-  readline_result_t timezone = *(readline_result_t*)coro_yield((const char* []){ "readline", "/etc/timezone" });
+static void timer_check(uint64_t deadline) {
+  const uint64_t due = timer_bench.start + deadline * 1000000;
+  const int64_t late = now_ns() - (due > timer_bench.run ? due : timer_bench.run);
+  timer_bench.fired++;
+  if (coro_loop_now(timer_bench.loop) < deadline) timer_bench.early++;
+  if (late > 0) {
+    timer_bench.late_ns += late;
+    if ((uint64_t)late > timer_bench.max_late_ns) timer_bench.max_late_ns = late;
+  }
+}
 
-  coro_yield((const char* []){ "writeline", timezone.str });
+static void timer_expire(coro_timer_t* timer) {
+  timer_check(timer->deadline);
+}
 
+coro_value_t timer_sleeper(coro_value_t arg) {
+  const uint64_t ms = (uintptr_t)arg;
+  const uint64_t deadline = coro_loop_now(timer_bench.loop) + ms;
+  coro_sleep(ms);
+  timer_check(deadline);
   return 0;
 }
 
-int main() {
-  static char interaction_stack[4096];
-  coro_t interaction;
-  coro_init(&interaction, gen_interaction, interaction_stack, sizeof(interaction_stack), 0);
+static void timer_report(const char* what, uint64_t count) {
+  printf("%-18s %lu fired, %lu early, %.3f ms late on average, %.3f ms at most, %s\n", what, timer_bench.fired,
+    timer_bench.early, timer_bench.fired ? timer_bench.late_ns / 1e6 / timer_bench.fired : 0,
+    timer_bench.max_late_ns / 1e6, timer_bench.fired == count && !timer_bench.early ? "ok" : "WRONG");
+}
 
-  readline_result_t readline_result;
+coro_value_t timer_chan_wait(coro_value_t arg) {
+  coro_chan_t* chan = coro_chan_new(1, false);
+  coro_value_t value;
+  const uint64_t start = now_ns();
+  coro_deadline(50);
+  const bool received = coro_chan_recv(chan, &value);
+  printf("channel recv with a 50 ms deadline: %s after %.1f ms\n", received ? "received" : strerror(errno),
+    (now_ns() - start) / 1e6);
+  coro_chan_delete(chan);
+  return 0;
+}
 
-  const char** request;
-  void* response = 0;
-  while (coro_next(&interaction, (coro_value_t)&request, response)) {
-    response = 0;
+coro_value_t timer_pipe_writer(coro_value_t arg) {
+  coro_sleep(10);
+  coro_write((intptr_t)arg, "x", 1, -1);
+  return 0;
+}
 
-    if (strcmp(request[0], "readline") == 0) {
-      FILE* f = fopen(request[1], "r");
-      readline_result = (readline_result_t){ 0, 0 };
-      getline(&readline_result.str, &readline_result.len, f);
-      fclose(f);
+/* Nobody writes the first time, a writer 10 ms late the second time. */
+coro_value_t timer_pipe_wait(coro_value_t arg) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+    perror("pipe2");
+    exit(1);
+  }
 
-      response = &readline_result;
-    }
-    else if (strcmp(request[0], "writeline") == 0) {
-      fputs(request[1], stdout);
-    }
+  for (int writer = 0; writer <= 1; writer++) {
+    if (writer) coro_loop_spawn(timer_bench.loop, timer_pipe_writer, (coro_value_t)(intptr_t)fds[1]);
+    char buf[16];
+    const uint64_t start = now_ns();
+    coro_deadline(50);
+    const int64_t n = coro_read(fds[0], buf, sizeof(buf), -1);
+    printf("%-8s read with a 50 ms deadline: %s after %.1f ms\n", coro_loop_backend(timer_bench.loop),
+      n < 0 ? strerror(errno) : "read", (now_ns() - start) / 1e6);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+void timer_demo(uint32_t count) {
+  coro_timer_t* timers = calloc(count, sizeof(coro_timer_t));
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  timer_bench = (timer_bench_t){ .loop = coro_loop_new(true), .start = now_ns() };
+
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < count; i++) {
+    timers[i].expire = timer_expire;
+    coro_timer_start(timer_bench.loop, &timers[i], 1 + timer_random(&seed) % 1000);
   }
+  const uint64_t started = now_ns() - start;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < count; i += 2) coro_timer_cancel(timer_bench.loop, &timers[i]);
+  const uint64_t cancelled = now_ns() - start;
+  const uint32_t cancels = count / 2 + count % 2;
+  printf("%u timers: %.1f ns/start, %.1f ns/cancel\n", count, (double)started / count, (double)cancelled / cancels);
+
+  timer_bench.run = now_ns();
+  coro_loop_run(timer_bench.loop);
+  printf("expired in %.1f ms\n", (now_ns() - timer_bench.run) / 1e6);
+  timer_report("timers:", count / 2);
+  coro_loop_delete(timer_bench.loop);
+  free(timers);
+
+  const uint32_t sleepers = count < 100000 ? count : 100000;
+  timer_bench = (timer_bench_t){ .loop = coro_loop_new(true), .start = now_ns() };
+  for (uint32_t i = 0; i < sleepers; i++) {
+    coro_loop_spawn(timer_bench.loop, timer_sleeper, (coro_value_t)(uintptr_t)(1 + timer_random(&seed) % 1000));
+  }
+  timer_bench.run = now_ns();
+  coro_loop_run(timer_bench.loop);
+  timer_report("coro_sleep:", sleepers);
+  coro_loop_delete(timer_bench.loop);
+
+  coro_loop_t* loop = coro_loop_new(true);
+  coro_loop_spawn(loop, timer_chan_wait, 0);
+  coro_loop_run(loop);
+  coro_loop_delete(loop);
+
+  for (int epoll_only = 0; epoll_only <= 1; epoll_only++) {
+    timer_bench.loop = coro_loop_new(epoll_only);
+    coro_loop_spawn(timer_bench.loop, timer_pipe_wait, 0);
+    coro_loop_run(timer_bench.loop);
+    coro_loop_delete(timer_bench.loop);
+  }
+}
+
+/* Tasks and channels on a few workers, then the trace of every switch they made. */
+void trace_demo(uint32_t workers, const char* path) {
+#ifndef CORO_TRACE
+  printf("built without tracing, rebuild with make -B CORO_TRACE=1\n");
+#else
+  sched_demo(workers, 10000);
+  chan_demo(workers, 100000);
+  if (!coro_trace_dump(path)) {
+    perror(path);
+    exit(1);
+  }
+  printf("%lu events, the last 64k of every thread are in %s\n", coro_trace_count(), path);
+#endif
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "grow") == 0) {
+    grow_demo(argc > 2 ? strtoul(argv[2], 0, 0) : 100000);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "sched") == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sched_demo(argc > 2 ? strtoul(argv[2], 0, 0) : cpus, argc > 3 ? strtoul(argv[3], 0, 0) : 1000000);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "echo") == 0) {
+    const bool unix_socket = argc > 4 && strcmp(argv[4], "unix") == 0;
+    echo_demo(argc > 2 ? strtoul(argv[2], 0, 0) : 1000, argc > 3 ? strtoul(argv[3], 0, 0) : 100,
+      unix_socket ? AF_UNIX : AF_INET);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "chan") == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    chan_demo(argc > 2 ? strtoul(argv[2], 0, 0) : cpus, argc > 3 ? strtoull(argv[3], 0, 0) : 4000000);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "timers") == 0) {
+    timer_demo(argc > 2 ? strtoul(argv[2], 0, 0) : 1000000);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    trace_demo(argc > 2 ? strtoul(argv[2], 0, 0) : cpus, argc > 3 ? argv[3] : "coro-trace.json");
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "pool") == 0) {
+    pool_demo(argc > 2 ? strtoul(argv[2], 0, 0) : 100000);
+    return 0;
+  }
+
+  coro_loop_t* loop = coro_loop_new(false);
+  coro_loop_spawn(loop, gen_interaction, 0);
+  coro_loop_run(loop);
+  coro_loop_delete(loop);
 
   static char range_stack[4096];
   coro_t range;
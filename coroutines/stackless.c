@@ -4,18 +4,41 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+
 /********/
 /* core */
 /********/
 
+typedef struct generator_arena generator_arena_t;
+
+/*
+ * next_batch is optional: it fills up to `capacity` values at once and returns how many, 0 only at the end. Stages
+ * which have it pull from their sources a batch at a time, so it's an indirect call per stage per batch instead of
+ * per element. next works as before, consumers can use either (but shouldn't mix them on stages which buffer).
+ *
+ * split is optional too: it cuts off the next `count` values into a new generator (from `arena`, null for the heap)
+ * without producing them, so that pieces of one source can be processed independently. Null when nothing is left.
+ */
 #define GeneratorDefine(Name, Prefix, Type, ...) \
   typedef struct { Type value; bool done; } Prefix##_result_t; \
   typedef struct Prefix##__struct Name; \
   typedef Prefix##_result_t (*Prefix##_next_fn)(Name* self, ##__VA_ARGS__); \
-  struct Prefix##__struct { Prefix##_next_fn next; void (*cleanup)(Name*); };
+  struct Prefix##__struct { \
+    Prefix##_next_fn next; \
+    void (*cleanup)(Name*); \
+    size_t (*next_batch)(Name* self, Type* values, size_t capacity); \
+    Name* (*split)(Name* self, generator_arena_t* arena, size_t count); \
+  };
 
 #define GeneratorForEach(Value, Range) \
   for (__auto_type Value = Range->next(Range); !Value.done; Value = Range->next(Range))
@@ -26,14 +49,79 @@
 
 GeneratorDefine(int_generator_t, int_generator, int);
 
+enum { generator_batch = 256 };
+
+/* next_batch, or next one by one for generators which don't have it. */
+size_t int_generator_fill(int_generator_t* self, int* values, size_t capacity) {
+  if (self->next_batch) {
+    return self->next_batch(self, values, capacity);
+  }
+
+  size_t count = 0;
+  for (; count < capacity; count++) {
+    int_generator_result_t res = self->next(self);
+    if (res.done) break;
+    values[count] = res.value;
+  }
+  return count;
+}
+
+/*
+ * Instead of the heap, a whole pipeline can live in one buffer owned by the caller: every stage takes its state from
+ * an arena, one after another. Each stage has gen_*_size, so the buffer is sized at compile time by adding them up:
+ *
+ *   GeneratorArena(arena, gen_range_size + gen_head_size);
+ *   int_generator_t* head = gen_head_in(&arena, gen_range_in(&arena, 0, 10), 5);
+ *
+ * Arena generators have no cleanup, they are gone with the buffer.
+ */
+struct generator_arena {
+  char* data;
+  size_t size;
+  size_t used;
+};
+
+#define GeneratorSize(Bytes) (((Bytes) + 15) & ~(size_t)15)
+
+#define GeneratorArena(Name, Size) \
+  _Alignas(16) char Name##__storage[Size]; \
+  generator_arena_t Name = { Name##__storage, sizeof(Name##__storage), 0 }
+
+static size_t generator_heap_allocations;
+
+void* generator_alloc(generator_arena_t* arena, size_t size) {
+  if (!arena) {
+    generator_heap_allocations++;
+    return malloc(size);
+  }
+
+  size = GeneratorSize(size);
+  if (arena->size - arena->used < size) {
+    fprintf(stderr, "generator arena of %zu bytes is too small, %zu more needed\n", arena->size, size);
+    abort();
+  }
+
+  void* state = arena->data + arena->used;
+  arena->used += size;
+  return state;
+}
+
 #define HeapGeneratorNew(State, Next, Cleanup, ...) ({ \
-    State* state = malloc(sizeof(*state)); \
+    State* state = generator_alloc(0, sizeof(*state)); \
     *state = (State){ {(void*)Next, Cleanup}, __VA_ARGS__ }; \
     &state->base; \
   })
 
 #define HeapGeneratorFree (void*)free
 
+/* HeapGeneratorNew when `Arena` is null. */
+#define GeneratorNew(Arena, State, Next, ...) ({ \
+    generator_arena_t* state_arena = (Arena); \
+    State* state = generator_alloc(state_arena, sizeof(*state)); \
+    *state = (State){ {(void*)Next, state_arena ? 0 : HeapGeneratorFree}, __VA_ARGS__ }; \
+    &state->base; \
+  })
+
 /**********************************/
 /* utils (can leave without them) */
 /**********************************/
@@ -62,6 +150,8 @@ typedef struct {
   int to;
 } gen_range_generator_t;
 
+#define gen_range_size GeneratorSize(sizeof(gen_range_generator_t))
+
 int_generator_result_t gen_range__next(void* self_) {
   gen_range_generator_t* self = self_;
   return self->current < self->to
@@ -69,8 +159,38 @@ int_generator_result_t gen_range__next(void* self_) {
     : (int_generator_result_t){ 0, true };
 }
 
+size_t gen_range__next_batch(void* self_, int* values, size_t capacity) {
+  gen_range_generator_t* self = self_;
+  size_t count = self->current < self->to ? (size_t)self->to - self->current : 0;
+  if (count > capacity) count = capacity;
+
+  for (size_t i = 0; i < count; i++) {
+    values[i] = self->current + i;
+  }
+  self->current += count;
+  return count;
+}
+
+int_generator_t* gen_range_in(generator_arena_t* arena, int from, int to);
+
+void* gen_range__split(void* self_, generator_arena_t* arena, size_t count) {
+  gen_range_generator_t* self = self_;
+  const int from = self->current;
+  const size_t left = self->current < self->to ? (size_t)self->to - self->current : 0;
+  if (!left) return 0;
+  self->current += left < count ? left : count;
+  return gen_range_in(arena, from, self->current);
+}
+
+int_generator_t* gen_range_in(generator_arena_t* arena, int from, int to) {
+  int_generator_t* range = GeneratorNew(arena, gen_range_generator_t, gen_range__next, from, to);
+  range->next_batch = (void*)gen_range__next_batch;
+  range->split = (void*)gen_range__split;
+  return range;
+}
+
 int_generator_t* gen_range(int from, int to) {
-  return HeapGeneratorNew(gen_range_generator_t, gen_range__next, HeapGeneratorFree, from, to);
+  return gen_range_in(0, from, to);
 }
 
 /****************/
@@ -81,16 +201,50 @@ typedef struct {
   int_generator_t base;
   int_generator_t* source;
   int (*callback)(int arg);
+  void (*block_callback)(int* values, size_t count);  /* instead of callback: one call per batch, free to vectorize */
 } gen_transform_generator_t;
 
+#define gen_transform_size GeneratorSize(sizeof(gen_transform_generator_t))
+
 int_generator_result_t gen_transform__next(void* self_) {
   gen_transform_generator_t* self = self_;
   auto res = self->source->next(self->source);
+  if (!res.done && self->block_callback) {
+    self->block_callback(&res.value, 1);
+    return res;
+  }
   return (int_generator_result_t){ .value = res.done ? 0 : self->callback(res.value), .done = res.done };
 }
 
+size_t gen_transform__next_batch(void* self_, int* values, size_t capacity) {
+  gen_transform_generator_t* self = self_;
+  const size_t count = int_generator_fill(self->source, values, capacity);
+  if (self->block_callback) {
+    if (count) self->block_callback(values, count);
+    return count;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    values[i] = self->callback(values[i]);
+  }
+  return count;
+}
+
+int_generator_t* gen_transform_in(generator_arena_t* arena, int_generator_t* source, int (*callback)(int arg)) {
+  int_generator_t* transform = GeneratorNew(arena, gen_transform_generator_t, gen_transform__next, source, callback);
+  transform->next_batch = (void*)gen_transform__next_batch;
+  return transform;
+}
+
 int_generator_t* gen_transform(int_generator_t* source, int (*callback)(int arg)) {
-  return HeapGeneratorNew(gen_transform_generator_t, gen_transform__next, HeapGeneratorFree, source, callback);
+  return gen_transform_in(0, source, callback);
+}
+
+int_generator_t* gen_transform_block_in(generator_arena_t* arena, int_generator_t* source,
+                                        void (*callback)(int* values, size_t count)) {
+  int_generator_t* transform = GeneratorNew(arena, gen_transform_generator_t, gen_transform__next, source, 0, callback);
+  transform->next_batch = (void*)gen_transform__next_batch;
+  return transform;
 }
 
 /**************/
@@ -103,6 +257,8 @@ typedef struct {
   bool (*callback)(int arg);
 } gen_filter_generator_t;
 
+#define gen_filter_size GeneratorSize(sizeof(gen_filter_generator_t))
+
 int_generator_result_t gen_filter__next(void* self_) {
   gen_filter_generator_t* self = self_;
   while (true) {
@@ -116,8 +272,31 @@ int_generator_result_t gen_filter__next(void* self_) {
   }
 }
 
+/* Compacts in place without branching on the callback's answer, it's as good as random for the predictor. */
+size_t gen_filter__next_batch(void* self_, int* values, size_t capacity) {
+  gen_filter_generator_t* self = self_;
+  size_t count = 0;
+  while (!count) {
+    const size_t read = int_generator_fill(self->source, values, capacity);
+    if (!read) return 0;
+
+    for (size_t i = 0; i < read; i++) {
+      const int value = values[i];
+      values[count] = value;
+      count += self->callback(value);
+    }
+  }
+  return count;
+}
+
+int_generator_t* gen_filter_in(generator_arena_t* arena, int_generator_t* source, bool (*callback)(int arg)) {
+  int_generator_t* filter = GeneratorNew(arena, gen_filter_generator_t, gen_filter__next, source, callback);
+  filter->next_batch = (void*)gen_filter__next_batch;
+  return filter;
+}
+
 int_generator_t* gen_filter(int_generator_t* source, bool (*callback)(int arg)) {
-  return HeapGeneratorNew(gen_filter_generator_t, gen_filter__next, HeapGeneratorFree, source, callback);
+  return gen_filter_in(0, source, callback);
 }
 
 /************/
@@ -130,6 +309,8 @@ typedef struct {
   size_t left;
 } gen_head_generator_t;
 
+#define gen_head_size GeneratorSize(sizeof(gen_head_generator_t))
+
 int_generator_result_t gen_head__next(void* self_) {
   gen_head_generator_t* self = self_;
   if (!self->left) {
@@ -141,10 +322,73 @@ int_generator_result_t gen_head__next(void* self_) {
   return (int_generator_result_t){ .value = res.value, .done = res.done };
 }
 
+size_t gen_head__next_batch(void* self_, int* values, size_t capacity) {
+  gen_head_generator_t* self = self_;
+  const size_t count = int_generator_fill(self->source, values, capacity < self->left ? capacity : self->left);
+  self->left -= count;
+  return count;
+}
+
+int_generator_t* gen_head_in(generator_arena_t* arena, int_generator_t* source, size_t length) {
+  int_generator_t* head = GeneratorNew(arena, gen_head_generator_t, gen_head__next, source, length);
+  head->next_batch = (void*)gen_head__next_batch;
+  return head;
+}
+
 int_generator_t* gen_head(int_generator_t* source, size_t length) {
-  return HeapGeneratorNew(gen_head_generator_t, gen_head__next, HeapGeneratorFree, source, length);
+  return gen_head_in(0, source, length);
 }
 
+/********/
+/* ring */
+/********/
+
+/*
+ * Fixed-capacity circular buffer over storage owned by someone else (usually the flexible array at the end of
+ * a generator's state). push overwrites the oldest value when full, so "last N values" is just pushing everything.
+ */
+#define RingDefine(Name, Prefix, Type) \
+  typedef struct { Type* values; size_t capacity; size_t start; size_t count; } Name; \
+  \
+  static inline size_t Prefix##__index(Name* ring, size_t i) { \
+    i += ring->start; \
+    return i >= ring->capacity ? i - ring->capacity : i; \
+  } \
+  \
+  static inline Type Prefix##_at(Name* ring, size_t i) { return ring->values[Prefix##__index(ring, i)]; } \
+  \
+  static inline void Prefix##_push(Name* ring, Type value) { \
+    if (ring->count < ring->capacity) { \
+      ring->values[Prefix##__index(ring, ring->count++)] = value; \
+    } else if (ring->capacity) { \
+      ring->values[ring->start] = value; \
+      ring->start = Prefix##__index(ring, 1); \
+    } \
+  } \
+  \
+  static inline Type Prefix##_pop_front(Name* ring) { \
+    Type value = ring->values[ring->start]; \
+    ring->start = Prefix##__index(ring, 1); \
+    ring->count--; \
+    return value; \
+  } \
+  \
+  static inline Type Prefix##_pop_back(Name* ring) { return ring->values[Prefix##__index(ring, --ring->count)]; } \
+  \
+  /* Moves up to `capacity` oldest values to `out` with at most two memcpy. */ \
+  static inline size_t Prefix##_drain(Name* ring, Type* out, size_t capacity) { \
+    const size_t count = ring->count < capacity ? ring->count : capacity; \
+    const size_t first = ring->capacity - ring->start < count ? ring->capacity - ring->start : count; \
+    memcpy(out, ring->values + ring->start, sizeof(Type) * first); \
+    memcpy(out + first, ring->values, sizeof(Type) * (count - first)); \
+    ring->start = count ? Prefix##__index(ring, count) : ring->start; \
+    ring->count -= count; \
+    return count; \
+  }
+
+RingDefine(int_ring_t, int_ring, int);
+RingDefine(index_ring_t, index_ring, uint64_t);
+
 /************/
 /* gen_tail */
 /************/
@@ -152,78 +396,901 @@ int_generator_t* gen_head(int_generator_t* source, size_t length) {
 typedef struct {
   int_generator_t base;
   int_generator_t* source;
-  size_t length;
-  size_t pos;
+  int_ring_t ring;
   bool completed;
   int buffer[];
 } gen_tail_generator_t;
 
-int_generator_result_t gen_tail__next(void* self_) {
-  gen_tail_generator_t* self = self_;
-  if (!self->completed) {
-    self->completed = true;
+#define gen_tail_size(length) GeneratorSize(sizeof(gen_tail_generator_t) + sizeof(int) * (length))
 
-    /* Read whole sequence until end and keep last N entries. */
-    self->pos = 0;
+/* Reads whole sequence until end and keeps last N entries. */
+static void gen_tail__complete(gen_tail_generator_t* self, bool batched) {
+  self->completed = true;
+  if (!batched) {
     GeneratorForEach(it, self->source) {
-      if (self->pos == self->length) {
-        memmove(self->buffer, self->buffer + 1, sizeof(self->buffer[0]) * (self->length - 1));
-        self->pos = self->length - 1;
-      }
-
-      self->buffer[self->pos++] = it.value;
+      int_ring_push(&self->ring, it.value);
     }
+    return;
+  }
 
-    /* Remember how much we currenty have in buffer. */
-    self->length = self->pos;
-    self->pos = 0;
+  /* Only the end of each batch can make it into the last N. */
+  int batch[generator_batch];
+  for (size_t read; (read = int_generator_fill(self->source, batch, generator_batch));) {
+    for (size_t i = read > self->ring.capacity ? read - self->ring.capacity : 0; i < read; i++) {
+      int_ring_push(&self->ring, batch[i]);
+    }
   }
+}
 
+int_generator_result_t gen_tail__next(void* self_) {
+  gen_tail_generator_t* self = self_;
+  if (!self->completed) gen_tail__complete(self, false);
 
-  if (self->pos == self->length) {
+  if (!self->ring.count) {
     return (int_generator_result_t){ .done = true };
   }
 
-  int value = self->buffer[self->pos++];
-  return (int_generator_result_t){ .value = value, .done = false };
+  return (int_generator_result_t){ .value = int_ring_pop_front(&self->ring), .done = false };
 }
 
-int_generator_t* gen_tail(int_generator_t* source, size_t length) {
-  gen_tail_generator_t* state = malloc(sizeof(*state) + sizeof(state->buffer[0])*length);
+size_t gen_tail__next_batch(void* self_, int* values, size_t capacity) {
+  gen_tail_generator_t* self = self_;
+  if (!self->completed) gen_tail__complete(self, true);
+
+  return int_ring_drain(&self->ring, values, capacity);
+}
+
+int_generator_t* gen_tail_in(generator_arena_t* arena, int_generator_t* source, size_t length) {
+  gen_tail_generator_t* state = generator_alloc(arena, sizeof(*state) + sizeof(state->buffer[0])*length);
   state->base.next = (void*)gen_tail__next;
-  state->base.cleanup = HeapGeneratorFree;
+  state->base.cleanup = arena ? 0 : HeapGeneratorFree;
+  state->base.next_batch = (void*)gen_tail__next_batch;
+  state->base.split = 0;
   state->source = source;
-  state->length = length;
+  state->ring = (int_ring_t){ .values = state->buffer, .capacity = length };
   state->completed = false;
 
   return (void*)state;
 }
 
+int_generator_t* gen_tail(int_generator_t* source, size_t length) {
+  return gen_tail_in(0, source, length);
+}
+
+/**************/
+/* gen_window */
+/**************/
+
+typedef enum { window_sum, window_min, window_max } window_op_t;
+
+/*
+ * Sliding aggregate of the last N > 0 values: one output per input once N are there. Sum subtracts whatever falls out
+ * of the window, min and max keep a monotonic deque of candidates (indices into the window), so every op is
+ * amortized O(1) per element whatever N is.
+ */
+typedef struct {
+  int_generator_t base;
+  int_generator_t* source;
+  window_op_t op;
+  uint64_t seen;
+  unsigned sum;
+  int_ring_t window;
+  index_ring_t candidates;   /* min/max: increasing indices of values, each better than everything after it */
+  uint64_t buffer[];         /* candidates, then window */
+} gen_window_generator_t;
+
+#define gen_window_size(length) \
+  GeneratorSize(sizeof(gen_window_generator_t) + (sizeof(int) + sizeof(uint64_t)) * (length))
+
+static bool gen_window__push(gen_window_generator_t* self, int value, int* aggregate) {
+  const uint64_t index = self->seen++;
+  const size_t length = self->window.capacity;
+  if (self->op == window_sum) {
+    if (self->window.count == length) self->sum -= int_ring_at(&self->window, 0);
+    self->sum += value;
+  }
+  int_ring_push(&self->window, value);
+
+  if (self->op != window_sum) {
+    /* Window holds values of indices [first, index]. */
+    const uint64_t first = index + 1 - self->window.count;
+    index_ring_t* candidates = &self->candidates;
+    if (candidates->count && index_ring_at(candidates, 0) < first) index_ring_pop_front(candidates);
+    while (candidates->count) {
+      const int back = int_ring_at(&self->window, index_ring_at(candidates, candidates->count - 1) - first);
+      if (self->op == window_min ? back < value : back > value) break;
+      index_ring_pop_back(candidates);
+    }
+    index_ring_push(candidates, index);
+  }
+
+  if (self->seen < length) return false;
+
+  *aggregate = self->op == window_sum
+    ? (int)self->sum
+    : int_ring_at(&self->window, index_ring_at(&self->candidates, 0) - (index + 1 - length));
+  return true;
+}
+
+int_generator_result_t gen_window__next(void* self_) {
+  gen_window_generator_t* self = self_;
+  int_generator_result_t res;
+  while (!(res = self->source->next(self->source)).done) {
+    if (gen_window__push(self, res.value, &res.value)) return res;
+  }
+  return (int_generator_result_t){ .done = true };
+}
+
+size_t gen_window__next_batch(void* self_, int* values, size_t capacity) {
+  gen_window_generator_t* self = self_;
+  size_t count = 0;
+  while (!count) {
+    const size_t read = int_generator_fill(self->source, values, capacity);
+    if (!read) return 0;
+
+    for (size_t i = 0; i < read; i++) {
+      count += gen_window__push(self, values[i], &values[count]);
+    }
+  }
+  return count;
+}
+
+int_generator_t* gen_window_in(generator_arena_t* arena, int_generator_t* source, size_t length, window_op_t op) {
+  gen_window_generator_t* state = generator_alloc(arena, gen_window_size(length));
+  state->base.next = (void*)gen_window__next;
+  state->base.cleanup = arena ? 0 : HeapGeneratorFree;
+  state->base.next_batch = (void*)gen_window__next_batch;
+  state->base.split = 0;
+  state->source = source;
+  state->op = op;
+  state->seen = 0;
+  state->sum = 0;
+  state->candidates = (index_ring_t){ .values = state->buffer, .capacity = length };
+  state->window = (int_ring_t){ .values = (int*)(state->buffer + length), .capacity = length };
+
+  return (void*)state;
+}
+
+int_generator_t* gen_window(int_generator_t* source, size_t length, window_op_t op) {
+  return gen_window_in(0, source, length, op);
+}
+
+/*********/
+/* typed */
+/*********/
+
+/*
+ * The same stages for generators of any type, stamped out by macro:
+ *
+ *   GeneratorStagesDefine(order_generator, order_t);
+ *   order_generator_t* big = order_generator_filter(0, order_generator_array(0, orders, count), is_big);
+ *
+ * Elements are passed by pointer, so a record is never copied between stages: next gives `const Type*` which stays
+ * valid until the following next on the same generator. It points into the caller's array, or into the state of the
+ * stage which made the value (transform, map, tail), filter and head just pass their source's pointers through.
+ * Consumers keep a copy when they need the value for longer. Typed generators only have next, the pointers would be
+ * overwritten by a batch.
+ *
+ * Every stage takes an arena first (null for the heap) and has its size for it like gen_*_size: Prefix_filter_size,
+ * map_name_size, GeneratorTailSize(Prefix, N) and so on. Stages which change the element type name both sides and are defined separately:
+ * GeneratorMapDefine, GeneratorZipDefine and GeneratorFlatMapDefine.
+ */
+#define GENERATOR__STATIC static __attribute__((unused))
+
+#define GeneratorTailSize(Prefix, Length) \
+  GeneratorSize(sizeof(Prefix##_tail_generator_t) + sizeof(Prefix##_value_t) * (Length))
+#define GeneratorChunkSize(Prefix, Length) \
+  GeneratorSize(sizeof(Prefix##_chunk_generator_t) + sizeof(Prefix##_value_t) * (Length))
+
+#define GeneratorCleanup(Prefix) __attribute__((cleanup(Prefix##__cleanup)))
+
+#define GeneratorStagesDefine(Prefix, Type) \
+  typedef Type Prefix##_value_t; \
+  GeneratorDefine(Prefix##_t, Prefix, const Type*) \
+  \
+  /* Runs of consecutive elements, what chunk gives. */ \
+  typedef struct { const Type* values; size_t count; } Prefix##_span_t; \
+  typedef Prefix##_span_t Prefix##_chunks_value_t; \
+  GeneratorDefine(Prefix##_chunks_t, Prefix##_chunks, const Prefix##_span_t*) \
+  \
+  RingDefine(Prefix##_ring_t, Prefix##_ring, Type) \
+  \
+  GENERATOR__STATIC void Prefix##__cleanup(Prefix##_t** self) { \
+    if (*self && (*self)->cleanup) (*self)->cleanup(*self); \
+  } \
+  \
+  GENERATOR__STATIC void Prefix##_chunks__cleanup(Prefix##_chunks_t** self) { \
+    if (*self && (*self)->cleanup) (*self)->cleanup(*self); \
+  } \
+  \
+  /* Elements of someone else's array. */ \
+  typedef struct { Prefix##_t base; const Type* values; size_t count; size_t index; } Prefix##_array_generator_t; \
+  enum { Prefix##_array_size = GeneratorSize(sizeof(Prefix##_array_generator_t)) }; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_array__next(void* self_) { \
+    Prefix##_array_generator_t* self = self_; \
+    return self->index < self->count \
+      ? (Prefix##_result_t){ self->values + self->index++, false } \
+      : (Prefix##_result_t){ 0, true }; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_array(generator_arena_t* arena, const Type* values, size_t count) { \
+    return GeneratorNew(arena, Prefix##_array_generator_t, Prefix##_array__next, values, count); \
+  } \
+  \
+  /* Element of every index in [from, to), made by the callback. */ \
+  typedef struct { \
+    Prefix##_t base; \
+    size_t current; \
+    size_t to; \
+    void (*callback)(size_t index, Type* value); \
+    Type value; \
+  } Prefix##_range_generator_t; \
+  enum { Prefix##_range_size = GeneratorSize(sizeof(Prefix##_range_generator_t)) }; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_range__next(void* self_) { \
+    Prefix##_range_generator_t* self = self_; \
+    if (self->current >= self->to) return (Prefix##_result_t){ 0, true }; \
+    self->callback(self->current++, &self->value); \
+    return (Prefix##_result_t){ &self->value, false }; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_range(generator_arena_t* arena, size_t from, size_t to, \
+                                               void (*callback)(size_t index, Type* value)) { \
+    return GeneratorNew(arena, Prefix##_range_generator_t, Prefix##_range__next, from, to, callback); \
+  } \
+  \
+  typedef struct { \
+    Prefix##_t base; \
+    Prefix##_t* source; \
+    void (*callback)(const Type* arg, Type* result); \
+    Type value; \
+  } Prefix##_transform_generator_t; \
+  enum { Prefix##_transform_size = GeneratorSize(sizeof(Prefix##_transform_generator_t)) }; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_transform__next(void* self_) { \
+    Prefix##_transform_generator_t* self = self_; \
+    Prefix##_result_t res = self->source->next(self->source); \
+    if (res.done) return res; \
+    self->callback(res.value, &self->value); \
+    return (Prefix##_result_t){ &self->value, false }; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_transform(generator_arena_t* arena, Prefix##_t* source, \
+                                                   void (*callback)(const Type* arg, Type* result)) { \
+    return GeneratorNew(arena, Prefix##_transform_generator_t, Prefix##_transform__next, source, callback); \
+  } \
+  \
+  typedef struct { \
+    Prefix##_t base; \
+    Prefix##_t* source; \
+    bool (*callback)(const Type* arg); \
+  } Prefix##_filter_generator_t; \
+  enum { Prefix##_filter_size = GeneratorSize(sizeof(Prefix##_filter_generator_t)) }; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_filter__next(void* self_) { \
+    Prefix##_filter_generator_t* self = self_; \
+    Prefix##_result_t res; \
+    while (!(res = self->source->next(self->source)).done && !self->callback(res.value)) {} \
+    return res; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_filter(generator_arena_t* arena, Prefix##_t* source, \
+                                                bool (*callback)(const Type* arg)) { \
+    return GeneratorNew(arena, Prefix##_filter_generator_t, Prefix##_filter__next, source, callback); \
+  } \
+  \
+  typedef struct { Prefix##_t base; Prefix##_t* source; size_t left; } Prefix##_head_generator_t; \
+  enum { Prefix##_head_size = GeneratorSize(sizeof(Prefix##_head_generator_t)) }; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_head__next(void* self_) { \
+    Prefix##_head_generator_t* self = self_; \
+    if (!self->left) return (Prefix##_result_t){ 0, true }; \
+    self->left--; \
+    return self->source->next(self->source); \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_head(generator_arena_t* arena, Prefix##_t* source, size_t length) { \
+    return GeneratorNew(arena, Prefix##_head_generator_t, Prefix##_head__next, source, length); \
+  } \
+  \
+  /* Copies of the last N elements, handed out from the ring itself. */ \
+  typedef struct { \
+    Prefix##_t base; \
+    Prefix##_t* source; \
+    Prefix##_ring_t ring; \
+    bool completed; \
+    Type buffer[]; \
+  } Prefix##_tail_generator_t; \
+  \
+  GENERATOR__STATIC Prefix##_result_t Prefix##_tail__next(void* self_) { \
+    Prefix##_tail_generator_t* self = self_; \
+    if (!self->completed) { \
+      self->completed = true; \
+      for (Prefix##_result_t res; !(res = self->source->next(self->source)).done;) { \
+        Prefix##_ring_push(&self->ring, *res.value); \
+      } \
+    } \
+    if (!self->ring.count) return (Prefix##_result_t){ 0, true }; \
+    \
+    /* The slot is only written again by push, and there are no pushes after the source is over. */ \
+    const Type* value = self->ring.values + self->ring.start; \
+    self->ring.start = Prefix##_ring__index(&self->ring, 1); \
+    self->ring.count--; \
+    return (Prefix##_result_t){ value, false }; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_t* Prefix##_tail(generator_arena_t* arena, Prefix##_t* source, size_t length) { \
+    Prefix##_tail_generator_t* state = generator_alloc(arena, sizeof(*state) + sizeof(Type) * length); \
+    state->base.next = (void*)Prefix##_tail__next; \
+    state->base.cleanup = arena ? 0 : HeapGeneratorFree; \
+    state->base.next_batch = 0; \
+    state->base.split = 0; \
+    state->source = source; \
+    state->ring = (Prefix##_ring_t){ .values = state->buffer, .capacity = length }; \
+    state->completed = false; \
+    return &state->base; \
+  } \
+  \
+  /* Consecutive runs of N elements copied next to each other, the last one can be shorter. */ \
+  typedef struct { \
+    Prefix##_chunks_t base; \
+    Prefix##_t* source; \
+    size_t length; \
+    Prefix##_span_t span; \
+    Type buffer[]; \
+  } Prefix##_chunk_generator_t; \
+  \
+  GENERATOR__STATIC Prefix##_chunks_result_t Prefix##_chunk__next(void* self_) { \
+    Prefix##_chunk_generator_t* self = self_; \
+    size_t count = 0; \
+    for (Prefix##_result_t res; count < self->length && !(res = self->source->next(self->source)).done;) { \
+      self->buffer[count++] = *res.value; \
+    } \
+    self->span = (Prefix##_span_t){ self->buffer, count }; \
+    return (Prefix##_chunks_result_t){ count ? &self->span : 0, !count }; \
+  } \
+  \
+  GENERATOR__STATIC Prefix##_chunks_t* Prefix##_chunk(generator_arena_t* arena, Prefix##_t* source, size_t length) { \
+    Prefix##_chunk_generator_t* state = generator_alloc(arena, sizeof(*state) + sizeof(Type) * length); \
+    state->base.next = (void*)Prefix##_chunk__next; \
+    state->base.cleanup = arena ? 0 : HeapGeneratorFree; \
+    state->base.next_batch = 0; \
+    state->base.split = 0; \
+    state->source = source; \
+    state->length = length; \
+    return &state->base; \
+  }
+
+/* Name(arena, source, callback): From elements made into To elements one by one. */
+#define GeneratorMapDefine(Name, From, To) \
+  typedef struct { \
+    To##_t base; \
+    From##_t* source; \
+    void (*callback)(const From##_value_t* arg, To##_value_t* result); \
+    To##_value_t value; \
+  } Name##_generator_t; \
+  enum { Name##_size = GeneratorSize(sizeof(Name##_generator_t)) }; \
+  \
+  GENERATOR__STATIC To##_result_t Name##__next(void* self_) { \
+    Name##_generator_t* self = self_; \
+    From##_result_t res = self->source->next(self->source); \
+    if (res.done) return (To##_result_t){ 0, true }; \
+    self->callback(res.value, &self->value); \
+    return (To##_result_t){ &self->value, false }; \
+  } \
+  \
+  GENERATOR__STATIC To##_t* Name(generator_arena_t* arena, From##_t* source, \
+                                 void (*callback)(const From##_value_t* arg, To##_value_t* result)) { \
+    return GeneratorNew(arena, Name##_generator_t, Name##__next, source, callback); \
+  }
+
+/* Name(arena, first, second, callback): pairs of elements combined into one, until either source is over. */
+#define GeneratorZipDefine(Name, First, Second, To) \
+  typedef struct { \
+    To##_t base; \
+    First##_t* first; \
+    Second##_t* second; \
+    void (*callback)(const First##_value_t* first, const Second##_value_t* second, To##_value_t* result); \
+    To##_value_t value; \
+  } Name##_generator_t; \
+  enum { Name##_size = GeneratorSize(sizeof(Name##_generator_t)) }; \
+  \
+  GENERATOR__STATIC To##_result_t Name##__next(void* self_) { \
+    Name##_generator_t* self = self_; \
+    First##_result_t first = self->first->next(self->first); \
+    if (first.done) return (To##_result_t){ 0, true }; \
+    Second##_result_t second = self->second->next(self->second); \
+    if (second.done) return (To##_result_t){ 0, true }; \
+    self->callback(first.value, second.value, &self->value); \
+    return (To##_result_t){ &self->value, false }; \
+  } \
+  \
+  GENERATOR__STATIC To##_t* Name(generator_arena_t* arena, First##_t* first, Second##_t* second, \
+    void (*callback)(const First##_value_t* first, const Second##_value_t* second, To##_value_t* result)) { \
+    return GeneratorNew(arena, Name##_generator_t, Name##__next, first, second, callback); \
+  }
+
+/*
+ * Name(arena, source, callback, inner_size): every From element expands into a generator of To elements, which the
+ * callback builds in an arena of `inner_size` bytes inside the stage (reused for every element; 0 means the heap, and
+ * heap generators are cleaned up when they are over). The inner generator can point into the From element, it stays
+ * valid until the inner generator is over.
+ */
+#define GeneratorFlatMapDefine(Name, From, To) \
+  typedef struct { \
+    To##_t base; \
+    From##_t* source; \
+    To##_t* (*callback)(generator_arena_t* arena, const From##_value_t* arg); \
+    To##_t* inner; \
+    generator_arena_t arena; \
+    _Alignas(16) char storage[]; \
+  } Name##_generator_t; \
+  \
+  GENERATOR__STATIC To##_result_t Name##__next(void* self_) { \
+    Name##_generator_t* self = self_; \
+    while (true) { \
+      if (self->inner) { \
+        To##_result_t res = self->inner->next(self->inner); \
+        if (!res.done) return res; \
+        if (self->inner->cleanup) self->inner->cleanup(self->inner); \
+        self->inner = 0; \
+      } \
+      \
+      From##_result_t res = self->source->next(self->source); \
+      if (res.done) return (To##_result_t){ 0, true }; \
+      self->arena.used = 0; \
+      self->inner = self->callback(self->arena.size ? &self->arena : 0, res.value); \
+    } \
+  } \
+  \
+  /* An unfinished heap inner generator is ours to clean up. */ \
+  GENERATOR__STATIC void Name##__cleanup(void* self_) { \
+    Name##_generator_t* self = self_; \
+    if (self->inner && self->inner->cleanup) self->inner->cleanup(self->inner); \
+    free(self); \
+  } \
+  \
+  GENERATOR__STATIC To##_t* Name(generator_arena_t* arena, From##_t* source, \
+                                 To##_t* (*callback)(generator_arena_t* arena, const From##_value_t* arg), \
+                                 size_t inner_size) { \
+    inner_size = GeneratorSize(inner_size); \
+    Name##_generator_t* state = generator_alloc(arena, sizeof(*state) + inner_size); \
+    state->base.next = (void*)Name##__next; \
+    state->base.cleanup = arena ? 0 : (void*)Name##__cleanup; \
+    state->base.next_batch = 0; \
+    state->base.split = 0; \
+    state->source = source; \
+    state->callback = callback; \
+    state->inner = 0; \
+    state->arena = (generator_arena_t){ state->storage, inner_size, 0 }; \
+    return &state->base; \
+  }
+
+#define GeneratorFlatMapSize(Name, InnerSize) GeneratorSize(sizeof(Name##_generator_t) + GeneratorSize(InnerSize))
+
+/*********/
+/* fused */
+/*********/
+
+/*
+ * Everything above calls stages through function pointers, which the compiler can't see through. When the whole
+ * chain is known at compile time it can be written as a loop instead:
+ *
+ *   FusedForEach(x, fuse_range(0, 1000), fuse_transform(square), fuse_filter(is_odd), fuse_head(10)) {
+ *     printf("%d ", x);
+ *   }
+ *
+ * Each stage is a small struct, `_Generic` picks an always_inline function for it, and since the callbacks are
+ * constants right there the compiler inlines them too: the result is one loop with no calls. The source can also be
+ * any int_generator_t* (built at runtime), then it's pulled a batch at a time and the fused stages run on that.
+ * One to eight stages; `break` and `continue` work as in a regular loop.
+ */
+typedef struct { int from; int to; } fuse_range_t;
+typedef struct { int (*callback)(int arg); } fuse_transform_t;
+typedef struct { bool (*callback)(int arg); } fuse_filter_t;
+typedef struct { size_t length; } fuse_head_t;
+
+#define fuse_range(From, To) ((fuse_range_t){ (From), (To) })
+#define fuse_transform(Callback) ((fuse_transform_t){ (Callback) })
+#define fuse_filter(Callback) ((fuse_filter_t){ (Callback) })
+#define fuse_head(Length) ((fuse_head_t){ (Length) })
+
+enum { fused__max_stages = 8, fused__batch = 64 };
+
+/* Loop state, small enough for the compiler to keep in registers when the source is a range. */
+typedef struct {
+  int current;
+  int to;
+  int value;
+  bool done;                    /* a head stage has had enough */
+  bool broke;                   /* set while the loop body runs, still set after the body means `break` */
+  size_t taken[fused__max_stages];
+} fused__range_state_t;
+
+typedef struct {
+  int_generator_t* source;
+  int value;
+  bool done;
+  bool broke;
+  size_t taken[fused__max_stages];
+  size_t count;
+  size_t pos;
+  int batch[fused__batch];
+} fused__source_state_t;
+
+#define FUSED__INLINE static inline __attribute__((always_inline))
+
+FUSED__INLINE fused__range_state_t fused__range(fuse_range_t range) {
+  return (fused__range_state_t){ .current = range.from, .to = range.to };
+}
+
+FUSED__INLINE fused__source_state_t fused__source(int_generator_t* source) {
+  fused__source_state_t state;
+  state.source = source;
+  state.done = state.broke = false;
+  memset(state.taken, 0, sizeof(state.taken));
+  state.count = state.pos = 0;
+  return state;
+}
+
+FUSED__INLINE bool fused__range_next(fused__range_state_t* state) {
+  if (state->done || state->current >= state->to) return false;
+  state->value = state->current++;
+  return true;
+}
+
+FUSED__INLINE bool fused__source_next(fused__source_state_t* state) {
+  if (state->done) return false;
+  if (state->pos == state->count) {
+    state->count = int_generator_fill(state->source, state->batch, fused__batch);
+    state->pos = 0;
+    if (!state->count) return false;
+  }
+  state->value = state->batch[state->pos++];
+  return true;
+}
+
+FUSED__INLINE bool fused__transform(int* value, size_t* taken, bool* done, fuse_transform_t transform) {
+  *value = transform.callback(*value);
+  return true;
+}
+
+FUSED__INLINE bool fused__filter(int* value, size_t* taken, bool* done, fuse_filter_t filter) {
+  return filter.callback(*value);
+}
+
+FUSED__INLINE bool fused__head(int* value, size_t* taken, bool* done, fuse_head_t head) {
+  if (*taken >= head.length) {
+    *done = true;
+    return false;
+  }
+  /* Don't pull another element just to throw it away. */
+  if (++*taken == head.length) *done = true;
+  return true;
+}
+
+#define FUSED__STAGE(Value, State, Index, Stage) \
+  _Generic((Stage), \
+    fuse_transform_t: fused__transform, \
+    fuse_filter_t: fused__filter, \
+    fuse_head_t: fused__head \
+  )(&(Value), &(State).taken[Index], &(State).done, (Stage))
+
+#define FUSED__COUNT(...) FUSED__COUNT_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1)
+#define FUSED__COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define FUSED__CAT(A, B) FUSED__CAT_(A, B)
+#define FUSED__CAT_(A, B) A##B
+
+#define FUSED__STAGES(V, S, ...) FUSED__CAT(FUSED__STAGES_, FUSED__COUNT(__VA_ARGS__))(V, S, __VA_ARGS__)
+#define FUSED__STAGES_1(V, S, A) FUSED__STAGE(V, S, 0, A)
+#define FUSED__STAGES_2(V, S, A, B) FUSED__STAGES_1(V, S, A) && FUSED__STAGE(V, S, 1, B)
+#define FUSED__STAGES_3(V, S, A, B, C) FUSED__STAGES_2(V, S, A, B) && FUSED__STAGE(V, S, 2, C)
+#define FUSED__STAGES_4(V, S, A, B, C, D) FUSED__STAGES_3(V, S, A, B, C) && FUSED__STAGE(V, S, 3, D)
+#define FUSED__STAGES_5(V, S, A, B, C, D, E) FUSED__STAGES_4(V, S, A, B, C, D) && FUSED__STAGE(V, S, 4, E)
+#define FUSED__STAGES_6(V, S, A, B, C, D, E, F) FUSED__STAGES_5(V, S, A, B, C, D, E) && FUSED__STAGE(V, S, 5, F)
+#define FUSED__STAGES_7(V, S, A, B, C, D, E, F, G) \
+  FUSED__STAGES_6(V, S, A, B, C, D, E, F) && FUSED__STAGE(V, S, 6, G)
+#define FUSED__STAGES_8(V, S, A, B, C, D, E, F, G, H) \
+  FUSED__STAGES_7(V, S, A, B, C, D, E, F, G) && FUSED__STAGE(V, S, 7, H)
+
+#define FusedForEach(Value, Source, ...) \
+  for (__auto_type Value##__state = _Generic((Source), fuse_range_t: fused__range, default: fused__source)(Source); \
+       !Value##__state.broke && _Generic(&Value##__state, \
+         fused__range_state_t*: fused__range_next, \
+         fused__source_state_t*: fused__source_next \
+       )(&Value##__state);) \
+    for (int Value = Value##__state.value, Value##__once = (Value##__state.broke = true); Value##__once; \
+         Value##__once = Value##__state.broke = false) \
+      if (FUSED__STAGES(Value, Value##__state, __VA_ARGS__))
+
+/*************/
+/* gen_array */
+/*************/
+
+/* Values of someone else's array. */
+typedef struct {
+  int_generator_t base;
+  const int* values;
+  size_t count;
+  size_t pos;
+} gen_array_generator_t;
+
+#define gen_array_size GeneratorSize(sizeof(gen_array_generator_t))
+
+int_generator_result_t gen_array__next(void* self_) {
+  gen_array_generator_t* self = self_;
+  return self->pos < self->count
+    ? (int_generator_result_t){ self->values[self->pos++], false }
+    : (int_generator_result_t){ 0, true };
+}
+
+size_t gen_array__next_batch(void* self_, int* values, size_t capacity) {
+  gen_array_generator_t* self = self_;
+  const size_t count = self->count - self->pos < capacity ? self->count - self->pos : capacity;
+  memcpy(values, self->values + self->pos, sizeof(values[0]) * count);
+  self->pos += count;
+  return count;
+}
+
+int_generator_t* gen_array_in(generator_arena_t* arena, const int* values, size_t count);
+
+void* gen_array__split(void* self_, generator_arena_t* arena, size_t count) {
+  gen_array_generator_t* self = self_;
+  if (count > self->count - self->pos) count = self->count - self->pos;
+  if (!count) return 0;
+  self->pos += count;
+  return gen_array_in(arena, self->values + self->pos - count, count);
+}
+
+int_generator_t* gen_array_in(generator_arena_t* arena, const int* values, size_t count) {
+  int_generator_t* array = GeneratorNew(arena, gen_array_generator_t, gen_array__next, values, count);
+  array->next_batch = (void*)gen_array__next_batch;
+  array->split = (void*)gen_array__split;
+  return array;
+}
+
+int_generator_t* gen_array(const int* values, size_t count) {
+  return gen_array_in(0, values, count);
+}
+
+/****************/
+/* gen_parallel */
+/****************/
+
+/*
+ * Runs the same stages over pieces ("chunks") of one source on a coro_sched_t. Sources which can split hand out
+ * chunks for free, anything else is read into a buffer a chunk at a time by the consumer. `stages` builds a chunk's
+ * pipeline on top of its piece of the source, in the arena it's given (that's on the task's stack, 1 KiB), and every
+ * stage sees only its own chunk: head and tail are per chunk.
+ *
+ * Results come back in source order, or with `ordered` false in whatever order chunks finish, which doesn't wait
+ * for one slow chunk. At most gen_parallel__in_flight chunks are out at once, so memory stays bounded.
+ */
+typedef int_generator_t* (*parallel_stages_fn)(generator_arena_t* arena, int_generator_t* chunk, void* context);
+
+enum { gen_parallel__in_flight = 64, gen_parallel__arena = 1024 };
+
+typedef struct gen_parallel__chunk gen_parallel__chunk_t;
+typedef struct gen_parallel__generator gen_parallel_generator_t;
+
+struct gen_parallel__chunk {
+  gen_parallel_generator_t* parallel;
+  coro_task_t* task;
+  uint64_t sequence;
+  int_generator_t* source;      /* split off, lives in `source_storage` */
+  int* input;                   /* or read by the consumer */
+  size_t input_count;
+  int* values;                  /* output, reused by the next chunk in this slot */
+  size_t count;
+  size_t capacity;
+  bool done;
+  gen_parallel__chunk_t* next_done;
+  _Alignas(16) char source_storage[64];
+};
+
+struct gen_parallel__generator {
+  int_generator_t base;
+  coro_sched_t* sched;
+  int_generator_t* source;
+  size_t chunk;
+  parallel_stages_fn stages;
+  void* context;
+  bool ordered;
+  bool source_done;
+  uint64_t spawned;
+  uint64_t consumed;
+  gen_parallel__chunk_t* current;
+  size_t pos;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  gen_parallel__chunk_t* done;        /* finished and not taken yet, unordered only */
+  gen_parallel__chunk_t** done_tail;
+  gen_parallel__chunk_t slots[gen_parallel__in_flight];
+};
+
+coro_value_t gen_parallel__run(coro_value_t arg) {
+  gen_parallel__chunk_t* chunk = arg;
+  gen_parallel_generator_t* parallel = chunk->parallel;
+
+  GeneratorArena(arena, gen_parallel__arena);
+  int_generator_t* source = chunk->source ? chunk->source : gen_array_in(&arena, chunk->input, chunk->input_count);
+  int_generator_t* output = parallel->stages(&arena, source, parallel->context);
+
+  chunk->count = 0;
+  while (true) {
+    if (chunk->capacity - chunk->count < generator_batch) {
+      chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 4 * generator_batch;
+      chunk->values = realloc(chunk->values, sizeof(chunk->values[0]) * chunk->capacity);
+    }
+    const size_t count = int_generator_fill(output, chunk->values + chunk->count, generator_batch);
+    if (!count) break;
+    chunk->count += count;
+  }
+
+  pthread_mutex_lock(&parallel->lock);
+  chunk->done = true;
+  if (!parallel->ordered) {
+    chunk->next_done = 0;
+    *parallel->done_tail = chunk;
+    parallel->done_tail = &chunk->next_done;
+  }
+  pthread_cond_broadcast(&parallel->finished);
+  pthread_mutex_unlock(&parallel->lock);
+  return 0;
+}
+
+/* Cuts the next chunk off the source into a free slot and starts it, false when the source is over. */
+static bool gen_parallel__spawn(gen_parallel_generator_t* self, gen_parallel__chunk_t* chunk) {
+  if (self->source_done) return false;
+
+  chunk->source = 0;
+  chunk->input_count = 0;
+  if (self->source->split) {
+    generator_arena_t arena = { chunk->source_storage, sizeof(chunk->source_storage), 0 };
+    chunk->source = self->source->split(self->source, &arena, self->chunk);
+    self->source_done = !chunk->source;
+  } else {
+    if (!chunk->input) chunk->input = malloc(sizeof(chunk->input[0]) * self->chunk);
+    for (size_t count; chunk->input_count < self->chunk; chunk->input_count += count) {
+      count = int_generator_fill(self->source, chunk->input + chunk->input_count, self->chunk - chunk->input_count);
+      if (!count) break;
+    }
+    self->source_done = chunk->input_count < self->chunk;
+    if (!chunk->input_count) return false;
+  }
+  if (!chunk->source && !chunk->input_count) return false;
+
+  chunk->sequence = self->spawned++;
+  chunk->done = false;
+  chunk->task = coro_sched_spawn(self->sched, gen_parallel__run, chunk);
+  return true;
+}
+
+/* Waits for the next finished chunk: the oldest one when ordered, any one otherwise. Null when all are taken. */
+static gen_parallel__chunk_t* gen_parallel__take(gen_parallel_generator_t* self) {
+  if (self->consumed == self->spawned) return 0;
+
+  gen_parallel__chunk_t* chunk;
+  pthread_mutex_lock(&self->lock);
+  if (self->ordered) {
+    /* Slots are refilled in the order they're consumed, so chunk N is always in slot N % in_flight. */
+    chunk = &self->slots[self->consumed % gen_parallel__in_flight];
+    while (!chunk->done) pthread_cond_wait(&self->finished, &self->lock);
+  } else {
+    while (!self->done) pthread_cond_wait(&self->finished, &self->lock);
+    chunk = self->done;
+    self->done = chunk->next_done;
+    if (!self->done) self->done_tail = &self->done;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  coro_sched_join(chunk->task);
+  self->consumed++;
+  return chunk;
+}
+
+size_t gen_parallel__next_batch(void* self_, int* values, size_t capacity) {
+  gen_parallel_generator_t* self = self_;
+  while (!self->current || self->pos == self->current->count) {
+    if (self->current) gen_parallel__spawn(self, self->current);
+    if (!(self->current = gen_parallel__take(self))) return 0;
+    self->pos = 0;
+  }
+
+  size_t count = self->current->count - self->pos;
+  if (count > capacity) count = capacity;
+  memcpy(values, self->current->values + self->pos, sizeof(values[0]) * count);
+  self->pos += count;
+  return count;
+}
+
+int_generator_result_t gen_parallel__next(void* self) {
+  int value;
+  return gen_parallel__next_batch(self, &value, 1)
+    ? (int_generator_result_t){ .value = value, .done = false }
+    : (int_generator_result_t){ .done = true };
+}
+
+/* Chunks still running use the generator, wait for them even if nobody wants their results. */
+void gen_parallel__cleanup(void* self_) {
+  gen_parallel_generator_t* self = self_;
+  while (gen_parallel__take(self)) {}
+
+  for (size_t i = 0; i < gen_parallel__in_flight; i++) {
+    free(self->slots[i].values);
+    free(self->slots[i].input);
+  }
+  pthread_cond_destroy(&self->finished);
+  pthread_mutex_destroy(&self->lock);
+  free(self);
+}
+
+/* Starts the first chunks right away. */
+int_generator_t* gen_parallel(coro_sched_t* sched, int_generator_t* source, size_t chunk, parallel_stages_fn stages,
+                              void* context, bool ordered) {
+  gen_parallel_generator_t* self = calloc(1, sizeof(*self));
+  self->base = (int_generator_t){
+    (void*)gen_parallel__next, (void*)gen_parallel__cleanup, (void*)gen_parallel__next_batch, 0
+  };
+  self->sched = sched;
+  self->source = source;
+  self->chunk = chunk;
+  self->stages = stages;
+  self->context = context;
+  self->ordered = ordered;
+  pthread_mutex_init(&self->lock, 0);
+  pthread_cond_init(&self->finished, 0);
+  self->done_tail = &self->done;
+  for (size_t i = 0; i < gen_parallel__in_flight; i++) {
+    self->slots[i].parallel = self;
+  }
+
+  for (size_t i = 0; i < gen_parallel__in_flight && gen_parallel__spawn(self, &self->slots[i]); i++) {}
+  return &self->base;
+}
+
 /*******************/
 /* gen_interaction */
 /*******************/
 
-GeneratorDefine(interaction_generator_t, interaction_generator, const char**, const char*);
+/* Asks the caller to do I/O: yields operations for a coro_loop_t and gets their results back. */
+GeneratorDefine(interaction_generator_t, interaction_generator, coro_io_t*, int64_t);
 
 typedef struct {
   interaction_generator_t base;
   void* state;
+  int fd;
+  coro_io_t io;
+  char line[256];
 } gen_interaction_generator_t;
 
-interaction_generator_result_t gen_interaction__next(gen_interaction_generator_t* self, const char* response) {
+interaction_generator_result_t gen_interaction__next(gen_interaction_generator_t* self, int64_t result) {
   if (self->state) goto *self->state;
 
   state_start: {
+    self->fd = open("/etc/timezone", O_RDONLY | O_CLOEXEC);
+    if (self->fd < 0) {
+      perror("gen_interaction: /etc/timezone");
+      goto state_exit;
+    }
+
     self->state = &&state_onread;
-    static const char* request[] = { "readline", "/etc/timezone" };
-    return (interaction_generator_result_t){ .value = request, .done = false };
+    self->io = (coro_io_t){ .op = CORO_IO_READ, .fd = self->fd, .buf = self->line, .len = sizeof(self->line) };
+    return (interaction_generator_result_t){ .value = &self->io, .done = false };
   }
 
   state_onread: {
+    close(self->fd);
+    if (result < 0) goto state_exit;
+
+    const char* newline = memchr(self->line, '\n', result);
     self->state = &&state_exit;
-    static const char* request[] = { "writeline", "" };
-    request[1] = response;
-    return (interaction_generator_result_t){ .value = request, .done = false };
+    self->io = (coro_io_t){
+      .op = CORO_IO_WRITE, .fd = STDOUT_FILENO, .buf = self->line,
+      .len = newline ? newline - self->line + 1 : result, .offset = -1
+    };
+    return (interaction_generator_result_t){ .value = &self->io, .done = false };
   }
 
   state_exit: {
@@ -235,12 +1302,404 @@ interaction_generator_t* gen_interaction() {
   return HeapGeneratorNew(gen_interaction_generator_t, gen_interaction__next, HeapGeneratorFree, 0);
 }
 
+static coro_loop_t* interaction_loop;
+
+/* Completion of the last request: hand its result to the generator and submit whatever it asks for next. */
+void interaction_step(coro_io_t* io) {
+  interaction_generator_t* interaction = io->data;
+  interaction_generator_result_t res = interaction->next(interaction, io->result);
+  if (res.done) {
+    interaction->cleanup(interaction);
+    return;
+  }
+
+  res.value->complete = interaction_step;
+  res.value->data = interaction;
+  coro_loop_submit(interaction_loop, res.value);
+}
+
+
+/*********/
+/* bench */
+/*********/
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_triple(int arg) { return arg * 3 + 1; }
+bool bench_odd(int arg) { return arg & 1; }
+
+/* range | transform | filter | head | tail, every stage from the heap or all of them from one stack buffer. */
+unsigned bench_pipeline(bool in_arena, int elements) {
+  GeneratorArena(arena, gen_range_size + gen_transform_size + gen_filter_size + gen_head_size + gen_tail_size(16));
+  generator_arena_t* a = in_arena ? &arena : 0;
+
+  int_generator_t* range CLEANUP_int_generator = gen_range_in(a, 0, elements);
+  int_generator_t* triple CLEANUP_int_generator = gen_transform_in(a, range, bench_triple);
+  int_generator_t* odd CLEANUP_int_generator = gen_filter_in(a, triple, bench_odd);
+  int_generator_t* head CLEANUP_int_generator = gen_head_in(a, odd, elements);
+  int_generator_t* tail CLEANUP_int_generator = gen_tail_in(a, head, 16);
+
+  unsigned sum = 0;
+  GeneratorForEach(it, tail) {
+    sum += it.value;
+  }
+  return sum;
+}
+
+int bench_square(int arg) { return (unsigned)arg * arg; }
+
+void bench_square_block(int* values, size_t count) {
+  for (size_t i = 0; i < count; i++) values[i] = (unsigned)values[i] * values[i];
+}
+
+/*
+ * The demo pipeline, [0..elements) | square | head | tail(10), pulled one by one or a batch at a time, and batched
+ * with squares done by a block callback.
+ */
+unsigned bench_square_tail(int batched, int elements) {
+  GeneratorArena(arena, gen_range_size + gen_transform_size + gen_head_size + gen_tail_size(10));
+  int_generator_t* range = gen_range_in(&arena, 0, elements);
+  int_generator_t* squared = batched == 2
+    ? gen_transform_block_in(&arena, range, bench_square_block)
+    : gen_transform_in(&arena, range, bench_square);
+  int_generator_t* head = gen_head_in(&arena, squared, elements);
+  int_generator_t* tail = gen_tail_in(&arena, head, 10);
+
+  unsigned sum = 0;
+  if (batched) {
+    int values[generator_batch];
+    for (size_t count; (count = int_generator_fill(tail, values, generator_batch));) {
+      for (size_t i = 0; i < count; i++) sum += values[i];
+    }
+  } else {
+    GeneratorForEach(it, tail) {
+      sum += it.value;
+    }
+  }
+  return sum;
+}
+
+unsigned bench_tail(bool batched, int elements, size_t length) {
+  int_generator_t* range CLEANUP_int_generator = gen_range(0, elements);
+  int_generator_t* tail CLEANUP_int_generator = gen_tail(range, length);
+
+  unsigned sum = 0;
+  if (batched) {
+    int values[generator_batch];
+    for (size_t count; (count = int_generator_fill(tail, values, generator_batch));) {
+      for (size_t i = 0; i < count; i++) sum += values[i];
+    }
+  } else {
+    GeneratorForEach(it, tail) {
+      sum += it.value;
+    }
+  }
+  return sum;
+}
+
+int bench_scramble(int arg) { return (unsigned)arg * 2654435761u >> 8; }
+
+/* Sliding windows over pseudo-random values, checked against recomputing every window from scratch. */
+void bench_window(window_op_t op, const char* name, int elements, size_t length) {
+  int_generator_t* range CLEANUP_int_generator = gen_range(0, elements);
+  int_generator_t* values CLEANUP_int_generator = gen_transform(range, bench_scramble);
+  int_generator_t* window CLEANUP_int_generator = gen_window(values, length, op);
+
+  int* results = malloc(sizeof(int) * elements);
+  size_t produced = 0;
+  const uint64_t start = now_ns();
+  for (size_t count; (count = int_generator_fill(window, results + produced, generator_batch));) {
+    produced += count;
+  }
+  const uint64_t elapsed = now_ns() - start;
+
+  bool ok = produced == (size_t)elements - length + 1;
+  for (size_t i = 0; ok && i < produced; i += produced / 1000 + 1) {
+    unsigned sum = 0;
+    int min = bench_scramble(i), max = min;
+    for (size_t j = i; j < i + length; j++) {
+      const int value = bench_scramble(j);
+      sum += value;
+      if (value < min) min = value;
+      if (value > max) max = value;
+    }
+    ok = results[i] == (op == window_sum ? (int)sum : op == window_min ? min : max);
+  }
+  free(results);
+
+  printf("window %-3s(%zu): %d elements, %5.2f ns/element, %s\n", name, length, elements,
+    (double)elapsed / elements, ok ? "ok" : "WRONG RESULT");
+}
+
+/* range | transform | filter | head: through next, through next_batch and fused into one loop. */
+unsigned bench_fused(int mode, int elements) {
+  unsigned sum = 0;
+  if (mode == 2) {
+    FusedForEach(x, fuse_range(0, elements), fuse_transform(bench_triple), fuse_filter(bench_odd), fuse_head(elements)) {
+      sum += x;
+    }
+    return sum;
+  }
+
+  GeneratorArena(arena, gen_range_size + gen_transform_size + gen_filter_size + gen_head_size);
+  int_generator_t* range = gen_range_in(&arena, 0, elements);
+  int_generator_t* triple = gen_transform_in(&arena, range, bench_triple);
+  int_generator_t* odd = gen_filter_in(&arena, triple, bench_odd);
+  int_generator_t* head = gen_head_in(&arena, odd, elements);
+
+  if (mode == 1) {
+    int values[generator_batch];
+    for (size_t count; (count = int_generator_fill(head, values, generator_batch));) {
+      for (size_t i = 0; i < count; i++) sum += values[i];
+    }
+  } else {
+    GeneratorForEach(it, head) {
+      sum += it.value;
+    }
+  }
+  return sum;
+}
+
+/* Fused stages after a source only known at runtime. */
+unsigned bench_fused_dynamic(int elements) {
+  GeneratorArena(arena, gen_range_size);
+  unsigned sum = 0;
+  FusedForEach(x, gen_range_in(&arena, 0, elements), fuse_transform(bench_triple), fuse_filter(bench_odd)) {
+    sum += x;
+  }
+  return sum;
+}
+
+void bench(void) {
+  enum { fused_elements = 100000000 };
+  static const char* fused_names[] = { "next", "batched", "fused" };
+  uint64_t dynamic = 0;
+  for (int mode = 0; mode <= 3; mode++) {
+    const uint64_t start = now_ns();
+    const unsigned sum = mode == 3 ? bench_fused_dynamic(fused_elements) : bench_fused(mode, fused_elements);
+    const uint64_t elapsed = now_ns() - start;
+    if (!mode) dynamic = elapsed;
+
+    printf("fused %-15s: %d elements, %5.2f ns/element, x%.1f (sum %u)\n",
+      mode == 3 ? "runtime source" : fused_names[mode], fused_elements, (double)elapsed / fused_elements,
+      (double)dynamic / elapsed, sum);
+  }
+
+  enum { tail_elements = 100000000, tail_length = 10000 };
+  for (int batched = 0; batched <= 1; batched++) {
+    const uint64_t start = now_ns();
+    const unsigned sum = bench_tail(batched, tail_elements, tail_length);
+    const uint64_t elapsed = now_ns() - start;
+    printf("tail(%d) %-7s: %d elements, %5.2f ns/element (sum %u)\n", tail_length, batched ? "batched" : "next",
+      tail_elements, (double)elapsed / tail_elements, sum);
+  }
+
+  bench_window(window_sum, "sum", 10000000, 1000);
+  bench_window(window_min, "min", 10000000, 1000);
+  bench_window(window_max, "max", 10000000, 1000);
+
+  enum { square_elements = 100000000 };
+  uint64_t one_by_one = 0;
+  static const char* names[] = { "next", "batched", "block" };
+  for (int batched = 0; batched <= 2; batched++) {
+    const uint64_t start = now_ns();
+    const unsigned sum = bench_square_tail(batched, square_elements);
+    const uint64_t elapsed = now_ns() - start;
+    if (!batched) one_by_one = elapsed;
+
+    printf("square %-7s: %d elements, %5.2f ns/element, x%.1f (sum %u)\n", names[batched],
+      square_elements, (double)elapsed / square_elements, (double)one_by_one / elapsed, sum);
+  }
+
+  static const struct { const char* name; int pipelines; int elements; } runs[] = {
+    { "short", 1000000, 64 },
+    { "long", 1, 100000000 },
+  };
+
+  for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    for (int in_arena = 0; in_arena <= 1; in_arena++) {
+      const size_t allocations = generator_heap_allocations;
+      const uint64_t start = now_ns();
+      unsigned sum = 0;
+      for (int j = 0; j < runs[i].pipelines; j++) {
+        sum += bench_pipeline(in_arena, runs[i].elements);
+      }
+      const uint64_t elapsed = now_ns() - start;
+
+      printf("%-5s %-5s: %d x %d elements, %5.2f ns/element, %zu allocations/pipeline (sum %u)\n",
+        runs[i].name, in_arena ? "arena" : "heap", runs[i].pipelines, runs[i].elements,
+        (double)elapsed / ((double)runs[i].pipelines * runs[i].elements),
+        (generator_heap_allocations - allocations) / runs[i].pipelines, sum);
+    }
+  }
+}
+
+bool primes_is_prime(int arg) {
+  if (arg < 4) return arg >= 2;
+  if (arg % 2 == 0) return false;
+  for (int i = 3; i <= arg / i; i += 2) {
+    if (arg % i == 0) return false;
+  }
+  return true;
+}
+
+int_generator_t* primes_stages(generator_arena_t* arena, int_generator_t* chunk, void* context) {
+  return gen_filter_in(arena, chunk, primes_is_prime);
+}
+
+/* Primes below `limit` with the filter on one thread and then on 1..workers worker threads, ordered and not. */
+void primes_demo(int limit, uint32_t workers) {
+  uint64_t start = now_ns();
+  size_t expected_count = 0;
+  unsigned expected_sum = 0;
+  {
+    int_generator_t* numbers CLEANUP_int_generator = gen_range(2, limit);
+    int_generator_t* primes CLEANUP_int_generator = gen_filter(numbers, primes_is_prime);
+    int values[generator_batch];
+    for (size_t count; (count = int_generator_fill(primes, values, generator_batch));) {
+      for (size_t i = 0; i < count; i++) expected_sum += values[i];
+      expected_count += count;
+    }
+  }
+  const uint64_t sequential = now_ns() - start;
+  printf("primes below %d: %zu, sequential filter %.1f ms\n", limit, expected_count, sequential / 1e6);
+
+  if (!workers) workers = 1;
+  for (uint32_t w = 1;; w = w * 2 < workers ? w * 2 : workers) {
+    coro_sched_t* sched = coro_sched_new(w, 64 * 1024);
+    for (int ordered = 1; ordered >= 0; ordered--) {
+      start = now_ns();
+      int_generator_t* numbers CLEANUP_int_generator = gen_range(2, limit);
+      int_generator_t* primes CLEANUP_int_generator = gen_parallel(sched, numbers, 1 << 16, primes_stages, 0, ordered);
+
+      size_t count = 0;
+      unsigned sum = 0;
+      int last = 0;
+      bool sorted = true;
+      int values[generator_batch];
+      for (size_t n; (n = int_generator_fill(primes, values, generator_batch));) {
+        for (size_t i = 0; i < n; i++) {
+          sorted &= values[i] > last;
+          last = values[i];
+          sum += values[i];
+        }
+        count += n;
+      }
+      const uint64_t elapsed = now_ns() - start;
+
+      const bool ok = count == expected_count && sum == expected_sum && (sorted || !ordered);
+      printf("  %2u workers %-9s: %.1f ms, x%.2f, %s\n", w, ordered ? "ordered" : "unordered", elapsed / 1e6,
+        (double)sequential / elapsed, ok ? "ok" : "WRONG RESULT");
+    }
+    coro_sched_delete(sched);
+    if (w == workers) break;
+  }
+}
+
+/***********/
+/* records */
+/***********/
+
+typedef struct {
+  uint32_t id;
+  char customer[16];
+  size_t item_count;
+  double items[4];
+  double total;
+} order_t;
+
+GeneratorStagesDefine(double_generator, double);
+GeneratorStagesDefine(order_generator, order_t);
+GeneratorMapDefine(order_totals, order_generator, double_generator);
+GeneratorMapDefine(double_sums, double_generator_chunks, double_generator);
+GeneratorZipDefine(double_products, double_generator, double_generator, double_generator);
+GeneratorFlatMapDefine(order_items, order_generator, double_generator);
+
+void order_make(size_t index, order_t* order) {
+  static const char* customers[] = { "ada", "bob", "eve", "joe", "max" };
+  *order = (order_t){ .id = 1000 + index, .item_count = 1 + index * 7 % 4 };
+  snprintf(order->customer, sizeof(order->customer), "%s", customers[index * 3 % 5]);
+  for (size_t i = 0; i < order->item_count; i++) {
+    order->items[i] = (double)((index + 1) * (i + 3) * 37 % 100) / 4;
+    order->total += order->items[i];
+  }
+}
+
+bool order_is_big(const order_t* order) { return order->total >= 30; }
+void order_total(const order_t* order, double* total) { *total = order->total; }
+void order_discount(size_t index, double* rate) { *rate = index % 3 ? 1 : 0.9; }
+void double_product(const double* first, const double* second, double* result) { *result = *first * *second; }
+
+void double_sum(const double_generator_span_t* span, double* sum) {
+  *sum = 0;
+  for (size_t i = 0; i < span->count; i++) *sum += span->values[i];
+}
+
+double_generator_t* order_items_of(generator_arena_t* arena, const order_t* order) {
+  return double_generator_array(arena, order->items, order->item_count);
+}
+
+/* Orders are 80 bytes, none of them is copied on the way except by tail and chunk, which keep what they hold. */
+void records_demo(void) {
+  enum { orders = 12 };
+
+  order_generator_t* all GeneratorCleanup(order_generator) = order_generator_range(0, 0, orders, order_make);
+  order_generator_t* big GeneratorCleanup(order_generator) = order_generator_filter(0, all, order_is_big);
+  order_generator_t* last GeneratorCleanup(order_generator) = order_generator_tail(0, big, 3);
+
+  printf("orders | total >= 30 | tail(3): ");
+  GeneratorForEach(it, last) {
+    printf("#%u %s %.2f; ", it.value->id, it.value->customer, it.value->total);
+  }
+  printf("\n");
+
+  GeneratorArena(arena, order_generator_range_size + order_generator_head_size
+    + GeneratorFlatMapSize(order_items, double_generator_array_size));
+  order_generator_t* first = order_generator_head(&arena, order_generator_range(&arena, 0, orders, order_make), 3);
+  double_generator_t* items = order_items(&arena, first, order_items_of, double_generator_array_size);
+
+  printf("orders | head(3) | flat_map(items): ");
+  GeneratorForEach(it, items) {
+    printf("%.2f ", *it.value);
+  }
+  printf("\n");
+
+  GeneratorArena(totals_arena, order_generator_range_size + order_totals_size + double_generator_range_size
+    + double_products_size + GeneratorChunkSize(double_generator, 4) + double_sums_size);
+  double_generator_t* totals = order_totals(&totals_arena,
+    order_generator_range(&totals_arena, 0, orders, order_make), order_total);
+  double_generator_t* rates = double_generator_range(&totals_arena, 0, orders, order_discount);
+  double_generator_t* discounted = double_products(&totals_arena, totals, rates, double_product);
+  double_generator_t* sums = double_sums(&totals_arena,
+    double_generator_chunk(&totals_arena, discounted, 4), double_sum);
+
+  printf("orders | total | zip(discount) | chunk(4) | sum: ");
+  GeneratorForEach(it, sums) {
+    printf("%.2f ", *it.value);
+  }
+  printf("\n");
+}
 
 /********/
 /* main */
 /********/
 
-int main(char* argv[], int argc) {
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "primes") == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    primes_demo(argc > 2 ? strtol(argv[2], 0, 0) : 10000000, argc > 3 ? strtoul(argv[3], 0, 0) : cpus);
+    return 0;
+  }
+
   int_generator_t* range CLEANUP_int_generator = gen_range(0, 1000);
   int_generator_t* squared CLEANUP_int_generator = gen_transform(range, LAMBDA(int, (int arg), { return arg*arg; }));
   int_generator_t* head CLEANUP_int_generator = gen_head(squared, 100);
@@ -270,29 +1729,35 @@ int main(char* argv[], int argc) {
   }
   printf("\n");
 
-  interaction_generator_t* interaction = gen_interaction();
-  char* response = 0;
-  while (true) {
-    interaction_generator_result_t res = interaction->next(interaction, response);
-    if (res.done) break;
-
-    response = 0;
+  int_generator_t* digits_range CLEANUP_int_generator = gen_range(0, 12);
+  int_generator_t* digits CLEANUP_int_generator = gen_transform(digits_range, LAMBDA(int, (int arg), {
+    return arg * 7 % 10;
+  }));
+  int_generator_t* maxima CLEANUP_int_generator = gen_window(digits, 3, window_max);
 
-    if (strcmp(res.value[0], "readline") == 0) {
-      size_t capacity = 0;
-      FILE* f = fopen(res.value[1], "r");
-      size_t length = getline(&response, &capacity, f);
-      response[length - 1] = '\0'; // cut \n
-      continue;
-    }
+  printf("[0..12] | 7x %% 10 | window_max(3): ");
+  GeneratorForEach(it, maxima) {
+    printf("%d ", it.value);
+  }
+  printf("\n");
 
-    if (strcmp(res.value[0], "writeline") == 0) {
-      printf("%s\n", res.value[1]);
-      continue;
-    }
+  printf("fused [0..1000] | square | odd | head(10): ");
+  FusedForEach(x, fuse_range(0, 1000),
+               fuse_transform(LAMBDA(int, (int arg), { return arg * arg; })),
+               fuse_filter(LAMBDA(bool, (int arg), { return arg & 1; })),
+               fuse_head(10)) {
+    printf("%d ", x);
   }
+  printf("\n");
+
+  records_demo();
 
-  interaction->cleanup(interaction);
+  /* Nothing else to do meanwhile here, but the loop would run any number of generators like this one at once. */
+  fflush(stdout);
+  interaction_loop = coro_loop_new(false);
+  interaction_step(&(coro_io_t){ .data = gen_interaction() });
+  coro_loop_run(interaction_loop);
+  coro_loop_delete(interaction_loop);
 
   return 0;
 }
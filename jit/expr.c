@@ -0,0 +1,769 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "expr.h"
+
+/********/
+/* tree */
+/********/
+
+typedef enum expr_op expr_op;
+enum expr_op {
+  expr_const,
+  expr_column_ref,
+  expr_neg,
+  expr_not,
+  expr_to_f64,  // inserted by the type checker wherever an int64 meets a double
+  expr_add,
+  expr_sub,
+  expr_mul,
+  expr_div,
+  expr_mod,
+  expr_lt,
+  expr_le,
+  expr_gt,
+  expr_ge,
+  expr_eq,
+  expr_ne,
+  expr_and,
+  expr_or,
+};
+
+typedef struct expr_node expr_node;
+struct expr_node {
+  uint8_t op;
+  uint8_t type;
+  uint16_t left, right;
+  union {
+    int64_t i;
+    double f;
+    uint32_t column;
+  };
+};
+
+struct expr {
+  char* source;
+  expr_node* nodes;
+  uint32_t length;
+  uint16_t root;
+  const expr_column* columns;
+  uint32_t column_count;
+};
+
+void expr_free(expr* e) {
+  if (!e) return;
+  free(e->source);
+  free(e->nodes);
+  free(e);
+}
+
+expr_type expr_result(const expr* e) {
+  return e->nodes[e->root].type;
+}
+
+/***********/
+/* parsing */
+/***********/
+
+typedef struct expr__parser expr__parser;
+struct expr__parser {
+  expr* e;
+  const char* source;
+  const char* at;
+  uint32_t capacity;
+  char* error;
+  size_t error_size;
+  bool failed;
+};
+
+__attribute__((format(printf, 2, 3)))
+static uint16_t expr__fail(expr__parser* p, const char* format, ...) {
+  if (!p->failed && p->error_size) {
+    const int length = snprintf(p->error, p->error_size, "at %d: ", (int)(p->at - p->source));
+    va_list args;
+    va_start(args, format);
+    if ((size_t)length < p->error_size) vsnprintf(p->error + length, p->error_size - length, format, args);
+    va_end(args);
+  }
+  p->failed = true;
+  return 0;
+}
+
+static uint16_t expr__node(expr__parser* p, expr_node node) {
+  expr* e = p->e;
+  if (e->length == UINT16_MAX) return expr__fail(p, "expression is too long");
+  if (e->length == p->capacity) {
+    p->capacity = p->capacity ? p->capacity * 2 : 32;
+    e->nodes = realloc(e->nodes, p->capacity * sizeof(expr_node));
+    if (!e->nodes) DIE("out of memory");
+  }
+  e->nodes[e->length] = node;
+  return e->length++;
+}
+
+static bool expr__numeric(expr__parser* p, uint16_t node) {
+  return p->e->nodes[node].type != expr_bool;
+}
+
+static uint16_t expr__promote(expr__parser* p, uint16_t node) {
+  if (p->e->nodes[node].type != expr_i64) return node;
+  return expr__node(p, (expr_node){ .op = expr_to_f64, .type = expr_f64, .left = node });
+}
+
+static const char* const expr__op_names[] = {
+  [expr_neg] = "-", [expr_not] = "!", [expr_add] = "+", [expr_sub] = "-", [expr_mul] = "*", [expr_div] = "/",
+  [expr_mod] = "%", [expr_lt] = "<", [expr_le] = "<=", [expr_gt] = ">", [expr_ge] = ">=", [expr_eq] = "==",
+  [expr_ne] = "!=", [expr_and] = "&&", [expr_or] = "||",
+};
+
+static uint16_t expr__binary(expr__parser* p, expr_op op, uint16_t left, uint16_t right) {
+  if (p->failed) return 0;
+  expr_node* nodes = p->e->nodes;
+
+  if (op == expr_and || op == expr_or) {
+    if (nodes[left].type != expr_bool || nodes[right].type != expr_bool) {
+      return expr__fail(p, "operands of %s must be comparisons", expr__op_names[op]);
+    }
+    return expr__node(p, (expr_node){ .op = op, .type = expr_bool, .left = left, .right = right });
+  }
+
+  if (!expr__numeric(p, left) || !expr__numeric(p, right)) {
+    return expr__fail(p, "operands of %s must be numbers", expr__op_names[op]);
+  }
+  const bool f64 = nodes[left].type == expr_f64 || nodes[right].type == expr_f64;
+  if (op == expr_mod && f64) return expr__fail(p, "%% needs integer operands");
+  if (f64) {
+    left = expr__promote(p, left);
+    right = expr__promote(p, right);
+  }
+
+  const expr_type type = op >= expr_lt ? expr_bool : f64 ? expr_f64 : expr_i64;
+  return expr__node(p, (expr_node){ .op = op, .type = type, .left = left, .right = right });
+}
+
+static void expr__skip_spaces(expr__parser* p) {
+  while (isspace((unsigned char)*p->at)) p->at++;
+}
+
+static bool expr__accept(expr__parser* p, const char* token) {
+  expr__skip_spaces(p);
+  const size_t length = strlen(token);
+  if (strncmp(p->at, token, length) != 0) return false;
+  // `<` must not eat the first half of `<=` and so on.
+  if (length == 1 && strchr("<>=!", *token) && p->at[1] == '=') return false;
+  p->at += length;
+  return true;
+}
+
+static uint16_t expr__or(expr__parser* p);
+
+static uint16_t expr__primary(expr__parser* p) {
+  expr__skip_spaces(p);
+  const char* start = p->at;
+
+  if (expr__accept(p, "(")) {
+    const uint16_t node = expr__or(p);
+    if (!expr__accept(p, ")")) return expr__fail(p, "expected )");
+    return node;
+  }
+
+  if (isdigit((unsigned char)*start) || *start == '.') {
+    char* end;
+    const int64_t value = strtoll(start, &end, 10);
+    if (*end == '.' || *end == 'e' || *end == 'E') {
+      const double f = strtod(start, &end);
+      p->at = end;
+      return expr__node(p, (expr_node){ .op = expr_const, .type = expr_f64, .f = f });
+    }
+    p->at = end;
+    return expr__node(p, (expr_node){ .op = expr_const, .type = expr_i64, .i = value });
+  }
+
+  if (isalpha((unsigned char)*start) || *start == '_') {
+    size_t length = 0;
+    while (isalnum((unsigned char)start[length]) || start[length] == '_') length++;
+    p->at += length;
+    for (uint32_t k = 0; k < p->e->column_count; k++) {
+      const expr_column* column = &p->e->columns[k];
+      if (strlen(column->name) == length && memcmp(column->name, start, length) == 0) {
+        return expr__node(p, (expr_node){ .op = expr_column_ref, .type = column->type, .column = k });
+      }
+    }
+    return expr__fail(p, "unknown column %.*s", (int)length, start);
+  }
+
+  return expr__fail(p, *start ? "unexpected %c" : "unexpected end", *start);
+}
+
+static uint16_t expr__unary(expr__parser* p) {
+  if (expr__accept(p, "-")) {
+    const uint16_t operand = expr__unary(p);
+    if (p->failed) return 0;
+    expr_node* node = &p->e->nodes[operand];
+    if (node->type == expr_bool) return expr__fail(p, "operand of - must be a number");
+    // Negative literals stay literals, so they can become immediates.
+    if (node->op == expr_const) {
+      if (node->type == expr_i64) node->i = -(uint64_t)node->i; else node->f = -node->f;
+      return operand;
+    }
+    return expr__node(p, (expr_node){ .op = expr_neg, .type = node->type, .left = operand });
+  }
+  if (expr__accept(p, "!")) {
+    const uint16_t operand = expr__unary(p);
+    if (p->failed) return 0;
+    if (p->e->nodes[operand].type != expr_bool) return expr__fail(p, "operand of ! must be a comparison");
+    return expr__node(p, (expr_node){ .op = expr_not, .type = expr_bool, .left = operand });
+  }
+  return expr__primary(p);
+}
+
+static uint16_t expr__term(expr__parser* p) {
+  uint16_t node = expr__unary(p);
+  while (!p->failed) {
+    const expr_op op = expr__accept(p, "*") ? expr_mul : expr__accept(p, "/") ? expr_div
+      : expr__accept(p, "%") ? expr_mod : expr_const;
+    if (op == expr_const) break;
+    node = expr__binary(p, op, node, expr__unary(p));
+  }
+  return node;
+}
+
+static uint16_t expr__sum(expr__parser* p) {
+  uint16_t node = expr__term(p);
+  while (!p->failed) {
+    const expr_op op = expr__accept(p, "+") ? expr_add : expr__accept(p, "-") ? expr_sub : expr_const;
+    if (op == expr_const) break;
+    node = expr__binary(p, op, node, expr__term(p));
+  }
+  return node;
+}
+
+static uint16_t expr__compare(expr__parser* p) {
+  const uint16_t node = expr__sum(p);
+  static const struct { const char* token; expr_op op; } ops[] = {
+    { "<=", expr_le }, { ">=", expr_ge }, { "==", expr_eq }, { "!=", expr_ne }, { "<", expr_lt }, { ">", expr_gt },
+  };
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]) && !p->failed; i++) {
+    if (expr__accept(p, ops[i].token)) return expr__binary(p, ops[i].op, node, expr__sum(p));
+  }
+  return node;
+}
+
+static uint16_t expr__and(expr__parser* p) {
+  uint16_t node = expr__compare(p);
+  while (!p->failed && expr__accept(p, "&&")) node = expr__binary(p, expr_and, node, expr__compare(p));
+  return node;
+}
+
+static uint16_t expr__or(expr__parser* p) {
+  uint16_t node = expr__and(p);
+  while (!p->failed && expr__accept(p, "||")) node = expr__binary(p, expr_or, node, expr__and(p));
+  return node;
+}
+
+expr* expr_parse(const char* source, const expr_column* columns, uint32_t count, char* error, size_t error_size) {
+  expr* e = calloc(1, sizeof(expr));
+  if (!e) DIE("out of memory");
+  e->source = strdup(source);
+  e->columns = columns;
+  e->column_count = count;
+  if (!e->source) DIE("out of memory");
+
+  expr__parser p = { .e = e, .source = source, .at = source, .error = error, .error_size = error_size };
+  e->root = expr__or(&p);
+  expr__skip_spaces(&p);
+  if (!p.failed && *p.at) expr__fail(&p, "unexpected %c", *p.at);
+  if (p.failed) {
+    expr_free(e);
+    return 0;
+  }
+  return e;
+}
+
+/****************/
+/* interpreting */
+/****************/
+
+typedef union expr_value expr_value;
+union expr_value {
+  int64_t i;
+  double f;
+  bool b;
+};
+
+static expr_value expr__eval(const expr* e, uint16_t index, const void* const* columns, uint64_t row) {
+  const expr_node* node = &e->nodes[index];
+  const bool f64 = e->nodes[node->left].type == expr_f64;
+
+#define EXPR__ARITHMETIC(op) ({ \
+    const expr_value l = expr__eval(e, node->left, columns, row); \
+    const expr_value r = expr__eval(e, node->right, columns, row); \
+    f64 ? (expr_value){ .f = l.f op r.f } : (expr_value){ .i = l.i op r.i }; \
+  })
+#define EXPR__COMPARE(op) ({ \
+    const expr_value l = expr__eval(e, node->left, columns, row); \
+    const expr_value r = expr__eval(e, node->right, columns, row); \
+    (expr_value){ .b = f64 ? l.f op r.f : l.i op r.i }; \
+  })
+
+  switch ((expr_op)node->op) {
+    case expr_const:
+      return node->type == expr_f64 ? (expr_value){ .f = node->f } : (expr_value){ .i = node->i };
+    case expr_column_ref:
+      return node->type == expr_f64
+        ? (expr_value){ .f = ((const double*)columns[node->column])[row] }
+        : (expr_value){ .i = ((const int64_t*)columns[node->column])[row] };
+    case expr_neg: {
+      const expr_value v = expr__eval(e, node->left, columns, row);
+      return f64 ? (expr_value){ .f = -v.f } : (expr_value){ .i = -(uint64_t)v.i };
+    }
+    case expr_not: return (expr_value){ .b = !expr__eval(e, node->left, columns, row).b };
+    case expr_to_f64: return (expr_value){ .f = expr__eval(e, node->left, columns, row).i };
+    case expr_add: return EXPR__ARITHMETIC(+);
+    case expr_sub: return EXPR__ARITHMETIC(-);
+    case expr_mul: return EXPR__ARITHMETIC(*);
+    case expr_div:
+    case expr_mod: {
+      const expr_value l = expr__eval(e, node->left, columns, row);
+      const expr_value r = expr__eval(e, node->right, columns, row);
+      if (f64) return (expr_value){ .f = l.f / r.f };
+      // Same as the compiled code: x / 0 and x % 0 are 0, INT64_MIN / -1 wraps to INT64_MIN.
+      if (r.i == 0 || r.i == -1) return (expr_value){ .i = node->op == expr_div ? (int64_t)((uint64_t)l.i * r.i) : 0 };
+      return (expr_value){ .i = node->op == expr_div ? l.i / r.i : l.i % r.i };
+    }
+    case expr_lt: return EXPR__COMPARE(<);
+    case expr_le: return EXPR__COMPARE(<=);
+    case expr_gt: return EXPR__COMPARE(>);
+    case expr_ge: return EXPR__COMPARE(>=);
+    case expr_eq: return EXPR__COMPARE(==);
+    case expr_ne: return EXPR__COMPARE(!=);
+    case expr_and:
+      return (expr_value){ .b = expr__eval(e, node->left, columns, row).b && expr__eval(e, node->right, columns, row).b };
+    case expr_or:
+      return (expr_value){ .b = expr__eval(e, node->left, columns, row).b || expr__eval(e, node->right, columns, row).b };
+  }
+
+#undef EXPR__ARITHMETIC
+#undef EXPR__COMPARE
+  DIE("unknown node %u", node->op);
+}
+
+uint64_t expr_interpret(const expr* e, const void* const* columns, uint64_t rows, void* out) {
+  switch (expr_result(e)) {
+    case expr_bool: {
+      uint64_t* selected = out;
+      uint64_t count = 0;
+      for (uint64_t row = 0; row < rows; row++) {
+        if (expr__eval(e, e->root, columns, row).b) selected[count++] = row;
+      }
+      return count;
+    }
+    case expr_f64:
+      for (uint64_t row = 0; row < rows; row++) ((double*)out)[row] = expr__eval(e, e->root, columns, row).f;
+      return rows;
+    case expr_i64:
+      for (uint64_t row = 0; row < rows; row++) ((int64_t*)out)[row] = expr__eval(e, e->root, columns, row).i;
+      return rows;
+  }
+  return 0;
+}
+
+/*************/
+/* compiling */
+/*************/
+
+// Generated code keeps everything in registers:
+//   rdi - columns, rsi - rows, rcx - current row, rbx - rows selected so far, rbp - out,
+//   r12-r15 - pointers to the most used columns, r8-r11, the rest of r12-r15 and xmm0-15 - temporaries,
+//   rax, rdx - scratch for idiv, double literals and columns which didn't get a register.
+// Temporaries are handed out during a Sethi-Ullman ordered walk, so a subtree needing more registers is
+// evaluated first. Booleans never become values: comparisons branch straight to the next row.
+
+enum {
+  expr__temporaries = (1u << jj_r8) | (1u << jj_r9) | (1u << jj_r10) | (1u << jj_r11),
+  expr__pinned_count = 4,
+};
+
+static const jj_reg expr__pinned[expr__pinned_count] = { jj_r12, jj_r13, jj_r14, jj_r15 };
+
+typedef struct expr__compiler expr__compiler;
+struct expr__compiler {
+  const expr* e;
+  jj_ctx* ctx;
+  uint8_t* need;
+  jj_reg* column_regs;
+  uint32_t free_gprs;
+  uint32_t free_xmms;
+  bool failed;
+};
+
+static jj_reg expr__alloc(expr__compiler* c, bool xmm) {
+  uint32_t* free = xmm ? &c->free_xmms : &c->free_gprs;
+  if (!*free) {
+    // Keep emitting into some register, the result is thrown away anyway.
+    c->failed = true;
+    return xmm ? (jj_reg)jj_xmm15 : jj_r11;
+  }
+  const jj_reg reg = __builtin_ctz(*free);
+  *free &= *free - 1;
+  return reg;
+}
+
+static void expr__release(expr__compiler* c, jj_reg reg, bool xmm) {
+  *(xmm ? &c->free_xmms : &c->free_gprs) |= 1u << reg;
+}
+
+/** Address of the current row of `column`. Columns without a register are reached through rax. */
+static jj_mem expr__column(expr__compiler* c, uint32_t column) {
+  jj_reg base = c->column_regs[column];
+  if (base == jj_rNONE) {
+    base = jj_rax;
+    jj_mov_r_m(c->ctx, jj_rax, jj_addr(jj_rdi, jj_rNONE, jj_s1, column * 8));
+  }
+  return jj_addr(base, jj_rcx, jj_s8, 0);
+}
+
+/** Whether `node` can be the second operand as is: an imm32 or a column with a register. */
+static bool expr__direct(expr__compiler* c, uint16_t index, bool allow_imm, jj_op* op) {
+  const expr_node* node = &c->e->nodes[index];
+  if (node->op == expr_const && node->type == expr_i64 && allow_imm && node->i == (int32_t)node->i) {
+    if (op) *op = jj_mkimm(node->i);
+    return true;
+  }
+  if (node->op == expr_column_ref && c->column_regs[node->column] != jj_rNONE) {
+    if (op) *op = (jj_op){ .type = 'm', .mem = expr__column(c, node->column) };
+    return true;
+  }
+  return false;
+}
+
+/** idiv has no immediate form. Double literals are never direct, so the rest only matters for integers. */
+static bool expr__allows_imm(const expr_node* node) {
+  return node->op != expr_div && node->op != expr_mod;
+}
+
+/** Registers needed to evaluate `index` when its siblings don't hold any. */
+static uint8_t expr__compute_need(expr__compiler* c, uint16_t index) {
+  const expr_node* node = &c->e->nodes[index];
+  uint8_t need = 1;
+  switch ((expr_op)node->op) {
+    case expr_const:
+    case expr_column_ref:
+      break;
+    case expr_neg:
+    case expr_not:
+    case expr_to_f64:
+      need = expr__compute_need(c, node->left);
+      break;
+    case expr_and:
+    case expr_or: {
+      // Halves are evaluated one after another, nothing stays live in between.
+      const uint8_t l = expr__compute_need(c, node->left), r = expr__compute_need(c, node->right);
+      need = l > r ? l : r;
+      break;
+    }
+    default: {
+      const uint8_t l = expr__compute_need(c, node->left);
+      uint8_t r = expr__compute_need(c, node->right);
+      if (expr__direct(c, node->right, expr__allows_imm(node), 0)) r = 0;
+      need = l == r ? l + 1 : l > r ? l : r;
+      break;
+    }
+  }
+  return c->need[index] = need;
+}
+
+static jj_reg expr__value(expr__compiler* c, uint16_t index);
+
+/** Evaluates both operands of a binary node, the one needing more registers first. */
+static void expr__operands(expr__compiler* c, const expr_node* node, bool allow_direct, jj_reg* left, jj_op* right) {
+  if (allow_direct && expr__direct(c, node->right, expr__allows_imm(node), 0)) {
+    *left = expr__value(c, node->left);
+    expr__direct(c, node->right, expr__allows_imm(node), right);
+  } else if (c->need[node->right] > c->need[node->left]) {
+    *right = jj_mkreg(expr__value(c, node->right));
+    *left = expr__value(c, node->left);
+  } else {
+    *left = expr__value(c, node->left);
+    *right = jj_mkreg(expr__value(c, node->right));
+  }
+}
+
+#define EXPR__SD(mn, ctx, a, b) \
+  ((b).type == 'm' ? jj_##mn##_x_x_m(ctx, jj_xmm(a), jj_xmm(a), (b).mem) \
+                   : jj_##mn##_x_x_x(ctx, jj_xmm(a), jj_xmm(a), jj_xmm((b).reg)))
+
+/** Evaluates a number into a fresh temporary: r8-r11 for int64, xmm for doubles (by number, see `jj_xmm`). */
+static jj_reg expr__value(expr__compiler* c, uint16_t index) {
+  jj_ctx* ctx = c->ctx;
+  const expr_node* node = &c->e->nodes[index];
+  const bool f64 = node->type == expr_f64;
+
+  switch ((expr_op)node->op) {
+    case expr_const: {
+      const jj_reg reg = expr__alloc(c, f64);
+      if (f64) {
+        jj_emit(ctx, mov, jj_mkreg(jj_rax), jj_mkimm(node->i));
+        jj_vmovq_x_r(ctx, jj_xmm(reg), jj_rax);
+      } else {
+        jj_emit(ctx, mov, jj_mkreg(reg), jj_mkimm(node->i));
+      }
+      return reg;
+    }
+
+    case expr_column_ref: {
+      const jj_mem mem = expr__column(c, node->column);
+      const jj_reg reg = expr__alloc(c, f64);
+      if (f64) jj_vmovsd_x_m(ctx, jj_xmm(reg), mem); else jj_mov_r_m(ctx, reg, mem);
+      return reg;
+    }
+
+    case expr_neg: {
+      const jj_reg value = expr__value(c, node->left);
+      if (!f64) {
+        jj_neg_r(ctx, value);
+        return value;
+      }
+      const jj_reg zero = expr__alloc(c, true);
+      jj_vpxor_x_x_x(ctx, jj_xmm(zero), jj_xmm(zero), jj_xmm(zero));
+      jj_vsubsd_x_x_x(ctx, jj_xmm(zero), jj_xmm(zero), jj_xmm(value));
+      expr__release(c, value, true);
+      return zero;
+    }
+
+    case expr_to_f64: {
+      const jj_reg value = expr__value(c, node->left);
+      const jj_reg reg = expr__alloc(c, true);
+      // vcvtsi2sd only writes the low half, clearing the register first breaks the dependency on its old value.
+      jj_vpxor_x_x_x(ctx, jj_xmm(reg), jj_xmm(reg), jj_xmm(reg));
+      jj_vcvtsi2sd_x_x_r(ctx, jj_xmm(reg), jj_xmm(reg), value);
+      expr__release(c, value, false);
+      return reg;
+    }
+
+    case expr_add:
+    case expr_sub:
+    case expr_mul:
+    case expr_div:
+    case expr_mod: {
+      jj_reg left;
+      jj_op right;
+      expr__operands(c, node, true, &left, &right);
+
+      if (f64) {
+        switch ((expr_op)node->op) {
+          case expr_add: EXPR__SD(vaddsd, ctx, left, right); break;
+          case expr_sub: EXPR__SD(vsubsd, ctx, left, right); break;
+          case expr_mul: EXPR__SD(vmulsd, ctx, left, right); break;
+          default:       EXPR__SD(vdivsd, ctx, left, right); break;
+        }
+      } else if (node->op == expr_add || node->op == expr_sub) {
+        jj__emit(ctx, node->op == expr_add ? jj_mn_add : jj_mn_sub, (jj_op[]){ jj_mkreg(left), right }, 2);
+      } else if (node->op == expr_mul && right.type == 'i') {
+        jj_emit(ctx, imul, jj_mkreg(left), jj_mkreg(left), right);
+      } else if (node->op == expr_mul) {
+        jj_emit(ctx, imul, jj_mkreg(left), right);
+      } else {
+        // Divisors 0 and -1 never reach idiv: x / 0 and x % 0 are 0, INT64_MIN / -1 wraps. x / d is x * d for
+        // both of them and x % d is 0, so one unsigned compare of d + 1 against 1 catches them.
+        const jj_label special = jj_label_new(ctx), done = jj_label_new(ctx);
+        jj_emit(ctx, mov, jj_mkreg(jj_rdx), right);
+        jj_lea_r_m(ctx, jj_rax, jj_addr(jj_rdx, jj_rNONE, jj_s1, 1));
+        jj_cmp_r_i8(ctx, jj_rax, 1);
+        jj_jcc_l(ctx, jj_cc_be, special);
+        jj_mov_r_r(ctx, jj_rax, left);
+        jj_cqo(ctx);
+        jj_emit(ctx, idiv, right);
+        jj_mov_r_r(ctx, left, node->op == expr_div ? jj_rax : jj_rdx);
+        jj_jmp_l(ctx, done);
+        jj_label_bind(ctx, special);
+        if (node->op == expr_div) {
+          jj_imul_r_r(ctx, left, jj_rdx);
+        } else {
+          jj_xor32_r_r(ctx, left, left);
+        }
+        jj_label_bind(ctx, done);
+      }
+
+      if (right.type == 'r') expr__release(c, right.reg, f64);
+      return left;
+    }
+
+    default:
+      DIE("%u is not a number", node->op);
+  }
+}
+
+/** Jumps to `target` when `index` evaluates to `when`, falls through otherwise. */
+static void expr__branch(expr__compiler* c, uint16_t index, bool when, jj_label target) {
+  jj_ctx* ctx = c->ctx;
+  const expr_node* node = &c->e->nodes[index];
+
+  switch ((expr_op)node->op) {
+    case expr_not:
+      expr__branch(c, node->left, !when, target);
+      return;
+
+    case expr_and:
+    case expr_or: {
+      // a && b jumps when both are true, so it's only decided early when a is false. a || b is the mirror image.
+      const bool early = node->op == expr_or;
+      if (when == early) {
+        expr__branch(c, node->left, when, target);
+        expr__branch(c, node->right, when, target);
+      } else {
+        const jj_label skip = jj_label_new(ctx);
+        expr__branch(c, node->left, early, skip);
+        expr__branch(c, node->right, when, target);
+        jj_label_bind(ctx, skip);
+      }
+      return;
+    }
+
+    default:
+      break;
+  }
+
+  const bool f64 = c->e->nodes[node->left].type == expr_f64;
+  if (!f64) {
+    static const jj_cond conds[] = {
+      [expr_lt] = jj_cc_l, [expr_le] = jj_cc_le, [expr_gt] = jj_cc_g, [expr_ge] = jj_cc_ge, [expr_eq] = jj_cc_e, [expr_ne] = jj_cc_ne,
+    };
+    jj_reg left;
+    jj_op right;
+    expr__operands(c, node, true, &left, &right);
+    jj__emit(ctx, jj_mn_cmp, (jj_op[]){ jj_mkreg(left), right }, 2);
+    expr__release(c, left, false);
+    if (right.type == 'r') expr__release(c, right.reg, false);
+    // Condition codes come in pairs which differ in the lowest bit only.
+    jj_jcc_l(ctx, when ? conds[node->op] : conds[node->op] ^ 1, target);
+    return;
+  }
+
+  // ucomisd sets CF for below and ZF for equal like an unsigned compare, and all of ZF, PF and CF when either side
+  // is NaN. So a > b is `a` and a >= b is `ae`, both false on NaN, and a < b is b > a. Negations are exact.
+  const bool swap = node->op == expr_lt || node->op == expr_le;
+  jj_reg left;
+  jj_op right;
+  expr__operands(c, node, !swap, &left, &right);
+  if (swap) {
+    jj_vucomisd_x_x(ctx, jj_xmm(right.reg), jj_xmm(left));
+  } else if (right.type == 'm') {
+    jj_vucomisd_x_m(ctx, jj_xmm(left), right.mem);
+  } else {
+    jj_vucomisd_x_x(ctx, jj_xmm(left), jj_xmm(right.reg));
+  }
+  expr__release(c, left, true);
+  if (right.type == 'r') expr__release(c, right.reg, true);
+
+  if (node->op == expr_eq || node->op == expr_ne) {
+    // Equal is ZF without PF.
+    if (when == (node->op == expr_eq)) {
+      const jj_label skip = jj_label_new(ctx);
+      jj_jcc_l(ctx, jj_cc_p, skip);
+      jj_jcc_l(ctx, jj_cc_e, target);
+      jj_label_bind(ctx, skip);
+    } else {
+      jj_jcc_l(ctx, jj_cc_p, target);
+      jj_jcc_l(ctx, jj_cc_ne, target);
+    }
+    return;
+  }
+
+  const jj_cond cond = node->op == expr_gt || node->op == expr_lt ? jj_cc_a : jj_cc_ae;
+  jj_jcc_l(ctx, when ? cond : cond ^ 1, target);
+}
+
+expr_fn expr_compile(const expr* e, jj_ctx* ctx, jj_cache* cache) {
+  bool uses_f64 = false;
+  uint32_t uses[e->column_count + 1];
+  memset(uses, 0, sizeof(uses));
+  for (uint32_t i = 0; i < e->length; i++) {
+    uses_f64 |= e->nodes[i].type == expr_f64;
+    if (e->nodes[i].op == expr_column_ref) uses[e->nodes[i].column]++;
+  }
+  if (uses_f64 && !jj_cpu_has(jj_cpu_avx)) return 0;
+
+  // The most used columns get a register each.
+  jj_reg column_regs[e->column_count + 1];
+  for (uint32_t k = 0; k < e->column_count; k++) column_regs[k] = jj_rNONE;
+  for (uint32_t pinned = 0; pinned < expr__pinned_count; pinned++) {
+    uint32_t best = 0;
+    for (uint32_t k = 0; k < e->column_count; k++) {
+      if (column_regs[k] == jj_rNONE && uses[k] > uses[best]) best = k;
+    }
+    if (!uses[best] || column_regs[best] != jj_rNONE) break;
+    column_regs[best] = expr__pinned[pinned];
+    uses[best] = 0;
+  }
+
+  // Column registers nobody took are temporaries too.
+  uint32_t free_gprs = expr__temporaries;
+  for (uint32_t pinned = 0; pinned < expr__pinned_count; pinned++) free_gprs |= 1u << expr__pinned[pinned];
+  for (uint32_t k = 0; k < e->column_count; k++) {
+    if (column_regs[k] != jj_rNONE) free_gprs &= ~(1u << column_regs[k]);
+  }
+
+  uint8_t need[e->length];
+  expr__compiler c = {
+    .e = e, .ctx = ctx, .need = need, .column_regs = column_regs, .free_gprs = free_gprs, .free_xmms = 0xffff,
+  };
+  expr__compute_need(&c, e->root);
+
+  jj_reset(ctx);
+  static const jj_reg saved[] = { jj_rbx, jj_rbp, jj_r12, jj_r13, jj_r14, jj_r15 };
+  for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) jj_push_r(ctx, saved[i]);
+  jj_mov_r_r(ctx, jj_rbp, jj_rdx);
+  jj_xor32_r_r(ctx, jj_rbx, jj_rbx);
+  jj_xor32_r_r(ctx, jj_rcx, jj_rcx);
+  for (uint32_t k = 0; k < e->column_count; k++) {
+    if (column_regs[k] != jj_rNONE) jj_mov_r_m(ctx, column_regs[k], jj_addr(jj_rdi, jj_rNONE, jj_s1, k * 8));
+  }
+
+  const jj_label loop = jj_label_new(ctx), done = jj_label_new(ctx);
+  jj_test_r_r(ctx, jj_rsi, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_e, done);
+  jj_align(ctx, 16);
+  jj_label_bind(ctx, loop);
+
+  switch (expr_result(e)) {
+    case expr_bool: {
+      const jj_label next = jj_label_new(ctx);
+      expr__branch(&c, e->root, false, next);
+      jj_mov_m_r(ctx, jj_addr(jj_rbp, jj_rbx, jj_s8, 0), jj_rcx);
+      jj_inc_r(ctx, jj_rbx);
+      jj_label_bind(ctx, next);
+      break;
+    }
+    case expr_f64: {
+      const jj_reg value = expr__value(&c, e->root);
+      jj_vmovsd_m_x(ctx, jj_addr(jj_rbp, jj_rcx, jj_s8, 0), jj_xmm(value));
+      break;
+    }
+    case expr_i64: {
+      const jj_reg value = expr__value(&c, e->root);
+      jj_mov_m_r(ctx, jj_addr(jj_rbp, jj_rcx, jj_s8, 0), value);
+      break;
+    }
+  }
+
+  jj_inc_r(ctx, jj_rcx);
+  jj_cmp_r_r(ctx, jj_rcx, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_b, loop);
+  jj_label_bind(ctx, done);
+  jj_mov_r_r(ctx, jj_rax, expr_result(e) == expr_bool ? jj_rbx : jj_rsi);
+  for (size_t i = sizeof(saved) / sizeof(saved[0]); i-- > 0; ) jj_pop_r(ctx, saved[i]);
+  jj_ret(ctx);
+
+  if (c.failed) return 0;
+  expr_fn fn = jj_cache_install(cache, ctx);
+  jj_cache_flush(cache);
+  jj_debug_name(fn, ctx->ip - ctx->base, "expr %s", e->source);
+  return fn;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jj.h"
+
+// Expressions over columns of a batch, e.g. `price * qty > 5000.0 && (region == 3 || !(discount < 0.5))`.
+//
+// Integer columns and decimal literals are int64, literals with a dot or an exponent are double, mixing the two
+// promotes to double. Operators are the C ones with C precedence: unary - and !, * / %, + -, comparisons, &&, ||.
+// % is integer only. Integer x / 0 and x % 0 are 0 and INT64_MIN / -1 wraps, so every row has a value. Comparisons
+// and && || ! give booleans, which can only be combined with each other: a boolean expression is a filter, anything
+// else is a projection.
+
+typedef enum expr_type expr_type;
+enum expr_type {
+  expr_i64,
+  expr_f64,
+  expr_bool,
+};
+
+typedef struct expr_column expr_column;
+struct expr_column {
+  const char* name;
+  expr_type type;  // expr_i64 or expr_f64
+};
+
+typedef struct expr expr;
+
+/** Parses and type checks `source`. Returns 0 and writes a message to `error` if it's not a valid expression. */
+expr* expr_parse(const char* source, const expr_column* columns, uint32_t count, char* error, size_t error_size);
+void expr_free(expr* e);
+expr_type expr_result(const expr* e);
+
+/**
+ * Evaluates an expression over `rows` rows, `columns[k]` points to the values of k-th declared column.
+ * Filters write indices of matching rows to `out` (uint64_t) and return how many matched, projections write one
+ * int64_t or double per row to `out` and return `rows`.
+ */
+typedef uint64_t (*expr_fn)(const void* const* columns, uint64_t rows, void* out);
+
+/** Tree-walking interpreter with the same contract as `expr_fn`. */
+uint64_t expr_interpret(const expr* e, const void* const* columns, uint64_t rows, void* out);
+
+/**
+ * Compiles `e` into a loop over the whole batch. Code is emitted into `ctx` (reset first, so it can be dumped
+ * afterwards), installed into `cache` and flushed. Returns 0 when the expression needs more temporaries than
+ * there are registers or uses doubles without AVX, the interpreter still works for those.
+ */
+expr_fn expr_compile(const expr* e, jj_ctx* ctx, jj_cache* cache);
@@ -4,322 +4,906 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#include <unistd.h>
-
-#include <sys/mman.h>
-
-#define DIE(FORMAT, ...) do { fprintf(stderr, "%s: " FORMAT "\n", __func__, ##__VA_ARGS__); exit(1); } while(0)
-
-// 3.1.1.1 Opcode Column in the Instruction Summary Table (Instructions without VEX Prefix)
-// /digit — A digit between 0 and 7 indicates that the ModR/M byte of the instruction uses only the r/m (register
-//          or memory) operand. The reg field contains the digit that provides an extension to the instruction's opcode.
-// /r     — Indicates that the ModR/M byte of the instruction contains a register operand and an r/m operand.
-// cb, cw, cd, cp, co, ct — A 1-byte (cb), 2-byte (cw), 4-byte (cd), 6-byte (cp), 8-byte (co) or 10-byte (ct) value
-//          following the opcode. This value is used to specify a code offset and possibly a new value for the code segment
-//          register
-// ib, iw, id, io — A 1-byte (ib), 2-byte (iw), 4-byte (id) or 8-byte (io) immediate operand to the instruction that
-//          follows the opcode, ModR/M bytes or scale-indexing bytes. The opcode determines if the operand is a signed
-//          value. All words, doublewords and quadwords are given with the low-order byte first.
-// +rb, +rw, +rd, +ro — Indicated the lower 3 bits of the opcode byte is used to encode the register operand
-//          without a modR/M byte
-
-// 3.1.1.3 Instruction Column in the Opcode Summary Table
-// rel8   — A relative address in the range from 128 bytes before the end of the instruction to 127 bytes after the
-//          end of the instruction.
-// r32    — One of the doubleword general-purpose registers: EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI; or one of
-//          the doubleword registers (R8D - R15D) available when using REX.R in 64-bit mode
-// r64    — One of the quadword general-purpose registers: RAX, RBX, RCX, RDX, RDI, RSI, RBP, RSP, R8–R15.
-//          These are available when using REX.R and 64-bit mode.
-// imm8   — An immediate byte value. The imm8 symbol is a signed number between –128 and +127 inclusive.
-// imm32  — An immediate doubleword value used for instructions whose operand-size attribute is 32 bits.
-// r/m8   — A byte operand that is either the contents of a byte general-purpose register ... or a byte from memory.
-// r/m64  — A quadword general-purpose register or memory operand used for instructions whose operand-size attribute is 64 bits when using REX.W
-
-// TODO: REX
-// Table 2-4. REX Prefix Fields [BITS: 0100WRXB]
-// *p++ = 0b01000000;
-
-// Vol. 2A 2-5. Table 2-2. 32-Bit Addressing Forms with the ModR/M Byte
-typedef enum jj_reg jj_reg;
-enum jj_reg {
-  /** Passed as a placeholder when register is unused. */
-  jj_rNONE = 0b11111111,
-
-  /** Passed as a mask for /digit arguments. */
-  jj__rDIGIT = 0b10000000,
-
-  jj_rax = 0b000,
-  jj_rcx = 0b001,
-  jj_rdx = 0b010,
-  jj_rbx = 0b011,
-  jj_rsp = 0b100,
-  jj_rbp = 0b101,
-  jj_rsi = 0b110,
-  jj_rdi = 0b111
-};
-
-typedef enum jj_scale jj_scale;
-enum jj_scale {
-  jj_s1 = 0b00000000,
-  jj_s2 = 0b01000000,
-  jj_s4 = 0b10000000,
-  jj_s8 = 0b11000000
-};
-
-typedef struct jj_op jj_op;
-struct jj_op {
-  char type; // 'r' - reg, 'm' - effective memory address, 'i' - immediate value
-  union {
-    jj_reg reg;
-    uint64_t imm;
-    struct {
-      jj_reg base;
-      jj_reg index;
-      jj_scale scale;
-      int32_t disp;
-    } mem;
-  };
-};
+#include "jj.h"
+#include "expr.h"
 
-typedef struct jj_ctx jj_ctx;
-struct jj_ctx {
-  uint8_t* ip;
-  uint8_t* base;
-};
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-jj_op jj_mkreg(jj_reg reg) {
-  return (jj_op){.type = 'r', .reg = reg};
+/** Emits the same 16 instructions either through typed table functions or through `jj_emit`. */
+static void bench_block(jj_ctx* ctx, bool generic) {
+  const jj_mem m = jj_addr(jj_rsi, jj_r9, jj_s8, 0x40);
+  if (!generic) {
+    jj_mov_r_r(ctx, jj_rax, jj_rdi);
+    jj_mov_r_m(ctx, jj_r8, m);
+    jj_mov_m_r(ctx, m, jj_r10);
+    jj_mov_r_i64(ctx, jj_r11, 0x123456789abcdef);
+    jj_add_r_i8(ctx, jj_rax, 8);
+    jj_add_r_i32(ctx, jj_rcx, 0x1000);
+    jj_sub_m_i32(ctx, m, 0x700);
+    jj_xor_r_r(ctx, jj_rdx, jj_rdx);
+    jj_and_r_m(ctx, jj_r12, m);
+    jj_cmp_r_r(ctx, jj_r13, jj_r14);
+    jj_imul_r_r(ctx, jj_rax, jj_r15);
+    jj_lea_r_m(ctx, jj_rax, jj_addr(jj_rax, jj_rax, jj_s4, 0));
+    jj_shl_r_i8(ctx, jj_rbx, 3);
+    jj_push_r(ctx, jj_r12);
+    jj_pop_r(ctx, jj_r12);
+    jj_ret(ctx);
+  } else {
+    const jj_op mm = {.type = 'm', .mem = m};
+    jj_emit(ctx, mov, jj_mkreg(jj_rax), jj_mkreg(jj_rdi));
+    jj_emit(ctx, mov, jj_mkreg(jj_r8), mm);
+    jj_emit(ctx, mov, mm, jj_mkreg(jj_r10));
+    jj_emit(ctx, mov, jj_mkreg(jj_r11), jj_mkimm(0x123456789abcdef));
+    jj_emit(ctx, add, jj_mkreg(jj_rax), jj_mkimm(8));
+    jj_emit(ctx, add, jj_mkreg(jj_rcx), jj_mkimm(0x1000));
+    jj_emit(ctx, sub, mm, jj_mkimm(0x700));
+    jj_emit(ctx, xor, jj_mkreg(jj_rdx), jj_mkreg(jj_rdx));
+    jj_emit(ctx, and, jj_mkreg(jj_r12), mm);
+    jj_emit(ctx, cmp, jj_mkreg(jj_r13), jj_mkreg(jj_r14));
+    jj_emit(ctx, imul, jj_mkreg(jj_rax), jj_mkreg(jj_r15));
+    jj_emit(ctx, lea, jj_mkreg(jj_rax), jj_mkmem(jj_rax, jj_rax, jj_s4, 0));
+    jj_emit(ctx, shl, jj_mkreg(jj_rbx), jj_mkimm(3));
+    jj_emit(ctx, push, jj_mkreg(jj_r12));
+    jj_emit(ctx, pop, jj_mkreg(jj_r12));
+    jj_emit(ctx, ret);
+  }
 }
-jj_op jj_mkimm(uint64_t imm) {
-  return (jj_op){.type = 'i', .imm = imm};
+
+static void bench(void) {
+  enum { block_insns = 16, blocks = 4096, rounds = 2000 };
+  jj_ctx ctx;
+  jj_init(&ctx, 1 << 20);
+
+  for (int generic = 0; generic < 2; generic++) {
+    uint64_t checksum = 0;
+    const uint64_t start = now_ns();
+    for (int round = 0; round < rounds; round++) {
+      ctx.ip = ctx.base;
+      for (int i = 0; i < blocks; i++) {
+        bench_block(&ctx, generic);
+      }
+      checksum += ctx.ip[-1] + ctx.ip - ctx.base;
+    }
+    const uint64_t elapsed = now_ns() - start;
+
+    const double insns = (double)block_insns * blocks * rounds;
+    const double bytes = (double)(ctx.ip - ctx.base) * rounds;
+    printf("%-12s %8.1f Minsn/s %8.1f MB/s %6.2f ns/insn (checksum %" PRIu64 ")\n",
+      generic ? "jj_emit:" : "jj_<insn>:",
+      insns / elapsed * 1e3, bytes / elapsed * 1e3, elapsed / insns, checksum);
+  }
+
+  jj_destroy(&ctx);
 }
-jj_op jj_mkmem(jj_reg base, jj_reg index, jj_scale scale, int32_t disp) {
-  return (jj_op){.type ='m', .mem = {.base = base, .index = index, .scale = scale, .disp = disp}};
+
+static void evicted(void* user, void* code, size_t size) {
+  (void)size;
+  void** live = user;
+  for (int i = 0; i < 256; i++) {
+    if (live[i] == code) live[i] = 0;
+  }
 }
 
-void jj__ib(jj_ctx* ctx, int8_t imm) {
-  *ctx->ip++ = (uint8_t)imm;
+/** Fills a small cache with functions of random size, freeing some of them, and prints how it copes. */
+static void cache_demo(void) {
+  // Functions which are still referenced, either freed explicitly or dropped on eviction.
+  void* live[256] = {0};
+  jj_cache* cache = jj_cache_new(256 << 10, evicted, live);
+  jj_ctx ctx;
+  jj_init(&ctx, 4096);
+
+  srand(42);
+  for (uint32_t i = 0; i < 20000; i++) {
+    // uint64_t f(void) { return i; } padded with a random amount of nops
+    jj_reset(&ctx);
+    jj_mov_r_i32(&ctx, jj_rax, i);
+    for (int n = rand() % 2000; n > 0; n--) jj_nop(&ctx);
+    jj_ret(&ctx);
+
+    const uint32_t slot = rand() % 256;
+    if (live[slot]) jj_cache_free(cache, live[slot]);
+    live[slot] = jj_cache_install(cache, &ctx);
+    jj_debug_name(live[slot], ctx.ip - ctx.base, "cache_%u", i);
+
+    if (i % 5000 == 4999) {
+      jj_cache_flush(cache);
+      const uint64_t ret = ((uint64_t (*)(void))live[slot])();
+      const jj_cache_stats stats = jj_cache_get_stats(cache);
+      printf("installed %5u: f() = %5" PRIu64 ", committed %4zuK, used %4zuK in %3u chunks, "
+        "free %4zuK in %3u chunks (largest %3zuK, fragmentation %.2f), evicted %" PRIu64 "\n",
+        i + 1, ret, stats.committed >> 10, stats.used >> 10, stats.chunks,
+        stats.free >> 10, stats.free_chunks, stats.largest_free >> 10, stats.fragmentation, stats.evictions);
+    }
+  }
+
+  jj_destroy(&ctx);
+  jj_cache_delete(cache);
+
+  // Free chunks at the end go back to the bump space, where they grow into bigger allocations.
+  cache = jj_cache_new(1 << 20, 0, 0);
+  uint8_t* rw;
+  void* first = jj_cache_alloc(cache, 300 << 10, &rw);
+  void* second = jj_cache_alloc(cache, 300 << 10, &rw);
+  jj_cache_free(cache, first);
+  jj_cache_free(cache, second);
+  jj_cache_alloc(cache, 700 << 10, &rw);
+  const jj_cache_stats stats = jj_cache_get_stats(cache);
+  printf("300K, 300K, both freed, then 700K in a 1M cache: used %zuK, free %zuK in %u chunks, evicted %" PRIu64
+    ", %s\n", stats.used >> 10, stats.free >> 10, stats.free_chunks, stats.evictions,
+    stats.used == 700 << 10 && !stats.free_chunks && !stats.evictions ? "ok" : "WRONG");
+  jj_cache_delete(cache);
 }
 
-void jj__id(jj_ctx* ctx, int32_t imm) {
-  const uint32_t uimm = (uint32_t)imm;
-  *ctx->ip++ = (uimm >>  0) & 0xff;
-  *ctx->ip++ = (uimm >>  8) & 0xff;
-  *ctx->ip++ = (uimm >> 16) & 0xff;
-  *ctx->ip++ = (uimm >> 24) & 0xff;
+/** Reduces 8 dwords of ymm0 into xmm0[0], using ymm1 as scratch. */
+static void emit_hsum_epi32(jj_ctx* ctx) {
+  jj_vextracti128_x_y_i8(ctx, jj_xmm1, jj_ymm0, 1);
+  jj_vpaddd_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm1);
+  jj_vpshufd_x_x_i8(ctx, jj_xmm1, jj_xmm0, 0x4e);
+  jj_vpaddd_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm1);
+  jj_vpshufd_x_x_i8(ctx, jj_xmm1, jj_xmm0, 0xb1);
+  jj_vpaddd_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm1);
 }
 
-void jj__modrmsib(jj_ctx* ctx, jj_reg reg, jj_op rm) {
-  if (rm.type == 'i') DIE("rm cannot be immediate");
+/** uint32_t checksum(const uint32_t* values, uint64_t count): wrapping sum, 8 lanes at a time plus a scalar tail. */
+static void emit_checksum_avx2(jj_ctx* ctx) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label tail = jj_label_new(ctx);
+  const jj_label tail_loop = jj_label_new(ctx);
+  const jj_label reduce = jj_label_new(ctx);
+
+  jj_vpxor_y_y_y(ctx, jj_ymm0, jj_ymm0, jj_ymm0);
+  jj_mov_r_r(ctx, jj_rcx, jj_rsi);
+  jj_shr_r_i8(ctx, jj_rcx, 3);
+  jj_jcc_l(ctx, jj_cc_e, tail);
+  jj_label_bind(ctx, loop);
+  jj_vpaddd_y_y_m(ctx, jj_ymm0, jj_ymm0, jj_addr(jj_rdi, jj_rNONE, jj_s1, 0));
+  jj_add_r_i8(ctx, jj_rdi, 32);
+  jj_dec_r(ctx, jj_rcx);
+  jj_jcc_l(ctx, jj_cc_ne, loop);
+
+  jj_label_bind(ctx, tail);
+  jj_and_r_i8(ctx, jj_rsi, 7);
+  jj_jcc_l(ctx, jj_cc_e, reduce);
+  jj_label_bind(ctx, tail_loop);
+  // VEX vmovd zeroes the rest of ymm1, so the tail can be added to the whole accumulator.
+  jj_vmovd_x_m(ctx, jj_xmm1, jj_addr(jj_rdi, jj_rNONE, jj_s1, 0));
+  jj_vpaddd_y_y_y(ctx, jj_ymm0, jj_ymm0, jj_ymm1);
+  jj_add_r_i8(ctx, jj_rdi, 4);
+  jj_dec_r(ctx, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_ne, tail_loop);
+
+  jj_label_bind(ctx, reduce);
+  emit_hsum_epi32(ctx);
+  jj_vmovd_r_x(ctx, jj_rax, jj_xmm0);
+  jj_vzeroupper(ctx);
+  jj_ret(ctx);
+}
 
-  reg = reg & ~jj__rDIGIT;
-  if (rm.type == 'r') {
-    *ctx->ip++ = 0b11000000 | (reg << 3) | rm.reg;
-    return;
-  }
+/** uint32_t checksum(const uint32_t* values, uint64_t count) for count divisible by 16. */
+static void emit_checksum_avx512(jj_ctx* ctx) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label reduce = jj_label_new(ctx);
+
+  jj_vpxord_z_z_z(ctx, jj_zmm0, jj_zmm0, jj_zmm0);
+  jj_test_r_r(ctx, jj_rsi, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_e, reduce);
+  jj_label_bind(ctx, loop);
+  jj_vpaddd_z_z_m(ctx, jj_zmm0, jj_zmm0, jj_addr(jj_rdi, jj_rNONE, jj_s1, 0));
+  jj_add_r_i8(ctx, jj_rdi, 64);
+  jj_sub_r_i8(ctx, jj_rsi, 16);
+  jj_jcc_l(ctx, jj_cc_ne, loop);
+
+  jj_label_bind(ctx, reduce);
+  jj_vextracti64x4_y_z_i8(ctx, jj_ymm1, jj_zmm0, 1);
+  jj_vpaddd_y_y_y(ctx, jj_ymm0, jj_ymm0, jj_ymm1);
+  emit_hsum_epi32(ctx);
+  jj_vmovd_r_x(ctx, jj_rax, jj_xmm0);
+  jj_vzeroupper(ctx);
+  jj_ret(ctx);
+}
 
-  // 2.1.5 Addressing-Mode Encoding of ModR/M and SIB Bytes
-  if (rm.mem.scale != jj_s1 && rm.mem.index == jj_rsp) DIE("rsp cannot be used as base for effective address");
+/** float dot(const float* a, const float* b, uint64_t count) for count divisible by 8. */
+static void emit_dot_fma(jj_ctx* ctx) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label reduce = jj_label_new(ctx);
+
+  jj_vxorps_y_y_y(ctx, jj_ymm0, jj_ymm0, jj_ymm0);
+  jj_test_r_r(ctx, jj_rdx, jj_rdx);
+  jj_jcc_l(ctx, jj_cc_e, reduce);
+  jj_label_bind(ctx, loop);
+  jj_vmovups_y_m(ctx, jj_ymm1, jj_addr(jj_rdi, jj_rNONE, jj_s1, 0));
+  jj_vfmadd231ps_y_y_m(ctx, jj_ymm0, jj_ymm1, jj_addr(jj_rsi, jj_rNONE, jj_s1, 0));
+  jj_add_r_i8(ctx, jj_rdi, 32);
+  jj_add_r_i8(ctx, jj_rsi, 32);
+  jj_sub_r_i8(ctx, jj_rdx, 8);
+  jj_jcc_l(ctx, jj_cc_ne, loop);
+
+  jj_label_bind(ctx, reduce);
+  jj_vextractf128_x_y_i8(ctx, jj_xmm1, jj_ymm0, 1);
+  jj_vaddps_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm1);
+  jj_vhaddps_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm0);
+  jj_vhaddps_x_x_x(ctx, jj_xmm0, jj_xmm0, jj_xmm0);
+  jj_vzeroupper(ctx);
+  jj_ret(ctx);
+}
 
-  const bool has_sib = rm.mem.index != jj_rNONE || rm.mem.scale != jj_s1 || rm.mem.base == jj_rsp;
-  const uint8_t disp_size = rm.mem.disp == 0 ? 0 : (uint32_t)rm.mem.disp <= 255 ? 1 : 4;
-  const uint8_t mod =
-    disp_size == 0 ? 0b00000000 :
-    disp_size == 1 ? 0b01000000 :
-                     0b10000000;
+static uint32_t checksum_c(const uint32_t* values, uint64_t count) {
+  uint32_t sum = 0;
+  for (uint64_t i = 0; i < count; i++) sum += values[i];
+  return sum;
+}
 
-  *ctx->ip++ = mod | (reg << 3) | (has_sib ? 0b100 : rm.mem.base);
+/** Evaluates `expr` `rounds` times, prints GB/s for `bytes` processed per call and yields the last result. */
+#define AVX_TIME(name, rounds, bytes, expr) ({ \
+    __auto_type result = (expr); \
+    const uint64_t start = now_ns(); \
+    for (int round = 0; round < (rounds); round++) { \
+      __asm__ volatile("" ::: "memory"); \
+      result = (expr); \
+    } \
+    const uint64_t elapsed = now_ns() - start; \
+    printf("%-16s %6.2f GB/s\n", name, (double)(bytes) * (rounds) / elapsed); \
+    result; \
+  })
+
+/** JITs vector kernels, checks them against plain C and times them. */
+static void avx_demo(void) {
+  if (!jj_cpu_has(jj_cpu_avx2) || !jj_cpu_has(jj_cpu_fma)) {
+    printf("AVX2 and FMA are not supported, nothing to do\n");
+    return;
+  }
 
-  if (has_sib) {
-    *ctx->ip++ = rm.mem.scale
-      | ((rm.mem.index == jj_rNONE ? 0b100 : rm.mem.index) << 3)
-      | (rm.mem.base == jj_rNONE ? 0b101 : rm.mem.base);
+  jj_cache* cache = jj_cache_new(1 << 20, 0, 0);
+  jj_ctx ctx;
+  jj_init(&ctx, 4096);
+
+  const jj_label checksum_avx2 = jj_label_new(&ctx);
+  const jj_label checksum_avx512 = jj_label_new(&ctx);
+  const jj_label dot_fma = jj_label_new(&ctx);
+  const bool avx512 = jj_cpu_has(jj_cpu_avx512f);
+
+  jj_label_bind(&ctx, checksum_avx2);
+  emit_checksum_avx2(&ctx);
+  jj_align(&ctx, 16);
+  jj_label_bind(&ctx, dot_fma);
+  emit_dot_fma(&ctx);
+  if (avx512) {
+    jj_align(&ctx, 16);
+    jj_label_bind(&ctx, checksum_avx512);
+    emit_checksum_avx512(&ctx);
   }
 
-  if (disp_size == 1) {
-    jj__ib(ctx, rm.mem.disp);
-  } else if (disp_size == 4) {
-    jj__id(ctx, rm.mem.disp);
+  uint8_t* code = jj_cache_install(cache, &ctx);
+  jj_cache_flush(cache);
+  const uint32_t dot_offset = jj_label_offset(&ctx, dot_fma), end = ctx.ip - ctx.base;
+  const uint32_t avx512_offset = avx512 ? jj_label_offset(&ctx, checksum_avx512) : end;
+  jj_debug_name(code, dot_offset, "checksum_avx2");
+  jj_debug_name(code + dot_offset, avx512_offset - dot_offset, "dot_fma");
+  if (avx512) jj_debug_name(code + avx512_offset, end - avx512_offset, "checksum_avx512");
+
+  uint32_t (*checksum)(const uint32_t*, uint64_t) = (void*)(code + jj_label_offset(&ctx, checksum_avx2));
+  float (*dot)(const float*, const float*, uint64_t) = (void*)(code + jj_label_offset(&ctx, dot_fma));
+
+  enum { count = 1 << 16, rounds = 2000 };
+  static uint32_t values[count + 7];
+  static float a[count], b[count];
+  for (uint32_t i = 0; i < count + 7; i++) values[i] = i * 2654435761u;
+  // Small integers keep every partial sum exact, so the order of additions doesn't matter.
+  float expected_dot = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    a[i] = i % 7;
+    b[i] = i % 5;
+    expected_dot += a[i] * b[i];
   }
-}
 
-void jj_mov(jj_ctx* ctx, jj_op dst, jj_op src) {
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'r') {
-    // REX.W + 89 /r | MOV r/m64,r64 | Move r64 to r/m64.
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x89;
-    jj__modrmsib(ctx, src.reg, dst);
-    return;
+  bool ok = true;
+  for (uint64_t n = 0; n < 40; n++) {
+    ok &= checksum(values, n) == checksum_c(values, n);
   }
+  ok &= checksum(values, count + 7) == checksum_c(values, count + 7);
+
+  const uint32_t c = AVX_TIME("checksum C:", rounds, count * 4, checksum_c(values, count));
+  const uint32_t j = AVX_TIME("checksum AVX2:", rounds, count * 4, checksum(values, count));
+  ok &= c == j;
+  if (avx512) {
+    uint32_t (*checksum512)(const uint32_t*, uint64_t) = (void*)(code + jj_label_offset(&ctx, checksum_avx512));
+    ok &= AVX_TIME("checksum AVX512:", rounds, count * 4, checksum512(values, count)) == c;
+  }
+  const float d = AVX_TIME("dot FMA:", rounds, count * 8, dot(a, b, count));
+  ok &= d == expected_dot;
+
+  printf("checksum = %08x, dot = %.0f, %s\n", c, d, ok ? "all kernels match C" : "MISMATCH");
 
-  DIE("bad operands. supported: MOV r/m64,r64");
+  jj_destroy(&ctx);
+  jj_cache_delete(cache);
 }
 
-void jj_lea(jj_ctx* ctx, jj_op dst, jj_op src) {
-  if (dst.type == 'r' && src.type == 'm') {
-    // REX.W + 8D /r | LEA r64,m | Store effective address for m in register r64.
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x8d;
-    jj__modrmsib(ctx, dst.reg, src);
-    return;
-  }
+#define R(reg) jj_mkreg(jj_##reg)
+#define I(imm) jj_mkimm(imm)
+
+/**
+ * uint64_t hash(const uint64_t* values, uint64_t count) the way a template JIT would record it:
+ * every operation moves its operands into fresh registers and nothing looks at its neighbours.
+ */
+static void record_naive_hash(jj_ir* ir, jj_ctx* ctx) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label done = jj_label_new(ctx);
+
+  jj_ir_add(ir, mov, R(rax), I(0));
+  jj_ir_add(ir, mov, R(rcx), I(0));
+  jj_ir_add(ir, cmp, R(rsi), I(0));
+  jj_ir_jcc(ir, jj_cc_e, done);
+  jj_ir_align(ir, 16);
+  jj_ir_bind(ir, loop);
+  // h * 9
+  jj_ir_add(ir, mov, R(rdx), R(rax));
+  jj_ir_add(ir, shl, R(rdx), I(3));
+  jj_ir_add(ir, add, R(rdx), R(rax));
+  // values[i] + 128
+  jj_ir_add(ir, mov, R(r8), jj_mkmem(jj_rdi, jj_rcx, jj_s8, 0));
+  jj_ir_add(ir, mov, R(r8), R(r8));
+  jj_ir_add(ir, mov, R(r9), R(r8));
+  jj_ir_add(ir, add, R(r9), I(128));
+  jj_ir_add(ir, add, R(r9), I(0));
+  // h = h * 9 + values[i] + 128
+  jj_ir_add(ir, mov, R(r10), R(r9));
+  jj_ir_add(ir, add, R(r10), R(rdx));
+  jj_ir_add(ir, mov, R(rax), R(r10));
+  jj_ir_add(ir, mov, R(r10), R(rax));
+  jj_ir_add(ir, shl, R(r10), I(0));
+  jj_ir_add(ir, add, R(rcx), I(1));
+  jj_ir_add(ir, cmp, R(rcx), R(rsi));
+  jj_ir_jcc(ir, jj_cc_b, loop);
+  jj_ir_jmp(ir, done);
+  jj_ir_bind(ir, done);
+  jj_ir_add(ir, mov, R(rdx), I(0xffffffff));
+  jj_ir_add(ir, and, R(rax), R(rdx));
+  jj_ir_add(ir, ret);
+}
+
+#undef R
+#undef I
 
-  DIE("bad operands. supported: LEA r64,m");
+static uint64_t hash_c(const uint64_t* values, uint64_t count) {
+  uint64_t h = 0;
+  for (uint64_t i = 0; i < count; i++) h = h * 9 + values[i] + 128;
+  return h & 0xffffffff;
 }
 
-void jj_xor(jj_ctx* ctx, jj_op dst, jj_op src) {
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'r') {
-    // REX.W + 31 /r | XOR r/m64, r64 | r/m64 XOR r64
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x31;
-    jj__modrmsib(ctx, src.reg, dst);
-    return;
+/** Records the same kernel twice, optimizes one copy and compares size, result and speed. */
+static void peephole_demo(void) {
+  enum { count = 1 << 16, rounds = 2000 };
+  static uint64_t values[count];
+  for (uint32_t i = 0; i < count; i++) values[i] = i * 0x9e3779b97f4a7c15ull;
+  const uint64_t expected = hash_c(values, count);
+
+  jj_cache* cache = jj_cache_new(1 << 20, 0, 0);
+  for (int optimize = 0; optimize < 2; optimize++) {
+    jj_ctx ctx;
+    jj_init(&ctx, 4096);
+    jj_ir ir;
+    jj_ir_init(&ir);
+
+    record_naive_hash(&ir, &ctx);
+    const uint32_t recorded = ir.length;
+    const uint32_t rewrites = optimize ? jj_ir_optimize(&ir) : 0;
+    jj_ir_emit(&ir, &ctx);
+    uint64_t (*hash)(const uint64_t*, uint64_t) = jj_cache_install(cache, &ctx);
+    jj_cache_flush(cache);
+    jj_debug_name(hash, ctx.ip - ctx.base, optimize ? "hash_optimized" : "hash_naive");
+
+    uint64_t result = 0;
+    const uint64_t start = now_ns();
+    for (int round = 0; round < rounds; round++) result = hash(values, count);
+    const uint64_t elapsed = now_ns() - start;
+
+    printf("%-10s %2u -> %2u entries (%2u rewrites), %3zu bytes, %.3f ns/value, %s\n",
+      optimize ? "optimized:" : "naive:", recorded, ir.length, rewrites, (size_t)(ctx.ip - ctx.base),
+      (double)elapsed / rounds / count, result == expected ? "ok" : "MISMATCH");
+    if (optimize) jj_dump_disas(&ctx);
+
+    jj_ir_destroy(&ir);
+    jj_destroy(&ctx);
   }
+  jj_cache_delete(cache);
+}
 
-  DIE("bad operands. supported: XOR r/m64, r64");
+static uint64_t mix(uint64_t x) {
+  return x * 31 + 7;
 }
 
-void jj_add(jj_ctx* ctx, jj_op dst, jj_op src) {
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'r') {
-    // REX.W + 01 /r | ADD r/m64, r64 | Add r64 to r/m64.
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x01;
-    jj__modrmsib(ctx, src.reg, dst);
-    return;
-  }
+/** What `record_pressure` computes, to check the allocated code against. */
+static uint64_t pressure_c(uint64_t a, uint64_t b, uint64_t n) {
+  uint64_t terms[20];
+  for (int k = 0; k < 20; k++) terms[k] = a * (k + 1) + b;
 
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'i') {
-    // REX.W + 81 /0 id | ADD r/m64, imm32 | Add imm32 sign-extended to 64-bits to r/m64.
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x81;
-    jj__modrmsib(ctx, jj__rDIGIT | 0, dst);
-    jj__id(ctx, src.imm);
-    return;
+  uint64_t acc = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    for (int k = 0; k < 20; k++) acc += terms[k] ^ i;
+    acc = mix(acc);
   }
-
-  DIE("bad operands. ADD r/m64, r64 and ADD r/m64, imm32 are supported");
+  for (int k = 0; k < 20; k++) acc -= terms[k];
+  return acc;
 }
 
-void jj_sub(jj_ctx* ctx, jj_op dst, jj_op src) {
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'r') {
-    // REX.W + 29 /r | SUB r/m64, r64 | Subtract r64 from r/m64.
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x29;
-    jj__modrmsib(ctx, src.reg, dst);
-    return;
+/**
+ * uint64_t pressure(uint64_t a, uint64_t b, uint64_t n) on virtual registers only: 20 values stay live through a loop
+ * with a call in it, so some of them have to go to callee-saved registers and the rest to the frame. With `tail` it
+ * returns mix(acc) through a tail call to a target loaded before the loop, which is just as likely to end up there.
+ */
+static void record_pressure(jj_ir* ir, jj_ctx* ctx, bool tail) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label done = jj_label_new(ctx);
+  jj_reg terms[20];
+
+  const jj_reg a = jj_ir_vreg(ir), b = jj_ir_vreg(ir), n = jj_ir_vreg(ir);
+  const jj_reg acc = jj_ir_vreg(ir), i = jj_ir_vreg(ir), t = jj_ir_vreg(ir);
+  const jj_reg target = tail ? jj_ir_vreg(ir) : jj_rNONE;
+  if (tail) jj_ir_add(ir, mov, jj_mkreg(target), jj_mkimm((uint64_t)mix));
+  jj_ir_add(ir, mov, jj_mkreg(a), jj_mkreg(jj_rdi));
+  jj_ir_add(ir, mov, jj_mkreg(b), jj_mkreg(jj_rsi));
+  jj_ir_add(ir, mov, jj_mkreg(n), jj_mkreg(jj_rdx));
+  for (int k = 0; k < 20; k++) {
+    terms[k] = jj_ir_vreg(ir);
+    jj_ir_add(ir, imul, jj_mkreg(terms[k]), jj_mkreg(a), jj_mkimm(k + 1));
+    jj_ir_add(ir, add, jj_mkreg(terms[k]), jj_mkreg(b));
   }
 
-  if ((dst.type == 'r' || dst.type == 'm') && src.type == 'i') {
-    // REX.W + 81 /5 id | SUB r/m64, imm32 | Subtract imm32 sign-extended to 64-bits from r/m64
-    *ctx->ip++ = 0x48; // TODO: REX
-    *ctx->ip++ = 0x81;
-    jj__modrmsib(ctx, jj__rDIGIT | 5, dst);
-    jj__id(ctx, src.imm);
-    return;
+  jj_ir_add(ir, xor, jj_mkreg(acc), jj_mkreg(acc));
+  jj_ir_add(ir, xor, jj_mkreg(i), jj_mkreg(i));
+  jj_ir_add(ir, test, jj_mkreg(n), jj_mkreg(n));
+  jj_ir_jcc(ir, jj_cc_e, done);
+  jj_ir_bind(ir, loop);
+  for (int k = 0; k < 20; k++) {
+    jj_ir_add(ir, mov, jj_mkreg(t), jj_mkreg(terms[k]));
+    jj_ir_add(ir, xor, jj_mkreg(t), jj_mkreg(i));
+    jj_ir_add(ir, add, jj_mkreg(acc), jj_mkreg(t));
   }
+  jj_ir_add(ir, mov, jj_mkreg(jj_rdi), jj_mkreg(acc));
+  jj_ir_add(ir, mov, jj_mkreg(jj_rax), jj_mkimm((uint64_t)mix));
+  jj_ir_add(ir, call, jj_mkreg(jj_rax));
+  jj_ir_add(ir, mov, jj_mkreg(acc), jj_mkreg(jj_rax));
+  jj_ir_add(ir, add, jj_mkreg(i), jj_mkimm(1));
+  jj_ir_add(ir, cmp, jj_mkreg(i), jj_mkreg(n));
+  jj_ir_jcc(ir, jj_cc_b, loop);
+  jj_ir_bind(ir, done);
+  for (int k = 0; k < 20; k++) {
+    jj_ir_add(ir, sub, jj_mkreg(acc), jj_mkreg(terms[k]));
+  }
+  if (tail) {
+    jj_ir_add(ir, mov, jj_mkreg(jj_rdi), jj_mkreg(acc));
+    jj_ir_add(ir, jmp, jj_mkreg(target));
+  } else {
+    jj_ir_add(ir, mov, jj_mkreg(jj_rax), jj_mkreg(acc));
+    jj_ir_add(ir, ret);
+  }
+}
+
+/** Allocates registers for `record_pressure`, returning and tail calling, then runs and checks it. */
+static void regalloc_demo(bool verbose) {
+  jj_cache* cache = jj_cache_new(1 << 20, 0, 0);
+
+  for (int tail = 0; tail <= 1; tail++) {
+    jj_ctx ctx;
+    jj_init(&ctx, 4096);
+    jj_ir ir;
+    jj_ir_init(&ir);
+
+    record_pressure(&ir, &ctx, tail);
+    const uint32_t recorded = ir.length;
+    const jj_ra_stats stats = jj_ra_allocate(&ir);
+    const uint32_t rewrites = jj_ir_optimize(&ir);
+    jj_ir_emit(&ir, &ctx);
+    uint64_t (*pressure)(uint64_t, uint64_t, uint64_t) = jj_cache_install(cache, &ctx);
+    jj_cache_flush(cache);
+    jj_debug_name(pressure, ctx.ip - ctx.base, tail ? "pressure_tail" : "pressure");
+    if (verbose) jj_dump_disas(&ctx);
+
+    printf("%-10s %u vregs, %u spilled, %u spill loads/stores, saved %d callee-saved registers, frame %u bytes\n",
+      tail ? "tail call:" : "ret:", stats.vregs, stats.spilled, stats.spill_insns, __builtin_popcount(stats.saved),
+      stats.frame_size);
+    printf("%-10s %u -> %u entries after allocation and %u peephole rewrites, %zu bytes of code\n",
+      "", recorded, ir.length, rewrites, (size_t)(ctx.ip - ctx.base));
+
+    bool ok = true;
+    for (uint64_t n = 0; n < 5; n++) {
+      const uint64_t expected = tail ? mix(pressure_c(3, 5, n)) : pressure_c(3, 5, n);
+      ok &= pressure(3, 5, n) == expected;
+    }
+    printf("%-10s pressure(3, 5, 4) = %" PRIu64 ", %s\n", "", pressure(3, 5, 4), ok ? "matches C" : "MISMATCH");
 
-  DIE("bad operands. SUB r/m64, r64 and SUB r/m64, imm32 are supported");
+    jj_ir_destroy(&ir);
+    jj_destroy(&ctx);
+  }
+  jj_cache_delete(cache);
 }
 
-void jj_push(jj_ctx* ctx, jj_op op) {
-  if (op.type == 'r') {
-    // 50+rd | PUSH r64 | Push r64
-    *ctx->ip++ = 0x50 + op.reg;
+/** Runs `source` over the rows through the interpreter and the compiled loop, checks and times both. */
+static void expr_run(const char* source, const expr_column* columns, uint32_t count, const void* const* data,
+                     uint64_t rows, void* expected, void* actual, jj_cache* cache, bool verbose) {
+  char error[128];
+  expr* e = expr_parse(source, columns, count, error, sizeof(error));
+  if (!e) {
+    printf("%s: %s\n", source, error);
     return;
   }
 
-  if (op.type == 'i') {
-    if (op.imm <= 0xff) {
-      // 6A ib | PUSH imm8 | Push imm8.
-      *ctx->ip++ = 0x6a;
-      jj__ib(ctx, op.imm);
-    } else {
-      // 68 id | PUSH imm32 | Push imm32.
-      *ctx->ip++ = 0x68;
-      jj__id(ctx, op.imm);
-    }
+  jj_ctx ctx;
+  jj_init(&ctx, 4096);
+  const uint64_t compile_start = now_ns();
+  expr_fn fn = expr_compile(e, &ctx, cache);
+  const uint64_t compile_elapsed = now_ns() - compile_start;
+
+  printf("%s\n", source);
+  uint64_t start = now_ns();
+  const uint64_t interpreted = expr_interpret(e, data, rows, expected);
+  const uint64_t interpret_elapsed = now_ns() - start;
+  printf("  interpreter: %7.2f ns/row, %7.1f Mrows/s\n", (double)interpret_elapsed / rows, rows * 1e3 / interpret_elapsed);
+  if (!fn) {
+    printf("  too many temporaries or no AVX, not compiled\n");
+    expr_free(e);
+    jj_destroy(&ctx);
     return;
   }
 
-  if (op.type == 'm') {
-    // FF /6 | PUSH r/m64 | Push r/m64
-    *ctx->ip++ = 0xff;
-    jj__modrmsib(ctx, jj__rDIGIT | 6, op);
+  start = now_ns();
+  const uint64_t compiled = fn(data, rows, actual);
+  const uint64_t compiled_elapsed = now_ns() - start;
+  printf("  compiled:    %7.2f ns/row, %7.1f Mrows/s, %.1fx, %zu bytes in %.1f us\n",
+    (double)compiled_elapsed / rows, rows * 1e3 / compiled_elapsed, (double)interpret_elapsed / compiled_elapsed,
+    (size_t)(ctx.ip - ctx.base), compile_elapsed / 1e3);
+
+  const bool ok = compiled == interpreted && memcmp(expected, actual, interpreted * 8) == 0;
+  if (expr_result(e) == expr_bool) {
+    printf("  %" PRIu64 " rows selected, %s\n", compiled, ok ? "same as interpreter" : "MISMATCH");
+  } else {
+    printf("  %s\n", ok ? "same as interpreter" : "MISMATCH");
   }
+  if (verbose) jj_dump_disas(&ctx);
+
+  expr_free(e);
+  jj_destroy(&ctx);
 }
 
-void jj_pop(jj_ctx* ctx, jj_op op) {
-  if (op.type == 'r') {
-    // 58+ rd | POP r64 | Pop top of stack into r64; increment stack pointer.
-    *ctx->ip++ = 0x58 + op.reg;
-    return;
+/** Compiles filters and projections over 10M rows and compares them with the tree-walking interpreter. */
+static void expr_demo(const char* source, bool verbose) {
+  enum { rows = 10 * 1000 * 1000 };
+  static const expr_column columns[] = {
+    { "a", expr_i64 }, { "b", expr_i64 }, { "qty", expr_i64 }, { "price", expr_f64 },
+  };
+  int64_t* a = malloc(rows * 8);
+  int64_t* b = malloc(rows * 8);
+  int64_t* qty = malloc(rows * 8);
+  double* price = malloc(rows * 8);
+  void* expected = malloc(rows * 8);
+  void* actual = malloc(rows * 8);
+  if (!a || !b || !qty || !price || !expected || !actual) DIE("out of memory");
+  // Fault the output pages in up front, otherwise whoever runs first pays for them.
+  memset(expected, 0, rows * 8);
+  memset(actual, 0, rows * 8);
+
+  uint64_t state = 1;
+  for (uint64_t i = 0; i < rows; i++) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    const uint32_t r = state >> 32;
+    a[i] = (int64_t)(r % 2001) - 1000;
+    b[i] = (r >> 11) % 10000;
+    qty[i] = 1 + (r >> 7) % 100;
+    price[i] = ((r >> 3) % 10000) / 100.0;
   }
 
-  DIE("bad operands. POP r64 is supported");
+  const void* const data[] = { a, b, qty, price };
+  jj_cache* cache = jj_cache_new(1 << 20, 0, 0);
+  if (source) {
+    expr_run(source, columns, 4, data, rows, expected, actual, cache, verbose);
+  } else {
+    static const char* const sources[] = {
+      "a > 0 && b % 10 != 0",
+      "price * qty > 5000.0 && (a % 7 == 3 || b < 100)",
+      "(a + b) * 3 - qty / 7",
+      "price * qty * (1.0 - a / 2000.0)",
+      "a % b == 1",
+      "a / (b % 3 - 1) + a % (b - b)",
+    };
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+      expr_run(sources[i], columns, 4, data, rows, expected, actual, cache, verbose);
+    }
+  }
+
+  jj_cache_delete(cache);
+  free(a);
+  free(b);
+  free(qty);
+  free(price);
+  free(expected);
+  free(actual);
 }
 
-void jj_ret(jj_ctx* ctx) {
-  // C3 | RET | Near return to calling procedure
-  *ctx->ip++ = 0xc3;
+/** Parses JJ_CPU, a comma separated list of `jj_cpu_name`s, anything else (`baseline`) adds nothing. */
+static uint32_t parse_features(const char* list) {
+  uint32_t mask = 0;
+  for (const char* at = list; *at; ) {
+    const size_t length = strcspn(at, ",");
+    for (int feature = 0; feature < jj_cpu__count; feature++) {
+      const char* name = jj_cpu_name(feature);
+      if (strlen(name) == length && strncmp(at, name, length) == 0) mask |= 1u << feature;
+    }
+    at += length + (at[length] == ',');
+  }
+  return mask;
 }
 
-void jj_leave(jj_ctx* ctx) {
-  // C9 | LEAVE | Set RSP to RBP, then pop RBP
-  *ctx->ip++ = 0xc9;
+/**
+ * uint64_t bits(const uint64_t* values, uint64_t count, uint64_t* copy, uint64_t bytes): copies `bytes` bytes
+ * of values and mixes every counting, andn and shift helper over the first `count` copied values.
+ */
+static void emit_bits(jj_ctx* ctx) {
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label done = jj_label_new(ctx);
+
+  jj_mov_r_r(ctx, jj_r8, jj_rdi);
+  jj_mov_r_r(ctx, jj_r9, jj_rsi);
+  jj_mov_r_r(ctx, jj_rdi, jj_rdx);
+  jj_mov_r_r(ctx, jj_rsi, jj_r8);
+  jj_gen_copy(ctx);
+
+  jj_xor32_r_r(ctx, jj_rax, jj_rax);
+  jj_xor32_r_r(ctx, jj_rcx, jj_rcx);
+  jj_test_r_r(ctx, jj_r9, jj_r9);
+  jj_jcc_l(ctx, jj_cc_e, done);
+  jj_label_bind(ctx, loop);
+  jj_mov_r_m(ctx, jj_r8, jj_addr(jj_rdx, jj_rcx, jj_s8, 0));
+  jj_gen_popcnt(ctx, jj_rsi, jj_r8);
+  jj_add_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_lzcnt(ctx, jj_rsi, jj_r8);
+  jj_add_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_tzcnt(ctx, jj_rsi, jj_r8);
+  jj_add_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_andn(ctx, jj_rsi, jj_r8, jj_rax);
+  jj_xor_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_shift(ctx, jj_mn_shl, jj_rsi, jj_r8, jj_rax);
+  jj_add_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_shift(ctx, jj_mn_shr, jj_rsi, jj_r8, jj_rax);
+  jj_xor_r_r(ctx, jj_rax, jj_rsi);
+  jj_gen_shift(ctx, jj_mn_sar, jj_rsi, jj_r8, jj_rcx);
+  jj_add_r_r(ctx, jj_rax, jj_rsi);
+  jj_rol_r_i8(ctx, jj_rax, 7);
+  jj_gen_popcnt(ctx, jj_r8, jj_r8);
+  jj_add_r_r(ctx, jj_rax, jj_r8);
+  jj_inc_r(ctx, jj_rcx);
+  jj_cmp_r_r(ctx, jj_rcx, jj_r9);
+  jj_jcc_l(ctx, jj_cc_b, loop);
+  jj_label_bind(ctx, done);
+  jj_ret(ctx);
 }
 
-void jj_prologue(jj_ctx* ctx, uint32_t size) {
-  jj_push(ctx, jj_mkreg(jj_rbp));
-  jj_mov(ctx, jj_mkreg(jj_rbp), jj_mkreg(jj_rsp));
-  jj_sub(ctx, jj_mkreg(jj_rsp), jj_mkimm(size));
+static uint64_t bits_c(const uint64_t* values, uint64_t count, uint64_t* copy, uint64_t bytes) {
+  memcpy(copy, values, bytes);
+  uint64_t acc = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint64_t v = copy[i];
+    acc += __builtin_popcountll(v);
+    acc += v ? __builtin_clzll(v) : 64;
+    acc += v ? __builtin_ctzll(v) : 64;
+    acc ^= ~v & acc;
+    acc += v << (acc & 63);
+    acc ^= v >> (acc & 63);
+    acc += (uint64_t)((int64_t)v >> (i & 63));
+    acc = acc << 7 | acc >> 57;
+    acc += __builtin_popcountll(v);
+  }
+  return acc;
 }
 
-void jj_epilogue(jj_ctx* ctx) {
-  jj_leave(ctx);
-  jj_ret(ctx);
+/** Generates `emit_bits` for every subset of detected features the helpers care about and checks them against C. */
+static void cpu_demo(void) {
+  printf("cpu:");
+  for (int feature = 0; feature < jj_cpu__count; feature++) {
+    printf(" %s%s", jj_cpu_has(feature) ? "+" : "-", jj_cpu_name(feature));
+  }
+  printf("\n");
+
+  const uint32_t relevant = 1u << jj_cpu_popcnt | 1u << jj_cpu_lzcnt | 1u << jj_cpu_bmi1 | 1u << jj_cpu_bmi2
+    | 1u << jj_cpu_erms;
+  const uint32_t detected = jj_cpu_features();
+
+  enum { count = 1 << 16, rounds = 100 };
+  static uint64_t values[count], copy[count], expected_copy[count];
+  uint64_t x = 42;
+  for (uint32_t i = 0; i < count; i++) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    // Sparse and dense values, and every zero and sign corner case of the counting instructions.
+    values[i] = i % 4 == 0 ? x & (x >> 17) & (x >> 31) : i % 4 == 1 ? x >> (x & 63) : x;
+  }
+  values[0] = 0, values[1] = 1, values[2] = ~0ull, values[3] = 1ull << 63;
+
+  jj_cache* cache = jj_cache_new(1 << 20, 0, 0);
+  jj_ctx ctx;
+  jj_init(&ctx, 4096);
+
+  // The tail of an odd byte count goes through rep movsb on both paths of `jj_gen_copy`.
+  const uint64_t bytes = count * 8 - 3;
+  memset(expected_copy, 0xcc, sizeof(expected_copy));
+  const uint64_t expected = bits_c(values, count, expected_copy, bytes);
+
+  uint32_t variants = 0, mismatches = 0;
+  for (uint32_t subset = detected & relevant; ; subset = (subset - 1) & detected & relevant) {
+    jj_cpu_limit(~relevant | subset);
+    jj_reset(&ctx);
+    emit_bits(&ctx);
+    uint64_t (*bits)(const uint64_t*, uint64_t, uint64_t*, uint64_t) = jj_cache_install(cache, &ctx);
+    jj_cache_flush(cache);
+
+    char name[64] = "baseline";
+    for (int feature = 0, length = 0; feature < jj_cpu__count; feature++) {
+      if (!(subset & (1u << feature))) continue;
+      length += snprintf(name + length, sizeof(name) - length, "%s%s", length ? "," : "", jj_cpu_name(feature));
+    }
+    jj_debug_name(bits, ctx.ip - ctx.base, "bits %s", name);
+
+    memset(copy, 0xcc, sizeof(copy));
+    const uint64_t start = now_ns();
+    uint64_t result = 0;
+    for (int round = 0; round < rounds; round++) result = bits(values, count, copy, bytes);
+    const uint64_t elapsed = now_ns() - start;
+    const bool ok = result == expected && memcmp(copy, expected_copy, sizeof(copy)) == 0;
+
+    printf("  %-32s %4zu bytes %6.2f ns/value  %s\n",
+      name, (size_t)(ctx.ip - ctx.base), (double)elapsed / rounds / count, ok ? "ok" : "MISMATCH");
+    variants++;
+    mismatches += !ok;
+    if (!subset) break;
+  }
+  jj_cpu_limit(~0u);
+
+  printf("%u variants, %u mismatches, result = %016" PRIx64 "\n", variants, mismatches, expected);
+
+  jj_destroy(&ctx);
+  jj_cache_delete(cache);
 }
 
-void jj_dump_disas(jj_ctx* ctx) {
-  FILE* out = fopen("./.jj.dump", "wb");
-  fwrite(ctx->base, 1, ctx->ip - ctx->base, out);
-  fclose(out);
+/** Encodes random operands for every table row and decodes them back, then measures decoding speed. */
+static void fuzz_demo(uint32_t iterations) {
+  const uint64_t start = now_ns();
+  const uint32_t mismatches = jj_fuzz_roundtrip(iterations, 42);
+  const uint64_t elapsed = now_ns() - start;
+  printf("%u rounds over every table row in %.1f ms, %u mismatches\n", iterations, elapsed / 1e6, mismatches);
+
+  jj_ctx ctx;
+  jj_init(&ctx, 1 << 20);
+  while (ctx.ip - ctx.base < (1 << 20) - 64) {
+    jj_mov_r_m(&ctx, jj_rax, jj_addr(jj_rsi, jj_rcx, jj_s8, 0x40));
+    jj_add_r_i8(&ctx, jj_r12, 1);
+    jj_lea_r_m(&ctx, jj_rdx, jj_addr(jj_rax, jj_rax, jj_s4, 0));
+    jj_vpaddd_y_y_y(&ctx, jj_ymm1, jj_ymm2, jj_ymm3);
+  }
 
-  system(
-    "objdump -D -b binary -M intel,x86-64 -m i386 -j .data ./.jj.dump | awk -F'\n' '$0 ~ /<\\.data>/,0';"
-    "rm ./.jj.dump;"
-  );
-  printf("\n");
+  jj_decoded insn;
+  const size_t size = ctx.ip - ctx.base;
+  uint64_t count = 0;
+  const uint64_t decode_start = now_ns();
+  for (size_t at = 0; at < size; count++) {
+    at += jj_decode(ctx.base + at, size - at, at, &insn);
+  }
+  const uint64_t decode_elapsed = now_ns() - decode_start;
+  printf("decoded %" PRIu64 " instructions at %.1f ns/insn\n", count, (double)decode_elapsed / count);
+  jj_destroy(&ctx);
 }
 
-int main() {
-  uint32_t page_size = getpagesize();
+int main(int argc, char* argv[]) {
+  // JJ_DEBUG=perf,jitdump,gdb in any combination.
+  const char* debug = getenv("JJ_DEBUG");
+  if (debug) {
+    jj_debug_enable((strstr(debug, "perf") ? jj_debug_perf_map : 0) | (strstr(debug, "jitdump") ? jj_debug_jitdump : 0)
+      | (strstr(debug, "gdb") ? jj_debug_gdb : 0));
+  }
+
+  // JJ_CPU=baseline or JJ_CPU=popcnt,bmi2 pretends only those features are there, for reproducible runs.
+  const char* cpu = getenv("JJ_CPU");
+  if (cpu) jj_cpu_limit(parse_features(cpu));
+
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "cache") == 0) {
+    cache_demo();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "avx") == 0) {
+    avx_demo();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "peephole") == 0) {
+    peephole_demo();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "regalloc") == 0) {
+    regalloc_demo(argc > 2 && strcmp(argv[2], "-v") == 0);
+    return 0;
+  }
 
-  const uint64_t prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-  const uint64_t flags = MAP_PRIVATE | MAP_ANONYMOUS;
-  uint8_t* const page = mmap(0, page_size, prot, flags, -1, 0);
-  if (page == MAP_FAILED) {
-    perror("mmap");
-    return 1;
+  if (argc > 1 && strcmp(argv[1], "expr") == 0) {
+    const bool verbose = argc > 2 && strcmp(argv[argc - 1], "-v") == 0;
+    expr_demo(argc > 2 + verbose ? argv[2] : 0, verbose);
+    return 0;
   }
 
-  jj_ctx __ctx = {page, page};
+  if (argc > 1 && strcmp(argv[1], "cpu") == 0) {
+    cpu_demo();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "fuzz") == 0) {
+    fuzz_demo(argc > 2 ? strtoul(argv[2], 0, 0) : 1000);
+    return 0;
+  }
+
+  jj_cache* cache = jj_cache_new(16 << 20, 0, 0);
+
+  jj_ctx __ctx;
   jj_ctx* ctx = &__ctx;
+  jj_init(ctx, 4096);
 
   jj_prologue(ctx, 0x100);
-  jj_sub(ctx, jj_mkmem(jj_rsi, jj_rNONE, jj_s1, 0), jj_mkimm(0x700));
-  jj_xor(ctx, jj_mkreg(jj_rax), jj_mkreg(jj_rax));
-  jj_add(ctx, jj_mkreg(jj_rax), jj_mkreg(jj_rdi));
-  jj_lea(ctx, jj_mkreg(jj_rax), jj_mkmem(jj_rax, jj_rax, jj_s4, 0));
-  jj_lea(ctx, jj_mkreg(jj_rax), jj_mkmem(jj_rax, jj_rax, jj_s1, 0));
+  jj_sub_m_i32(ctx, jj_addr(jj_rsi, jj_rNONE, jj_s1, 0), 0x700);
+  jj_xor_r_r(ctx, jj_rax, jj_rax);
+  jj_add_r_r(ctx, jj_rax, jj_rdi);
+  jj_lea_r_m(ctx, jj_rax, jj_addr(jj_rax, jj_rax, jj_s4, 0));
+  jj_emit(ctx, lea, jj_mkreg(jj_rax), jj_mkmem(jj_rax, jj_rax, jj_s1, 0));
   jj_epilogue(ctx);
 
+  // uint64_t sum(const uint64_t* values, uint64_t count) { ... return total * scale; }
+  jj_align(ctx, 16);
+  const jj_label sum = jj_label_new(ctx);
+  const jj_label loop = jj_label_new(ctx);
+  const jj_label done = jj_label_new(ctx);
+  const jj_label scale = jj_label_new(ctx);
+  jj_label_bind(ctx, sum);
+  jj_xor_r_r(ctx, jj_rax, jj_rax);
+  jj_test_r_r(ctx, jj_rsi, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_e, done);
+  jj_label_bind(ctx, loop);
+  jj_add_r_m(ctx, jj_rax, jj_addr(jj_rdi, jj_rNONE, jj_s1, 0));
+  jj_add_r_i8(ctx, jj_rdi, 8);
+  jj_dec_r(ctx, jj_rsi);
+  jj_jcc_l(ctx, jj_cc_ne, loop);
+  jj_label_bind(ctx, done);
+  jj_imul_r_m(ctx, jj_rax, jj_rip(scale));
+  jj_ret(ctx);
+  jj_align(ctx, 8);
+  jj_label_bind(ctx, scale);
+  jj_data(ctx, &(uint64_t){3}, sizeof(uint64_t));
+
+  uint8_t* code = jj_cache_install(cache, ctx);
+  jj_cache_flush(cache);
+  jj_debug_name(code, jj_label_offset(ctx, sum), "demo");
+  jj_debug_name(code + jj_label_offset(ctx, sum), ctx->ip - ctx->base - jj_label_offset(ctx, sum), "sum");
   jj_dump_disas(ctx);
 
-  uint64_t (*fn)(uint64_t x, uint64_t* y) = (void*)ctx->base;
+  uint64_t (*fn)(uint64_t x, uint64_t* y) = (void*)code;
   uint64_t arg = 0x900;
   uint64_t ret = fn(100, &arg);
   printf("ret = %" PRIu64 "\narg = 0x%" PRIx64 "\n", ret, arg);
 
+  uint64_t (*sum_fn)(const uint64_t* values, uint64_t count) = (void*)(code + jj_label_offset(ctx, sum));
+  const uint64_t values[] = {1, 2, 3, 4};
+  printf("sum = %" PRIu64 "\n", sum_fn(values, 4));
+
+  jj_destroy(ctx);
+  jj_cache_delete(cache);
+
   return 0;
 }
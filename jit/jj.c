@@ -0,0 +1,356 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jj.h"
+
+/**********************/
+/* generic table rows */
+/**********************/
+
+// Adapters from `const jj_op*` to the typed signature of every generated function.
+#define JJ__THUNK_OPS_r_r(mn, kinds)           jj_##mn##kinds(ctx, ops[0].reg, ops[1].reg)
+#define JJ__THUNK_OPS_m_r(mn, kinds)           jj_##mn##kinds(ctx, ops[0].mem, ops[1].reg)
+#define JJ__THUNK_OPS_r_m(mn, kinds)           jj_##mn##kinds(ctx, ops[0].reg, ops[1].mem)
+#define JJ__THUNK_OPS_r_i8(mn, kinds)          jj_##mn##kinds(ctx, ops[0].reg, (int8_t)ops[1].imm)
+#define JJ__THUNK_OPS_r_i32(mn, kinds)         jj_##mn##kinds(ctx, ops[0].reg, (int32_t)ops[1].imm)
+#define JJ__THUNK_OPS_r_i64(mn, kinds)         jj_##mn##kinds(ctx, ops[0].reg, (int64_t)ops[1].imm)
+#define JJ__THUNK_OPS_m_i8(mn, kinds)          jj_##mn##kinds(ctx, ops[0].mem, (int8_t)ops[1].imm)
+#define JJ__THUNK_OPS_m_i32(mn, kinds)         jj_##mn##kinds(ctx, ops[0].mem, (int32_t)ops[1].imm)
+#define JJ__THUNK_OPS_r_r_i8(mn, kinds)        jj_##mn##kinds(ctx, ops[0].reg, ops[1].reg, (int8_t)ops[2].imm)
+#define JJ__THUNK_OPS_r_r_i32(mn, kinds)       jj_##mn##kinds(ctx, ops[0].reg, ops[1].reg, (int32_t)ops[2].imm)
+#define JJ__THUNK_OPS_r_cl(mn, kinds)          jj_##mn##kinds(ctx, ops[0].reg)
+#define JJ__THUNK_OPS_r(mn, kinds)             jj_##mn##kinds(ctx, ops[0].reg)
+#define JJ__THUNK_OPS_m(mn, kinds)             jj_##mn##kinds(ctx, ops[0].mem)
+#define JJ__THUNK_OPS_i8(mn, kinds)            jj_##mn##kinds(ctx, (int8_t)ops[0].imm)
+#define JJ__THUNK_OPS_i32(mn, kinds)           jj_##mn##kinds(ctx, (int32_t)ops[0].imm)
+#define JJ__THUNK_OPS(mn, kinds)               ((void)ops, jj_##mn##kinds(ctx))
+
+#define JJ__THUNK(mn, kinds, ...) \
+  static void jj__thunk_##mn##kinds(jj_ctx* ctx, const jj_op* ops) { JJ__THUNK_OPS##kinds(mn, kinds); }
+JJ_INSNS(JJ__THUNK)
+#undef JJ__THUNK
+
+typedef struct jj__row jj__row;
+struct jj__row {
+  jj_mnemonic mn;
+  const char* kinds;
+  bool w;
+  void (*emit)(jj_ctx* ctx, const jj_op* ops);
+};
+
+static const char* const jj__mnemonics[] = {
+#define JJ__NAME(mn) #mn,
+  JJ_MNEMONICS(JJ__NAME)
+#undef JJ__NAME
+};
+
+static const jj__row jj__rows[] = {
+#define JJ__ROW(mn, kinds, en, prefix, w, ...) { jj_mn_##mn, #kinds, w, jj__thunk_##mn##kinds },
+  JJ_INSNS(JJ__ROW)
+#undef JJ__ROW
+};
+
+static bool jj__match_kind(const char* kind, size_t length, bool w, jj_op op) {
+  if (length == 1 && kind[0] == 'r') return op.type == 'r';
+  if (length == 1 && kind[0] == 'm') return op.type == 'm';
+  if (length == 2 && memcmp(kind, "cl", 2) == 0) return op.type == 'r' && op.reg == jj_rcx;
+  if (op.type != 'i') return false;
+
+  // Immediates are sign-extended to operand size, except when operand size is 32 bit: the upper half is zeroed.
+  const int64_t imm = op.imm;
+  if (length == 2 && memcmp(kind, "i8", 2) == 0) return imm == (int8_t)imm;
+  if (length == 3 && memcmp(kind, "i32", 3) == 0) return imm == (int32_t)imm || (!w && op.imm <= UINT32_MAX);
+  if (length == 3 && memcmp(kind, "i64", 3) == 0) return true;
+
+  return false;
+}
+
+static bool jj__match(const jj__row* row, const jj_op* ops, int count) {
+  // `kinds` looks like "_r_i32", every '_' starts one operand.
+  const char* kind = row->kinds;
+  int i = 0;
+  while (*kind) {
+    kind++;
+    const char* end = kind + strcspn(kind, "_");
+    if (i == count || !jj__match_kind(kind, end - kind, row->w, ops[i])) return false;
+    i++;
+    kind = end;
+  }
+  return i == count;
+}
+
+bool jj__encodable(jj_mnemonic mn, const jj_op* ops, int count) {
+  for (size_t i = 0; i < sizeof(jj__rows) / sizeof(jj__rows[0]); i++) {
+    if (jj__rows[i].mn == mn && jj__match(&jj__rows[i], ops, count)) return true;
+  }
+  return false;
+}
+
+void jj__emit(jj_ctx* ctx, jj_mnemonic mn, const jj_op* ops, int count) {
+  for (size_t i = 0; i < sizeof(jj__rows) / sizeof(jj__rows[0]); i++) {
+    const jj__row* row = &jj__rows[i];
+    if (row->mn == mn && jj__match(row, ops, count)) {
+      row->emit(ctx, ops);
+      return;
+    }
+  }
+
+  DIE("bad operands for %s", jj__mnemonics[mn]);
+}
+
+/****************/
+/* code buffers */
+/****************/
+
+void jj_init(jj_ctx* ctx, size_t capacity) {
+  *ctx = (jj_ctx){0};
+  ctx->base = malloc(capacity);
+  if (!ctx->base) DIE("out of memory");
+  ctx->ip = ctx->base;
+  ctx->end = ctx->base + capacity;
+}
+
+void jj_reset(jj_ctx* ctx) {
+  ctx->ip = ctx->base;
+  ctx->labels_length = 0;
+  ctx->fixups_length = 0;
+}
+
+void jj_destroy(jj_ctx* ctx) {
+  free(ctx->base);
+  free(ctx->labels);
+  free(ctx->fixups);
+  *ctx = (jj_ctx){0};
+}
+
+void jj__grow_code(jj_ctx* ctx, size_t size) {
+  // Everything refers to code by offsets, so the buffer can move.
+  const size_t length = ctx->ip - ctx->base;
+  size_t capacity = ctx->end - ctx->base;
+  if (!capacity) capacity = 4096;
+  while (capacity - length < size) capacity *= 2;
+
+  uint8_t* base = realloc(ctx->base, capacity);
+  if (!base) DIE("out of memory");
+  ctx->base = base;
+  ctx->ip = base + length;
+  ctx->end = base + capacity;
+}
+
+/*********************/
+/* labels and fixups */
+/*********************/
+
+static void* jj__grow(void* array, uint32_t* capacity, uint32_t length, size_t item_size) {
+  if (length < *capacity) return array;
+
+  *capacity = *capacity ? *capacity * 2 : 16;
+  array = realloc(array, *capacity * item_size);
+  if (!array) DIE("out of memory");
+  return array;
+}
+
+static void jj__fixup_add(jj_ctx* ctx, char kind, uint8_t size, uint8_t arg, jj_label label) {
+  ctx->fixups = jj__grow(ctx->fixups, &ctx->fixups_capacity, ctx->fixups_length, sizeof(jj__fixup));
+  ctx->fixups[ctx->fixups_length++] = (jj__fixup){
+    .at = ctx->ip - ctx->base, .kind = kind, .size = size, .arg = arg, .label = label
+  };
+}
+
+void jj__fixup_rip(jj_ctx* ctx, jj_label label, uint8_t tail) {
+  jj__fixup_add(ctx, 'r', 4, tail, label);
+}
+
+jj_label jj_label_new(jj_ctx* ctx) {
+  ctx->labels = jj__grow(ctx->labels, &ctx->labels_capacity, ctx->labels_length, sizeof(int32_t));
+  ctx->labels[ctx->labels_length] = -1;
+  return ctx->labels_length++;
+}
+
+void jj_label_bind(jj_ctx* ctx, jj_label label) {
+  if (label >= ctx->labels_length) DIE("unknown label %u", label);
+  if (ctx->labels[label] != -1) DIE("label %u is already bound", label);
+  ctx->labels[label] = ctx->ip - ctx->base;
+}
+
+uint32_t jj_label_offset(jj_ctx* ctx, jj_label label) {
+  if (label >= ctx->labels_length || ctx->labels[label] == -1) DIE("label %u is not bound", label);
+  return ctx->labels[label];
+}
+
+void jj_jmp_l(jj_ctx* ctx, jj_label label) {
+  // E9 cd | JMP rel32 | Jump near, relative, RIP = RIP + 32-bit displacement sign extended to 64-bits.
+  jj__reserve(ctx, 5);
+  jj__fixup_add(ctx, 'j', 5, 0, label);
+  *ctx->ip++ = 0xe9;
+  jj__id(ctx, 0);
+}
+
+void jj_jcc_l(jj_ctx* ctx, jj_cond cond, jj_label label) {
+  // 0F 80+cc cd | Jcc rel32 | Jump near if condition is met.
+  jj__reserve(ctx, 6);
+  jj__fixup_add(ctx, 'c', 6, cond, label);
+  *ctx->ip++ = 0x0f;
+  *ctx->ip++ = 0x80 + cond;
+  jj__id(ctx, 0);
+}
+
+void jj_call_l(jj_ctx* ctx, jj_label label) {
+  // E8 cd | CALL rel32 | Call near, relative, displacement relative to next instruction.
+  jj__reserve(ctx, 5);
+  jj__fixup_add(ctx, 'l', 5, 0, label);
+  *ctx->ip++ = 0xe8;
+  jj__id(ctx, 0);
+}
+
+void jj_call_abs(jj_ctx* ctx, const void* fn) {
+  jj_mov_r_i64(ctx, jj_r11, (int64_t)fn);
+  jj_call_r(ctx, jj_r11);
+}
+
+void jj_align(jj_ctx* ctx, uint8_t alignment) {
+  if (!alignment || (alignment & (alignment - 1)) || alignment > 64) DIE("bad alignment %u", alignment);
+
+  // Reserve the worst case, branches only shrink so the padding never needs more.
+  jj__reserve(ctx, alignment - 1);
+  jj__fixup_add(ctx, 'a', alignment - 1, alignment, 0);
+  memset(ctx->ip, 0x90, alignment - 1);
+  ctx->ip += alignment - 1;
+}
+
+void jj_data(jj_ctx* ctx, const void* data, size_t size) {
+  jj__reserve(ctx, size);
+  memcpy(ctx->ip, data, size);
+  ctx->ip += size;
+}
+
+static uint8_t jj__branch_size(char kind, bool near) {
+  if (kind == 'l') return 5;
+  if (!near) return 2;
+  return kind == 'c' ? 6 : 5;
+}
+
+/** Maps offset of the code before relaxation to the offset after it. */
+static uint32_t jj__moved(const jj_ctx* ctx, const int32_t* shifts, uint32_t offset) {
+  // `shifts[i]` is the total change of size of fixups [0, i), find the first fixup at or after `offset`.
+  uint32_t lo = 0, hi = ctx->fixups_length;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (ctx->fixups[mid].at < offset) lo = mid + 1; else hi = mid;
+  }
+  return offset + shifts[lo];
+}
+
+void jj_finalize(jj_ctx* ctx) {
+  const uint32_t count = ctx->fixups_length;
+  jj__fixup* const fixups = ctx->fixups;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (fixups[i].kind != 'a' && ctx->labels[fixups[i].label] == -1) DIE("label %u is not bound", fixups[i].label);
+  }
+
+  uint8_t* sizes = malloc(count + 1);
+  uint32_t* positions = malloc(sizeof(uint32_t) * (count + 1));
+  int32_t* shifts = malloc(sizeof(int32_t) * (count + 1));
+
+  // Start with every jmp/jcc short and grow the ones which don't reach. Sizes only grow, so it terminates.
+  for (uint32_t i = 0; i < count; i++) {
+    sizes[i] = fixups[i].kind == 'a' ? 0 : fixups[i].kind == 'r' ? 4 : jj__branch_size(fixups[i].kind, false);
+  }
+
+  for (bool changed = true; changed; ) {
+    changed = false;
+
+    int32_t shift = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      shifts[i] = shift;
+      positions[i] = fixups[i].at + shift;
+      if (fixups[i].kind == 'a') sizes[i] = -positions[i] & (fixups[i].arg - 1);
+      shift += sizes[i] - fixups[i].size;
+    }
+    shifts[count] = shift;
+
+    for (uint32_t i = 0; i < count; i++) {
+      if ((fixups[i].kind != 'j' && fixups[i].kind != 'c') || sizes[i] != 2) continue;
+
+      const int64_t target = jj__moved(ctx, shifts, ctx->labels[fixups[i].label]);
+      const int64_t rel = target - (positions[i] + 2);
+      if (rel != (int8_t)rel) {
+        sizes[i] = jj__branch_size(fixups[i].kind, true);
+        changed = true;
+      }
+    }
+  }
+
+  // Every fixup is now at most as large as in the buffer, so code moves only backwards and in place.
+  uint8_t* const code = ctx->base;
+  uint8_t* dst = code;
+  uint32_t src = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const jj__fixup* fixup = &fixups[i];
+    memmove(dst, code + src, fixup->at - src);
+    dst += fixup->at - src;
+    src = fixup->at + fixup->size;
+
+    if (fixup->kind == 'a') {
+      memset(dst, 0x90, sizes[i]);
+      dst += sizes[i];
+      continue;
+    }
+
+    const int64_t target = jj__moved(ctx, shifts, ctx->labels[fixup->label]);
+    const int32_t end = positions[i] + sizes[i] + (fixup->kind == 'r' ? fixup->arg : 0);
+    const int32_t rel = target - end;
+
+    if (fixup->kind == 'r') {
+      memcpy(dst, &rel, 4);
+      dst += 4;
+      continue;
+    }
+
+    if (sizes[i] == 2) {
+      // EB cb | JMP rel8; 70+cc cb | Jcc rel8
+      *dst++ = fixup->kind == 'j' ? 0xeb : 0x70 + fixup->arg;
+      *dst++ = (int8_t)rel;
+      continue;
+    }
+
+    if (fixup->kind == 'c') *dst++ = 0x0f;
+    *dst++ = fixup->kind == 'j' ? 0xe9 : fixup->kind == 'l' ? 0xe8 : 0x80 + fixup->arg;
+    memcpy(dst, &rel, 4);
+    dst += 4;
+  }
+
+  const uint32_t tail = ctx->ip - code - src;
+  memmove(dst, code + src, tail);
+  ctx->ip = dst + tail;
+
+  for (uint32_t i = 0; i < ctx->labels_length; i++) {
+    if (ctx->labels[i] != -1) ctx->labels[i] = jj__moved(ctx, shifts, ctx->labels[i]);
+  }
+  ctx->fixups_length = 0;
+
+  free(sizes);
+  free(positions);
+  free(shifts);
+}
+
+
+/**********/
+/* frames */
+/**********/
+
+void jj_prologue(jj_ctx* ctx, uint32_t size) {
+  jj_push_r(ctx, jj_rbp);
+  jj_mov_r_r(ctx, jj_rbp, jj_rsp);
+  jj_sub_r_i32(ctx, jj_rsp, size);
+}
+
+void jj_epilogue(jj_ctx* ctx) {
+  jj_leave(ctx);
+  jj_ret(ctx);
+}
@@ -0,0 +1,1076 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIE(FORMAT, ...) do { fprintf(stderr, "%s: " FORMAT "\n", __func__, ##__VA_ARGS__); exit(1); } while(0)
+
+// 3.1.1.1 Opcode Column in the Instruction Summary Table (Instructions without VEX Prefix)
+// /digit — A digit between 0 and 7 indicates that the ModR/M byte of the instruction uses only the r/m (register
+//          or memory) operand. The reg field contains the digit that provides an extension to the instruction's opcode.
+// /r     — Indicates that the ModR/M byte of the instruction contains a register operand and an r/m operand.
+// cb, cw, cd, cp, co, ct — A 1-byte (cb), 2-byte (cw), 4-byte (cd), 6-byte (cp), 8-byte (co) or 10-byte (ct) value
+//          following the opcode. This value is used to specify a code offset and possibly a new value for the code segment
+//          register
+// ib, iw, id, io — A 1-byte (ib), 2-byte (iw), 4-byte (id) or 8-byte (io) immediate operand to the instruction that
+//          follows the opcode, ModR/M bytes or scale-indexing bytes. The opcode determines if the operand is a signed
+//          value. All words, doublewords and quadwords are given with the low-order byte first.
+// +rb, +rw, +rd, +ro — Indicated the lower 3 bits of the opcode byte is used to encode the register operand
+//          without a modR/M byte
+
+// 3.1.1.3 Instruction Column in the Opcode Summary Table
+// rel8   — A relative address in the range from 128 bytes before the end of the instruction to 127 bytes after the
+//          end of the instruction.
+// r32    — One of the doubleword general-purpose registers: EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI; or one of
+//          the doubleword registers (R8D - R15D) available when using REX.R in 64-bit mode
+// r64    — One of the quadword general-purpose registers: RAX, RBX, RCX, RDX, RDI, RSI, RBP, RSP, R8–R15.
+//          These are available when using REX.R and 64-bit mode.
+// imm8   — An immediate byte value. The imm8 symbol is a signed number between –128 and +127 inclusive.
+// imm32  — An immediate doubleword value used for instructions whose operand-size attribute is 32 bits.
+// r/m8   — A byte operand that is either the contents of a byte general-purpose register ... or a byte from memory.
+// r/m64  — A quadword general-purpose register or memory operand used for instructions whose operand-size attribute is 64 bits when using REX.W
+
+// Vol. 2A 2-5. Table 2-2. 32-Bit Addressing Forms with the ModR/M Byte
+// Bit 3 goes to REX.R/REX.X/REX.B, lower 3 bits go to ModR/M, SIB or opcode.
+typedef enum jj_reg jj_reg;
+enum jj_reg {
+  /** Passed as a placeholder when register is unused. */
+  jj_rNONE = 0b11111111,
+
+  /** Passed as a mask for /digit arguments. */
+  jj__rDIGIT = 0b10000000,
+
+  /** Used as `jj_mem.base` for RIP-relative addressing, see `jj_rip`. */
+  jj_rRIP = 0b11111110,
+
+  /** Virtual registers of `jj_ir` start here, see `jj_ir_vreg`. Never reach the encoder. */
+  jj__rVIRTUAL = 0x100,
+
+  jj_rax = 0b0000,
+  jj_rcx = 0b0001,
+  jj_rdx = 0b0010,
+  jj_rbx = 0b0011,
+  jj_rsp = 0b0100,
+  jj_rbp = 0b0101,
+  jj_rsi = 0b0110,
+  jj_rdi = 0b0111,
+  jj_r8  = 0b1000,
+  jj_r9  = 0b1001,
+  jj_r10 = 0b1010,
+  jj_r11 = 0b1011,
+  jj_r12 = 0b1100,
+  jj_r13 = 0b1101,
+  jj_r14 = 0b1110,
+  jj_r15 = 0b1111
+};
+
+/** Vector registers. xmmN, ymmN and zmmN are the same register, width comes from the instruction. */
+typedef enum jj_vreg jj_vreg;
+enum jj_vreg {
+  jj_xmm0 = 0, jj_xmm1, jj_xmm2, jj_xmm3, jj_xmm4, jj_xmm5, jj_xmm6, jj_xmm7,
+  jj_xmm8, jj_xmm9, jj_xmm10, jj_xmm11, jj_xmm12, jj_xmm13, jj_xmm14, jj_xmm15,
+
+  jj_ymm0 = 0, jj_ymm1, jj_ymm2, jj_ymm3, jj_ymm4, jj_ymm5, jj_ymm6, jj_ymm7,
+  jj_ymm8, jj_ymm9, jj_ymm10, jj_ymm11, jj_ymm12, jj_ymm13, jj_ymm14, jj_ymm15,
+
+  jj_zmm0 = 0, jj_zmm1, jj_zmm2, jj_zmm3, jj_zmm4, jj_zmm5, jj_zmm6, jj_zmm7,
+  jj_zmm8, jj_zmm9, jj_zmm10, jj_zmm11, jj_zmm12, jj_zmm13, jj_zmm14, jj_zmm15
+};
+
+/** Register numbers cross between `jj_reg` and `jj_vreg` only here: in `jj_op`, in allocators and in the encoder. */
+static inline jj_vreg jj_xmm(uint32_t n) { return (jj_vreg)n; }
+static inline jj_reg jj__vreg_num(jj_vreg reg) { return (jj_reg)reg; }
+
+typedef enum jj_scale jj_scale;
+enum jj_scale {
+  jj_s1 = 0b00000000,
+  jj_s2 = 0b01000000,
+  jj_s4 = 0b10000000,
+  jj_s8 = 0b11000000
+};
+
+typedef struct jj_mem jj_mem;
+struct jj_mem {
+  jj_reg base;
+  jj_reg index;
+  jj_scale scale;
+  int32_t disp;
+};
+
+typedef struct jj_op jj_op;
+struct jj_op {
+  char type; // 'r' - reg, 'm' - effective memory address, 'i' - immediate value
+  union {
+    jj_reg reg;
+    uint64_t imm;
+    jj_mem mem;
+  };
+};
+
+// Table B-1. Condition codes, low nibble of Jcc/SETcc/CMOVcc opcodes.
+typedef enum jj_cond jj_cond;
+enum jj_cond {
+  jj_cc_o  = 0x0,
+  jj_cc_no = 0x1,
+  jj_cc_b  = 0x2, // unsigned <
+  jj_cc_ae = 0x3, // unsigned >=
+  jj_cc_e  = 0x4,
+  jj_cc_ne = 0x5,
+  jj_cc_be = 0x6, // unsigned <=
+  jj_cc_a  = 0x7, // unsigned >
+  jj_cc_s  = 0x8,
+  jj_cc_ns = 0x9,
+  jj_cc_p  = 0xa,
+  jj_cc_np = 0xb,
+  jj_cc_l  = 0xc, // signed <
+  jj_cc_ge = 0xd, // signed >=
+  jj_cc_le = 0xe, // signed <=
+  jj_cc_g  = 0xf  // signed >
+};
+
+/** Index of a label inside `jj_ctx`. Labels are created unbound and bound to a position once. */
+typedef uint32_t jj_label;
+
+/**
+ * Everything which depends on final positions of labels: branches (which shrink to rel8 when possible),
+ * alignment padding and RIP-relative displacements. Patched by `jj_finalize`.
+ */
+typedef struct jj__fixup jj__fixup;
+struct jj__fixup {
+  uint32_t at;   // offset of instruction for 'j', 'c', 'l' and 'a'; offset of disp32 for 'r'
+  char kind;     // 'j' - jmp, 'c' - jcc, 'l' - call, 'r' - rip-relative disp32, 'a' - alignment
+  uint8_t size;  // bytes occupied in the buffer now ('r' always has 4)
+  uint8_t arg;   // condition for 'c', bytes between disp32 and end of instruction for 'r', alignment for 'a'
+  jj_label label;
+};
+
+typedef struct jj_ctx jj_ctx;
+struct jj_ctx {
+  uint8_t* ip;
+  uint8_t* base;
+  /** End of the buffer, it's reallocated when an instruction doesn't fit. */
+  uint8_t* end;
+
+  /** Offsets of labels from `base`, -1 while unbound. */
+  int32_t* labels;
+  uint32_t labels_length;
+  uint32_t labels_capacity;
+
+  /** Sorted by `at`, as they are recorded while emitting. */
+  jj__fixup* fixups;
+  uint32_t fixups_length;
+  uint32_t fixups_capacity;
+};
+
+static inline jj_mem jj_addr(jj_reg base, jj_reg index, jj_scale scale, int32_t disp) {
+  return (jj_mem){.base = base, .index = index, .scale = scale, .disp = disp};
+}
+
+/** [rip + disp32] where disp32 is patched to point at `label` by `jj_finalize`. */
+static inline jj_mem jj_rip(jj_label label) {
+  return (jj_mem){.base = jj_rRIP, .index = jj_rNONE, .scale = jj_s1, .disp = (int32_t)label};
+}
+
+static inline jj_op jj_mkreg(jj_reg reg) {
+  return (jj_op){.type = 'r', .reg = reg};
+}
+static inline jj_op jj_mkimm(uint64_t imm) {
+  return (jj_op){.type = 'i', .imm = imm};
+}
+static inline jj_op jj_mkmem(jj_reg base, jj_reg index, jj_scale scale, int32_t disp) {
+  return (jj_op){.type ='m', .mem = jj_addr(base, index, scale, disp)};
+}
+
+/*****************/
+/* byte emitters */
+/*****************/
+
+static inline void jj__ib(jj_ctx* ctx, int8_t imm) {
+  *ctx->ip++ = (uint8_t)imm;
+}
+
+// x86 is little-endian, so immediates are stored as is.
+static inline void jj__id(jj_ctx* ctx, int32_t imm) {
+  memcpy(ctx->ip, &imm, sizeof(imm));
+  ctx->ip += sizeof(imm);
+}
+
+static inline void jj__io(jj_ctx* ctx, int64_t imm) {
+  memcpy(ctx->ip, &imm, sizeof(imm));
+  ctx->ip += sizeof(imm);
+}
+
+static inline uint8_t jj__rexbit(jj_reg reg) {
+  // Placeholders (rNONE, rRIP, rDIGIT) have high bits set and never extend anything.
+  return (reg & 0b11110000) == 0 && (reg & 0b1000) ? 1 : 0;
+}
+
+void jj__fixup_rip(jj_ctx* ctx, jj_label label, uint8_t tail);
+
+__attribute__((cold)) void jj__grow_code(jj_ctx* ctx, size_t size);
+
+/** Any instruction is at most 15 bytes, so the check is done once per instruction, not per byte. */
+static inline void jj__reserve(jj_ctx* ctx, size_t size) {
+  if (__builtin_expect((size_t)(ctx->end - ctx->ip) < size, 0)) jj__grow_code(ctx, size);
+}
+
+// Table 2-4. REX Prefix Fields [BITS: 0100WRXB]
+// Legacy prefix goes first, then REX, then opcode. Opcodes above 0xff are multi-byte (0F xx, 0F 38 xx).
+static inline void jj__head(jj_ctx* ctx, uint8_t prefix, bool w, jj_reg r, jj_reg x, jj_reg b, uint32_t opcode) {
+  jj__reserve(ctx, 16);
+
+  // Local copy of ip: stores through uint8_t* may alias ctx->ip, the compiler would reload it after every byte.
+  uint8_t* ip = ctx->ip;
+  if (prefix) *ip++ = prefix;
+
+  const uint8_t rex = 0b01000000 | (w << 3) | (jj__rexbit(r) << 2) | (jj__rexbit(x) << 1) | jj__rexbit(b);
+  if (rex != 0b01000000) *ip++ = rex;
+
+  if (opcode > 0xffff) *ip++ = (opcode >> 16) & 0xff;
+  if (opcode > 0xff) *ip++ = (opcode >> 8) & 0xff;
+  *ip++ = opcode & 0xff;
+  ctx->ip = ip;
+}
+
+static inline void jj__encode_zo(jj_ctx* ctx, uint8_t prefix, bool w, uint32_t opcode) {
+  jj__head(ctx, prefix, w, jj_rNONE, jj_rNONE, jj_rNONE, opcode);
+}
+
+static inline void jj__encode_o(jj_ctx* ctx, uint8_t prefix, bool w, uint32_t opcode, jj_reg reg) {
+  jj__head(ctx, prefix, w, jj_rNONE, jj_rNONE, reg, opcode + (reg & 0b111));
+}
+
+static inline void jj__encode_r(jj_ctx* ctx, uint8_t prefix, bool w, uint32_t opcode, jj_reg reg, jj_reg rm, uint8_t tail) {
+  (void)tail;  // only RIP-relative displacements care what follows them
+  jj__head(ctx, prefix, w, reg, jj_rNONE, rm, opcode);
+  *ctx->ip++ = 0b11000000 | ((reg & 0b111) << 3) | (rm & 0b111);
+}
+
+/**
+ * ModR/M, SIB and displacement for a memory operand, shared by legacy, VEX and EVEX encodings.
+ * `scale` is N of EVEX compressed disp8 (disp8*N), 1 otherwise.
+ */
+static inline void jj__modrm_mem(jj_ctx* ctx, jj_reg reg, jj_mem rm, uint8_t tail, uint8_t scale) {
+  // 2.2.1.6 RIP-Relative Addressing: mod=00, r/m=101, disp32 from the end of instruction.
+  if (rm.base == jj_rRIP) {
+    *ctx->ip++ = ((reg & 0b111) << 3) | 0b101;
+    jj__fixup_rip(ctx, rm.disp, tail);
+    jj__id(ctx, 0);
+    return;
+  }
+
+  // rsp/r12 as base are only encodable via SIB, no base at all is SIB with base=101 and mod=00.
+  const bool has_sib = rm.index != jj_rNONE || rm.scale != jj_s1 || rm.base == jj_rNONE || (rm.base & 0b111) == jj_rsp;
+  // rbp/r13 as base with mod=00 mean RIP-relative (or disp32 in SIB), so they always need a displacement.
+  const uint8_t disp_size =
+    rm.base == jj_rNONE ? 4 :
+    rm.disp == 0 && (rm.base & 0b111) != jj_rbp ? 0 :
+    rm.disp % scale == 0 && rm.disp / scale == (int8_t)(rm.disp / scale) ? 1 : 4;
+  const uint8_t mod =
+    rm.base == jj_rNONE ? 0b00000000 :
+    disp_size == 0      ? 0b00000000 :
+    disp_size == 1      ? 0b01000000 :
+                          0b10000000;
+
+  uint8_t* ip = ctx->ip;
+  *ip++ = mod | ((reg & 0b111) << 3) | (has_sib ? 0b100 : (rm.base & 0b111));
+
+  if (has_sib) {
+    *ip++ = rm.scale
+      | ((rm.index == jj_rNONE ? 0b100 : (rm.index & 0b111)) << 3)
+      | (rm.base == jj_rNONE ? 0b101 : (rm.base & 0b111));
+  }
+  ctx->ip = ip;
+
+  if (disp_size == 1) {
+    jj__ib(ctx, rm.disp / scale);
+  } else if (disp_size == 4) {
+    jj__id(ctx, rm.disp);
+  }
+}
+
+static inline void jj__encode_m(jj_ctx* ctx, uint8_t prefix, bool w, uint32_t opcode, jj_reg reg, jj_mem rm, uint8_t tail) {
+  // 2.1.5 Addressing-Mode Encoding of ModR/M and SIB Bytes
+  if (rm.index == jj_rsp) DIE("rsp cannot be used as index for effective address");
+
+  jj__head(ctx, prefix, w, reg, rm.index, rm.base, opcode);
+  jj__modrm_mem(ctx, reg, rm, tail, 1);
+}
+
+/** Picks register or memory form of ModR/M by the static type of `rm`. */
+#define jj__encode_modrm(ctx, prefix, w, opcode, reg, rm, tail) \
+  _Generic((rm), jj_mem: jj__encode_m, default: jj__encode_r)(ctx, prefix, w, opcode, reg, rm, tail)
+
+/*********************/
+/* instruction table */
+/*********************/
+
+// Every row becomes a `static inline void jj_<mnemonic><kinds>(jj_ctx* ctx, ...)` with all table values folded
+// in as constants, so emitting an instruction is a handful of byte stores with no dispatch at runtime.
+//
+// Operand kinds (also the suffix of the generated function and its signature):
+//   _r    — r64, `jj_reg`
+//   _m    — m64, `jj_mem`
+//   _i8, _i32, _i64 — immediate of that size (ib, id, io)
+//   _cl   — implicit cl register, no argument
+//   (empty) — no operands
+//
+// Op/En column follows Intel's Instruction Operand Encoding tables:
+//   MR  — ModRM:r/m = op1, ModRM:reg = op2
+//   RM  — ModRM:reg = op1, ModRM:r/m = op2
+//   RMI — same as RM, followed by immediate
+//   MI, M, MC — ModRM:r/m = op1, ModRM:reg = /digit
+//   O, OI — op1 is added to the last opcode byte (+rd, +ro)
+//   I, ZO — no ModR/M at all
+//
+// Order matters for `jj_emit`: the first row with matching operands wins, so shorter forms go first.
+
+#define JJ__ALU(X, mn, base, digit) \
+  X(mn, _r_r,   MR, 0, 1, base + 1, r)     \
+  X(mn, _m_r,   MR, 0, 1, base + 1, r)     \
+  X(mn, _r_m,   RM, 0, 1, base + 3, r)     \
+  X(mn, _r_i8,  MI, 0, 1, 0x83,     digit) \
+  X(mn, _m_i8,  MI, 0, 1, 0x83,     digit) \
+  X(mn, _r_i32, MI, 0, 1, 0x81,     digit) \
+  X(mn, _m_i32, MI, 0, 1, 0x81,     digit)
+
+#define JJ__SHIFT(X, mn, digit) \
+  X(mn, _r_i8, MI, 0, 1, 0xc1, digit) \
+  X(mn, _r_cl, MC, 0, 1, 0xd3, digit)
+
+#define JJ__UNARY(X, mn, opcode, digit) \
+  X(mn, _r, M, 0, 1, opcode, digit) \
+  X(mn, _m, M, 0, 1, opcode, digit)
+
+#define JJ_INSNS(X) \
+  /* mnemonic, kinds, Op/En, prefix, REX.W, opcode, /digit */ \
+  X(mov,   _r_r,     MR,  0, 1, 0x89,   r) /* MOV r/m64, r64 */ \
+  X(mov,   _m_r,     MR,  0, 1, 0x89,   r) \
+  X(mov,   _r_m,     RM,  0, 1, 0x8b,   r) /* MOV r64, r/m64 */ \
+  X(mov,   _r_i32,   MI,  0, 1, 0xc7,   0) /* MOV r/m64, imm32 (sign-extended) */ \
+  X(mov,   _m_i32,   MI,  0, 1, 0xc7,   0) \
+  X(mov,   _r_i64,   OI,  0, 1, 0xb8,   _) /* MOV r64, imm64 */ \
+  X(mov32, _r_r,     MR,  0, 0, 0x89,   r) /* MOV r/m32, r32 (zero-extends) */ \
+  X(mov32, _r_i32,   OI,  0, 0, 0xb8,   _) /* MOV r32, imm32 (zero-extends) */ \
+  X(xor32, _r_r,     MR,  0, 0, 0x31,   r) /* XOR r/m32, r32 (zero-extends) */ \
+  X(lea,   _r_m,     RM,  0, 1, 0x8d,   r) /* LEA r64, m */ \
+  X(xchg,  _r_r,     MR,  0, 1, 0x87,   r) /* XCHG r/m64, r64 */ \
+  JJ__ALU(X, add, 0x00, 0) \
+  JJ__ALU(X, or,  0x08, 1) \
+  JJ__ALU(X, adc, 0x10, 2) \
+  JJ__ALU(X, sbb, 0x18, 3) \
+  JJ__ALU(X, and, 0x20, 4) \
+  JJ__ALU(X, sub, 0x28, 5) \
+  JJ__ALU(X, xor, 0x30, 6) \
+  JJ__ALU(X, cmp, 0x38, 7) \
+  X(test,  _r_r,     MR,  0, 1, 0x85,   r) /* TEST r/m64, r64 */ \
+  X(test,  _m_r,     MR,  0, 1, 0x85,   r) \
+  X(test,  _r_i32,   MI,  0, 1, 0xf7,   0) /* TEST r/m64, imm32 */ \
+  X(test,  _m_i32,   MI,  0, 1, 0xf7,   0) \
+  X(imul,  _r_r,     RM,  0, 1, 0x0faf, r) /* IMUL r64, r/m64 */ \
+  X(imul,  _r_m,     RM,  0, 1, 0x0faf, r) \
+  X(imul,  _r_r_i8,  RMI, 0, 1, 0x6b,   r) /* IMUL r64, r/m64, imm8 */ \
+  X(imul,  _r_r_i32, RMI, 0, 1, 0x69,   r) /* IMUL r64, r/m64, imm32 */ \
+  X(popcnt, _r_r,    RM,  0xf3, 1, 0x0fb8, r) /* POPCNT r64, r/m64 (POPCNT) */ \
+  X(popcnt, _r_m,    RM,  0xf3, 1, 0x0fb8, r) \
+  X(lzcnt, _r_r,     RM,  0xf3, 1, 0x0fbd, r) /* LZCNT r64, r/m64 (LZCNT) */ \
+  X(lzcnt, _r_m,     RM,  0xf3, 1, 0x0fbd, r) \
+  X(tzcnt, _r_r,     RM,  0xf3, 1, 0x0fbc, r) /* TZCNT r64, r/m64 (BMI1) */ \
+  X(tzcnt, _r_m,     RM,  0xf3, 1, 0x0fbc, r) \
+  X(bsr,   _r_r,     RM,  0, 1, 0x0fbd, r) /* BSR r64, r/m64 (destination undefined for 0) */ \
+  X(bsf,   _r_r,     RM,  0, 1, 0x0fbc, r) /* BSF r64, r/m64 */ \
+  JJ__UNARY(X, not,  0xf7, 2) \
+  JJ__UNARY(X, neg,  0xf7, 3) \
+  JJ__UNARY(X, mul,  0xf7, 4) \
+  JJ__UNARY(X, div,  0xf7, 6) \
+  JJ__UNARY(X, idiv, 0xf7, 7) \
+  JJ__UNARY(X, inc,  0xff, 0) \
+  JJ__UNARY(X, dec,  0xff, 1) \
+  JJ__SHIFT(X, rol, 0) \
+  JJ__SHIFT(X, ror, 1) \
+  JJ__SHIFT(X, shl, 4) \
+  JJ__SHIFT(X, shr, 5) \
+  JJ__SHIFT(X, sar, 7) \
+  X(push,  _r,       O,   0, 0, 0x50,   _) /* PUSH r64 */ \
+  X(push,  _m,       M,   0, 0, 0xff,   6) /* PUSH r/m64 */ \
+  X(push,  _i8,      I,   0, 0, 0x6a,   _) /* PUSH imm8 */ \
+  X(push,  _i32,     I,   0, 0, 0x68,   _) /* PUSH imm32 */ \
+  X(pop,   _r,       O,   0, 0, 0x58,   _) /* POP r64 */ \
+  X(pop,   _m,       M,   0, 0, 0x8f,   0) /* POP r/m64 */ \
+  X(call,  _r,       M,   0, 0, 0xff,   2) /* CALL r/m64 */ \
+  X(call,  _m,       M,   0, 0, 0xff,   2) \
+  X(jmp,   _r,       M,   0, 0, 0xff,   4) /* JMP r/m64 */ \
+  X(jmp,   _m,       M,   0, 0, 0xff,   4) \
+  X(cqo,   ,         ZO,  0, 1, 0x99,   _) /* CQO */ \
+  X(rep_movsb, ,     ZO,  0xf3, 0, 0xa4, _) /* REP MOVSB: rcx bytes from [rsi] to [rdi] */ \
+  X(rep_movsq, ,     ZO,  0xf3, 1, 0xa5, _) /* REP MOVSQ: rcx qwords */ \
+  X(ret,   ,         ZO,  0, 0, 0xc3,   _) /* RET */ \
+  X(leave, ,         ZO,  0, 0, 0xc9,   _) /* LEAVE */ \
+  X(nop,   ,         ZO,  0, 0, 0x90,   _) /* NOP */ \
+  X(int3,  ,         ZO,  0, 0, 0xcc,   _) /* INT3 */ \
+  X(ud2,   ,         ZO,  0, 0, 0x0f0b, _) /* UD2 */
+
+#define JJ_MNEMONICS(X) \
+  X(mov) X(mov32) X(xor32) X(lea) X(xchg) \
+  X(add) X(or) X(adc) X(sbb) X(and) X(sub) X(xor) X(cmp) X(test) \
+  X(imul) X(not) X(neg) X(mul) X(div) X(idiv) X(inc) X(dec) \
+  X(popcnt) X(lzcnt) X(tzcnt) X(bsr) X(bsf) \
+  X(rol) X(ror) X(shl) X(shr) X(sar) \
+  X(push) X(pop) X(call) X(jmp) X(cqo) X(rep_movsb) X(rep_movsq) X(ret) X(leave) X(nop) X(int3) X(ud2)
+
+typedef enum jj_mnemonic jj_mnemonic;
+enum jj_mnemonic {
+#define JJ__MNEMONIC(mn) jj_mn_##mn,
+  JJ_MNEMONICS(JJ__MNEMONIC)
+#undef JJ__MNEMONIC
+  jj_mn__count
+};
+
+#define JJ__DIGIT_0 0
+#define JJ__DIGIT_1 1
+#define JJ__DIGIT_2 2
+#define JJ__DIGIT_3 3
+#define JJ__DIGIT_4 4
+#define JJ__DIGIT_5 5
+#define JJ__DIGIT_6 6
+#define JJ__DIGIT_7 7
+#define JJ__DIGIT_r 0
+#define JJ__DIGIT__ 0
+
+#define JJ__ENC_MR(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_modrm(ctx, prefix, w, opcode, b, a, tail)
+#define JJ__ENC_RM(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_modrm(ctx, prefix, w, opcode, a, b, tail)
+#define JJ__ENC_RMI(ctx, prefix, w, opcode, digit, tail, a, b)  jj__encode_modrm(ctx, prefix, w, opcode, a, b, tail)
+#define JJ__ENC_MI(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_modrm(ctx, prefix, w, opcode, jj__rDIGIT | JJ__DIGIT_##digit, a, tail)
+#define JJ__ENC_M(ctx, prefix, w, opcode, digit, tail, a, b)    jj__encode_modrm(ctx, prefix, w, opcode, jj__rDIGIT | JJ__DIGIT_##digit, a, tail)
+#define JJ__ENC_MC(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_modrm(ctx, prefix, w, opcode, jj__rDIGIT | JJ__DIGIT_##digit, a, tail)
+#define JJ__ENC_O(ctx, prefix, w, opcode, digit, tail, a, b)    jj__encode_o(ctx, prefix, w, opcode, a)
+#define JJ__ENC_OI(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_o(ctx, prefix, w, opcode, a)
+#define JJ__ENC_I(ctx, prefix, w, opcode, digit, tail, a, b)    jj__encode_zo(ctx, prefix, w, opcode)
+#define JJ__ENC_ZO(ctx, prefix, w, opcode, digit, tail, a, b)   jj__encode_zo(ctx, prefix, w, opcode)
+
+// Each operand kind list gets its own signature. `prefix`, `w`, `opcode` and `digit` are macro parameters.
+#define JJ__DEFINE_r_r(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, b); }
+#define JJ__DEFINE_m_r(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_mem a, jj_reg b) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, b); }
+#define JJ__DEFINE_r_m(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_mem b) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, b); }
+#define JJ__DEFINE_r_i8(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, int8_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 1, a, jj_rNONE); jj__ib(ctx, imm); }
+#define JJ__DEFINE_r_i32(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, int32_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 4, a, jj_rNONE); jj__id(ctx, imm); }
+#define JJ__DEFINE_r_i64(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, int64_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 8, a, jj_rNONE); jj__io(ctx, imm); }
+#define JJ__DEFINE_m_i8(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_mem a, int8_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 1, a, jj_rNONE); jj__ib(ctx, imm); }
+#define JJ__DEFINE_m_i32(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_mem a, int32_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 4, a, jj_rNONE); jj__id(ctx, imm); }
+#define JJ__DEFINE_r_r_i8(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b, int8_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 1, a, b); jj__ib(ctx, imm); }
+#define JJ__DEFINE_r_r_i32(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b, int32_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 4, a, b); jj__id(ctx, imm); }
+#define JJ__DEFINE_r_cl(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, jj_rNONE); }
+#define JJ__DEFINE_r(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, jj_rNONE); }
+#define JJ__DEFINE_m(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_mem a) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, a, jj_rNONE); }
+#define JJ__DEFINE_i8(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, int8_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 1, jj_rNONE, jj_rNONE); jj__ib(ctx, imm); }
+#define JJ__DEFINE_i32(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, int32_t imm) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 4, jj_rNONE, jj_rNONE); jj__id(ctx, imm); }
+#define JJ__DEFINE(mn, kinds, en, prefix, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx) { JJ__ENC_##en(ctx, prefix, w, opcode, digit, 0, jj_rNONE, jj_rNONE); }
+
+#define JJ__DECLARE(mn, kinds, ...) JJ__DEFINE##kinds(mn, kinds, __VA_ARGS__)
+JJ_INSNS(JJ__DECLARE)
+#undef JJ__DECLARE
+
+/****************************/
+/* VEX and EVEX (AVX, AVX2, */
+/* FMA, AVX-512F) encodings */
+/****************************/
+
+// 2.3.5 The VEX Prefix. R, X, B and vvvv are stored inverted; the 2-byte form (C5) only has R.
+static inline void jj__vex(jj_ctx* ctx, bool l, uint8_t pp, uint8_t map, bool w, jj_reg r, jj_reg x, jj_reg b, jj_reg v, uint8_t opcode) {
+  jj__reserve(ctx, 16);
+
+  uint8_t* ip = ctx->ip;
+  const uint8_t vvvv = v == jj_rNONE ? 0 : (v & 0b1111);
+  const uint8_t last = ((~vvvv & 0b1111) << 3) | (l << 2) | pp;
+  if (!jj__rexbit(x) && !jj__rexbit(b) && !w && map == 1) {
+    *ip++ = 0xc5;
+    *ip++ = (!jj__rexbit(r) << 7) | last;
+  } else {
+    *ip++ = 0xc4;
+    *ip++ = (!jj__rexbit(r) << 7) | (!jj__rexbit(x) << 6) | (!jj__rexbit(b) << 5) | map;
+    *ip++ = (w << 7) | last;
+  }
+  *ip++ = opcode;
+  ctx->ip = ip;
+}
+
+// 2.7.1 Instruction Format and EVEX. Only zmm0-15 without masking, broadcast and rounding control:
+// R', V' are 1 (inverted 0), aaa = 000 (k0), z = 0, b = 0.
+static inline void jj__evex(jj_ctx* ctx, uint8_t ll, uint8_t pp, uint8_t map, bool w, jj_reg r, jj_reg x, jj_reg b, jj_reg v, uint8_t opcode) {
+  jj__reserve(ctx, 16);
+
+  uint8_t* ip = ctx->ip;
+  const uint8_t vvvv = v == jj_rNONE ? 0 : (v & 0b1111);
+  *ip++ = 0x62;
+  *ip++ = (!jj__rexbit(r) << 7) | (!jj__rexbit(x) << 6) | (!jj__rexbit(b) << 5) | (1 << 4) | map;
+  *ip++ = (w << 7) | ((~vvvv & 0b1111) << 3) | (1 << 2) | pp;
+  *ip++ = (ll << 5) | (1 << 3);
+  *ip++ = opcode;
+  ctx->ip = ip;
+}
+
+static inline void jj__vex_r(jj_ctx* ctx, bool l, uint8_t pp, uint8_t map, bool w, uint8_t opcode, jj_reg reg, jj_reg v, jj_reg rm, uint8_t tail) {
+  (void)tail;
+  jj__vex(ctx, l, pp, map, w, reg, jj_rNONE, rm, v, opcode);
+  *ctx->ip++ = 0b11000000 | ((reg & 0b111) << 3) | (rm & 0b111);
+}
+
+static inline void jj__vex_m(jj_ctx* ctx, bool l, uint8_t pp, uint8_t map, bool w, uint8_t opcode, jj_reg reg, jj_reg v, jj_mem rm, uint8_t tail) {
+  if (rm.index == jj_rsp) DIE("rsp cannot be used as index for effective address");
+  jj__vex(ctx, l, pp, map, w, reg, rm.index, rm.base, v, opcode);
+  jj__modrm_mem(ctx, reg, rm, tail, 1);
+}
+
+static inline void jj__evex_r(jj_ctx* ctx, bool l, uint8_t pp, uint8_t map, bool w, uint8_t opcode, jj_reg reg, jj_reg v, jj_reg rm, uint8_t tail) {
+  (void)l, (void)tail;  // EVEX rows are all 512 bits wide
+  jj__evex(ctx, 0b10, pp, map, w, reg, jj_rNONE, rm, v, opcode);
+  *ctx->ip++ = 0b11000000 | ((reg & 0b111) << 3) | (rm & 0b111);
+}
+
+static inline void jj__evex_m(jj_ctx* ctx, bool l, uint8_t pp, uint8_t map, bool w, uint8_t opcode, jj_reg reg, jj_reg v, jj_mem rm, uint8_t tail) {
+  (void)l;
+  if (rm.index == jj_rsp) DIE("rsp cannot be used as index for effective address");
+  jj__evex(ctx, 0b10, pp, map, w, reg, rm.index, rm.base, v, opcode);
+  // 2.7.5 Compressed Displacement: every instruction here reads a full 64 byte vector, so disp8 is scaled by 64.
+  jj__modrm_mem(ctx, reg, rm, tail, 64);
+}
+
+#define jj__vex_modrm(ctx, l, pp, map, w, opcode, reg, v, rm, tail) \
+  _Generic((rm), jj_mem: jj__vex_m, default: jj__vex_r)(ctx, l, pp, map, w, opcode, reg, v, rm, tail)
+#define jj__evex_modrm(ctx, l, pp, map, w, opcode, reg, v, rm, tail) \
+  _Generic((rm), jj_mem: jj__evex_m, default: jj__evex_r)(ctx, l, pp, map, w, opcode, reg, v, rm, tail)
+
+// Rows are like in JJ_INSNS, but kinds are:
+//   _x, _y, _z — xmm, ymm, zmm register, `jj_vreg`
+//   _r, _m, _i8 — same as in JJ_INSNS
+// and instead of legacy prefix and REX.W there are VEX fields: L (0 - 128 bit, 1 - 256 bit), pp (implied 66/F3/F2
+// prefix, NP - none), opcode map (0F, 0F38, 0F3A) and W. Op/En adds VEX.vvvv as V: RVM is reg, vvvv, r/m.
+// BMI1/BMI2 rows at the end are VEX encoded general purpose instructions, only usable when `jj_cpu_has` says so.
+#define JJ_VEX_INSNS(X) \
+  /* mnemonic,   kinds,      Op/En, L, pp, map,  W, opcode, /digit */ \
+  X(vmovdqu,     _x_m,       RM,    0, F3, 0F,   0, 0x6f,   r) /* VMOVDQU xmm1, m128 */ \
+  X(vmovdqu,     _y_m,       RM,    1, F3, 0F,   0, 0x6f,   r) \
+  X(vmovdqu,     _m_x,       MR,    0, F3, 0F,   0, 0x7f,   r) /* VMOVDQU m128, xmm1 */ \
+  X(vmovdqu,     _m_y,       MR,    1, F3, 0F,   0, 0x7f,   r) \
+  X(vmovdqa,     _x_x,       RM,    0, 66, 0F,   0, 0x6f,   r) /* VMOVDQA xmm1, xmm2/m128 */ \
+  X(vmovdqa,     _y_y,       RM,    1, 66, 0F,   0, 0x6f,   r) \
+  X(vmovups,     _x_m,       RM,    0, NP, 0F,   0, 0x10,   r) /* VMOVUPS xmm1, m128 */ \
+  X(vmovups,     _y_m,       RM,    1, NP, 0F,   0, 0x10,   r) \
+  X(vmovups,     _m_x,       MR,    0, NP, 0F,   0, 0x11,   r) /* VMOVUPS m128, xmm1 */ \
+  X(vmovups,     _m_y,       MR,    1, NP, 0F,   0, 0x11,   r) \
+  X(vmovd,       _x_r,       RM,    0, 66, 0F,   0, 0x6e,   r) /* VMOVD xmm1, r32 */ \
+  X(vmovd,       _x_m,       RM,    0, 66, 0F,   0, 0x6e,   r) /* VMOVD xmm1, m32 */ \
+  X(vmovd,       _r_x,       MR,    0, 66, 0F,   0, 0x7e,   r) /* VMOVD r32, xmm1 */ \
+  X(vmovq,       _x_r,       RM,    0, 66, 0F,   1, 0x6e,   r) /* VMOVQ xmm1, r64 */ \
+  X(vmovq,       _r_x,       MR,    0, 66, 0F,   1, 0x7e,   r) /* VMOVQ r64, xmm1 */ \
+  X(vpbroadcastd,_x_x,       RM,    0, 66, 0F38, 0, 0x58,   r) /* VPBROADCASTD xmm1, xmm2/m32 (AVX2) */ \
+  X(vpbroadcastd,_y_x,       RM,    1, 66, 0F38, 0, 0x58,   r) \
+  X(vpbroadcastd,_y_m,       RM,    1, 66, 0F38, 0, 0x58,   r) \
+  X(vbroadcastss,_y_m,       RM,    1, 66, 0F38, 0, 0x18,   r) /* VBROADCASTSS ymm1, m32 */ \
+  X(vpaddb,      _y_y_y,     RVM,   1, 66, 0F,   0, 0xfc,   r) /* VPADDB ymm1, ymm2, ymm3/m256 (AVX2) */ \
+  X(vpaddd,      _x_x_x,     RVM,   0, 66, 0F,   0, 0xfe,   r) /* VPADDD */ \
+  X(vpaddd,      _y_y_y,     RVM,   1, 66, 0F,   0, 0xfe,   r) \
+  X(vpaddd,      _y_y_m,     RVM,   1, 66, 0F,   0, 0xfe,   r) \
+  X(vpaddq,      _x_x_x,     RVM,   0, 66, 0F,   0, 0xd4,   r) /* VPADDQ */ \
+  X(vpaddq,      _y_y_y,     RVM,   1, 66, 0F,   0, 0xd4,   r) \
+  X(vpsubd,      _y_y_y,     RVM,   1, 66, 0F,   0, 0xfa,   r) /* VPSUBD */ \
+  X(vpmulld,     _y_y_y,     RVM,   1, 66, 0F38, 0, 0x40,   r) /* VPMULLD */ \
+  X(vpmaddwd,    _y_y_y,     RVM,   1, 66, 0F,   0, 0xf5,   r) /* VPMADDWD */ \
+  X(vpsadbw,     _y_y_y,     RVM,   1, 66, 0F,   0, 0xf6,   r) /* VPSADBW */ \
+  X(vpsadbw,     _y_y_m,     RVM,   1, 66, 0F,   0, 0xf6,   r) \
+  X(vpand,       _y_y_y,     RVM,   1, 66, 0F,   0, 0xdb,   r) /* VPAND */ \
+  X(vpandn,      _y_y_y,     RVM,   1, 66, 0F,   0, 0xdf,   r) /* VPANDN */ \
+  X(vpor,        _y_y_y,     RVM,   1, 66, 0F,   0, 0xeb,   r) /* VPOR */ \
+  X(vpxor,       _x_x_x,     RVM,   0, 66, 0F,   0, 0xef,   r) /* VPXOR */ \
+  X(vpxor,       _y_y_y,     RVM,   1, 66, 0F,   0, 0xef,   r) \
+  X(vpcmpeqd,    _y_y_y,     RVM,   1, 66, 0F,   0, 0x76,   r) /* VPCMPEQD */ \
+  X(vpcmpgtd,    _y_y_y,     RVM,   1, 66, 0F,   0, 0x66,   r) /* VPCMPGTD */ \
+  X(vpminsd,     _y_y_y,     RVM,   1, 66, 0F38, 0, 0x39,   r) /* VPMINSD */ \
+  X(vpmaxsd,     _y_y_y,     RVM,   1, 66, 0F38, 0, 0x3d,   r) /* VPMAXSD */ \
+  X(vpslld,      _y_y_i8,    VMI,   1, 66, 0F,   0, 0x72,   6) /* VPSLLD ymm1, ymm2, imm8 */ \
+  X(vpsrld,      _y_y_i8,    VMI,   1, 66, 0F,   0, 0x72,   2) /* VPSRLD ymm1, ymm2, imm8 */ \
+  X(vpsrad,      _y_y_i8,    VMI,   1, 66, 0F,   0, 0x72,   4) /* VPSRAD ymm1, ymm2, imm8 */ \
+  X(vpshufd,     _x_x_i8,    RMI,   0, 66, 0F,   0, 0x70,   r) /* VPSHUFD xmm1, xmm2/m128, imm8 */ \
+  X(vpshufd,     _y_y_i8,    RMI,   1, 66, 0F,   0, 0x70,   r) \
+  X(vpshufb,     _y_y_y,     RVM,   1, 66, 0F38, 0, 0x00,   r) /* VPSHUFB */ \
+  X(vpermd,      _y_y_y,     RVM,   1, 66, 0F38, 0, 0x36,   r) /* VPERMD ymm1, ymm2, ymm3/m256 */ \
+  X(vpermq,      _y_y_i8,    RMI,   1, 66, 0F3A, 1, 0x00,   r) /* VPERMQ ymm1, ymm2/m256, imm8 */ \
+  X(vperm2i128,  _y_y_y_i8,  RVMI,  1, 66, 0F3A, 0, 0x46,   r) /* VPERM2I128 */ \
+  X(vextracti128,_x_y_i8,    MRI,   1, 66, 0F3A, 0, 0x39,   r) /* VEXTRACTI128 xmm1/m128, ymm2, imm8 */ \
+  X(vextractf128,_x_y_i8,    MRI,   1, 66, 0F3A, 0, 0x19,   r) /* VEXTRACTF128 xmm1/m128, ymm2, imm8 */ \
+  X(vinserti128, _y_y_x_i8,  RVMI,  1, 66, 0F3A, 0, 0x38,   r) /* VINSERTI128 ymm1, ymm2, xmm3/m128, imm8 */ \
+  X(vpmovmskb,   _r_y,       RM,    1, 66, 0F,   0, 0xd7,   r) /* VPMOVMSKB r32, ymm1 */ \
+  X(vmovmskps,   _r_y,       RM,    1, NP, 0F,   0, 0x50,   r) /* VMOVMSKPS r32, ymm2 */ \
+  X(vptest,      _y_y,       RM,    1, 66, 0F38, 0, 0x17,   r) /* VPTEST ymm1, ymm2/m256 */ \
+  X(vxorps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x57,   r) /* VXORPS */ \
+  X(vaddps,      _x_x_x,     RVM,   0, NP, 0F,   0, 0x58,   r) /* VADDPS */ \
+  X(vaddps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x58,   r) \
+  X(vaddps,      _y_y_m,     RVM,   1, NP, 0F,   0, 0x58,   r) \
+  X(vsubps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x5c,   r) /* VSUBPS */ \
+  X(vmulps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x59,   r) /* VMULPS */ \
+  X(vmulps,      _y_y_m,     RVM,   1, NP, 0F,   0, 0x59,   r) \
+  X(vdivps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x5e,   r) /* VDIVPS */ \
+  X(vminps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x5d,   r) /* VMINPS */ \
+  X(vmaxps,      _y_y_y,     RVM,   1, NP, 0F,   0, 0x5f,   r) /* VMAXPS */ \
+  X(vsqrtps,     _y_y,       RM,    1, NP, 0F,   0, 0x51,   r) /* VSQRTPS */ \
+  X(vcmpps,      _y_y_y_i8,  RVMI,  1, NP, 0F,   0, 0xc2,   r) /* VCMPPS ymm1, ymm2, ymm3/m256, imm8 */ \
+  X(vhaddps,     _x_x_x,     RVM,   0, F2, 0F,   0, 0x7c,   r) /* VHADDPS */ \
+  X(vaddpd,      _y_y_y,     RVM,   1, 66, 0F,   0, 0x58,   r) /* VADDPD */ \
+  X(vmulpd,      _y_y_y,     RVM,   1, 66, 0F,   0, 0x59,   r) /* VMULPD */ \
+  X(vmovsd,      _x_m,       RM,    0, F2, 0F,   0, 0x10,   r) /* VMOVSD xmm1, m64 */ \
+  X(vmovsd,      _m_x,       MR,    0, F2, 0F,   0, 0x11,   r) /* VMOVSD m64, xmm1 */ \
+  X(vaddsd,      _x_x_x,     RVM,   0, F2, 0F,   0, 0x58,   r) /* VADDSD xmm1, xmm2, xmm3/m64 */ \
+  X(vaddsd,      _x_x_m,     RVM,   0, F2, 0F,   0, 0x58,   r) \
+  X(vsubsd,      _x_x_x,     RVM,   0, F2, 0F,   0, 0x5c,   r) /* VSUBSD */ \
+  X(vsubsd,      _x_x_m,     RVM,   0, F2, 0F,   0, 0x5c,   r) \
+  X(vmulsd,      _x_x_x,     RVM,   0, F2, 0F,   0, 0x59,   r) /* VMULSD */ \
+  X(vmulsd,      _x_x_m,     RVM,   0, F2, 0F,   0, 0x59,   r) \
+  X(vdivsd,      _x_x_x,     RVM,   0, F2, 0F,   0, 0x5e,   r) /* VDIVSD */ \
+  X(vdivsd,      _x_x_m,     RVM,   0, F2, 0F,   0, 0x5e,   r) \
+  X(vucomisd,    _x_x,       RM,    0, 66, 0F,   0, 0x2e,   r) /* VUCOMISD xmm1, xmm2/m64 */ \
+  X(vucomisd,    _x_m,       RM,    0, 66, 0F,   0, 0x2e,   r) \
+  X(vcvtsi2sd,   _x_x_r,     RVM,   0, F2, 0F,   1, 0x2a,   r) /* VCVTSI2SD xmm1, xmm2, r/m64 */ \
+  X(vfmadd132ps, _y_y_y,     RVM,   1, 66, 0F38, 0, 0x98,   r) /* VFMADD132PS ymm1 = ymm1*ymm3 + ymm2 */ \
+  X(vfmadd213ps, _y_y_y,     RVM,   1, 66, 0F38, 0, 0xa8,   r) /* VFMADD213PS ymm1 = ymm2*ymm1 + ymm3 */ \
+  X(vfmadd231ps, _y_y_y,     RVM,   1, 66, 0F38, 0, 0xb8,   r) /* VFMADD231PS ymm1 = ymm2*ymm3 + ymm1 */ \
+  X(vfmadd231ps, _y_y_m,     RVM,   1, 66, 0F38, 0, 0xb8,   r) \
+  X(vfmadd231pd, _y_y_y,     RVM,   1, 66, 0F38, 1, 0xb8,   r) /* VFMADD231PD */ \
+  X(vfnmadd231ps,_y_y_y,     RVM,   1, 66, 0F38, 0, 0xbc,   r) /* VFNMADD231PS ymm1 = -(ymm2*ymm3) + ymm1 */ \
+  X(vzeroupper,  ,           ZO,    0, NP, 0F,   0, 0x77,   _) /* VZEROUPPER */ \
+  X(andn,        _r_r_r,     RVM,   0, NP, 0F38, 1, 0xf2,   r) /* ANDN r64a, r64b, r/m64: a = ~b & c (BMI1) */ \
+  X(blsr,        _r_r,       VM,    0, NP, 0F38, 1, 0xf3,   1) /* BLSR r64, r/m64: a = b & (b - 1) (BMI1) */ \
+  X(bzhi,        _r_r_r,     RMV,   0, NP, 0F38, 1, 0xf5,   r) /* BZHI r64a, r/m64, r64b (BMI2) */ \
+  X(pdep,        _r_r_r,     RVM,   0, F2, 0F38, 1, 0xf5,   r) /* PDEP r64a, r64b, r/m64 (BMI2) */ \
+  X(pext,        _r_r_r,     RVM,   0, F3, 0F38, 1, 0xf5,   r) /* PEXT r64a, r64b, r/m64 (BMI2) */ \
+  X(shlx,        _r_r_r,     RMV,   0, 66, 0F38, 1, 0xf7,   r) /* SHLX r64a, r/m64, r64b (BMI2) */ \
+  X(shrx,        _r_r_r,     RMV,   0, F2, 0F38, 1, 0xf7,   r) /* SHRX r64a, r/m64, r64b (BMI2) */ \
+  X(sarx,        _r_r_r,     RMV,   0, F3, 0F38, 1, 0xf7,   r) /* SARX r64a, r/m64, r64b (BMI2) */ \
+  X(rorx,        _r_r_i8,    RMI,   0, F2, 0F3A, 1, 0xf0,   r) /* RORX r64, r/m64, imm8 (BMI2) */
+
+// EVEX.512 rows, only to be used when `jj_cpu_has(jj_cpu_avx512f)`.
+#define JJ_EVEX_INSNS(X) \
+  /* mnemonic,     kinds,    Op/En, L, pp, map,  W, opcode, /digit */ \
+  X(vmovdqu32,     _z_m,     RM,    2, F3, 0F,   0, 0x6f,   r) /* VMOVDQU32 zmm1, m512 */ \
+  X(vmovdqu32,     _m_z,     MR,    2, F3, 0F,   0, 0x7f,   r) /* VMOVDQU32 m512, zmm1 */ \
+  X(vmovups,       _z_m,     RM,    2, NP, 0F,   0, 0x10,   r) /* VMOVUPS zmm1, m512 */ \
+  X(vpaddd,        _z_z_z,   RVM,   2, 66, 0F,   0, 0xfe,   r) /* VPADDD zmm1, zmm2, zmm3/m512 */ \
+  X(vpaddd,        _z_z_m,   RVM,   2, 66, 0F,   0, 0xfe,   r) \
+  X(vpaddq,        _z_z_z,   RVM,   2, 66, 0F,   1, 0xd4,   r) /* VPADDQ */ \
+  X(vpmulld,       _z_z_z,   RVM,   2, 66, 0F38, 0, 0x40,   r) /* VPMULLD */ \
+  X(vpandd,        _z_z_z,   RVM,   2, 66, 0F,   0, 0xdb,   r) /* VPANDD */ \
+  X(vpord,         _z_z_z,   RVM,   2, 66, 0F,   0, 0xeb,   r) /* VPORD */ \
+  X(vpxord,        _z_z_z,   RVM,   2, 66, 0F,   0, 0xef,   r) /* VPXORD */ \
+  X(vaddps,        _z_z_z,   RVM,   2, NP, 0F,   0, 0x58,   r) /* VADDPS */ \
+  X(vmulps,        _z_z_z,   RVM,   2, NP, 0F,   0, 0x59,   r) /* VMULPS */ \
+  X(vfmadd231ps,   _z_z_z,   RVM,   2, 66, 0F38, 0, 0xb8,   r) /* VFMADD231PS */ \
+  X(vfmadd231ps,   _z_z_m,   RVM,   2, 66, 0F38, 0, 0xb8,   r) \
+  X(vextracti64x4, _y_z_i8,  MRI,   2, 66, 0F3A, 1, 0x3b,   r) /* VEXTRACTI64X4 ymm1/m256, zmm2, imm8 */ \
+  X(vextractf32x8, _y_z_i8,  MRI,   2, 66, 0F3A, 0, 0x1b,   r) /* VEXTRACTF32X8 ymm1/m256, zmm2, imm8 (AVX512DQ) */
+
+#define JJ__PP_NP 0
+#define JJ__PP_66 1
+#define JJ__PP_F3 2
+#define JJ__PP_F2 3
+#define JJ__MAP_0F   1
+#define JJ__MAP_0F38 2
+#define JJ__MAP_0F3A 3
+
+#define JJ__VENC_RVM(enc, l, pp, map, w, opcode, digit, tail, a, b, c)  enc(ctx, l, pp, map, w, opcode, a, b, c, tail)
+#define JJ__VENC_RVMI(enc, l, pp, map, w, opcode, digit, tail, a, b, c) enc(ctx, l, pp, map, w, opcode, a, b, c, tail)
+#define JJ__VENC_RM(enc, l, pp, map, w, opcode, digit, tail, a, b, c)   enc(ctx, l, pp, map, w, opcode, a, jj_rNONE, b, tail)
+#define JJ__VENC_RMI(enc, l, pp, map, w, opcode, digit, tail, a, b, c)  enc(ctx, l, pp, map, w, opcode, a, jj_rNONE, b, tail)
+#define JJ__VENC_MR(enc, l, pp, map, w, opcode, digit, tail, a, b, c)   enc(ctx, l, pp, map, w, opcode, b, jj_rNONE, a, tail)
+#define JJ__VENC_MRI(enc, l, pp, map, w, opcode, digit, tail, a, b, c)  enc(ctx, l, pp, map, w, opcode, b, jj_rNONE, a, tail)
+#define JJ__VENC_RMV(enc, l, pp, map, w, opcode, digit, tail, a, b, c)  enc(ctx, l, pp, map, w, opcode, a, c, b, tail)
+#define JJ__VENC_VMI(enc, l, pp, map, w, opcode, digit, tail, a, b, c)  enc(ctx, l, pp, map, w, opcode, jj__rDIGIT | JJ__DIGIT_##digit, a, b, tail)
+#define JJ__VENC_VM(enc, l, pp, map, w, opcode, digit, tail, a, b, c)   enc(ctx, l, pp, map, w, opcode, jj__rDIGIT | JJ__DIGIT_##digit, a, b, tail)
+#define JJ__VENC_ZO(enc, l, pp, map, w, opcode, digit, tail, a, b, c)   jj__vex(ctx, l, pp, map, w, jj_rNONE, jj_rNONE, jj_rNONE, jj_rNONE, opcode)
+
+// Signatures by operand shape: V - vector register, R - general purpose register, M - memory, I - imm8.
+#define JJ__VSHAPE_VVV(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b, jj_vreg c) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), jj__vreg_num(b), jj__vreg_num(c)); }
+#define JJ__VSHAPE_VVM(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b, jj_mem c) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), jj__vreg_num(b), c); }
+#define JJ__VSHAPE_VVVI(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b, jj_vreg c, uint8_t imm) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 1, jj__vreg_num(a), jj__vreg_num(b), jj__vreg_num(c)); jj__ib(ctx, imm); }
+#define JJ__VSHAPE_VVI(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b, uint8_t imm) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 1, jj__vreg_num(a), jj__vreg_num(b), jj_rNONE); jj__ib(ctx, imm); }
+#define JJ__VSHAPE_VVR(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b, jj_reg c) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), jj__vreg_num(b), c); }
+#define JJ__VSHAPE_VV(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_vreg b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), jj__vreg_num(b), jj_rNONE); }
+#define JJ__VSHAPE_VM(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_mem b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), b, jj_rNONE); }
+#define JJ__VSHAPE_MV(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_mem a, jj_vreg b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, a, jj__vreg_num(b), jj_rNONE); }
+#define JJ__VSHAPE_VR(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_vreg a, jj_reg b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj__vreg_num(a), b, jj_rNONE); }
+#define JJ__VSHAPE_RV(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_vreg b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, a, jj__vreg_num(b), jj_rNONE); }
+#define JJ__VSHAPE_RRR(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b, jj_reg c) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, a, b, c); }
+#define JJ__VSHAPE_RRI(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b, uint8_t imm) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 1, a, b, jj_rNONE); jj__ib(ctx, imm); }
+#define JJ__VSHAPE_RR(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx, jj_reg a, jj_reg b) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, a, b, jj_rNONE); }
+#define JJ__VSHAPE_(enc, mn, kinds, en, l, pp, map, w, opcode, digit) \
+  static inline void jj_##mn##kinds(jj_ctx* ctx) { \
+    JJ__VENC_##en(enc, l, JJ__PP_##pp, JJ__MAP_##map, w, opcode, digit, 0, jj_rNONE, jj_rNONE, jj_rNONE); }
+
+#define JJ__VKINDS_x_x_x   VVV
+#define JJ__VKINDS_y_y_y   VVV
+#define JJ__VKINDS_z_z_z   VVV
+#define JJ__VKINDS_x_x_m   VVM
+#define JJ__VKINDS_y_y_m   VVM
+#define JJ__VKINDS_z_z_m   VVM
+#define JJ__VKINDS_x_x_r   VVR
+#define JJ__VKINDS_y_y_y_i8 VVVI
+#define JJ__VKINDS_y_y_x_i8 VVVI
+#define JJ__VKINDS_x_x_i8  VVI
+#define JJ__VKINDS_y_y_i8  VVI
+#define JJ__VKINDS_x_y_i8  VVI
+#define JJ__VKINDS_y_z_i8  VVI
+#define JJ__VKINDS_x_x     VV
+#define JJ__VKINDS_y_y     VV
+#define JJ__VKINDS_y_x     VV
+#define JJ__VKINDS_x_m     VM
+#define JJ__VKINDS_y_m     VM
+#define JJ__VKINDS_z_m     VM
+#define JJ__VKINDS_m_x     MV
+#define JJ__VKINDS_m_y     MV
+#define JJ__VKINDS_m_z     MV
+#define JJ__VKINDS_x_r     VR
+#define JJ__VKINDS_r_x     RV
+#define JJ__VKINDS_r_y     RV
+#define JJ__VKINDS_r_r_r   RRR
+#define JJ__VKINDS_r_r_i8  RRI
+#define JJ__VKINDS_r_r     RR
+#define JJ__VKINDS         
+
+#define JJ__VSHAPE(shape, ...) JJ__VSHAPE2(shape, __VA_ARGS__)
+#define JJ__VSHAPE2(shape, ...) JJ__VSHAPE_##shape(__VA_ARGS__)
+#define JJ__VDECLARE(mn, kinds, ...) JJ__VSHAPE(JJ__VKINDS##kinds, jj__vex_modrm, mn, kinds, __VA_ARGS__)
+#define JJ__EDECLARE(mn, kinds, ...) JJ__VSHAPE(JJ__VKINDS##kinds, jj__evex_modrm, mn, kinds, __VA_ARGS__)
+JJ_VEX_INSNS(JJ__VDECLARE)
+JJ_EVEX_INSNS(JJ__EDECLARE)
+#undef JJ__VDECLARE
+#undef JJ__EDECLARE
+
+/****************/
+/* code buffers */
+/****************/
+
+/** Code is emitted into a growable heap buffer and copied to executable memory by `jj_cache_install`. */
+void jj_init(jj_ctx* ctx, size_t capacity);
+/** Drops code, labels and fixups but keeps memory for the next function. */
+void jj_reset(jj_ctx* ctx);
+/** Releases buffer, labels and fixups. */
+void jj_destroy(jj_ctx* ctx);
+
+/**********************/
+/* generic operations */
+/**********************/
+
+/**
+ * Slow path for callers which only know operands at runtime: looks up the first table row of `mn`
+ * accepting given operands and emits it. Dies if nothing matches.
+ */
+void jj__emit(jj_ctx* ctx, jj_mnemonic mn, const jj_op* ops, int count);
+/** Whether some row of `mn` accepts `ops`. */
+bool jj__encodable(jj_mnemonic mn, const jj_op* ops, int count);
+
+#define jj_emit(ctx, mn, ...) \
+  jj__emit(ctx, jj_mn_##mn, (jj_op[]){__VA_ARGS__}, sizeof((jj_op[]){__VA_ARGS__}) / sizeof(jj_op))
+
+/*********************/
+/* labels and fixups */
+/*********************/
+
+jj_label jj_label_new(jj_ctx* ctx);
+void jj_label_bind(jj_ctx* ctx, jj_label label);
+/** Offset of a bound label from `ctx->base`. Final only after `jj_finalize`. */
+uint32_t jj_label_offset(jj_ctx* ctx, jj_label label);
+
+/** Branches are emitted as rel32 and relaxed to rel8 by `jj_finalize` when the target is close enough. */
+void jj_jmp_l(jj_ctx* ctx, jj_label label);
+void jj_jcc_l(jj_ctx* ctx, jj_cond cond, jj_label label);
+void jj_call_l(jj_ctx* ctx, jj_label label);
+/** Calls absolute address via r11, which is a scratch register in SysV ABI. */
+void jj_call_abs(jj_ctx* ctx, const void* fn);
+
+/** Pads with nops to `alignment` (power of two up to 64), padding is recomputed by `jj_finalize`. */
+void jj_align(jj_ctx* ctx, uint8_t alignment);
+void jj_data(jj_ctx* ctx, const void* data, size_t size);
+
+/**
+ * Relaxes branches, shrinks the code in place, and patches all label references. Code is position
+ * independent afterwards unless `jj_call_abs` or absolute immediates were used.
+ */
+void jj_finalize(jj_ctx* ctx);
+
+/**********************/
+/* instruction buffer */
+/**********************/
+
+/**
+ * Instructions recorded instead of encoded, so they can be rewritten before `jj_ir_emit` turns them into bytes.
+ * Real instructions keep their `jj_mnemonic`, labels and branches are pseudo instructions with the label in
+ * `ops[0].imm` and the condition of `jj_mn__jcc_l` in `ops[1].imm`.
+ */
+typedef struct jj_insn jj_insn;
+struct jj_insn {
+  uint16_t mn;
+  uint8_t count;
+  jj_op ops[3];
+};
+
+enum {
+  jj_mn__bind = jj_mn__count,
+  jj_mn__jmp_l,
+  jj_mn__jcc_l,
+  jj_mn__call_l,
+  jj_mn__align,
+  jj_mn__dead,  // removed by the optimizer, skipped by everything else
+};
+
+typedef struct jj_ir jj_ir;
+struct jj_ir {
+  jj_insn* insns;
+  uint32_t length;
+  uint32_t capacity;
+  uint32_t vregs;
+};
+
+void jj_ir_init(jj_ir* ir);
+void jj_ir_destroy(jj_ir* ir);
+
+void jj__ir_add(jj_ir* ir, uint16_t mn, const jj_op* ops, int count);
+/** Same as `jj_emit`, but records the instruction: `jj_ir_add(ir, add, jj_mkreg(jj_rax), jj_mkimm(1))`. */
+#define jj_ir_add(ir, mn, ...) \
+  jj__ir_add(ir, jj_mn_##mn, (jj_op[]){__VA_ARGS__}, sizeof((jj_op[]){__VA_ARGS__}) / sizeof(jj_op))
+
+/** New virtual register, usable wherever a `jj_reg` is until `jj_ra_allocate` replaces it with a physical one. */
+jj_reg jj_ir_vreg(jj_ir* ir);
+
+/** Labels come from `jj_label_new` of the context the buffer will be emitted into. */
+void jj_ir_bind(jj_ir* ir, jj_label label);
+void jj_ir_jmp(jj_ir* ir, jj_label label);
+void jj_ir_jcc(jj_ir* ir, jj_cond cond, jj_label label);
+void jj_ir_call(jj_ir* ir, jj_label label);
+void jj_ir_align(jj_ir* ir, uint8_t alignment);
+
+/**
+ * Peephole pass, repeated until nothing changes:
+ *  - drops `mov r, r`, `add r, 0`, shifts by 0, the second half of `mov a, b; mov b, a` and jumps to the next insn
+ *  - picks shorter forms: `mov32` for immediates which fit 32 bits unsigned, `xor32 r, r` for zero, `inc`/`dec`
+ *    for +-1, `sub r, -128` for `add r, 128`, `test r, r` for `cmp r, 0`
+ *  - folds `mov d, s; add d, x` and `shl d, 1..3; add d, r` into `lea`, merges `lea`/`add` chains of immediates
+ * Rewrites which change flags are only done when flags are overwritten before anything can read them.
+ * Returns the number of rewrites.
+ */
+uint32_t jj_ir_optimize(jj_ir* ir);
+
+/** Encodes everything into `ctx`, `jj_finalize` is still up to the caller. */
+void jj_ir_emit(jj_ir* ir, jj_ctx* ctx);
+
+/***********************/
+/* register allocation */
+/***********************/
+
+typedef struct jj_ra_stats jj_ra_stats;
+struct jj_ra_stats {
+  uint32_t vregs;
+  uint32_t spilled;        // virtual registers living in the frame
+  uint32_t spill_insns;    // loads and stores inserted for them
+  uint16_t saved;          // mask of callee-saved registers saved in the prologue
+  uint32_t frame_size;
+};
+
+/**
+ * Linear scan over the whole function in `ir` (Poletto & Sarkar): one live interval per virtual register from
+ * block-level liveness, registers handed out in order of interval start, the interval ending last is spilled when
+ * none is free. Physical registers in `ir` (arguments, return value, implicit operands of mul/div/cqo/shift by cl)
+ * are respected, values live across calls only get callee-saved registers or the frame.
+ *
+ * 12 registers are allocatable: r10 and r11 are kept for reloading spilled values, rsp and rbp hold the frame.
+ * Adds `jj_prologue`-like frame setup with callee-saved registers stored in it and restores them before every ret.
+ * `jmp` to a register or memory is a tail call: the target goes to r11 and the frame is torn down the same way.
+ */
+jj_ra_stats jj_ra_allocate(jj_ir* ir);
+
+/**************/
+/* code cache */
+/**************/
+
+/**
+ * Executable memory for finalized functions. One memfd is mapped twice: RW view is used for copying code in and
+ * RX view for running it, so no page is ever writable and executable at once and no mprotect is needed per function.
+ * The address space is reserved up front and committed page by page with ftruncate as the bump pointer grows.
+ * Freed chunks go to a first-fit free list; when nothing fits, the oldest chunks are evicted.
+ *
+ * Without memfd there's a single mapping flipped RW on the first install after `jj_cache_flush` and back RX on flush,
+ * so a batch of installs costs two mprotect calls.
+ */
+typedef struct jj_cache jj_cache;
+
+typedef struct jj_cache_stats jj_cache_stats;
+struct jj_cache_stats {
+  size_t reserved;
+  size_t committed;         // bytes backed by the memfd, page granular
+  size_t used;              // bytes in live chunks
+  size_t free;              // bytes in free chunks below the bump pointer
+  size_t largest_free;
+  uint32_t chunks;
+  uint32_t free_chunks;
+  uint64_t allocations;
+  uint64_t evictions;
+  double fragmentation;     // 1 - largest_free / free, 0 when there's no free space or all of it is contiguous
+};
+
+/** Called for every evicted chunk before its memory is reused. Anything pointing at `code` must be dropped. */
+typedef void (*jj_cache_evict_fn)(void* user, void* code, size_t size);
+
+jj_cache* jj_cache_new(size_t reserve, jj_cache_evict_fn evict, void* user);
+void jj_cache_delete(jj_cache* cache);
+
+/** Allocates a chunk and returns its RX address, `*rw` gets the address to write code through. */
+void* jj_cache_alloc(jj_cache* cache, size_t size, uint8_t** rw);
+void jj_cache_free(jj_cache* cache, void* code);
+/** Finalizes `ctx`, copies its code into a new chunk and returns the executable address of `ctx->base`. */
+void* jj_cache_install(jj_cache* cache, jj_ctx* ctx);
+/** Makes everything installed since the previous flush executable. */
+void jj_cache_flush(jj_cache* cache);
+jj_cache_stats jj_cache_get_stats(jj_cache* cache);
+
+/***************************/
+/* profilers and debuggers */
+/***************************/
+
+typedef enum jj_debug_flags jj_debug_flags;
+enum jj_debug_flags {
+  jj_debug_perf_map = 1 << 0,  // /tmp/perf-<pid>.map, enough for perf report and perf top
+  jj_debug_jitdump = 1 << 1,   // /tmp/jit-<pid>.dump with the code itself, for perf inject --jit and annotate
+  jj_debug_gdb = 1 << 2,       // in-memory ELF per function registered through __jit_debug_register_code
+};
+
+/** Starts describing code named with `jj_debug_name` to the tools in `flags`. Not thread safe, like the cache. */
+void jj_debug_enable(uint32_t flags);
+/** Names a function at its final address. Does nothing until `jj_debug_enable`. */
+__attribute__((format(printf, 3, 4)))
+void jj_debug_name(const void* code, size_t size, const char* format, ...);
+/** Drops GDB's symbols for `code` before the memory is reused. perf keeps history, a newer name for the address wins. */
+void jj_debug_forget(const void* code);
+
+/****************/
+/* cpu features */
+/****************/
+
+typedef enum jj_cpu_feature jj_cpu_feature;
+enum jj_cpu_feature {
+  jj_cpu_avx,
+  jj_cpu_avx2,
+  jj_cpu_fma,
+  jj_cpu_avx512f,
+  jj_cpu_popcnt,
+  jj_cpu_lzcnt,
+  jj_cpu_bmi1,     // andn, blsr, tzcnt
+  jj_cpu_bmi2,     // shlx, shrx, sarx, bzhi, pdep, pext, rorx
+  jj_cpu_erms,     // Enhanced REP MOVSB, fast rep movsb for any size
+  jj_cpu__count
+};
+
+/** Whether both the CPU and the OS (XCR0 state saving) support `feature`. Detected once on the first call. */
+bool jj_cpu_has(jj_cpu_feature feature);
+/** Mask of usable features, bit N is `jj_cpu_feature` N. */
+uint32_t jj_cpu_features(void);
+/**
+ * Hides detected features outside of `mask` from `jj_cpu_has`, so code generators fall back to baseline x86-64
+ * sequences: 0 forces the baseline, `~0u` lifts the limit. Code which is already generated is not affected.
+ */
+void jj_cpu_limit(uint32_t mask);
+const char* jj_cpu_name(jj_cpu_feature feature);
+
+// Operations with a fast path behind a feature and a baseline sequence, picked by `jj_cpu_has` at emit time.
+// They clobber flags, r10 and r11, `dst` may be the same as a source but none of them may be r10 or r11.
+
+/** dst = number of set bits of src. */
+void jj_gen_popcnt(jj_ctx* ctx, jj_reg dst, jj_reg src);
+/** dst = number of leading zero bits of src, 64 for 0. */
+void jj_gen_lzcnt(jj_ctx* ctx, jj_reg dst, jj_reg src);
+/** dst = number of trailing zero bits of src, 64 for 0. */
+void jj_gen_tzcnt(jj_ctx* ctx, jj_reg dst, jj_reg src);
+/** dst = ~a & b. */
+void jj_gen_andn(jj_ctx* ctx, jj_reg dst, jj_reg a, jj_reg b);
+/** dst = src shifted by count & 63, `mn` is `jj_mn_shl`, `jj_mn_shr` or `jj_mn_sar`. */
+void jj_gen_shift(jj_ctx* ctx, jj_mnemonic mn, jj_reg dst, jj_reg src, jj_reg count);
+/** Copies rcx bytes from [rsi] to [rdi] like rep movsb, rcx, rsi and rdi are clobbered. */
+void jj_gen_copy(jj_ctx* ctx);
+
+void jj_prologue(jj_ctx* ctx, uint32_t size);
+void jj_epilogue(jj_ctx* ctx);
+
+/***************/
+/* disassembly */
+/***************/
+
+/** One decoded instruction, operands are in the same order and form as for the emitters. */
+typedef struct jj_decoded jj_decoded;
+struct jj_decoded {
+  const char* name;    // table mnemonic (`mov32`, `vpaddd`), or `jmp`, `call`, `j<cc>` for relative branches
+  const char* kinds;   // table kinds (`_r_m`), `_l` for the target of a relative branch
+  char enc;            // 'l' - legacy, 'v' - VEX, 'e' - EVEX, 'b' - relative branch
+  bool w;
+  uint8_t length;
+  uint8_t count;
+  jj_op ops[4];        // branch target is an immediate offset, vector registers are numbers in `reg`
+};
+
+/**
+ * Decodes an instruction at `code` which sits `offset` bytes from the start of the function, using the same tables
+ * as the encoder, so it knows exactly what `jj_*` can emit. Returns its length, 0 for anything else.
+ */
+size_t jj_decode(const uint8_t* code, size_t size, uint64_t offset, jj_decoded* insn);
+/** Intel syntax, objdump style. Returns what snprintf returns. */
+int jj_format(const jj_decoded* insn, uint64_t offset, char* buffer, size_t size);
+/** Listing of `ctx` on stdout. */
+void jj_dump_disas(jj_ctx* ctx);
+
+/**
+ * Emits `iterations` random instructions from every table row (registers, addressing forms, immediates of every
+ * size), decodes them back and compares. Prints every mismatch and returns how many there were.
+ */
+uint32_t jj_fuzz_roundtrip(uint32_t iterations, uint32_t seed);
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jj.h"
+
+enum {
+  /** Chunks start on a cache line, so functions don't share lines with their neighbours. */
+  jj__cache_align = 64
+};
+
+typedef struct jj__chunk jj__chunk;
+struct jj__chunk {
+  size_t offset;
+  size_t size;
+  uint64_t seq;  // allocation number, 0 for free chunks; the smallest one is evicted first
+};
+
+struct jj_cache {
+  int fd;        // -1 without memfd: rw == rx and permissions are flipped with mprotect
+  uint8_t* rw;
+  uint8_t* rx;
+  size_t reserved;
+  size_t committed;
+  size_t top;    // bump pointer, everything below is covered by chunks and the last one is never free
+  size_t page_size;
+
+  /** Sorted by offset, adjacent free chunks are always merged. Kept out of the cache to leave it code only. */
+  jj__chunk* chunks;
+  uint32_t chunks_length;
+  uint32_t chunks_capacity;
+
+  /** Range written since the last flush. */
+  size_t dirty_begin;
+  size_t dirty_end;
+  bool writable;
+
+  jj_cache_evict_fn evict;
+  void* user;
+
+  uint64_t allocations;
+  uint64_t evictions;
+};
+
+static size_t jj__round_up(size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+jj_cache* jj_cache_new(size_t reserve, jj_cache_evict_fn evict, void* user) {
+  jj_cache* cache = calloc(1, sizeof(*cache));
+  if (!cache) DIE("out of memory");
+
+  cache->page_size = getpagesize();
+  cache->reserved = jj__round_up(reserve, cache->page_size);
+  cache->evict = evict;
+  cache->user = user;
+
+  // Nothing is committed yet: the file is empty and touching views would SIGBUS, ftruncate adds pages on demand.
+  cache->fd = memfd_create("jj-code-cache", MFD_CLOEXEC);
+  if (cache->fd != -1) {
+    cache->rw = mmap(0, cache->reserved, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, cache->fd, 0);
+    cache->rx = mmap(0, cache->reserved, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_NORESERVE, cache->fd, 0);
+    if (cache->rw == MAP_FAILED || cache->rx == MAP_FAILED) DIE("mmap: %m");
+    return cache;
+  }
+
+  // Private anonymous memory is committed lazily by the kernel anyway.
+  cache->rw = mmap(0, cache->reserved, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (cache->rw == MAP_FAILED) DIE("mmap: %m");
+  cache->rx = cache->rw;
+  cache->committed = cache->reserved;
+  return cache;
+}
+
+void jj_cache_delete(jj_cache* cache) {
+  for (uint32_t i = 0; i < cache->chunks_length; i++) {
+    if (cache->chunks[i].seq) jj_debug_forget(cache->rx + cache->chunks[i].offset);
+  }
+  munmap(cache->rw, cache->reserved);
+  if (cache->fd != -1) {
+    munmap(cache->rx, cache->reserved);
+    close(cache->fd);
+  }
+  free(cache->chunks);
+  free(cache);
+}
+
+static void jj__cache_insert(jj_cache* cache, uint32_t at, jj__chunk chunk) {
+  if (cache->chunks_length == cache->chunks_capacity) {
+    cache->chunks_capacity = cache->chunks_capacity ? cache->chunks_capacity * 2 : 64;
+    cache->chunks = realloc(cache->chunks, sizeof(jj__chunk) * cache->chunks_capacity);
+    if (!cache->chunks) DIE("out of memory");
+  }
+
+  memmove(&cache->chunks[at + 1], &cache->chunks[at], sizeof(jj__chunk) * (cache->chunks_length - at));
+  cache->chunks[at] = chunk;
+  cache->chunks_length++;
+}
+
+static void jj__cache_remove(jj_cache* cache, uint32_t at) {
+  memmove(&cache->chunks[at], &cache->chunks[at + 1], sizeof(jj__chunk) * (cache->chunks_length - at - 1));
+  cache->chunks_length--;
+}
+
+/** Gives whole pages inside of a free chunk back to the kernel. */
+static void jj__cache_release(jj_cache* cache, const jj__chunk* chunk) {
+  const size_t begin = jj__round_up(chunk->offset, cache->page_size);
+  const size_t end = (chunk->offset + chunk->size) & ~(cache->page_size - 1);
+  if (end <= begin) return;
+
+  if (cache->fd != -1) {
+    fallocate(cache->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin);
+  } else {
+    madvise(cache->rw + begin, end - begin, MADV_DONTNEED);
+  }
+}
+
+/** Marks chunk as free and merges it with free neighbours, or with the bump space when it ends at the top. */
+static void jj__cache_release_chunk(jj_cache* cache, uint32_t at) {
+  cache->chunks[at].seq = 0;
+
+  if (at + 1 < cache->chunks_length && !cache->chunks[at + 1].seq) {
+    cache->chunks[at].size += cache->chunks[at + 1].size;
+    jj__cache_remove(cache, at + 1);
+  }
+  if (at > 0 && !cache->chunks[at - 1].seq) {
+    cache->chunks[at - 1].size += cache->chunks[at].size;
+    jj__cache_remove(cache, at);
+    at--;
+  }
+
+  jj__cache_release(cache, &cache->chunks[at]);
+  if (at + 1 == cache->chunks_length) {
+    cache->top = cache->chunks[at].offset;
+    jj__cache_remove(cache, at);
+  }
+}
+
+static uint32_t jj__cache_find(jj_cache* cache, size_t offset) {
+  uint32_t lo = 0, hi = cache->chunks_length;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (cache->chunks[mid].offset < offset) lo = mid + 1; else hi = mid;
+  }
+  if (lo == cache->chunks_length || cache->chunks[lo].offset != offset || !cache->chunks[lo].seq) {
+    DIE("%zx is not an allocated chunk", offset);
+  }
+  return lo;
+}
+
+static void jj__cache_evict_oldest(jj_cache* cache) {
+  uint32_t oldest = cache->chunks_length;
+  for (uint32_t i = 0; i < cache->chunks_length; i++) {
+    if (cache->chunks[i].seq && (oldest == cache->chunks_length || cache->chunks[i].seq < cache->chunks[oldest].seq)) {
+      oldest = i;
+    }
+  }
+  if (oldest == cache->chunks_length) DIE("cache is too small");
+
+  const jj__chunk chunk = cache->chunks[oldest];
+  if (cache->evict) cache->evict(cache->user, cache->rx + chunk.offset, chunk.size);
+  jj_debug_forget(cache->rx + chunk.offset);
+  cache->evictions++;
+  jj__cache_release_chunk(cache, oldest);
+}
+
+static bool jj__cache_try_alloc(jj_cache* cache, size_t size, size_t* offset) {
+  // First fit in the free list.
+  for (uint32_t i = 0; i < cache->chunks_length; i++) {
+    jj__chunk* chunk = &cache->chunks[i];
+    if (chunk->seq || chunk->size < size) continue;
+
+    *offset = chunk->offset;
+    if (chunk->size > size) {
+      jj__cache_insert(cache, i + 1, (jj__chunk){ chunk->offset + size, chunk->size - size, 0 });
+      chunk = &cache->chunks[i];
+    }
+    chunk->size = size;
+    chunk->seq = ++cache->allocations;
+    return true;
+  }
+
+  // Then bump, committing whole pages.
+  if (cache->top + size > cache->reserved) return false;
+
+  const size_t committed = jj__round_up(cache->top + size, cache->page_size);
+  if (committed > cache->committed) {
+    if (ftruncate(cache->fd, committed) == -1) DIE("ftruncate: %m");
+    cache->committed = committed;
+  }
+
+  *offset = cache->top;
+  jj__cache_insert(cache, cache->chunks_length, (jj__chunk){ cache->top, size, ++cache->allocations });
+  cache->top += size;
+  return true;
+}
+
+void* jj_cache_alloc(jj_cache* cache, size_t size, uint8_t** rw) {
+  size = jj__round_up(size ? size : 1, jj__cache_align);
+  if (size > cache->reserved) DIE("%zu bytes won't ever fit into the cache", size);
+
+  size_t offset;
+  while (!jj__cache_try_alloc(cache, size, &offset)) {
+    jj__cache_evict_oldest(cache);
+  }
+
+  if (!cache->writable && cache->fd == -1) {
+    if (mprotect(cache->rw, cache->reserved, PROT_READ | PROT_WRITE) == -1) DIE("mprotect: %m");
+  }
+  cache->writable = true;
+
+  if (cache->dirty_begin == cache->dirty_end) {
+    cache->dirty_begin = offset;
+    cache->dirty_end = offset + size;
+  } else {
+    if (offset < cache->dirty_begin) cache->dirty_begin = offset;
+    if (offset + size > cache->dirty_end) cache->dirty_end = offset + size;
+  }
+
+  *rw = cache->rw + offset;
+  return cache->rx + offset;
+}
+
+void jj_cache_free(jj_cache* cache, void* code) {
+  jj_debug_forget(code);
+  jj__cache_release_chunk(cache, jj__cache_find(cache, (uint8_t*)code - cache->rx));
+}
+
+void* jj_cache_install(jj_cache* cache, jj_ctx* ctx) {
+  jj_finalize(ctx);
+
+  uint8_t* rw;
+  void* rx = jj_cache_alloc(cache, ctx->ip - ctx->base, &rw);
+  memcpy(rw, ctx->base, ctx->ip - ctx->base);
+  return rx;
+}
+
+void jj_cache_flush(jj_cache* cache) {
+  if (!cache->writable) return;
+
+  if (cache->fd == -1) {
+    if (mprotect(cache->rw, cache->reserved, PROT_READ | PROT_EXEC) == -1) DIE("mprotect: %m");
+  }
+
+  // No-op on x86 which keeps instruction cache coherent, but keeps the contract explicit.
+  __builtin___clear_cache((char*)cache->rx + cache->dirty_begin, (char*)cache->rx + cache->dirty_end);
+  cache->dirty_begin = cache->dirty_end = 0;
+  cache->writable = false;
+}
+
+jj_cache_stats jj_cache_get_stats(jj_cache* cache) {
+  jj_cache_stats stats = {
+    .reserved = cache->reserved,
+    .committed = cache->fd == -1 ? cache->top : cache->committed,
+    .allocations = cache->allocations,
+    .evictions = cache->evictions,
+  };
+
+  for (uint32_t i = 0; i < cache->chunks_length; i++) {
+    const jj__chunk* chunk = &cache->chunks[i];
+    if (chunk->seq) {
+      stats.used += chunk->size;
+      stats.chunks++;
+      continue;
+    }
+
+    stats.free += chunk->size;
+    stats.free_chunks++;
+    if (chunk->size > stats.largest_free) stats.largest_free = chunk->size;
+  }
+
+  stats.fragmentation = stats.free ? 1.0 - (double)stats.largest_free / stats.free : 0.0;
+  return stats;
+}
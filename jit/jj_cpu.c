@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <cpuid.h>
+
+#include "jj.h"
+
+static uint32_t jj__cpu_features;
+static uint32_t jj__cpu_mask = ~0u;
+
+static const char* const jj__cpu_names[] = {
+  [jj_cpu_avx] = "avx",
+  [jj_cpu_avx2] = "avx2",
+  [jj_cpu_fma] = "fma",
+  [jj_cpu_avx512f] = "avx512f",
+  [jj_cpu_popcnt] = "popcnt",
+  [jj_cpu_lzcnt] = "lzcnt",
+  [jj_cpu_bmi1] = "bmi1",
+  [jj_cpu_bmi2] = "bmi2",
+  [jj_cpu_erms] = "erms",
+};
+
+_Static_assert(sizeof(jj__cpu_names) / sizeof(jj__cpu_names[0]) == jj_cpu__count, "every feature needs a name");
+
+// 13.3 Enabling the XSAVE Feature Set: registers are usable only when the OS saves them on context switch.
+static uint64_t jj__xgetbv(uint32_t index) {
+  uint32_t eax, edx;
+  __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+  return ((uint64_t)edx << 32) | eax;
+}
+
+static uint32_t jj__cpu_detect(void) {
+  uint32_t eax, ebx, ecx, edx;
+  uint32_t features = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return features;
+
+  const bool osxsave = ecx & bit_OSXSAVE;
+  const uint64_t xcr0 = osxsave ? jj__xgetbv(0) : 0;
+  const bool ymm = (xcr0 & 0b110) == 0b110;              // SSE and AVX state
+  const bool zmm = ymm && (xcr0 & 0b11100000) == 0b11100000;  // opmask, ZMM_Hi256 and Hi16_ZMM state
+
+  if (ymm && (ecx & bit_AVX)) features |= 1u << jj_cpu_avx;
+  if (ymm && (ecx & bit_FMA)) features |= 1u << jj_cpu_fma;
+  if (ecx & bit_POPCNT) features |= 1u << jj_cpu_popcnt;
+
+  // BMI instructions are VEX encoded but only touch general purpose registers, so they don't need XSAVE.
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    if (ymm && (ebx & bit_AVX2)) features |= 1u << jj_cpu_avx2;
+    if (zmm && (ebx & bit_AVX512F)) features |= 1u << jj_cpu_avx512f;
+    if (ebx & bit_BMI) features |= 1u << jj_cpu_bmi1;
+    if (ebx & bit_BMI2) features |= 1u << jj_cpu_bmi2;
+    if (ebx & (1u << 9)) features |= 1u << jj_cpu_erms;
+  }
+
+  // LZCNT is reported as ABM by AMD, without it F3 0F BD silently runs as BSR.
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & bit_LZCNT)) features |= 1u << jj_cpu_lzcnt;
+
+  // Marks detection as done even when nothing is supported.
+  return features | 1u << 31;
+}
+
+uint32_t jj_cpu_features(void) {
+  if (!jj__cpu_features) jj__cpu_features = jj__cpu_detect();
+  return jj__cpu_features & jj__cpu_mask & ~(1u << 31);
+}
+
+bool jj_cpu_has(jj_cpu_feature feature) {
+  return jj_cpu_features() & (1u << feature);
+}
+
+void jj_cpu_limit(uint32_t mask) {
+  jj__cpu_mask = mask;
+}
+
+const char* jj_cpu_name(jj_cpu_feature feature) {
+  return feature < jj_cpu__count ? jj__cpu_names[feature] : "?";
+}
+
+/******************************/
+/* multi-versioned operations */
+/******************************/
+
+void jj_gen_popcnt(jj_ctx* ctx, jj_reg dst, jj_reg src) {
+  if (jj_cpu_has(jj_cpu_popcnt)) {
+    jj_popcnt_r_r(ctx, dst, src);
+    return;
+  }
+
+  // Hacker's Delight 5-1: bit counts of pairs, nibbles and bytes, then a multiply sums the bytes into the top one.
+  jj_mov_r_r(ctx, jj_r10, src);
+  jj_mov_r_r(ctx, jj_r11, src);
+  jj_shr_r_i8(ctx, jj_r11, 1);
+  jj_mov_r_i64(ctx, dst, 0x5555555555555555);
+  jj_and_r_r(ctx, jj_r11, dst);
+  jj_sub_r_r(ctx, jj_r10, jj_r11);
+  jj_mov_r_i64(ctx, dst, 0x3333333333333333);
+  jj_mov_r_r(ctx, jj_r11, jj_r10);
+  jj_shr_r_i8(ctx, jj_r11, 2);
+  jj_and_r_r(ctx, jj_r10, dst);
+  jj_and_r_r(ctx, jj_r11, dst);
+  jj_add_r_r(ctx, jj_r10, jj_r11);
+  jj_mov_r_r(ctx, jj_r11, jj_r10);
+  jj_shr_r_i8(ctx, jj_r11, 4);
+  jj_add_r_r(ctx, jj_r10, jj_r11);
+  jj_mov_r_i64(ctx, dst, 0x0f0f0f0f0f0f0f0f);
+  jj_and_r_r(ctx, jj_r10, dst);
+  jj_mov_r_i64(ctx, dst, 0x0101010101010101);
+  jj_imul_r_r(ctx, dst, jj_r10);
+  jj_shr_r_i8(ctx, dst, 56);
+}
+
+void jj_gen_lzcnt(jj_ctx* ctx, jj_reg dst, jj_reg src) {
+  if (jj_cpu_has(jj_cpu_lzcnt)) {
+    jj_lzcnt_r_r(ctx, dst, src);
+    return;
+  }
+
+  // Index of the highest set bit is 63 - lzcnt, 127 ^ 63 gives 64 for zero which BSR leaves undefined.
+  const jj_label done = jj_label_new(ctx);
+  jj_bsr_r_r(ctx, dst, src);
+  jj_jcc_l(ctx, jj_cc_ne, done);
+  jj_mov32_r_i32(ctx, dst, 127);
+  jj_label_bind(ctx, done);
+  jj_xor_r_i8(ctx, dst, 63);
+}
+
+void jj_gen_tzcnt(jj_ctx* ctx, jj_reg dst, jj_reg src) {
+  if (jj_cpu_has(jj_cpu_bmi1)) {
+    jj_tzcnt_r_r(ctx, dst, src);
+    return;
+  }
+
+  const jj_label done = jj_label_new(ctx);
+  jj_bsf_r_r(ctx, dst, src);
+  jj_jcc_l(ctx, jj_cc_ne, done);
+  jj_mov32_r_i32(ctx, dst, 64);
+  jj_label_bind(ctx, done);
+}
+
+void jj_gen_andn(jj_ctx* ctx, jj_reg dst, jj_reg a, jj_reg b) {
+  if (jj_cpu_has(jj_cpu_bmi1)) {
+    jj_andn_r_r_r(ctx, dst, a, b);
+    return;
+  }
+
+  jj_mov_r_r(ctx, jj_r11, a);
+  jj_not_r(ctx, jj_r11);
+  jj_and_r_r(ctx, jj_r11, b);
+  jj_mov_r_r(ctx, dst, jj_r11);
+}
+
+void jj_gen_shift(jj_ctx* ctx, jj_mnemonic mn, jj_reg dst, jj_reg src, jj_reg count) {
+  if (mn != jj_mn_shl && mn != jj_mn_shr && mn != jj_mn_sar) DIE("jj_gen_shift: %d is not a shift", mn);
+
+  if (jj_cpu_has(jj_cpu_bmi2)) {
+    // Any count register and no flags, which also frees the scheduler from the flags dependency of shl r, cl.
+    if (mn == jj_mn_shl) jj_shlx_r_r_r(ctx, dst, src, count);
+    if (mn == jj_mn_shr) jj_shrx_r_r_r(ctx, dst, src, count);
+    if (mn == jj_mn_sar) jj_sarx_r_r_r(ctx, dst, src, count);
+    return;
+  }
+
+  // Legacy shifts only take the count in cl, so rcx is parked in r10 unless it already holds the count.
+  jj_mov_r_r(ctx, jj_r11, src);
+  if (count != jj_rcx) {
+    jj_mov_r_r(ctx, jj_r10, jj_rcx);
+    jj_mov_r_r(ctx, jj_rcx, count);
+  }
+  if (mn == jj_mn_shl) jj_shl_r_cl(ctx, jj_r11);
+  if (mn == jj_mn_shr) jj_shr_r_cl(ctx, jj_r11);
+  if (mn == jj_mn_sar) jj_sar_r_cl(ctx, jj_r11);
+  if (count != jj_rcx) jj_mov_r_r(ctx, jj_rcx, jj_r10);
+  jj_mov_r_r(ctx, dst, jj_r11);
+}
+
+void jj_gen_copy(jj_ctx* ctx) {
+  if (jj_cpu_has(jj_cpu_erms)) {
+    jj_rep_movsb(ctx);
+    return;
+  }
+
+  // Without ERMS rep movsb moves a byte at a time, so qwords go first and the 0-7 byte tail after them.
+  jj_mov_r_r(ctx, jj_r11, jj_rcx);
+  jj_shr_r_i8(ctx, jj_rcx, 3);
+  jj_rep_movsq(ctx);
+  jj_mov_r_r(ctx, jj_rcx, jj_r11);
+  jj_and_r_i8(ctx, jj_rcx, 7);
+  jj_rep_movsb(ctx);
+}
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "jj.h"
+
+static uint32_t jj__debug_flags;
+
+/************/
+/* perf map */
+/************/
+
+// tools/perf/Documentation/jit-interface.txt: one "START SIZE symbolname" line per function, hex without 0x.
+// perf reads the file after the process is gone, so lines are never removed, a later line for the same address wins.
+
+static FILE* jj__perf_map;
+
+static void jj__perf_map_open(void) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+  jj__perf_map = fopen(path, "w");
+  if (!jj__perf_map) DIE("%s: %m", path);
+}
+
+static void jj__perf_map_add(const void* code, size_t size, const char* name) {
+  fprintf(jj__perf_map, "%lx %zx %s\n", (unsigned long)code, size, name);
+  // Flushed per line so a crashed process still leaves a usable map.
+  fflush(jj__perf_map);
+}
+
+/***********/
+/* jitdump */
+/***********/
+
+// tools/perf/Documentation/jitdump-specification.txt. Unlike the map it carries the code itself, so `perf inject
+// --jit` can turn every function into a tiny ELF and perf annotate can show instructions. perf finds the file
+// through the MMAP event of a PROT_EXEC mapping of it, which is why the file is mapped once and never used.
+// Timestamps are CLOCK_MONOTONIC, record with `perf record -k mono`.
+
+enum {
+  jj__jitdump_magic = 0x4A695444,  // 'JiTD'
+  jj__jitdump_code_load = 0,
+  jj__jitdump_code_close = 3,
+};
+
+typedef struct jj__jitdump_header jj__jitdump_header;
+struct jj__jitdump_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+typedef struct jj__jitdump_record jj__jitdump_record;
+struct jj__jitdump_record {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+/** JIT_CODE_LOAD, followed by the zero terminated name and the code. */
+typedef struct jj__jitdump_load jj__jitdump_load;
+struct jj__jitdump_load {
+  jj__jitdump_record record;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+static int jj__jitdump_fd = -1;
+static void* jj__jitdump_marker;
+static uint64_t jj__jitdump_index;
+
+static uint64_t jj__timestamp(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void jj__write(int fd, const void* data, size_t size) {
+  for (const uint8_t* at = data; size; ) {
+    const ssize_t written = write(fd, at, size);
+    if (written < 0) DIE("write: %m");
+    at += written;
+    size -= written;
+  }
+}
+
+static void jj__jitdump_close(void) {
+  const jj__jitdump_record record = { jj__jitdump_code_close, sizeof(record), jj__timestamp() };
+  jj__write(jj__jitdump_fd, &record, sizeof(record));
+  munmap(jj__jitdump_marker, sysconf(_SC_PAGESIZE));
+  close(jj__jitdump_fd);
+  jj__jitdump_fd = -1;
+}
+
+static void jj__jitdump_open(void) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+  jj__jitdump_fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+  if (jj__jitdump_fd == -1) DIE("%s: %m", path);
+
+  const jj__jitdump_header header = {
+    .magic = jj__jitdump_magic,
+    .version = 1,
+    .total_size = sizeof(header),
+    .elf_mach = EM_X86_64,
+    .pid = getpid(),
+    .timestamp = jj__timestamp(),
+  };
+  jj__write(jj__jitdump_fd, &header, sizeof(header));
+
+  jj__jitdump_marker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, jj__jitdump_fd, 0);
+  if (jj__jitdump_marker == MAP_FAILED) DIE("mmap %s: %m", path);
+  atexit(jj__jitdump_close);
+}
+
+static void jj__jitdump_add(const void* code, size_t size, const char* name) {
+  const size_t name_size = strlen(name) + 1;
+  const jj__jitdump_load load = {
+    .record = { jj__jitdump_code_load, sizeof(load) + name_size + size, jj__timestamp() },
+    .pid = getpid(),
+    .tid = syscall(SYS_gettid),
+    .vma = (uint64_t)code,
+    .code_addr = (uint64_t)code,
+    .code_size = size,
+    .code_index = jj__jitdump_index++,
+  };
+  jj__write(jj__jitdump_fd, &load, sizeof(load));
+  jj__write(jj__jitdump_fd, name, name_size);
+  jj__write(jj__jitdump_fd, code, size);
+}
+
+/*******/
+/* GDB */
+/*******/
+
+// GDB's JIT interface, see "JIT Compilation Interface" in the GDB manual. Works like `_r_debug` and
+// `_dl_debug_state` in gdb-interop: GDB breaks on `__jit_debug_register_code` and reads `__jit_debug_descriptor`
+// to find which in-memory object file was added or removed. Names of both are the protocol.
+
+typedef enum jit_actions_t jit_actions_t;
+enum jit_actions_t {
+  JIT_NOACTION = 0,
+  JIT_REGISTER_FN,
+  JIT_UNREGISTER_FN
+};
+
+struct jit_code_entry {
+  struct jit_code_entry* next_entry;
+  struct jit_code_entry* prev_entry;
+  const char* symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  /** jit_actions_t, what happened to `relevant_entry` */
+  uint32_t action_flag;
+  struct jit_code_entry* relevant_entry;
+  struct jit_code_entry* first_entry;
+};
+
+__attribute__((noinline, used)) void __jit_debug_register_code(void) { __asm__ volatile(""); }
+
+__attribute__((used)) struct jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, 0, 0 };
+
+/**
+ * The smallest object file GDB accepts: a NOBITS .text placed right over the code and one function symbol in it,
+ * so backtraces, `info symbol` and `disassemble` know the name. There's no DWARF, so GDB unwinds through the code
+ * with its prologue analyzer, which copes with `jj_prologue` style rbp frames.
+ */
+typedef struct jj__symfile jj__symfile;
+struct jj__symfile {
+  Elf64_Ehdr ehdr;
+  Elf64_Shdr shdrs[5];
+  Elf64_Sym syms[2];
+  char shstrtab[40];
+  char strtab[];  // "\0" name "\0"
+};
+
+static const char jj__shstrtab[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+_Static_assert(sizeof(jj__shstrtab) <= sizeof(((jj__symfile*)0)->shstrtab), "shstrtab doesn't fit");
+
+typedef struct jj__gdb_entry jj__gdb_entry;
+struct jj__gdb_entry {
+  struct jit_code_entry entry;
+  const void* code;
+  jj__symfile symfile;
+};
+
+static void jj__gdb_add(const void* code, size_t size, const char* name) {
+  const size_t name_size = strlen(name) + 1;
+  jj__gdb_entry* e = calloc(1, sizeof(jj__gdb_entry) + 1 + name_size);
+  if (!e) DIE("out of memory");
+  e->code = code;
+
+  jj__symfile* s = &e->symfile;
+  memcpy(s->ehdr.e_ident, ELFMAG, SELFMAG);
+  s->ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  s->ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  s->ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  s->ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  s->ehdr.e_type = ET_REL;
+  s->ehdr.e_machine = EM_X86_64;
+  s->ehdr.e_version = EV_CURRENT;
+  s->ehdr.e_shoff = offsetof(jj__symfile, shdrs);
+  s->ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  s->ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  s->ehdr.e_shnum = 5;
+  s->ehdr.e_shstrndx = 4;
+
+  memcpy(s->shstrtab, jj__shstrtab, sizeof(jj__shstrtab));
+  memcpy(s->strtab + 1, name, name_size);
+
+  s->shdrs[1] = (Elf64_Shdr){
+    .sh_name = 1, .sh_type = SHT_NOBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+    .sh_addr = (uint64_t)code, .sh_size = size, .sh_addralign = 1,
+  };
+  s->shdrs[2] = (Elf64_Shdr){
+    .sh_name = 7, .sh_type = SHT_SYMTAB, .sh_offset = offsetof(jj__symfile, syms), .sh_size = sizeof(s->syms),
+    .sh_link = 3, .sh_info = 1, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym),
+  };
+  s->shdrs[3] = (Elf64_Shdr){
+    .sh_name = 15, .sh_type = SHT_STRTAB, .sh_offset = offsetof(jj__symfile, strtab), .sh_size = 1 + name_size,
+    .sh_addralign = 1,
+  };
+  s->shdrs[4] = (Elf64_Shdr){
+    .sh_name = 23, .sh_type = SHT_STRTAB, .sh_offset = offsetof(jj__symfile, shstrtab), .sh_size = sizeof(jj__shstrtab),
+    .sh_addralign = 1,
+  };
+  s->syms[1] = (Elf64_Sym){
+    .st_name = 1, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), .st_shndx = 1, .st_value = 0, .st_size = size,
+  };
+
+  e->entry.symfile_addr = (const char*)s;
+  e->entry.symfile_size = sizeof(jj__symfile) + 1 + name_size;
+  e->entry.next_entry = __jit_debug_descriptor.first_entry;
+  if (e->entry.next_entry) e->entry.next_entry->prev_entry = &e->entry;
+  __jit_debug_descriptor.first_entry = &e->entry;
+
+  __jit_debug_descriptor.relevant_entry = &e->entry;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code();
+}
+
+static void jj__gdb_remove(const void* code) {
+  for (struct jit_code_entry* entry = __jit_debug_descriptor.first_entry; entry; entry = entry->next_entry) {
+    jj__gdb_entry* e = (jj__gdb_entry*)entry;
+    if (e->code != code) continue;
+
+    if (entry->prev_entry) entry->prev_entry->next_entry = entry->next_entry;
+    else __jit_debug_descriptor.first_entry = entry->next_entry;
+    if (entry->next_entry) entry->next_entry->prev_entry = entry->prev_entry;
+
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+    free(e);
+    return;
+  }
+}
+
+/*******/
+/* api */
+/*******/
+
+void jj_debug_enable(uint32_t flags) {
+  flags &= ~jj__debug_flags;
+  if (flags & jj_debug_perf_map) jj__perf_map_open();
+  if (flags & jj_debug_jitdump) jj__jitdump_open();
+  jj__debug_flags |= flags;
+}
+
+void jj_debug_name(const void* code, size_t size, const char* format, ...) {
+  if (!jj__debug_flags) return;
+
+  char name[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(name, sizeof(name), format, args);
+  va_end(args);
+
+  if (jj__debug_flags & jj_debug_perf_map) jj__perf_map_add(code, size, name);
+  if (jj__debug_flags & jj_debug_jitdump) jj__jitdump_add(code, size, name);
+  if (jj__debug_flags & jj_debug_gdb) jj__gdb_add(code, size, name);
+}
+
+void jj_debug_forget(const void* code) {
+  if (jj__debug_flags & jj_debug_gdb) jj__gdb_remove(code);
+}
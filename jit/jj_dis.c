@@ -0,0 +1,619 @@
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jj.h"
+
+/*********/
+/* forms */
+/*********/
+
+// Adapters from `const jj_op*` to typed VEX/EVEX emitters, legacy rows go through `jj__emit` instead.
+#define JJ__VTHUNK_VVV(fn)  fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg), jj_xmm(ops[2].reg))
+#define JJ__VTHUNK_VVM(fn)  fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg), ops[2].mem)
+#define JJ__VTHUNK_VVR(fn)  fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg), ops[2].reg)
+#define JJ__VTHUNK_VVVI(fn) fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg), jj_xmm(ops[2].reg), ops[3].imm)
+#define JJ__VTHUNK_VVI(fn)  fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg), ops[2].imm)
+#define JJ__VTHUNK_VV(fn)   fn(ctx, jj_xmm(ops[0].reg), jj_xmm(ops[1].reg))
+#define JJ__VTHUNK_VM(fn)   fn(ctx, jj_xmm(ops[0].reg), ops[1].mem)
+#define JJ__VTHUNK_MV(fn)   fn(ctx, ops[0].mem, jj_xmm(ops[1].reg))
+#define JJ__VTHUNK_VR(fn)   fn(ctx, jj_xmm(ops[0].reg), ops[1].reg)
+#define JJ__VTHUNK_RV(fn)   fn(ctx, ops[0].reg, jj_xmm(ops[1].reg))
+#define JJ__VTHUNK_RRR(fn)  fn(ctx, ops[0].reg, ops[1].reg, ops[2].reg)
+#define JJ__VTHUNK_RRI(fn)  fn(ctx, ops[0].reg, ops[1].reg, ops[2].imm)
+#define JJ__VTHUNK_RR(fn)   fn(ctx, ops[0].reg, ops[1].reg)
+#define JJ__VTHUNK_(fn)     ((void)ops, fn(ctx))
+
+#define JJ__VTHUNK_SHAPE(shape, fn) JJ__VTHUNK_SHAPE2(shape, fn)
+#define JJ__VTHUNK_SHAPE2(shape, fn) JJ__VTHUNK_##shape(fn)
+#define JJ__VTHUNK(mn, kinds, ...) \
+  static void jj__vthunk_##mn##kinds(jj_ctx* ctx, const jj_op* ops) { JJ__VTHUNK_SHAPE(JJ__VKINDS##kinds, jj_##mn##kinds); }
+JJ_VEX_INSNS(JJ__VTHUNK)
+JJ_EVEX_INSNS(JJ__VTHUNK)
+#undef JJ__VTHUNK
+
+#define JJ__FORM_DIGIT_0 0
+#define JJ__FORM_DIGIT_1 1
+#define JJ__FORM_DIGIT_2 2
+#define JJ__FORM_DIGIT_3 3
+#define JJ__FORM_DIGIT_4 4
+#define JJ__FORM_DIGIT_5 5
+#define JJ__FORM_DIGIT_6 6
+#define JJ__FORM_DIGIT_7 7
+#define JJ__FORM_DIGIT_r -1
+#define JJ__FORM_DIGIT__ -1
+
+/** A table row as the decoder sees it. */
+typedef struct jj__form jj__form;
+struct jj__form {
+  const char* name;
+  const char* kinds;
+  const char* en;      // Op/En, every letter is where one operand comes from: R - ModRM.reg, M - ModRM.rm,
+                       // V - VEX.vvvv, O - low bits of opcode, I - immediate, C - cl
+  char enc;
+  bool w;
+  uint8_t prefix;      // legacy prefix byte or VEX.pp
+  uint8_t map;
+  uint8_t l;
+  uint32_t opcode;
+  int8_t digit;
+  jj_mnemonic mn;
+  void (*emit)(jj_ctx* ctx, const jj_op* ops);
+};
+
+static const jj__form jj__forms[] = {
+#define JJ__LEGACY_FORM(mn, kinds, en, prefix, w, opcode, digit) \
+  { #mn, #kinds, #en, 'l', w, prefix, 0, 0, opcode, JJ__FORM_DIGIT_##digit, jj_mn_##mn, 0 },
+#define JJ__VEX_FORM(mn, kinds, en, l, pp, map, w, opcode, digit) \
+  { #mn, #kinds, #en, 'v', w, JJ__PP_##pp, JJ__MAP_##map, l, opcode, JJ__FORM_DIGIT_##digit, 0, jj__vthunk_##mn##kinds },
+#define JJ__EVEX_FORM(mn, kinds, en, l, pp, map, w, opcode, digit) \
+  { #mn, #kinds, #en, 'e', w, JJ__PP_##pp, JJ__MAP_##map, l, opcode, JJ__FORM_DIGIT_##digit, 0, jj__vthunk_##mn##kinds },
+  JJ_INSNS(JJ__LEGACY_FORM)
+  JJ_VEX_INSNS(JJ__VEX_FORM)
+  JJ_EVEX_INSNS(JJ__EVEX_FORM)
+#undef JJ__LEGACY_FORM
+#undef JJ__VEX_FORM
+#undef JJ__EVEX_FORM
+};
+
+enum { jj__forms_count = sizeof(jj__forms) / sizeof(jj__forms[0]) };
+
+/** Splits kinds like "_r_i32" into one letter per operand: r, m, x, y, z, c (cl), b (i8), d (i32), q (i64). */
+static int jj__kinds(const char* kinds, char* out) {
+  int count = 0;
+  for (const char* kind = kinds; *kind; ) {
+    kind++;
+    const size_t length = strcspn(kind, "_");
+    out[count++] =
+      length == 2 && kind[0] == 'c' ? 'c' :
+      length == 2 && kind[0] == 'i' ? 'b' :
+      length == 3 && kind[1] == '3' ? 'd' :
+      length == 3 && kind[1] == '6' ? 'q' :
+      kind[0];
+    kind += length;
+  }
+  return count;
+}
+
+/************/
+/* decoding */
+/************/
+
+static const char* const jj__cc_names[] = {
+  "jo", "jno", "jb", "jae", "je", "jne", "jbe", "ja", "js", "jns", "jp", "jnp", "jl", "jge", "jle", "jg"
+};
+
+static size_t jj__decode_branch(const uint8_t* code, size_t size, uint64_t offset, jj_decoded* insn) {
+  const char* name = 0;
+  uint8_t length = 0, rel_size = 0;
+  if (code[0] == 0xe9 || code[0] == 0xe8) {
+    name = code[0] == 0xe9 ? "jmp" : "call";
+    length = 5, rel_size = 4;
+  } else if (code[0] == 0xeb) {
+    name = "jmp";
+    length = 2, rel_size = 1;
+  } else if ((code[0] & 0xf0) == 0x70) {
+    name = jj__cc_names[code[0] & 0xf];
+    length = 2, rel_size = 1;
+  } else if (code[0] == 0x0f && size > 1 && (code[1] & 0xf0) == 0x80) {
+    name = jj__cc_names[code[1] & 0xf];
+    length = 6, rel_size = 4;
+  } else {
+    return 0;
+  }
+  if (size < length) return 0;
+
+  int32_t rel = 0;
+  if (rel_size == 1) {
+    rel = (int8_t)code[length - 1];
+  } else {
+    memcpy(&rel, code + length - 4, 4);
+  }
+  *insn = (jj_decoded){
+    .name = name, .kinds = "_l", .enc = 'b', .length = length, .count = 1,
+    .ops = { jj_mkimm(offset + length + rel) }
+  };
+  return length;
+}
+
+typedef struct jj__prefix jj__prefix;
+struct jj__prefix {
+  char enc;
+  bool w, r, x, b;
+  uint8_t pp, map, l, vvvv;
+  uint8_t legacy;      // 66, F2 or F3 in front of REX
+};
+
+/** Legacy prefix and REX, VEX (2.3.5) or EVEX (2.7.1) prefix. Returns their length. */
+static size_t jj__decode_prefix(const uint8_t* code, size_t size, jj__prefix* prefix) {
+  *prefix = (jj__prefix){ .enc = 'l' };
+  // 2.1.1 Instruction Prefixes: mandatory prefixes (F3 0F B8 - POPCNT) and REP go before REX, and VEX with them is #UD.
+  if (code[0] == 0x66 || code[0] == 0xf2 || code[0] == 0xf3) {
+    prefix->legacy = code[0];
+    if (size >= 2 && (code[1] & 0xf0) == 0x40) {
+      prefix->w = code[1] & 8;
+      prefix->r = code[1] & 4;
+      prefix->x = code[1] & 2;
+      prefix->b = code[1] & 1;
+      return 2;
+    }
+    return 1;
+  }
+  // In 64-bit mode C4, C5 and 62 can't be LES, LDS or BOUND.
+  if (code[0] == 0xc5 && size >= 2) {
+    *prefix = (jj__prefix){
+      .enc = 'v', .r = !(code[1] & 0x80), .vvvv = (~code[1] >> 3) & 0xf, .l = (code[1] >> 2) & 1, .pp = code[1] & 3, .map = 1
+    };
+    return 2;
+  }
+  if (code[0] == 0xc4 && size >= 3) {
+    *prefix = (jj__prefix){
+      .enc = 'v', .r = !(code[1] & 0x80), .x = !(code[1] & 0x40), .b = !(code[1] & 0x20), .map = code[1] & 0x1f,
+      .w = code[2] >> 7, .vvvv = (~code[2] >> 3) & 0xf, .l = (code[2] >> 2) & 1, .pp = code[2] & 3
+    };
+    return 3;
+  }
+  if (code[0] == 0x62 && size >= 4) {
+    *prefix = (jj__prefix){
+      .enc = 'e', .r = !(code[1] & 0x80), .x = !(code[1] & 0x40), .b = !(code[1] & 0x20), .map = code[1] & 3,
+      .w = code[2] >> 7, .vvvv = (~code[2] >> 3) & 0xf, .pp = code[2] & 3, .l = (code[3] >> 5) & 3
+    };
+    return 4;
+  }
+  if ((code[0] & 0xf0) == 0x40) {
+    prefix->w = code[0] & 8;
+    prefix->r = code[0] & 4;
+    prefix->x = code[0] & 2;
+    prefix->b = code[0] & 1;
+    return 1;
+  }
+  return 0;
+}
+
+static bool jj__has_modrm(const char* en) {
+  return strchr(en, 'M') || strchr(en, 'R');
+}
+
+/** What the decoder would otherwise parse out of a form's strings for every candidate. */
+typedef struct jj__shape jj__shape;
+struct jj__shape {
+  char kinds[4];
+  uint8_t count;
+  bool modrm;
+  int8_t rm_mem;       // -1 without ModRM.rm, otherwise whether it's the memory form
+};
+
+/**
+ * Forms by opcode byte and map: legacy one-byte opcodes, then 0F, 0F38 and 0F3A (legacy 0F xx included). Built on the
+ * first decode by counting sort, so a bucket keeps table order and the first match wins as with the whole table.
+ * Opcodes with the register in their low bits (Op/En O) go to all eight buckets.
+ */
+enum { jj__bucket_count = 4 * 256 };
+static uint16_t jj__bucket_start[jj__bucket_count + 1];
+static uint16_t jj__bucket_forms[jj__forms_count * 8];
+static jj__shape jj__shapes[jj__forms_count];
+static bool jj__buckets_ready;
+
+static uint32_t jj__bucket(char enc, uint8_t map, uint32_t opcode) {
+  return (enc == 'l' ? opcode > 0xff : map) * 256 + (opcode & 0xff);
+}
+
+static void jj__buckets_build(void) {
+  for (int i = 0; i < jj__forms_count; i++) {
+    const jj__form* form = &jj__forms[i];
+    jj__shape* shape = &jj__shapes[i];
+    shape->count = jj__kinds(form->kinds, shape->kinds);
+    shape->modrm = jj__has_modrm(form->en);
+    const char* rm = strchr(form->en, 'M');
+    shape->rm_mem = rm ? shape->kinds[rm - form->en] == 'm' : -1;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    uint16_t fill[jj__bucket_count];
+    memcpy(fill, jj__bucket_start, sizeof(fill));
+    for (int i = 0; i < jj__forms_count; i++) {
+      const jj__form* form = &jj__forms[i];
+      for (uint32_t r = 0; r < (form->en[0] == 'O' ? 8u : 1u); r++) {
+        const uint32_t bucket = jj__bucket(form->enc, form->map, form->opcode + r);
+        if (pass) {
+          jj__bucket_forms[fill[bucket]++] = i;
+        } else {
+          jj__bucket_start[bucket + 1]++;
+        }
+      }
+    }
+    // Sizes after the first pass, starts of buckets from them.
+    for (int b = 0; !pass && b < jj__bucket_count; b++) jj__bucket_start[b + 1] += jj__bucket_start[b];
+  }
+  jj__buckets_ready = true;
+}
+
+/** Whether `form` can be the instruction with `opcode` and the following ModR/M byte. */
+static bool jj__form_matches(const jj__form* form, const jj__shape* shape, const jj__prefix* prefix, uint32_t opcode,
+                             const uint8_t* modrm) {
+  const bool short_reg = form->en[0] == 'O';
+  if (short_reg ? (opcode & ~7u) != form->opcode : opcode != form->opcode) return false;
+  if (form->enc != prefix->enc || form->w != prefix->w) return false;
+  if (form->enc == 'l' && form->prefix != prefix->legacy) return false;
+  if (form->enc != 'l' && (form->prefix != prefix->pp || form->map != prefix->map || form->l != prefix->l)) return false;
+  if (!shape->modrm) return true;
+  if (!modrm) return false;
+
+  if (form->digit >= 0 && ((*modrm >> 3) & 7) != form->digit) return false;
+
+  // Register and memory forms share opcodes, ModRM.mod tells them apart.
+  if (shape->rm_mem < 0) return true;
+  return shape->rm_mem == ((*modrm >> 6) != 0b11);
+}
+
+static size_t jj__decode_mem(const uint8_t* code, size_t size, const jj__prefix* prefix, uint8_t scale, jj_mem* mem) {
+  const uint8_t modrm = code[0];
+  const uint8_t mod = modrm >> 6;
+  const uint8_t rm = modrm & 7;
+  size_t length = 1;
+  *mem = (jj_mem){ .base = jj_rNONE, .index = jj_rNONE, .scale = jj_s1 };
+
+  if (mod == 0 && rm == 0b101) {
+    if (size < 5) return 0;
+    mem->base = jj_rRIP;
+    memcpy(&mem->disp, code + 1, 4);
+    return 5;
+  }
+
+  bool no_base = false;
+  if (rm == 0b100) {
+    if (size < 2) return 0;
+    const uint8_t sib = code[1];
+    length++;
+    mem->scale = sib & 0b11000000;
+    const uint8_t index = ((sib >> 3) & 7) | (prefix->x << 3);
+    if (index != jj_rsp) mem->index = index;
+    no_base = mod == 0 && (sib & 7) == 0b101;
+    if (!no_base) mem->base = (sib & 7) | (prefix->b << 3);
+  } else {
+    mem->base = rm | (prefix->b << 3);
+  }
+
+  if (mod == 1) {
+    if (size < length + 1) return 0;
+    mem->disp = (int8_t)code[length] * scale;
+    length += 1;
+  } else if (mod == 2 || no_base) {
+    if (size < length + 4) return 0;
+    memcpy(&mem->disp, code + length, 4);
+    length += 4;
+  }
+  return length;
+}
+
+size_t jj_decode(const uint8_t* code, size_t size, uint64_t offset, jj_decoded* insn) {
+  if (!size) return 0;
+  if (jj__decode_branch(code, size, offset, insn)) return insn->length;
+
+  jj__prefix prefix;
+  size_t at = jj__decode_prefix(code, size, &prefix);
+  if (at >= size) return 0;
+
+  uint32_t opcode = code[at++];
+  if (prefix.enc == 'l' && opcode == 0x0f) {
+    if (at >= size) return 0;
+    opcode = 0x0f00 | code[at++];
+  }
+
+  // No rows in VEX/EVEX maps other than 0F, 0F38 and 0F3A.
+  if (prefix.enc != 'l' && (prefix.map < 1 || prefix.map > 3)) return 0;
+  if (!jj__buckets_ready) jj__buckets_build();
+
+  const uint8_t* modrm = at < size ? &code[at] : 0;
+  const uint32_t bucket = jj__bucket(prefix.enc, prefix.map, opcode);
+  const jj__form* form = 0;
+  const jj__shape* shape = 0;
+  for (uint32_t i = jj__bucket_start[bucket]; i < jj__bucket_start[bucket + 1] && !form; i++) {
+    const uint16_t index = jj__bucket_forms[i];
+    if (jj__form_matches(&jj__forms[index], &jj__shapes[index], &prefix, opcode, modrm)) {
+      form = &jj__forms[index];
+      shape = &jj__shapes[index];
+    }
+  }
+  if (!form) return 0;
+
+  *insn = (jj_decoded){ .name = form->name, .kinds = form->kinds, .enc = form->enc, .w = form->w };
+  const char* kinds = shape->kinds;
+  insn->count = shape->count;
+
+  jj_mem mem = {0};
+  jj_reg reg = jj_rNONE, rm_reg = jj_rNONE;
+  if (shape->modrm) {
+    reg = ((*modrm >> 3) & 7) | (prefix.r << 3);
+    if ((*modrm >> 6) == 0b11) {
+      rm_reg = (*modrm & 7) | (prefix.b << 3);
+      at++;
+    } else {
+      // 2.7.5 Compressed Displacement: all EVEX rows take full 64 byte vectors.
+      const size_t length = jj__decode_mem(modrm, size - at, &prefix, prefix.enc == 'e' ? 64 : 1, &mem);
+      if (!length) return 0;
+      at += length;
+    }
+  }
+
+  for (int i = 0; i < insn->count; i++) {
+    jj_op* op = &insn->ops[i];
+    switch (form->en[i]) {
+      case 'R': *op = jj_mkreg(reg); break;
+      case 'V': *op = jj_mkreg(prefix.vvvv); break;
+      case 'O': *op = jj_mkreg((opcode & 7) | (prefix.b << 3)); break;
+      case 'C': *op = jj_mkreg(jj_rcx); break;
+      case 'M':
+        *op = kinds[i] == 'm' ? (jj_op){ .type = 'm', .mem = mem } : jj_mkreg(rm_reg);
+        break;
+      case 'I': {
+        const uint8_t bytes = kinds[i] == 'b' ? 1 : kinds[i] == 'd' ? 4 : 8;
+        if (at + bytes > size) return 0;
+        int64_t imm = 0;
+        if (bytes == 1) {
+          // VEX immediates are bit fields, legacy ones are sign-extended.
+          imm = form->enc == 'l' ? (int8_t)code[at] : code[at];
+        } else if (bytes == 4) {
+          int32_t imm32;
+          memcpy(&imm32, code + at, 4);
+          // B8+rd id without REX.W zero-extends, everything else sign-extends.
+          imm = form->en[0] == 'O' && !form->w ? (int64_t)(uint32_t)imm32 : imm32;
+        } else {
+          memcpy(&imm, code + at, 8);
+        }
+        *op = jj_mkimm(imm);
+        at += bytes;
+        break;
+      }
+    }
+  }
+
+  insn->length = at;
+  return at;
+}
+
+/**************/
+/* formatting */
+/**************/
+
+static const char* const jj__reg64[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+static const char* const jj__reg32[] = {
+  "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+
+typedef struct jj__out jj__out;
+struct jj__out {
+  char* buffer;
+  size_t size;
+  int length;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void jj__print(jj__out* out, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  const size_t used = (size_t)out->length < out->size ? (size_t)out->length : out->size;
+  out->length += vsnprintf(out->buffer + used, out->size - used, format, args);
+  va_end(args);
+}
+
+static void jj__print_hex(jj__out* out, int64_t value, bool sign) {
+  if (sign && value < 0) {
+    jj__print(out, "-0x%" PRIx64, -(uint64_t)value);
+  } else {
+    jj__print(out, "0x%" PRIx64, (uint64_t)value);
+  }
+}
+
+int jj_format(const jj_decoded* insn, uint64_t offset, char* buffer, size_t size) {
+  jj__out out = { buffer, size, 0 };
+  if (size) buffer[0] = 0;
+
+  // mov32 and xor32 are mov and xor with 32 bit registers.
+  size_t name_length = strlen(insn->name);
+  const bool r32 = insn->enc == 'l' ? name_length > 2 && strcmp(insn->name + name_length - 2, "32") == 0 : !insn->w;
+  if (insn->enc == 'l' && r32) name_length -= 2;
+  // rep_movsb is rep movsb.
+  char name[16];
+  snprintf(name, sizeof(name), "%.*s", (int)name_length, insn->name);
+  for (char* c = strchr(name, '_'); c; c = strchr(c, '_')) *c = ' ';
+  jj__print(&out, "%-6s ", name);
+
+  char kinds[4];
+  if (insn->enc == 'b') {
+    kinds[0] = 'l';
+  } else {
+    jj__kinds(insn->kinds, kinds);
+  }
+
+  uint64_t rip_target = 0;
+  bool rip = false;
+  for (int i = 0; i < insn->count; i++) {
+    const jj_op* op = &insn->ops[i];
+    if (i) jj__print(&out, ",");
+
+    switch (kinds[i]) {
+      case 'l': jj__print(&out, "0x%" PRIx64, op->imm); break;
+      case 'r': jj__print(&out, "%s", (r32 ? jj__reg32 : jj__reg64)[op->reg & 15]); break;
+      case 'c': jj__print(&out, "cl"); break;
+      case 'x': jj__print(&out, "xmm%u", op->reg); break;
+      case 'y': jj__print(&out, "ymm%u", op->reg); break;
+      case 'z': jj__print(&out, "zmm%u", op->reg); break;
+      case 'b': case 'd': case 'q': jj__print_hex(&out, op->imm, insn->enc == 'l'); break;
+      case 'm': {
+        const jj_mem* m = &op->mem;
+        if (insn->enc == 'l') jj__print(&out, "QWORD PTR ");
+        jj__print(&out, "[");
+        if (m->base == jj_rRIP) {
+          jj__print(&out, "rip");
+          rip = true;
+          rip_target = offset + insn->length + m->disp;
+        } else if (m->base != jj_rNONE) {
+          jj__print(&out, "%s", jj__reg64[m->base]);
+        }
+        if (m->index != jj_rNONE) {
+          jj__print(&out, "%s%s*%d", m->base != jj_rNONE ? "+" : "", jj__reg64[m->index], 1 << (m->scale >> 6));
+        }
+        if (m->disp || (m->base == jj_rNONE && m->index == jj_rNONE)) {
+          if (m->base == jj_rNONE && m->index == jj_rNONE) {
+            jj__print(&out, "0x%" PRIx32, (uint32_t)m->disp);
+          } else {
+            jj__print(&out, m->disp < 0 ? "-" : "+");
+            jj__print(&out, "0x%" PRIx64, m->disp < 0 ? -(int64_t)m->disp : (int64_t)m->disp);
+          }
+        }
+        jj__print(&out, "]");
+        break;
+      }
+    }
+  }
+
+  if (rip) jj__print(&out, "        # 0x%" PRIx64, rip_target);
+  return out.length;
+}
+
+void jj_dump_disas(jj_ctx* ctx) {
+  const uint8_t* code = ctx->base;
+  const size_t size = ctx->ip - ctx->base;
+  char text[128];
+
+  for (size_t at = 0; at < size; ) {
+    jj_decoded insn;
+    size_t length = jj_decode(code + at, size - at, at, &insn);
+    if (length) {
+      jj_format(&insn, at, text, sizeof(text));
+    } else {
+      length = 1;
+      strcpy(text, "(bad)");
+    }
+
+    // Same layout as objdump: up to 7 bytes per line, the rest continues below.
+    for (size_t line = 0; line < length; line += 7) {
+      printf("%4zx:\t", at + line);
+      for (size_t i = line; i < line + 7; i++) {
+        if (i < length) printf("%02x ", code[at + i]); else printf("   ");
+      }
+      printf(line ? "\n" : "\t%s\n", text);
+    }
+    at += length;
+  }
+  printf("\n");
+}
+
+/***********/
+/* fuzzing */
+/***********/
+
+static uint64_t jj__random(uint64_t* state) {
+  // splitmix64
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static jj_mem jj__random_mem(uint64_t* state, bool evex) {
+  const uint64_t r = jj__random(state);
+  jj_mem mem = { .base = r & 15, .index = jj_rNONE, .scale = jj_s1 };
+  if ((r >> 4) % 8 == 0) mem.base = jj_rNONE;
+  if ((r >> 7) & 1) {
+    mem.index = (r >> 8) & 15;
+    if (mem.index == jj_rsp) mem.index = jj_rNONE;
+    else mem.scale = ((r >> 12) & 3) << 6;
+  }
+
+  switch ((r >> 14) % 4) {
+    case 0: mem.disp = 0; break;
+    case 1: mem.disp = (int8_t)(r >> 16); break;
+    case 2: mem.disp = (int32_t)(r >> 32); break;
+    case 3: mem.disp = (int8_t)(r >> 16) * (evex ? 64 : 1); break;
+  }
+  return mem;
+}
+
+static bool jj__same_op(jj_op a, jj_op b) {
+  if (a.type != b.type) return false;
+  if (a.type == 'r') return a.reg == b.reg;
+  if (a.type == 'i') return a.imm == b.imm;
+  return a.mem.base == b.mem.base && a.mem.index == b.mem.index && a.mem.disp == b.mem.disp
+    && (a.mem.index == jj_rNONE || a.mem.scale == b.mem.scale);
+}
+
+uint32_t jj_fuzz_roundtrip(uint32_t iterations, uint32_t seed) {
+  uint64_t state = seed;
+  uint32_t mismatches = 0;
+  jj_ctx ctx;
+  jj_init(&ctx, 64);
+
+  for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+    for (int f = 0; f < jj__forms_count; f++) {
+      const jj__form* form = &jj__forms[f];
+      char kinds[4];
+      const int count = jj__kinds(form->kinds, kinds);
+
+      jj_op ops[4];
+      for (int i = 0; i < count; i++) {
+        const uint64_t r = jj__random(&state);
+        switch (kinds[i]) {
+          case 'r': case 'x': case 'y': case 'z': ops[i] = jj_mkreg(r & 15); break;
+          case 'c': ops[i] = jj_mkreg(jj_rcx); break;
+          case 'm': ops[i] = (jj_op){ .type = 'm', .mem = jj__random_mem(&state, form->enc == 'e') }; break;
+          case 'b': ops[i] = jj_mkimm(form->enc == 'l' ? (int64_t)(int8_t)r : (int64_t)(uint8_t)r); break;
+          case 'd': ops[i] = jj_mkimm(form->en[0] == 'O' && !form->w ? (int64_t)(uint32_t)r : (int64_t)(int32_t)r); break;
+          case 'q': ops[i] = jj_mkimm(r); break;
+        }
+      }
+
+      jj_reset(&ctx);
+      if (form->emit) {
+        form->emit(&ctx, ops);
+      } else {
+        jj__emit(&ctx, form->mn, ops, count);
+      }
+      const size_t size = ctx.ip - ctx.base;
+
+      // `jj__emit` may pick a shorter row of the same mnemonic, operands still have to come back the same.
+      jj_decoded insn;
+      bool ok = jj_decode(ctx.base, size, 0, &insn) == size && strcmp(insn.name, form->name) == 0 && insn.count == count;
+      for (int i = 0; ok && i < count; i++) ok = jj__same_op(insn.ops[i], ops[i]);
+      if (ok) continue;
+
+      mismatches++;
+      char text[128] = "(bad)";
+      if (jj_decode(ctx.base, size, 0, &insn)) jj_format(&insn, 0, text, sizeof(text));
+      printf("mismatch: %s%s encoded as", form->name, form->kinds);
+      for (size_t i = 0; i < size; i++) printf(" %02x", ctx.base[i]);
+      printf(", decoded as %s\n", text);
+    }
+  }
+
+  jj_destroy(&ctx);
+  return mismatches;
+}
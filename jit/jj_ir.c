@@ -0,0 +1,327 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jj.h"
+
+/**********************/
+/* instruction buffer */
+/**********************/
+
+void jj_ir_init(jj_ir* ir) {
+  *ir = (jj_ir){0};
+}
+
+void jj_ir_destroy(jj_ir* ir) {
+  free(ir->insns);
+  *ir = (jj_ir){0};
+}
+
+jj_reg jj_ir_vreg(jj_ir* ir) {
+  return jj__rVIRTUAL + ir->vregs++;
+}
+
+void jj__ir_add(jj_ir* ir, uint16_t mn, const jj_op* ops, int count) {
+  if (count > 3) DIE("too many operands");
+
+  if (ir->length == ir->capacity) {
+    ir->capacity = ir->capacity ? ir->capacity * 2 : 64;
+    ir->insns = realloc(ir->insns, sizeof(jj_insn) * ir->capacity);
+    if (!ir->insns) DIE("out of memory");
+  }
+
+  jj_insn* insn = &ir->insns[ir->length++];
+  *insn = (jj_insn){ .mn = mn, .count = count };
+  memcpy(insn->ops, ops, sizeof(jj_op) * count);
+}
+
+void jj_ir_bind(jj_ir* ir, jj_label label) {
+  jj__ir_add(ir, jj_mn__bind, (jj_op[]){ jj_mkimm(label) }, 1);
+}
+
+void jj_ir_jmp(jj_ir* ir, jj_label label) {
+  jj__ir_add(ir, jj_mn__jmp_l, (jj_op[]){ jj_mkimm(label) }, 1);
+}
+
+void jj_ir_jcc(jj_ir* ir, jj_cond cond, jj_label label) {
+  jj__ir_add(ir, jj_mn__jcc_l, (jj_op[]){ jj_mkimm(label), jj_mkimm(cond) }, 2);
+}
+
+void jj_ir_call(jj_ir* ir, jj_label label) {
+  jj__ir_add(ir, jj_mn__call_l, (jj_op[]){ jj_mkimm(label) }, 1);
+}
+
+void jj_ir_align(jj_ir* ir, uint8_t alignment) {
+  jj__ir_add(ir, jj_mn__align, (jj_op[]){ jj_mkimm(alignment) }, 1);
+}
+
+void jj_ir_emit(jj_ir* ir, jj_ctx* ctx) {
+  for (uint32_t i = 0; i < ir->length; i++) {
+    const jj_insn* insn = &ir->insns[i];
+    switch (insn->mn) {
+      case jj_mn__bind:  jj_label_bind(ctx, insn->ops[0].imm); break;
+      case jj_mn__jmp_l:   jj_jmp_l(ctx, insn->ops[0].imm); break;
+      case jj_mn__jcc_l:   jj_jcc_l(ctx, insn->ops[1].imm, insn->ops[0].imm); break;
+      case jj_mn__call_l:  jj_call_l(ctx, insn->ops[0].imm); break;
+      case jj_mn__align: jj_align(ctx, insn->ops[0].imm); break;
+      case jj_mn__dead:  break;
+      default:          jj__emit(ctx, insn->mn, insn->ops, insn->count); break;
+    }
+  }
+}
+
+/*************/
+/* peepholes */
+/*************/
+
+/**
+ * How an instruction affects arithmetic flags: 'r' - may read them (or control goes somewhere unknown),
+ * 'w' - overwrites all of them, '-' - neither. Partial writers (inc, dec, rol, ror) are '-', they don't kill CF.
+ */
+static char jj__flags(const jj_insn* insn) {
+  switch (insn->mn) {
+    case jj_mn_adc: case jj_mn_sbb: case jj_mn__jcc_l:
+    case jj_mn_jmp: case jj_mn__jmp_l: case jj_mn__bind: case jj_mn__align:
+    case jj_mn_int3: case jj_mn_ud2:
+      return 'r';
+
+    case jj_mn_add: case jj_mn_or: case jj_mn_and: case jj_mn_sub: case jj_mn_xor: case jj_mn_xor32:
+    case jj_mn_cmp: case jj_mn_test: case jj_mn_neg: case jj_mn_imul: case jj_mn_mul: case jj_mn_div: case jj_mn_idiv:
+    case jj_mn_popcnt: case jj_mn_lzcnt: case jj_mn_tzcnt: case jj_mn_bsr: case jj_mn_bsf:
+    // SysV ABI doesn't preserve flags across calls, so they are dead at both.
+    case jj_mn_call: case jj_mn__call_l: case jj_mn_ret:
+      return 'w';
+
+    case jj_mn_shl: case jj_mn_shr: case jj_mn_sar:
+      // Shift by cl may be a shift by 0 which leaves flags alone.
+      if (insn->ops[1].type != 'i') return 'r';
+      return insn->ops[1].imm & 63 ? 'w' : '-';
+
+    default:
+      return '-';
+  }
+}
+
+/** Whether flags set by instruction `at` are overwritten before anything can observe them. */
+static bool jj__flags_dead(const jj_ir* ir, uint32_t at) {
+  for (uint32_t i = at + 1; i < ir->length; i++) {
+    const char flags = jj__flags(&ir->insns[i]);
+    if (flags == 'r') return false;
+    if (flags == 'w') return true;
+  }
+  return false;
+}
+
+static uint32_t jj__next(const jj_ir* ir, uint32_t at) {
+  do at++; while (at < ir->length && ir->insns[at].mn == jj_mn__dead);
+  return at;
+}
+
+static bool jj__is_reg(const jj_insn* insn, int i) {
+  return insn->count > i && insn->ops[i].type == 'r';
+}
+
+static bool jj__is_imm(const jj_insn* insn, int i) {
+  return insn->count > i && insn->ops[i].type == 'i';
+}
+
+static bool jj__fits32(int64_t value) {
+  return value == (int32_t)value;
+}
+
+static void jj__rewrite(jj_insn* insn, uint16_t mn, const jj_op* ops, int count) {
+  *insn = (jj_insn){ .mn = mn, .count = count };
+  memcpy(insn->ops, ops, sizeof(jj_op) * count);
+}
+
+#define JJ__REWRITE(insn, mn, ...) \
+  jj__rewrite(insn, jj_mn_##mn, (jj_op[]){__VA_ARGS__}, sizeof((jj_op[]){__VA_ARGS__}) / sizeof(jj_op))
+
+/** Rewrites of a single instruction. */
+static bool jj__peephole1(jj_ir* ir, uint32_t at) {
+  jj_insn* insn = &ir->insns[at];
+  const jj_reg d = insn->ops[0].reg;
+  const int64_t imm = jj__is_imm(insn, 1) ? (int64_t)insn->ops[1].imm : 0;
+
+  switch (insn->mn) {
+    case jj_mn_mov:
+      if (jj__is_reg(insn, 0) && jj__is_reg(insn, 1) && d == insn->ops[1].reg) {
+        insn->mn = jj_mn__dead;
+        return true;
+      }
+      if (jj__is_reg(insn, 0) && jj__is_imm(insn, 1)) {
+        // 31 /r is 2-3 bytes, B8+rd id is 5-6, REX.W C7 /0 id is 7 and REX.W B8+rd io is 10.
+        if (imm == 0 && jj__flags_dead(ir, at)) {
+          JJ__REWRITE(insn, xor32, jj_mkreg(d), jj_mkreg(d));
+          return true;
+        }
+        if ((uint64_t)imm <= UINT32_MAX) {
+          insn->mn = jj_mn_mov32;
+          return true;
+        }
+      }
+      return false;
+
+    case jj_mn_add:
+    case jj_mn_sub:
+      if (!jj__is_reg(insn, 0) || !jj__is_imm(insn, 1) || !jj__flags_dead(ir, at)) return false;
+      if (imm == 0) {
+        insn->mn = jj_mn__dead;
+        return true;
+      }
+      // inc/dec are a byte shorter than 83 /0 ib, and +128 only fits as -128 into ib.
+      if (imm == 1 || imm == -1) {
+        const bool up = (insn->mn == jj_mn_add) == (imm == 1);
+        jj__rewrite(insn, up ? jj_mn_inc : jj_mn_dec, (jj_op[]){ jj_mkreg(d) }, 1);
+        return true;
+      }
+      if (imm == 128) {
+        insn->mn = insn->mn == jj_mn_add ? jj_mn_sub : jj_mn_add;
+        insn->ops[1].imm = -128;
+        return true;
+      }
+      return false;
+
+    case jj_mn_or:
+    case jj_mn_xor:
+    case jj_mn_and:
+      if (!jj__is_reg(insn, 0) || !jj__is_imm(insn, 1)) return false;
+      if (imm != (insn->mn == jj_mn_and ? -1 : 0) || !jj__flags_dead(ir, at)) return false;
+      insn->mn = jj_mn__dead;
+      return true;
+
+    case jj_mn_shl:
+    case jj_mn_shr:
+    case jj_mn_sar:
+    case jj_mn_rol:
+    case jj_mn_ror:
+      // Shift by 0 doesn't touch flags.
+      if (!jj__is_imm(insn, 1) || imm & 63) return false;
+      insn->mn = jj_mn__dead;
+      return true;
+
+    case jj_mn_cmp:
+      // Both set ZF and SF from the value and clear CF and OF.
+      if (!jj__is_reg(insn, 0) || !jj__is_imm(insn, 1) || imm != 0) return false;
+      JJ__REWRITE(insn, test, jj_mkreg(d), jj_mkreg(d));
+      return true;
+
+    case jj_mn_imul:
+      if (insn->count != 3 || insn->ops[2].imm != 1 || !jj__flags_dead(ir, at)) return false;
+      JJ__REWRITE(insn, mov, jj_mkreg(d), insn->ops[1]);
+      return true;
+
+    case jj_mn_lea: {
+      const jj_mem m = insn->ops[1].mem;
+      if (m.index != jj_rNONE || m.disp != 0 || m.base == jj_rNONE || m.base == jj_rRIP) return false;
+      JJ__REWRITE(insn, mov, jj_mkreg(d), jj_mkreg(m.base));
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+/** Rewrites of two adjacent instructions, the result always ends up in the first one. */
+static bool jj__peephole2(jj_ir* ir, uint32_t at, uint32_t next) {
+  jj_insn* a = &ir->insns[at];
+  jj_insn* b = &ir->insns[next];
+
+  if (a->mn == jj_mn__jmp_l) {
+    // Jump to one of the labels bound right after it.
+    for (uint32_t i = next; i < ir->length && (ir->insns[i].mn == jj_mn__bind || ir->insns[i].mn == jj_mn__dead); i++) {
+      if (ir->insns[i].mn == jj_mn__bind && ir->insns[i].ops[0].imm == a->ops[0].imm) {
+        a->mn = jj_mn__dead;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (!jj__is_reg(a, 0) || !jj__is_reg(b, 0) || a->ops[0].reg != b->ops[0].reg) {
+    // mov a, b; mov b, a
+    if (a->mn == jj_mn_mov && b->mn == jj_mn_mov && jj__is_reg(a, 0) && jj__is_reg(a, 1)
+        && jj__is_reg(b, 0) && jj__is_reg(b, 1)
+        && a->ops[0].reg == b->ops[1].reg && a->ops[1].reg == b->ops[0].reg) {
+      b->mn = jj_mn__dead;
+      return true;
+    }
+    return false;
+  }
+
+  const jj_reg d = a->ops[0].reg;
+  if (b->mn != jj_mn_add || b->count != 2 || !jj__flags_dead(ir, next)) return false;
+
+  // mov d, s; add d, imm/t -> lea d, [s + imm/t]
+  if (a->mn == jj_mn_mov && jj__is_reg(a, 1) && a->ops[1].reg != d) {
+    const jj_reg s = a->ops[1].reg;
+    if (jj__is_imm(b, 1) && jj__fits32(b->ops[1].imm)) {
+      JJ__REWRITE(a, lea, jj_mkreg(d), jj_mkmem(s, jj_rNONE, jj_s1, b->ops[1].imm));
+      b->mn = jj_mn__dead;
+      return true;
+    }
+    if (jj__is_reg(b, 1) && b->ops[1].reg != d) {
+      const jj_reg t = b->ops[1].reg;
+      if (s == jj_rsp && t == jj_rsp) return false;
+      JJ__REWRITE(a, lea, jj_mkreg(d), t == jj_rsp ? jj_mkmem(t, s, jj_s1, 0) : jj_mkmem(s, t, jj_s1, 0));
+      b->mn = jj_mn__dead;
+      return true;
+    }
+    return false;
+  }
+
+  // shl d, k; add d, t -> lea d, [t + d * 2^k]
+  if (a->mn == jj_mn_shl && jj__is_imm(a, 1) && a->ops[1].imm >= 1 && a->ops[1].imm <= 3 && d != jj_rsp
+      && jj__is_reg(b, 1) && b->ops[1].reg != d) {
+    static const jj_scale scales[] = { jj_s1, jj_s2, jj_s4, jj_s8 };
+    JJ__REWRITE(a, lea, jj_mkreg(d), jj_mkmem(b->ops[1].reg, d, scales[a->ops[1].imm], 0));
+    b->mn = jj_mn__dead;
+    return true;
+  }
+
+  // lea d, [m]; add d, imm -> lea d, [m + imm]
+  if (a->mn == jj_mn_lea && a->ops[1].mem.base != jj_rRIP && jj__is_imm(b, 1)
+      && jj__fits32((int64_t)a->ops[1].mem.disp + (int64_t)b->ops[1].imm)) {
+    a->ops[1].mem.disp += (int32_t)b->ops[1].imm;
+    b->mn = jj_mn__dead;
+    return true;
+  }
+
+  // add d, x; add d, y -> add d, x + y
+  if (a->mn == jj_mn_add && jj__is_imm(a, 1) && jj__is_imm(b, 1)
+      && jj__fits32((int64_t)a->ops[1].imm + (int64_t)b->ops[1].imm)) {
+    a->ops[1].imm += b->ops[1].imm;
+    b->mn = jj_mn__dead;
+    return true;
+  }
+
+  return false;
+}
+
+uint32_t jj_ir_optimize(jj_ir* ir) {
+  uint32_t rewrites = 0;
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (uint32_t i = 0; i < ir->length; i++) {
+      if (ir->insns[i].mn == jj_mn__dead) continue;
+
+      bool rewritten = jj__peephole1(ir, i);
+      const uint32_t next = jj__next(ir, i);
+      if (!rewritten && ir->insns[i].mn != jj_mn__dead && next < ir->length) rewritten = jj__peephole2(ir, i, next);
+
+      rewrites += rewritten;
+      changed |= rewritten;
+    }
+  }
+
+  uint32_t length = 0;
+  for (uint32_t i = 0; i < ir->length; i++) {
+    if (ir->insns[i].mn != jj_mn__dead) ir->insns[length++] = ir->insns[i];
+  }
+  ir->length = length;
+  return rewrites;
+}
@@ -0,0 +1,605 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jj.h"
+
+#define JJ__BIT(reg) (1u << (reg))
+
+enum {
+  jj__caller_saved = JJ__BIT(jj_rax) | JJ__BIT(jj_rcx) | JJ__BIT(jj_rdx) | JJ__BIT(jj_rsi) | JJ__BIT(jj_rdi)
+    | JJ__BIT(jj_r8) | JJ__BIT(jj_r9) | JJ__BIT(jj_r10) | JJ__BIT(jj_r11),
+  jj__callee_saved = JJ__BIT(jj_rbx) | JJ__BIT(jj_r12) | JJ__BIT(jj_r13) | JJ__BIT(jj_r14) | JJ__BIT(jj_r15),
+  jj__arguments = JJ__BIT(jj_rdi) | JJ__BIT(jj_rsi) | JJ__BIT(jj_rdx) | JJ__BIT(jj_rcx) | JJ__BIT(jj_r8) | JJ__BIT(jj_r9),
+  jj__allocatable = (jj__caller_saved | jj__callee_saved) & ~JJ__BIT(jj_r10) & ~JJ__BIT(jj_r11),
+};
+
+// Caller-saved go first so short intervals don't cost a save in the prologue, the ones with implicit uses go last.
+static const jj_reg jj__order[] = {
+  jj_rsi, jj_rdi, jj_r8, jj_r9, jj_rdx, jj_rcx, jj_rax,
+  jj_rbx, jj_r12, jj_r13, jj_r14, jj_r15,
+};
+
+/** Registers kept out of allocation for loading spilled values around an instruction. */
+static const jj_reg jj__scratch[] = { jj_r11, jj_r10 };
+
+/***********************/
+/* operands and blocks */
+/***********************/
+
+typedef struct jj__access jj__access;
+struct jj__access {
+  uint8_t use;            // bit i - register operand i is read, memory operands always read their base and index
+  uint8_t def;            // bit i - register operand i is written
+  uint16_t implicit_use;  // physical registers
+  uint16_t implicit_def;
+};
+
+static jj__access jj__access_of(const jj_insn* insn) {
+  const bool same = insn->count == 2 && insn->ops[0].type == 'r' && insn->ops[1].type == 'r'
+    && insn->ops[0].reg == insn->ops[1].reg;
+
+  switch (insn->mn) {
+    case jj_mn_mov: case jj_mn_mov32: case jj_mn_lea: case jj_mn_pop:
+      return (jj__access){ .use = 0b110, .def = 0b1 };
+
+    case jj_mn_imul:
+      return (jj__access){ .use = insn->count == 3 ? 0b10 : 0b11, .def = 0b1 };
+
+    case jj_mn_popcnt: case jj_mn_lzcnt: case jj_mn_tzcnt:
+      return (jj__access){ .use = 0b10, .def = 0b1 };
+
+    case jj_mn_bsr: case jj_mn_bsf:
+      // Destination is left alone for zero on every CPU in practice, code relies on it.
+      return (jj__access){ .use = 0b11, .def = 0b1 };
+
+    case jj_mn_xor: case jj_mn_xor32: case jj_mn_sub:
+      // Zeroing idiom doesn't depend on the old value.
+      if (same) return (jj__access){ .def = 0b1 };
+      return (jj__access){ .use = 0b11, .def = 0b1 };
+
+    case jj_mn_add: case jj_mn_or: case jj_mn_adc: case jj_mn_sbb: case jj_mn_and:
+    case jj_mn_not: case jj_mn_neg: case jj_mn_inc: case jj_mn_dec:
+    case jj_mn_rol: case jj_mn_ror: case jj_mn_shl: case jj_mn_shr: case jj_mn_sar:
+      return (jj__access){ .use = 0b11, .def = 0b1 };
+
+    case jj_mn_xchg:
+      return (jj__access){ .use = 0b11, .def = 0b11 };
+
+    case jj_mn_mul:
+      return (jj__access){ .use = 0b1, .implicit_use = JJ__BIT(jj_rax), .implicit_def = JJ__BIT(jj_rax) | JJ__BIT(jj_rdx) };
+
+    case jj_mn_div: case jj_mn_idiv:
+      return (jj__access){
+        .use = 0b1, .implicit_use = JJ__BIT(jj_rax) | JJ__BIT(jj_rdx), .implicit_def = JJ__BIT(jj_rax) | JJ__BIT(jj_rdx)
+      };
+
+    case jj_mn_cqo:
+      return (jj__access){ .implicit_use = JJ__BIT(jj_rax), .implicit_def = JJ__BIT(jj_rdx) };
+
+    case jj_mn_rep_movsb: case jj_mn_rep_movsq: {
+      const uint16_t regs = JJ__BIT(jj_rcx) | JJ__BIT(jj_rsi) | JJ__BIT(jj_rdi);
+      return (jj__access){ .implicit_use = regs, .implicit_def = regs };
+    }
+
+    case jj_mn_call: case jj_mn__call_l:
+      return (jj__access){ .use = 0b1, .implicit_use = jj__arguments, .implicit_def = jj__caller_saved };
+
+    case jj_mn_jmp:
+      // Tail call.
+      return (jj__access){ .use = 0b1, .implicit_use = jj__arguments | JJ__BIT(jj_rax) };
+
+    case jj_mn_ret:
+      return (jj__access){ .implicit_use = JJ__BIT(jj_rax) };
+
+    default:
+      return (jj__access){ .use = 0b111 };
+  }
+}
+
+/** Index into liveness bitsets: physical registers first, then virtual ones. -1 for rsp, rbp and placeholders. */
+static int32_t jj__reg_id(jj_reg reg) {
+  if (reg >= jj__rVIRTUAL) return 16 + (reg - jj__rVIRTUAL);
+  if (reg < 16 && reg != jj_rsp && reg != jj_rbp) return reg;
+  return -1;
+}
+
+typedef struct jj__regs jj__regs;
+struct jj__regs {
+  int32_t ids[24];
+  uint8_t count;
+};
+
+static void jj__regs_add(jj__regs* regs, jj_reg reg) {
+  const int32_t id = jj__reg_id(reg);
+  if (id != -1) regs->ids[regs->count++] = id;
+}
+
+static void jj__regs_add_mask(jj__regs* regs, uint16_t mask) {
+  for (int r = 0; r < 16; r++) {
+    if (mask & JJ__BIT(r)) jj__regs_add(regs, r);
+  }
+}
+
+static void jj__uses_defs(const jj_insn* insn, jj__regs* uses, jj__regs* defs) {
+  const jj__access access = jj__access_of(insn);
+  uses->count = defs->count = 0;
+
+  if (insn->mn < jj_mn__count) {
+    for (int i = 0; i < insn->count; i++) {
+      const jj_op* op = &insn->ops[i];
+      if (op->type == 'm') {
+        jj__regs_add(uses, op->mem.base);
+        jj__regs_add(uses, op->mem.index);
+      } else if (op->type == 'r') {
+        if (access.use & JJ__BIT(i)) jj__regs_add(uses, op->reg);
+        if (access.def & JJ__BIT(i)) jj__regs_add(defs, op->reg);
+      }
+    }
+  }
+  jj__regs_add_mask(uses, access.implicit_use);
+  jj__regs_add_mask(defs, access.implicit_def);
+}
+
+typedef struct jj__block jj__block;
+struct jj__block {
+  uint32_t begin;
+  uint32_t end;
+  int32_t succs[2];
+};
+
+static bool jj__ends_block(uint16_t mn) {
+  return mn == jj_mn__jmp_l || mn == jj_mn__jcc_l || mn == jj_mn_ret || mn == jj_mn_jmp || mn == jj_mn_ud2;
+}
+
+/** Splits `ir` at labels and after branches. Returns the number of blocks, `*blocks` is malloc'ed. */
+static uint32_t jj__blocks(const jj_ir* ir, jj__block** blocks) {
+  uint32_t count = 0;
+  uint32_t labels = 0;
+  *blocks = malloc(sizeof(jj__block) * (ir->length + 1));
+  int32_t* block_of = malloc(sizeof(int32_t) * (ir->length + 1));
+
+  for (uint32_t i = 0; i < ir->length; i++) {
+    const jj_insn* insn = &ir->insns[i];
+    if (i == 0 || insn->mn == jj_mn__bind || jj__ends_block(ir->insns[i - 1].mn)) {
+      if (count) (*blocks)[count - 1].end = i;
+      (*blocks)[count++] = (jj__block){ .begin = i, .succs = { -1, -1 } };
+    }
+    block_of[i] = count - 1;
+    if (insn->mn == jj_mn__bind && insn->ops[0].imm >= labels) labels = insn->ops[0].imm + 1;
+  }
+  if (count) (*blocks)[count - 1].end = ir->length;
+
+  int32_t* label_block = malloc(sizeof(int32_t) * (labels + 1));
+  for (uint32_t i = 0; i < labels; i++) label_block[i] = -1;
+  for (uint32_t i = 0; i < ir->length; i++) {
+    if (ir->insns[i].mn == jj_mn__bind) label_block[ir->insns[i].ops[0].imm] = block_of[i];
+  }
+
+  for (uint32_t b = 0; b < count; b++) {
+    jj__block* block = &(*blocks)[b];
+    const jj_insn* last = &ir->insns[block->end - 1];
+    const int32_t next = b + 1 < count ? (int32_t)b + 1 : -1;
+
+    if (last->mn == jj_mn__jmp_l || last->mn == jj_mn__jcc_l) {
+      if (last->ops[0].imm >= labels || label_block[last->ops[0].imm] == -1) {
+        DIE("label %u is not bound in the buffer", (uint32_t)last->ops[0].imm);
+      }
+      block->succs[0] = label_block[last->ops[0].imm];
+      if (last->mn == jj_mn__jcc_l) block->succs[1] = next;
+    } else if (!jj__ends_block(last->mn)) {
+      block->succs[0] = next;
+    }
+  }
+
+  free(block_of);
+  free(label_block);
+  return count;
+}
+
+/************/
+/* liveness */
+/************/
+
+static void jj__bit_set(uint64_t* set, int32_t id, bool value) {
+  if (value) set[id / 64] |= 1ull << (id % 64); else set[id / 64] &= ~(1ull << (id % 64));
+}
+
+/** live = uses | (live - defs), walking from the end of the instruction. */
+static void jj__transfer(uint64_t* live, const jj__regs* uses, const jj__regs* defs) {
+  for (int i = 0; i < defs->count; i++) jj__bit_set(live, defs->ids[i], false);
+  for (int i = 0; i < uses->count; i++) jj__bit_set(live, uses->ids[i], true);
+}
+
+typedef struct jj__interval jj__interval;
+struct jj__interval {
+  uint32_t vreg;
+  uint32_t start;
+  uint32_t end;
+  jj_reg reg;       // jj_rNONE when spilled
+  jj_reg hint;      // physical register it's copied from or to, if any
+  int32_t slot;
+};
+
+/**
+ * Fills intervals of virtual registers and, for every position, physical registers which are written there
+ * or live after it. A virtual register can't take a physical one which is busy anywhere inside its interval.
+ */
+static void jj__liveness(const jj_ir* ir, jj__interval* intervals, uint16_t* busy) {
+  jj__block* blocks;
+  const uint32_t count = jj__blocks(ir, &blocks);
+  const uint32_t words = (16 + ir->vregs + 63) / 64;
+  uint64_t* live_in = calloc((size_t)count * words, sizeof(uint64_t));
+  uint64_t* live = malloc(words * sizeof(uint64_t));
+  jj__regs uses, defs;
+
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (uint32_t b = count; b-- > 0; ) {
+      memset(live, 0, words * sizeof(uint64_t));
+      for (int s = 0; s < 2; s++) {
+        if (blocks[b].succs[s] == -1) continue;
+        for (uint32_t w = 0; w < words; w++) live[w] |= live_in[blocks[b].succs[s] * words + w];
+      }
+      for (uint32_t i = blocks[b].end; i-- > blocks[b].begin; ) {
+        jj__uses_defs(&ir->insns[i], &uses, &defs);
+        jj__transfer(live, &uses, &defs);
+      }
+      if (memcmp(live, &live_in[b * words], words * sizeof(uint64_t))) {
+        memcpy(&live_in[b * words], live, words * sizeof(uint64_t));
+        changed = true;
+      }
+    }
+  }
+
+  for (uint32_t v = 0; v < ir->vregs; v++) {
+    intervals[v] = (jj__interval){ .vreg = v, .start = UINT32_MAX, .end = 0, .reg = jj_rNONE, .hint = jj_rNONE, .slot = -1 };
+  }
+
+  for (uint32_t b = 0; b < count; b++) {
+    memset(live, 0, words * sizeof(uint64_t));
+    for (int s = 0; s < 2; s++) {
+      if (blocks[b].succs[s] == -1) continue;
+      for (uint32_t w = 0; w < words; w++) live[w] |= live_in[blocks[b].succs[s] * words + w];
+    }
+
+    for (uint32_t i = blocks[b].end; i-- > blocks[b].begin; ) {
+      jj__uses_defs(&ir->insns[i], &uses, &defs);
+
+      // `live` is what's live after `i` here.
+      busy[i] = live[0] & 0xffff;
+      for (int d = 0; d < defs.count; d++) {
+        if (defs.ids[d] < 16) busy[i] |= JJ__BIT(defs.ids[d]);
+      }
+
+      for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = live[w];
+        if (w == 0) bits &= ~0xffffull;
+        for (; bits; bits &= bits - 1) {
+          jj__interval* interval = &intervals[w * 64 + __builtin_ctzll(bits) - 16];
+          if (i < interval->start) interval->start = i;
+          if (i > interval->end) interval->end = i;
+        }
+      }
+      for (int k = 0; k < uses.count + defs.count; k++) {
+        const int32_t id = k < uses.count ? uses.ids[k] : defs.ids[k - uses.count];
+        if (id < 16) continue;
+        jj__interval* interval = &intervals[id - 16];
+        if (i < interval->start) interval->start = i;
+        if (i > interval->end) interval->end = i;
+      }
+
+      jj__transfer(live, &uses, &defs);
+    }
+  }
+
+  free(live);
+  free(live_in);
+  free(blocks);
+}
+
+/***************/
+/* linear scan */
+/***************/
+
+static bool jj__conflicts(const uint16_t* busy, const jj__interval* interval, jj_reg reg) {
+  // The last instruction reads the value before anything it writes, so it doesn't count.
+  const uint32_t last = interval->end > interval->start ? interval->end - 1 : interval->start;
+  for (uint32_t i = interval->start; i <= last; i++) {
+    if (busy[i] & JJ__BIT(reg)) return true;
+  }
+  return false;
+}
+
+static int jj__by_start(const void* a, const void* b) {
+  const jj__interval* x = a;
+  const jj__interval* y = b;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return x->vreg < y->vreg ? -1 : x->vreg > y->vreg;
+}
+
+/** `mov v, phys` and `mov phys, v` make `phys` a good guess for `v`, the move then disappears in the peephole pass. */
+static void jj__hints(const jj_ir* ir, jj__interval* intervals) {
+  for (uint32_t i = 0; i < ir->length; i++) {
+    const jj_insn* insn = &ir->insns[i];
+    if (insn->mn != jj_mn_mov || insn->ops[0].type != 'r' || insn->ops[1].type != 'r') continue;
+
+    const jj_reg a = insn->ops[0].reg;
+    const jj_reg b = insn->ops[1].reg;
+    if (a >= jj__rVIRTUAL && b < 16 && intervals[a - jj__rVIRTUAL].hint == jj_rNONE) intervals[a - jj__rVIRTUAL].hint = b;
+    if (b >= jj__rVIRTUAL && a < 16 && intervals[b - jj__rVIRTUAL].hint == jj_rNONE) intervals[b - jj__rVIRTUAL].hint = a;
+  }
+}
+
+static void jj__scan(jj__interval* sorted, uint32_t count, const uint16_t* busy, uint32_t* slots) {
+  jj__interval** active = malloc(sizeof(jj__interval*) * (sizeof(jj__order) / sizeof(jj__order[0]) + 1));
+  uint32_t active_length = 0;
+
+  for (uint32_t n = 0; n < count; n++) {
+    jj__interval* cur = &sorted[n];
+
+    // Expire intervals which end before this one starts, `active` is sorted by end.
+    uint32_t expired = 0;
+    while (expired < active_length && active[expired]->end <= cur->start) expired++;
+    memmove(active, active + expired, sizeof(jj__interval*) * (active_length - expired));
+    active_length -= expired;
+
+    uint32_t taken = 0;
+    for (uint32_t a = 0; a < active_length; a++) taken |= JJ__BIT(active[a]->reg);
+
+    jj_reg reg = jj_rNONE;
+    if (cur->hint != jj_rNONE && jj__allocatable & ~taken & JJ__BIT(cur->hint) && !jj__conflicts(busy, cur, cur->hint)) {
+      reg = cur->hint;
+    }
+    for (size_t r = 0; reg == jj_rNONE && r < sizeof(jj__order) / sizeof(jj__order[0]); r++) {
+      if (!(taken & JJ__BIT(jj__order[r])) && !jj__conflicts(busy, cur, jj__order[r])) reg = jj__order[r];
+    }
+
+    if (reg == jj_rNONE) {
+      // Steal the register of the interval which lives the longest, if it's longer than this one.
+      int32_t victim = -1;
+      for (uint32_t a = 0; a < active_length; a++) {
+        if (active[a]->end > cur->end && !jj__conflicts(busy, cur, active[a]->reg)
+            && (victim == -1 || active[a]->end > active[victim]->end)) {
+          victim = a;
+        }
+      }
+      if (victim == -1) {
+        cur->slot = (*slots)++;
+        continue;
+      }
+
+      reg = active[victim]->reg;
+      active[victim]->reg = jj_rNONE;
+      active[victim]->slot = (*slots)++;
+      memmove(active + victim, active + victim + 1, sizeof(jj__interval*) * (active_length - victim - 1));
+      active_length--;
+    }
+
+    cur->reg = reg;
+    uint32_t at = active_length;
+    while (at > 0 && active[at - 1]->end > cur->end) at--;
+    memmove(active + at + 1, active + at, sizeof(jj__interval*) * (active_length - at));
+    active[at] = cur;
+    active_length++;
+  }
+
+  free(active);
+}
+
+/***********/
+/* rewrite */
+/***********/
+
+typedef struct jj__rewriter jj__rewriter;
+struct jj__rewriter {
+  jj_ir out;
+  const jj__interval* const* by_vreg;
+  int32_t spill_base;  // frame slot of the first spilled register
+  jj_ra_stats* stats;
+};
+
+static jj_mem jj__slot(int32_t slot) {
+  return (jj_mem){ .base = jj_rbp, .index = jj_rNONE, .scale = jj_s1, .disp = -8 * (slot + 1) };
+}
+
+static jj_mem jj__spill_slot(const jj__rewriter* rw, jj_reg vreg) {
+  return jj__slot(rw->spill_base + rw->by_vreg[vreg - jj__rVIRTUAL]->slot);
+}
+
+static bool jj__spilled(const jj__rewriter* rw, jj_reg reg) {
+  return reg >= jj__rVIRTUAL && rw->by_vreg[reg - jj__rVIRTUAL]->reg == jj_rNONE;
+}
+
+static jj_reg jj__assigned(const jj__rewriter* rw, jj_reg reg) {
+  return reg >= jj__rVIRTUAL ? rw->by_vreg[reg - jj__rVIRTUAL]->reg : reg;
+}
+
+static void jj__spill_code(jj__rewriter* rw, jj_reg reg, jj_mem slot, bool store) {
+  if (store) {
+    jj_ir_add(&rw->out, mov, ((jj_op){ .type = 'm', .mem = slot }), jj_mkreg(reg));
+  } else {
+    jj_ir_add(&rw->out, mov, jj_mkreg(reg), ((jj_op){ .type = 'm', .mem = slot }));
+  }
+  rw->stats->spill_insns++;
+}
+
+static void jj__rewrite_insn(jj__rewriter* rw, const jj_insn* insn) {
+  jj_insn out = *insn;
+  if (insn->mn >= jj_mn__count) {
+    jj__ir_add(&rw->out, out.mn, out.ops, out.count);
+    return;
+  }
+
+  const jj__access access = jj__access_of(insn);
+  uint32_t scratch = 0;
+  bool has_mem = false;
+  uint32_t spilled_regs = 0;
+  for (int i = 0; i < insn->count; i++) {
+    spilled_regs += insn->ops[i].type == 'r' && jj__spilled(rw, insn->ops[i].reg);
+  }
+
+  for (int i = 0; i < insn->count; i++) {
+    if (out.ops[i].type != 'm') continue;
+    has_mem = true;
+
+    jj_mem* m = &out.ops[i].mem;
+    const bool base_spilled = jj__spilled(rw, m->base);
+    const bool index_spilled = jj__spilled(rw, m->index);
+    if (base_spilled) {
+      jj__spill_code(rw, jj__scratch[scratch], jj__spill_slot(rw, m->base), false);
+      m->base = jj__scratch[scratch++];
+    } else {
+      m->base = jj__assigned(rw, m->base);
+    }
+    if (index_spilled) {
+      jj__spill_code(rw, jj__scratch[scratch], jj__spill_slot(rw, m->index), false);
+      m->index = jj__scratch[scratch++];
+    } else {
+      m->index = jj__assigned(rw, m->index);
+    }
+
+    // Both scratch registers hold the address and a register operand needs one too: compute the address first.
+    if (base_spilled && index_spilled && spilled_regs) {
+      jj_ir_add(&rw->out, lea, jj_mkreg(jj__scratch[0]), ((jj_op){ .type = 'm', .mem = *m }));
+      rw->stats->spill_insns++;
+      *m = (jj_mem){ .base = jj__scratch[0], .index = jj_rNONE, .scale = jj_s1, .disp = 0 };
+      scratch = 1;
+    }
+  }
+
+  jj_insn after[3];
+  int after_count = 0;
+  for (int i = 0; i < insn->count; i++) {
+    if (insn->ops[i].type != 'r') continue;
+    const jj_reg vreg = insn->ops[i].reg;
+    // Already replaced together with an earlier operand holding the same register.
+    if (out.ops[i].type != 'r' || out.ops[i].reg != vreg) continue;
+    if (!jj__spilled(rw, vreg)) {
+      out.ops[i].reg = jj__assigned(rw, vreg);
+      continue;
+    }
+
+    const jj_mem slot = jj__spill_slot(rw, vreg);
+    uint8_t occurrences = 0;
+    bool use = false, def = false;
+    for (int k = i; k < insn->count; k++) {
+      if (insn->ops[k].type != 'r' || insn->ops[k].reg != vreg) continue;
+      occurrences |= JJ__BIT(k);
+      use |= access.use >> k & 1;
+      def |= access.def >> k & 1;
+    }
+
+    // Use the slot directly when there's a row for it: `add [rbp - 8], 1` instead of load, add, store.
+    if (occurrences == JJ__BIT(i) && !has_mem) {
+      jj_insn direct = out;
+      direct.ops[i] = (jj_op){ .type = 'm', .mem = slot };
+      if (jj__encodable(direct.mn, direct.ops, direct.count)) {
+        out = direct;
+        has_mem = true;
+        continue;
+      }
+    }
+
+    if (scratch == sizeof(jj__scratch) / sizeof(jj__scratch[0])) DIE("out of scratch registers for spills");
+    const jj_reg reg = jj__scratch[scratch++];
+    if (use) jj__spill_code(rw, reg, slot, false);
+    if (def) {
+      after[after_count++] = (jj_insn){
+        .mn = jj_mn_mov, .count = 2, .ops = { { .type = 'm', .mem = slot }, jj_mkreg(reg) }
+      };
+    }
+    for (int k = i; k < insn->count; k++) {
+      if (occurrences & JJ__BIT(k)) out.ops[k].reg = reg;
+    }
+  }
+
+  jj__ir_add(&rw->out, out.mn, out.ops, out.count);
+  for (int i = 0; i < after_count; i++) {
+    jj__ir_add(&rw->out, after[i].mn, after[i].ops, after[i].count);
+    rw->stats->spill_insns++;
+  }
+}
+
+/** Restores callee-saved registers from the frame and drops it, right before leaving the function. */
+static void jj__epilogue(jj_ir* out, uint16_t saved) {
+  for (int r = 0, slot = 0; r < 16; r++) {
+    if (saved & JJ__BIT(r)) jj_ir_add(out, mov, jj_mkreg(r), ((jj_op){ .type = 'm', .mem = jj__slot(slot++) }));
+  }
+  jj_ir_add(out, leave);
+}
+
+jj_ra_stats jj_ra_allocate(jj_ir* ir) {
+  jj_ra_stats stats = { .vregs = ir->vregs };
+
+  jj__interval* intervals = malloc(sizeof(jj__interval) * (ir->vregs + 1));
+  uint16_t* busy = malloc(sizeof(uint16_t) * (ir->length + 1));
+  jj__liveness(ir, intervals, busy);
+  jj__hints(ir, intervals);
+
+  // Only registers which occur somewhere get allocated.
+  uint32_t count = 0;
+  for (uint32_t v = 0; v < ir->vregs; v++) {
+    if (intervals[v].start != UINT32_MAX) intervals[count++] = intervals[v];
+  }
+  qsort(intervals, count, sizeof(jj__interval), jj__by_start);
+
+  uint32_t slots = 0;
+  jj__scan(intervals, count, busy, &slots);
+  stats.spilled = slots;
+
+  const jj__interval** by_vreg = calloc(ir->vregs + 1, sizeof(jj__interval*));
+  for (uint32_t i = 0; i < count; i++) {
+    by_vreg[intervals[i].vreg] = &intervals[i];
+    if (intervals[i].reg != jj_rNONE) stats.saved |= JJ__BIT(intervals[i].reg) & jj__callee_saved;
+  }
+  for (uint32_t i = 0; i < ir->length; i++) {
+    jj__regs uses, defs;
+    jj__uses_defs(&ir->insns[i], &uses, &defs);
+    for (int d = 0; d < defs.count; d++) {
+      if (defs.ids[d] < 16) stats.saved |= JJ__BIT(defs.ids[d]) & jj__callee_saved;
+    }
+  }
+
+  // Frame: callee-saved registers right below rbp, then spill slots.
+  const uint32_t saved = __builtin_popcount(stats.saved);
+  stats.frame_size = ((saved + slots) * 8 + 15) & ~15u;
+
+  jj__rewriter rw = { .by_vreg = by_vreg, .spill_base = saved, .stats = &stats };
+  jj_ir_init(&rw.out);
+  rw.out.vregs = ir->vregs;
+
+  jj_ir_add(&rw.out, push, jj_mkreg(jj_rbp));
+  jj_ir_add(&rw.out, mov, jj_mkreg(jj_rbp), jj_mkreg(jj_rsp));
+  if (stats.frame_size) jj_ir_add(&rw.out, sub, jj_mkreg(jj_rsp), jj_mkimm(stats.frame_size));
+  for (int r = 0, slot = 0; r < 16; r++) {
+    if (stats.saved & JJ__BIT(r)) jj_ir_add(&rw.out, mov, ((jj_op){ .type = 'm', .mem = jj__slot(slot++) }), jj_mkreg(r));
+  }
+
+  for (uint32_t i = 0; i < ir->length; i++) {
+    if (ir->insns[i].mn == jj_mn_ret) {
+      jj__epilogue(&rw.out, stats.saved);
+      jj_ir_add(&rw.out, ret);
+      continue;
+    }
+    if (ir->insns[i].mn == jj_mn_jmp) {
+      // Tail call: the target may sit in a callee-saved register or in the frame, read it into r11 before both go.
+      jj__rewrite_insn(&rw, &(jj_insn){ .mn = jj_mn_mov, .count = 2, .ops = { jj_mkreg(jj_r11), ir->insns[i].ops[0] } });
+      jj__epilogue(&rw.out, stats.saved);
+      jj_ir_add(&rw.out, jmp, jj_mkreg(jj_r11));
+      continue;
+    }
+    jj__rewrite_insn(&rw, &ir->insns[i]);
+  }
+
+  jj_ir_destroy(ir);
+  *ir = rw.out;
+
+  free(by_vreg);
+  free(busy);
+  free(intervals);
+  return stats;
+}
@@ -9,14 +9,20 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 /* POSIX */
+#include <signal.h>
 #include <unistd.h>
 #include <sys/user.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
 
 /* Linux */
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 
 #define ptrace_or_die(...) do { \
@@ -29,64 +35,263 @@
 
 #define MAGIC_SYSCALL 4242ul
 
-int main(int argc, char** argv) {
-    pid_t pid = fork();
+/*
+ * How the tracee gets stopped:
+ *  - syscall: PTRACE_SYSCALL, two stops on every syscall (entry and exit), emulated ones are turned into a nop
+ *    by patching orig_rax to -1 on entry and get their result on exit.
+ *  - sysemu: PTRACE_SYSEMU, one stop on entry and the kernel never runs the syscall, the tracer just writes rax.
+ *    Syscalls which aren't emulated are rewound to the syscall instruction and run again under PTRACE_SYSCALL,
+ *    three stops for them, so it's for tracees whose syscalls are (almost) all emulated, like User Mode Linux.
+ *  - seccomp: a BPF filter returns SECCOMP_RET_TRACE only for emulated syscalls, everything else runs without
+ *    stopping at all; on the stop orig_rax = -1 skips the syscall and rax is its result.
+ */
+enum mode { MODE_SYSCALL, MODE_SYSEMU, MODE_SECCOMP, MODE_NONE };
 
-    /* child */
-    if (!pid) {
-        ptrace_or_die(PTRACE_TRACEME, 0, 0, 0);
-        static char* args[] = {"123", 0};
-        static char* env[] = {0};
-        execve(argv[1], args, env);
-        perror("execve");
-        return 1;
+static const char* mode_names[] = { "syscall", "sysemu", "seccomp", "native" };
+
+static uint64_t stops;
+static int exit_status;
+
+/* Decides if the syscall in `regs` is ours, and what it returns then. */
+static bool emulate(pid_t pid, const struct user_regs_struct* regs, int64_t* result) {
+    /* Tracer knows the pid anyway, no need to ask the kernel. */
+    if (regs->orig_rax == SYS_getpid) {
+        *result = pid;
+        return true;
     }
 
-    /* Wait for PTRACE_TRACEME in child. */
-    waitpid(pid, 0, 0);
+    if (regs->orig_rax == MAGIC_SYSCALL) {
+        printf(":: patching syscall %ld return value to ... ", MAGIC_SYSCALL);
+        fflush(stdout);
+        if (scanf("%ld", result) != 1) *result = -ENOSYS;
+        return true;
+    }
 
-    /* Automatically SIGKILL tracee, if tracer dies. */
-    ptrace_or_die(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_EXITKILL);
+    return false;
+}
 
+/* Resumes tracee until a syscall (or seccomp) stop, passing signals on. False when tracee is gone. */
+static bool resume(pid_t pid, enum __ptrace_request request) {
+    int signal = 0;
+    for (;;) {
+        ptrace_or_die(request, pid, 0, signal);
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            return false;
+        }
+
+        /* PTRACE_O_TRACESYSGOOD sets 0x80 on syscall stops, so they don't look like a SIGTRAP sent to tracee. */
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80) || status >> 8 == (SIGTRAP | PTRACE_EVENT_SECCOMP << 8)) {
+            stops++;
+            return true;
+        }
+        /* Other PTRACE_EVENT_* stops aren't signals, nothing to pass on. */
+        signal = status >> 16 ? 0 : WSTOPSIG(status);
+    }
+}
+
+static void trace_syscall(pid_t pid) {
     for (;;) {
         /* Resume tracee and wait for the next system call. */
-        ptrace_or_die(PTRACE_SYSCALL, pid, 0, 0);
-        waitpid(pid, 0, 0);
+        if (!resume(pid, PTRACE_SYSCALL)) return;
 
         /* Gather system call arguments. */
         struct user_regs_struct regs;
         ptrace_or_die(PTRACE_GETREGS, pid, 0, &regs);
 
-        /* Gather syscall number. */
-        const uint64_t syscall_number = regs.orig_rax;
-
-        /* Patch syscall to mke invalid syscall, i.e. nop. */
-        if (syscall_number == MAGIC_SYSCALL) {
+        /* Patch syscall to make invalid syscall, i.e. nop. */
+        int64_t result;
+        const bool emulated = emulate(pid, &regs, &result);
+        if (emulated) {
             regs.orig_rax = -1;
             ptrace_or_die(PTRACE_SETREGS, pid, 0, &regs);
         }
 
-        /* Pass syscall to the kernel and wait for result. */
-        ptrace_or_die(PTRACE_SYSCALL, pid, 0, 0);
-        waitpid(pid, 0, 0);
+        /* Pass syscall to the kernel and wait for result. At this point process may be already dead. */
+        if (!resume(pid, PTRACE_SYSCALL)) return;
 
-        /* At this point process may be already dead. */
-        if (syscall_number == SYS_exit || syscall_number == SYS_exit_group) {
-            printf(":: tracee exited\n");
-            return 0;
+        /* Update tracee's registers. */
+        if (emulated) {
+            ptrace_or_die(PTRACE_GETREGS, pid, 0, &regs);
+            regs.rax = result;
+            ptrace_or_die(PTRACE_SETREGS, pid, 0, &regs);
         }
+    }
+}
 
-        /* Update tracee's registers. */
-        if (syscall_number == MAGIC_SYSCALL) {
-            int64_t result;
-            printf(":: patching syscall %ld return value from %lld to ... ", MAGIC_SYSCALL, regs.orig_rax);
-            scanf("%lu", &result);
+static void trace_sysemu(pid_t pid) {
+    for (;;) {
+        /* Stops on entry, and whatever we do the kernel won't run this syscall. */
+        if (!resume(pid, PTRACE_SYSEMU)) return;
 
-            ptrace_or_die(PTRACE_GETREGS, pid, 0, &regs);
+        struct user_regs_struct regs;
+        ptrace_or_die(PTRACE_GETREGS, pid, 0, &regs);
+
+        int64_t result;
+        if (emulate(pid, &regs, &result)) {
+            regs.rax = result;
+            ptrace_or_die(PTRACE_SETREGS, pid, 0, &regs);
+            continue;
+        }
+
+        /*
+         * Not ours: back to the 2-byte `syscall` instruction with the number in rax again, and let tracee run it
+         * under PTRACE_SYSCALL. Resuming with PTRACE_SYSEMU from its entry stop would skip it again, so it takes
+         * the exit stop too, three stops in total.
+         */
+        regs.rax = regs.orig_rax;
+        regs.rip -= 2;
+        ptrace_or_die(PTRACE_SETREGS, pid, 0, &regs);
+        if (!resume(pid, PTRACE_SYSCALL) || !resume(pid, PTRACE_SYSCALL)) return;
+    }
+}
+
+static void trace_seccomp(pid_t pid) {
+    for (;;) {
+        /* Filter stops only syscalls we emulate. */
+        if (!resume(pid, PTRACE_CONT)) return;
+
+        struct user_regs_struct regs;
+        ptrace_or_die(PTRACE_GETREGS, pid, 0, &regs);
+
+        int64_t result;
+        if (emulate(pid, &regs, &result)) {
+            regs.orig_rax = -1;
             regs.rax = result;
             ptrace_or_die(PTRACE_SETREGS, pid, 0, &regs);
         }
     }
+}
+
+/* In tracee, before execve: filter is inherited and stays for good. */
+static void install_filter(void) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, MAGIC_SYSCALL, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_getpid, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE),
+    };
+    struct sock_fprog program = { .len = sizeof(filter) / sizeof(filter[0]), .filter = filter };
+
+    /* Unprivileged process may install filters only if it can't gain privileges with execve. */
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1 || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == -1) {
+        perror("prctl(PR_SET_SECCOMP)");
+        exit(1);
+    }
+}
+
+/* Starts `child` in a traced process and emulates its syscalls until it exits, returns its exit status. */
+static int run(enum mode mode, void (*child)(void* arg), void* arg) {
+    pid_t pid = fork();
+
+    /* child */
+    if (!pid) {
+        if (mode != MODE_NONE) {
+            ptrace_or_die(PTRACE_TRACEME, 0, 0, 0);
+            /* Wait for tracer to set options up. */
+            raise(SIGSTOP);
+        }
+        if (mode == MODE_SECCOMP) install_filter();
+        child(arg);
+        _exit(1);
+    }
+
+    if (mode == MODE_NONE) {
+        int status;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    /* Wait for SIGSTOP in child. */
+    waitpid(pid, 0, 0);
+
+    /* Automatically SIGKILL tracee, if tracer dies. Exec stops become events instead of a SIGTRAP sent to tracee. */
+    long options = PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC;
+    if (mode == MODE_SECCOMP) options |= PTRACE_O_TRACESECCOMP;
+    ptrace_or_die(PTRACE_SETOPTIONS, pid, 0, options);
+
+    if (mode == MODE_SYSCALL) trace_syscall(pid);
+    if (mode == MODE_SYSEMU) trace_sysemu(pid);
+    if (mode == MODE_SECCOMP) trace_seccomp(pid);
+    return exit_status;
+}
+
+static void child_exec(void* arg) {
+    static char* args[] = {"123", 0};
+    static char* env[] = {0};
+    execve(arg, args, env);
+    perror("execve");
+}
+
+static uint64_t bench_calls;
+
+/*
+ * Raw syscalls, glibc's getpid() is a plain syscall too nowadays, but let's not depend on it. getpid is emulated,
+ * gettid goes to the kernel; in a single-threaded process both are the pid.
+ */
+static void child_bench(void* arg) {
+    const long number = (intptr_t)arg;
+    const long pid = syscall(SYS_gettid);
+    for (uint64_t i = 0; i < bench_calls; i++) {
+        if (syscall(number) != pid) _exit(2);
+    }
+    _exit(0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench(uint64_t calls) {
+    static const enum mode modes[] = { MODE_NONE, MODE_SYSCALL, MODE_SYSEMU, MODE_SECCOMP };
+    static const struct { const char* name; long number; } syscalls[] = {
+        { "getpid", SYS_getpid },
+        { "gettid", SYS_gettid },
+    };
+    bench_calls = calls;
+    for (size_t j = 0; j < sizeof(syscalls) / sizeof(syscalls[0]); j++) {
+        for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+            const enum mode mode = modes[i];
+            stops = 0;
+            const uint64_t start = now_ns();
+            const int status = run(mode, child_bench, (void*)(intptr_t)syscalls[j].number);
+            const uint64_t elapsed = now_ns() - start;
+            printf(":: %-8s %lu %s in %7.1f ms, %7.1f ns/call, %.2f stops/call, %s\n", mode_names[mode], calls,
+                syscalls[j].name, elapsed / 1e6, (double)elapsed / calls, (double)stops / calls,
+                status ? "WRONG PID" : "ok");
+            fflush(stdout);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench(argc > 2 ? strtoull(argv[2], 0, 0) : 1000000);
+        return 0;
+    }
+
+    enum mode mode = MODE_SYSCALL;
+    for (enum mode m = MODE_SYSCALL; m <= MODE_SECCOMP; m++) {
+        if (argc > 2 && strcmp(argv[1], mode_names[m]) == 0) {
+            mode = m;
+            argv++;
+            argc--;
+        }
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [syscall|sysemu|seccomp] EXE\n       %s bench [N]\n", argv[0], argv[0]);
+        return 1;
+    }
 
-    return 0;
+    const int status = run(mode, child_exec, argv[1]);
+    printf(":: tracee exited\n");
+    return status;
 }